@@ -251,7 +251,14 @@ typedef enum QzDataFormat_E {
  *
  * @description
  *      Specifies whether the instance must be busy polling,
- *    or be periodical polling.
+ *    be periodical polling, or wait on the instance's event file
+ *    descriptor. Event polling needs instances configured for epoll
+ *    mode, otherwise it behaves as periodical polling. Adaptive polling
+ *    sleeps until the completion predicted from the service time the
+ *    instance has shown for recent requests, see qzGetPollModel().
+ *    Central polling leaves polling to one thread per instance, shared
+ *    by all the sessions of the process, which wakes the sessions as
+ *    their responses arrive.
  *
  *****************************************************************************/
 typedef enum QzPollingMode_E {
@@ -259,6 +266,12 @@ typedef enum QzPollingMode_E {
     /**< No busy polling */
     QZ_BUSY_POLLING,
     /**< busy polling */
+    QZ_EVENT_POLLING,
+    /**< sleep until the instance signals responses */
+    QZ_ADAPTIVE_POLLING,
+    /**< sleep until the predicted completion of a request */
+    QZ_CENTRAL_POLLING,
+    /**< sleep while a process wide thread polls the instance */
 } QzPollingMode_T;
 
 /**
@@ -531,6 +544,27 @@ typedef struct QzSessionParamsCommon_S {
     /**< 0 means no busy polling, 1 means busy polling */
     unsigned int is_sensitive_mode;
     /**< 0 means disable sensitive mode, 1 means enable sensitive mode*/
+    unsigned int share_inst;
+    /**< 0 means each call locks an instance for itself, 1 means the */
+    /**< instance may be used at the same time by other sessions which */
+    /**< also set share_inst, each session claiming its own buffers */
+    unsigned int coalesce_usec;
+    /**< 0 means compression requests below input_sz_thrshold go to */
+    /**< software. Otherwise the longest time in usec such a request */
+    /**< waits for small requests of other threads, to be submitted */
+    /**< to hardware together with them */
+    unsigned int strm_pipeline;
+    /**< 0 or 1 means qzCompressStream compresses one stream buffer at */
+    /**< a time. Otherwise the number of stream buffers which rotate, */
+    /**< a full one being compressed while the next one fills, by a */
+    /**< worker thread with its own session of the same parameters. */
+    /**< Calls for that stream must pass the session it started with */
+    unsigned int single_member;
+    /**< 0 means each hw_buff_sz block of compressed data is its own */
+    /**< gzip member, zlib stream or LZ4 frame. 1 means the blocks of */
+    /**< all calls up to the one with last set make up one standard */
+    /**< gzip member, zlib stream or LZ4 frame. qzCompressStream */
+    /**< always writes zlib as one stream */
 #ifdef ERR_INJECTION
     void *fbError;
     void *fbErrorCurr;
@@ -592,6 +626,12 @@ typedef struct QzSessionParamsDeflateExt_S {
 #define QZ_REQ_THRESHOLD_MAXIMUM     NUM_BUFF
 #define QZ_REQ_THRESHOLD_DEFAULT     QZ_REQ_THRESHOLD_MAXIMUM
 #define QZ_WAIT_CNT_THRESHOLD_DEFAULT 8
+#define QZ_SHARE_INST_DEFAULT        0
+#define QZ_COALESCE_USEC_DEFAULT     0
+#define QZ_COALESCE_USEC_MAX         10000
+#define QZ_STRM_PIPELINE_DEFAULT     0
+#define QZ_STRM_PIPELINE_MAX         8
+#define QZ_SINGLE_MEMBER_DEFAULT     0
 #define QZ_DEFLATE_COMP_LVL_MINIMUM      (1)
 #define QZ_DEFLATE_COMP_LVL_MAXIMUM      (9)
 #define QZ_DEFLATE_COMP_LVL_MAXIMUM_Gen3 (12)
@@ -719,6 +759,171 @@ typedef struct QzStatus_S {
     /**< Count of hardware devices supporting algorithms */
 } QzStatus_T;
 
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      QATzip process statistics structure
+ *
+ * @description
+ *      This structure contains counters collected by QATzip for the whole
+ *    process since it was started.
+ *
+ *****************************************************************************/
+typedef struct QzProcessStats_S {
+    unsigned long inst_grab_local;
+    /**< Requests served by an instance on the caller's NUMA node */
+    unsigned long inst_grab_remote;
+    /**< Requests served by an instance on a remote NUMA node */
+    unsigned long inst_grab_shared;
+    /**< Requests which joined an instance shared with other sessions */
+    unsigned long small_coalesced;
+    /**< Requests below input_sz_thrshold coalesced onto hardware */
+    unsigned long small_sw;
+    /**< Requests below input_sz_thrshold compressed in software */
+    unsigned long bytes_copied;
+    /**< Bytes copied between caller and instance buffers for hardware */
+    unsigned long bytes_zero_copy;
+    /**< Bytes the hardware read or wrote in caller buffers in place */
+    unsigned long ring_grows;
+    /**< Stream buffers set up as instance buffer rings grew under load */
+    unsigned long ring_trims;
+    /**< Idle stream buffers freed from instance buffer rings */
+} QzProcessStats_T;
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      QATzip memory pool statistics structure
+ *
+ * @description
+ *      This structure contains the state of the slab allocator serving
+ *    qzMalloc requests up to 2 MB.
+ *
+ *****************************************************************************/
+typedef struct QzMemPoolStats_S {
+    unsigned long slabs;
+    /**< Slabs held by the pool */
+    unsigned long slab_bytes;
+    /**< Bytes of the slabs held */
+    unsigned long retained_bytes;
+    /**< Bytes of free blocks in the slabs, not counting thread caches */
+    unsigned long retain_limit;
+    /**< Free bytes over which empty slabs are given back */
+    unsigned long cache_hits;
+    /**< Allocations served from a thread cache */
+    unsigned long central_hits;
+    /**< Allocations which refilled a thread cache from the slabs */
+    unsigned long slab_allocs;
+    /**< Slabs allocated */
+    unsigned long slab_frees;
+    /**< Slabs given back */
+    unsigned long direct_allocs;
+    /**< Allocations too large for the pool or which it couldn't serve */
+} QzMemPoolStats_T;
+
+#define QZ_MEM_MAX_NODES    (16)
+/**< NUMA nodes accounted apart, higher nodes are added to the last one */
+#define QZ_MEM_INST         (0)
+/**< Instance buffers and sessions */
+#define QZ_MEM_STREAM       (1)
+/**< Stream buffers */
+#define QZ_MEM_USER         (2)
+/**< qzMalloc requests of the application */
+#define QZ_MEM_PURPOSES     (3)
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      QATzip memory accounting structure
+ *
+ * @description
+ *      This structure contains the bytes QATzip holds per NUMA node and per
+ *    purpose, and the budget on the pinned memory it takes from the USDM
+ *    allocator.
+ *
+ *****************************************************************************/
+typedef struct QzMemStats_S {
+    unsigned long pinned[QZ_MEM_MAX_NODES][QZ_MEM_PURPOSES];
+    /**< Pinned bytes handed out, by node and purpose */
+    unsigned long common[QZ_MEM_MAX_NODES][QZ_MEM_PURPOSES];
+    /**< Pageable bytes handed out, by node and purpose */
+    unsigned long usdm[QZ_MEM_MAX_NODES];
+    /**< Bytes taken from the USDM allocator by node, pool slabs included */
+    unsigned long usdm_total;
+    /**< Bytes taken from the USDM allocator */
+    unsigned long node_budget[QZ_MEM_MAX_NODES];
+    /**< Budget of usdm[node], 0 if none */
+    unsigned long budget;
+    /**< Budget of usdm_total, 0 if none */
+    unsigned long budget_denials;
+    /**< USDM allocations refused as over budget */
+    unsigned long common_fallbacks;
+    /**< COMMON_MEM requests served from pageable memory */
+    unsigned long ring_denials;
+    /**< Instance buffer rings kept from growing for want of memory */
+} QzMemStats_T;
+
+#define QZ_PREWARM_ALL          (0)
+/**< Prewarm the instances of all NUMA nodes */
+#define QZ_PREWARM_NODE(n)      (1U << (n))
+/**< Prewarm the instances of NUMA node n, n < QZ_MEM_MAX_NODES */
+#define QZ_PREWARM_MEM_ONLY     (1U << 31)
+/**< Only set up the instance buffers, not the QAT sessions */
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      QATzip prewarm report
+ *
+ * @description
+ *      This structure reports the instances qzPrewarm set up and how long
+ *    it took.
+ *
+ *****************************************************************************/
+typedef struct QzPrewarmReport_S {
+    unsigned int instances;
+    /**< Instances on the selected nodes */
+    unsigned int ready;
+    /**< Instances ready for the session, including those already set up */
+    unsigned int busy;
+    /**< Instances left alone as other sessions held them */
+    unsigned int skipped;
+    /**< Instances unable to serve the session, wrong format or down */
+    unsigned int failed;
+    /**< Instances whose setup failed */
+    unsigned int ready_nodes;
+    /**< NUMA nodes with at least one ready instance, as QZ_PREWARM_NODE bits */
+    unsigned long elapsed_us;
+    /**< Wall time of the call */
+    unsigned long slowest_us;
+    /**< Longest setup of a single instance */
+} QzPrewarmReport_T;
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      QATzip adaptive polling model
+ *
+ * @description
+ *      This structure contains the service times QZ_ADAPTIVE_POLLING has
+ *    learned for an instance, and how well its predictions worked out.
+ *
+ *****************************************************************************/
+typedef struct QzPollModel_S {
+    unsigned long comp_ns_per_kb;
+    /**< Compression service time per KB of input, 0 if not learned */
+    unsigned long decomp_ns_per_kb;
+    /**< Decompression service time per KB of input, 0 if not learned */
+    unsigned long comp_samples;
+    /**< Completed compression requests the model learned from */
+    unsigned long decomp_samples;
+    /**< Completed decompression requests the model learned from */
+    unsigned long predicted_sleeps;
+    /**< Sleeps until a predicted completion */
+    unsigned long early_polls;
+    /**< Predicted sleeps after which the request was not done yet */
+} QzPollModel_T;
+
 /**
  *****************************************************************************
  * @ingroup qatZip
@@ -884,6 +1089,49 @@ typedef struct QzResult_S {
     /**< this pointer and always set this pointer as NULL */
 } QzResult_T;
 
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      QATzip batch request structure
+ *
+ * @description
+ *      This structure describes one independent message of a
+ *    qzCompressBatch or qzDecompressBatch call.
+ *
+ *****************************************************************************/
+typedef struct QzBatchReq_S {
+    const unsigned char *src;
+    /**< Source buffer of the message */
+    unsigned int src_len;
+    /**< Length of source buffer. Modified to number of bytes consumed */
+    unsigned char *dest;
+    /**< Destination buffer of the message */
+    unsigned int dest_len;
+    /**< Length of destination buffer. Modified to length of produced */
+    /**< data when function returns */
+    unsigned long crc;
+    /**< qzCompressBatch only, crc32 of the message as for qzCompressCrc */
+    int status;
+    /**< Status of the message, output only */
+} QzBatchReq_T;
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      QATzip source segment structure
+ *
+ * @description
+ *      This structure describes one segment of the input of a qzCompressV
+ *    or qzDecompressV call, the input being the segments in array order.
+ *
+ *****************************************************************************/
+typedef struct QzIovec_S {
+    unsigned char *buf;
+    /**< Start of the segment */
+    unsigned int len;
+    /**< Length of the segment, may be 0 */
+} QzIovec_T;
+
 /**
  *****************************************************************************
  * @ingroup qatZip
@@ -1808,6 +2056,225 @@ QATZIP_API int qzDecompress2(QzSession_T *sess, const unsigned char *src,
                              unsigned char *dest, qzAsyncCallbackFn callback,
                              QzResult_T *qzResults);
 
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Compress a batch of independent messages
+ *
+ * @description
+ *      This function compresses each message of reqs as qzCompressCrc with
+ *    last set to 1 would. Messages that fit in a single hardware request are
+ *    submitted to one instance back to back, and their responses collected
+ *    together, the other messages are compressed one at a time.
+ *
+ *    The output of every message and its src_len, dest_len and crc are the
+ *    same as from an individual qzCompressCrc call, its status is the value
+ *    that call would return.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       sess     Session handle
+ *                           (pointer to opaque instance and session data)
+ * @param[in,out]   reqs     Array of count message descriptors
+ * @param[in]       count    Number of messages in reqs
+ *
+ * @retval QZ_OK             All messages were compressed successfully
+ * @retval QZ_PARAMS         *sess or reqs is NULL
+ * @retval Other             The status of the first message that failed
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzCompressCrc(), qzDecompressBatch()
+ *
+ *****************************************************************************/
+QATZIP_API int qzCompressBatch(QzSession_T *sess, QzBatchReq_T *reqs,
+                               unsigned int count);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Decompress a batch of independent messages
+ *
+ * @description
+ *      This function decompresses each message of reqs as qzDecompress
+ *    would. Messages made of a single block are submitted to one instance
+ *    back to back, and their responses collected together, the other
+ *    messages are decompressed one at a time.
+ *
+ *    The output of every message and its src_len and dest_len are the same
+ *    as from an individual qzDecompress call, its status is the value that
+ *    call would return. The crc field is not used.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       sess     Session handle
+ *                           (pointer to opaque instance and session data)
+ * @param[in,out]   reqs     Array of count message descriptors
+ * @param[in]       count    Number of messages in reqs
+ *
+ * @retval QZ_OK             All messages were decompressed successfully
+ * @retval QZ_PARAMS         *sess or reqs is NULL
+ * @retval Other             The status of the first message that failed
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzDecompress(), qzCompressBatch()
+ *
+ *****************************************************************************/
+QATZIP_API int qzDecompressBatch(QzSession_T *sess, QzBatchReq_T *reqs,
+                                 unsigned int count);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Compress a buffer made of several segments
+ *
+ * @description
+ *      This function compresses the concatenation of the src_cnt segments
+ *    of src_iov as qzCompressCrc would compress it from one buffer, the
+ *    output is the same.
+ *
+ *    Each hardware request takes its segments in place as a scatter-gather
+ *    list when the instance can read them, that is when it doesn't need
+ *    physically contiguous memory or they are pinned, and when a request
+ *    spans no more than 32 of them. Otherwise the request is gathered into
+ *    the instance's own buffer, so the data is copied at most once.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       sess     Session handle
+ *                           (pointer to opaque instance and session data)
+ * @param[in]       src_iov  Array of src_cnt source segments
+ * @param[in]       src_cnt  Number of segments in src_iov
+ * @param[out]      src_len  Number of bytes consumed when function returns
+ * @param[in]       dest     Point to destination buffer
+ * @param[in,out]   dest_len Length of destination buffer. Modified
+ *                           to length of compressed data when
+ *                           function returns
+ * @param[in]       last     1 for 'No more data to be compressed'
+ *                           0 for 'More data to be compressed'
+ * @param[in,out]   crc      Pointer to CRC32 checksum buffer, or NULL
+ *
+ * @retval QZ_OK             Function executed successfully
+ * @retval QZ_PARAMS         *sess, src_iov or a segment is not valid, or
+ *                           the segments add up to more than 4GB
+ * @retval Other             As for qzCompressCrc
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzCompressCrc(), qzDecompressV()
+ *
+ *****************************************************************************/
+QATZIP_API int qzCompressV(QzSession_T *sess, const QzIovec_T *src_iov,
+                           unsigned int src_cnt, unsigned int *src_len,
+                           unsigned char *dest, unsigned int *dest_len,
+                           unsigned int last, unsigned long *crc);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Decompress a buffer made of several segments
+ *
+ * @description
+ *      This function decompresses the concatenation of the src_cnt
+ *    segments of src_iov as qzDecompressCrc would decompress it from one
+ *    buffer. As the compressed stream is parsed by its headers, the
+ *    segments are gathered once into a pinned buffer the hardware reads in
+ *    place, a single segment is used as it is.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       sess     Session handle
+ *                           (pointer to opaque instance and session data)
+ * @param[in]       src_iov  Array of src_cnt source segments
+ * @param[in]       src_cnt  Number of segments in src_iov
+ * @param[out]      src_len  Number of bytes consumed when function returns
+ * @param[in]       dest     Point to destination buffer
+ * @param[in,out]   dest_len Length of destination buffer. Modified
+ *                           to length of decompressed data when
+ *                           function returns
+ * @param[in,out]   crc      Pointer to CRC32 checksum buffer, or NULL
+ *
+ * @retval QZ_OK             Function executed successfully
+ * @retval QZ_PARAMS         *sess, src_iov or a segment is not valid, or
+ *                           the segments add up to more than 4GB
+ * @retval QZ_NOSW_LOW_MEM   Not enough memory to gather the segments
+ * @retval Other             As for qzDecompressCrc
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzDecompressCrc(), qzCompressV()
+ *
+ *****************************************************************************/
+QATZIP_API int qzDecompressV(QzSession_T *sess, const QzIovec_T *src_iov,
+                             unsigned int src_cnt, unsigned int *src_len,
+                             unsigned char *dest, unsigned int *dest_len,
+                             unsigned long *crc);
+
 /**
  *****************************************************************************
  * @ingroup qatZip
@@ -1906,7 +2373,8 @@ QATZIP_API int qzClose(QzSession_T *sess);
  *    qat_instance_attach  1 if session has attached to a hardware instance,
  *                         0 otherwise
  *    memory_alloced       Amount of memory, in kilobytes, from kernel or huge
- *                         pages allocated  by this process/thread.
+ *                         pages allocated  by this process/thread, see
+ *                         qzGetMemStats for the details.
  *    using_huge_pages     1 if memory is being allocated from huge pages, 0 if
  *                         memory is being allocated from standard kernel memory
  *    hw_session_status    Hw session status: one of:
@@ -1992,20 +2460,36 @@ QATZIP_API int qzClose(QzSession_T *sess);
  *****************************************************************************/
 QATZIP_API int qzGetStatus(QzSession_T *sess, QzStatus_T *status);
 
-/**
- *****************************************************************************
- return end of stream.
- *****************************************************************************/
-QATZIP_API int qzGetDeflateEndOfStream(QzSession_T *sess,
-                                       unsigned char *endofstream);
-
 /**
  *****************************************************************************
  * @ingroup qatZip
- *      Get the maximum compressed output length
+ *      Get QATzip process statistics
  *
  * @description
- *      Get the maximum compressed output length.
+ *    This function retrieves the counters QATzip collected for the calling
+ *    process. The statistics structure will be filled in as follows:
+ *    inst_grab_local      Number of hardware requests that ran on an
+ *                         instance attached to the NUMA node of the
+ *                         calling thread
+ *    inst_grab_remote     Number of hardware requests that ran on an
+ *                         instance of a remote NUMA node, because all the
+ *                         local instances were busy or unusable
+ *    inst_grab_shared     Number of hardware requests that joined an
+ *                         instance shared with other sessions
+ *    small_coalesced      Number of compression requests below
+ *                         input_sz_thrshold that were coalesced with
+ *                         others onto hardware, see coalesce_usec
+ *    small_sw             Number of compression requests below
+ *                         input_sz_thrshold that went to software
+ *    bytes_copied         Bytes of hardware request input and output
+ *                         copied through the instance's own buffers, as
+ *                         the caller buffer wasn't from qzMalloc or
+ *                         registered by qzRegisterMemory
+ *    bytes_zero_copy      Bytes of hardware request input and output
+ *                         the device accessed in the caller buffer
+ *
+ *    Instances are counted as local when the NUMA node of the calling
+ *    thread can't be determined.
  *
  * @context
  *      This function shall not be called in an interrupt context.
@@ -2014,20 +2498,15 @@ QATZIP_API int qzGetDeflateEndOfStream(QzSession_T *sess,
  * @sideEffects
  *      None
  * @blocking
- *      Yes
- * @reentrant
  *      No
+ * @reentrant
+ *      Yes
  * @threadSafe
  *      Yes
  *
- * @param[in]
- *         src_sz     Input data length in bytes
- *         sess       Session handle
- *                    (pointer to opaque instance and session data)
- *
- * @retval dest_sz    Max compressed data output length in bytes.
- *                    When src_sz is equal to 0, the return value is QZ_COMPRESSED_SZ_OF_EMPTY_FILE(34).
- *                    When integer overflow happens, the return value is 0
+ * @param[out]      stats   Pointer to QATzip process statistics structure
+ * @retval QZ_OK            Function executed successfully
+ * @retval QZ_PARAMS        *stats is NULL
  *
  * @pre
  *      None
@@ -2037,21 +2516,20 @@ QATZIP_API int qzGetDeflateEndOfStream(QzSession_T *sess,
  *      Only a synchronous version of this function is provided.
  *
  * @see
- *      None
+ *      qzGetStatus()
  *
  *****************************************************************************/
-#define QZ_SKID_PAD_SZ 48
-#define QZ_COMPRESSED_SZ_OF_EMPTY_FILE 34
-QATZIP_API
-unsigned int qzMaxCompressedLength(unsigned int src_sz, QzSession_T *sess);
+QATZIP_API int qzGetProcessStats(QzProcessStats_T *stats);
 
 /**
  *****************************************************************************
  * @ingroup qatZip
- *      Set default QzSessionParams_T value
+ *      Get the adaptive polling model of a session's instance
  *
  * @description
- *      Set default QzSessionParams_T value.
+ *      Fill in the model QZ_ADAPTIVE_POLLING has learned for the instance
+ *    the session used last. The model is shared by all the sessions using
+ *    the instance.
  *
  * @context
  *      This function shall not be called in an interrupt context.
@@ -2060,17 +2538,17 @@ unsigned int qzMaxCompressedLength(unsigned int src_sz, QzSession_T *sess);
  * @sideEffects
  *      None
  * @blocking
- *      Yes
- * @reentrant
  *      No
+ * @reentrant
+ *      Yes
  * @threadSafe
  *      Yes
  *
- * @param[in]
- *              defaults   The pointer to value to be set as default
- *
- * @retval      QZ_OK      Success on setting default value
- * @retval      QZ_PARAM   Fail to set default value
+ * @param[in]       sess    Session handle
+ * @param[out]      model   Pointer to QATzip adaptive polling model
+ * @retval QZ_OK            Function executed successfully
+ * @retval QZ_FAIL          The session hasn't used an instance yet
+ * @retval QZ_PARAMS        *sess or *model is NULL
  *
  * @pre
  *      None
@@ -2080,16 +2558,109 @@ unsigned int qzMaxCompressedLength(unsigned int src_sz, QzSession_T *sess);
  *      Only a synchronous version of this function is provided.
  *
  * @see
- *      None
+ *      qzGetProcessStats()
  *
  *****************************************************************************/
-QATZIP_API int qzSetDefaults(QzSessionParams_T *defaults);
-
-QATZIP_API int qzSetDefaultsDeflate(QzSessionParamsDeflate_T *defaults);
-
-QATZIP_API int qzSetDefaultsLZ4(QzSessionParamsLZ4_T *defaults);
+QATZIP_API int qzGetPollModel(QzSession_T *sess, QzPollModel_T *model);
 
-QATZIP_API int qzSetDefaultsLZ4S(QzSessionParamsLZ4S_T *defaults);
+/**
+ *****************************************************************************
+ return end of stream.
+ *****************************************************************************/
+QATZIP_API int qzGetDeflateEndOfStream(QzSession_T *sess,
+                                       unsigned char *endofstream);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Get the maximum compressed output length
+ *
+ * @description
+ *      Get the maximum compressed output length.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]
+ *         src_sz     Input data length in bytes
+ *         sess       Session handle
+ *                    (pointer to opaque instance and session data)
+ *
+ * @retval dest_sz    Max compressed data output length in bytes.
+ *                    When src_sz is equal to 0, the return value is QZ_COMPRESSED_SZ_OF_EMPTY_FILE(34).
+ *                    When integer overflow happens, the return value is 0
+ *
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      None
+ *
+ *****************************************************************************/
+#define QZ_SKID_PAD_SZ 48
+#define QZ_COMPRESSED_SZ_OF_EMPTY_FILE 34
+QATZIP_API
+unsigned int qzMaxCompressedLength(unsigned int src_sz, QzSession_T *sess);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Set default QzSessionParams_T value
+ *
+ * @description
+ *      Set default QzSessionParams_T value.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]
+ *              defaults   The pointer to value to be set as default
+ *
+ * @retval      QZ_OK      Success on setting default value
+ * @retval      QZ_PARAM   Fail to set default value
+ *
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      None
+ *
+ *****************************************************************************/
+QATZIP_API int qzSetDefaults(QzSessionParams_T *defaults);
+
+QATZIP_API int qzSetDefaultsDeflate(QzSessionParamsDeflate_T *defaults);
+
+QATZIP_API int qzSetDefaultsLZ4(QzSessionParamsLZ4_T *defaults);
+
+QATZIP_API int qzSetDefaultsLZ4S(QzSessionParamsLZ4S_T *defaults);
 
 QATZIP_API int qzSetDefaultsDeflateExt(QzSessionParamsDeflateExt_T *defaults);
 /**
@@ -2346,6 +2917,324 @@ QATZIP_API int qzFreeMetadata(QzMetadataBlob_T metadata);
  *****************************************************************************/
 QATZIP_API int qzMemFindAddr(unsigned char *a);
 
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Register application memory for zero-copy hardware requests
+ *
+ * @description
+ *      Record the pages of [addr, addr + len) as usable by the hardware in
+ *    place, so that compression and decompression requests on buffers in
+ *    the range are no longer copied through the instance's own buffers.
+ *    qzMemFindAddr returns 1 for the range until it is unregistered.
+ *
+ *    Only memory from the QAT memory driver (USDM) can be registered, as
+ *    the device addresses pages through its translation. Every page of the
+ *    range is checked, and the call fails if one isn't from it. The memory
+ *    has to stay allocated while it is registered.
+ *
+ *    Pages already from qzMalloc are left as they are. Registering a range
+ *    again is allowed, the pages stay registered until unregistered once.
+ *    A failed call leaves the pages registered before it as they were.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       addr    Start of the range
+ * @param[in]       len     Length of the range in bytes
+ *
+ * @retval QZ_OK            Function executed successfully
+ * @retval QZ_PARAMS        addr is NULL, len is 0 or the range wraps
+ * @retval QZ_FAIL          A page isn't from the QAT memory driver, or the
+ *                          page table could not be extended
+ *
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzUnregisterMemory(), qzMemFindAddr()
+ *
+ *****************************************************************************/
+QATZIP_API int qzRegisterMemory(void *addr, size_t len);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Unregister application memory
+ *
+ * @description
+ *      Forget the pages of [addr, addr + len) registered by
+ *    qzRegisterMemory, requests on them are copied again. It has to be
+ *    called before the memory is freed or unpinned, and no request may be
+ *    in flight on it.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       addr    Start of the range
+ * @param[in]       len     Length of the range in bytes
+ *
+ * @retval QZ_OK            Function executed successfully
+ * @retval QZ_PARAMS        addr is NULL, len is 0 or the range wraps
+ * @retval QZ_FAIL          Function did not succeed
+ *
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzRegisterMemory()
+ *
+ *****************************************************************************/
+QATZIP_API int qzUnregisterMemory(void *addr, size_t len);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Set the memory pool retained limit
+ *
+ * @description
+ *      qzMalloc serves requests up to 2 MB from 2 MB slabs cut in power of
+ *    two blocks, kept per NUMA node and cached per thread. Slabs come from
+ *    the USDM allocator, or from huge pages for COMMON_MEM requests when it
+ *    can't provide them. A slab whose blocks are all freed is given back
+ *    while the free bytes in the pool are over bytes, 64 MB by default.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      No
+ * @reentrant
+ *      Yes
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       bytes   Free bytes the pool may keep, 0 keeps none
+ *
+ * @retval QZ_OK            Function executed successfully
+ * @retval QZ_FAIL          The pool could not be set up
+ *
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzGetMemPoolStats(), qzMalloc()
+ *
+ *****************************************************************************/
+QATZIP_API int qzSetMemPoolLimit(size_t bytes);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Get memory pool statistics
+ *
+ * @description
+ *      Fill in the state of the pool behind qzMalloc. Counts of other
+ *    threads' caches are folded in when they refill, flush or exit.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      No
+ * @reentrant
+ *      Yes
+ * @threadSafe
+ *      Yes
+ *
+ * @param[out]      stats   Pointer to QATzip memory pool statistics
+ *
+ * @retval QZ_OK            Function executed successfully
+ * @retval QZ_PARAMS        *stats is NULL
+ *
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzSetMemPoolLimit()
+ *
+ *****************************************************************************/
+QATZIP_API int qzGetMemPoolStats(QzMemPoolStats_T *stats);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Set the pinned memory budget
+ *
+ * @description
+ *      Bound the memory QATzip takes from the USDM allocator, on one NUMA
+ *    node or for the process. When an allocation would go over, empty pool
+ *    slabs and cached stream buffers are given back first. If that isn't
+ *    enough, PINNED_MEM requests fail, COMMON_MEM requests are served from
+ *    pageable memory, and instance buffer rings stop growing. Memory
+ *    already held is kept when the budget is lowered below it.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      No
+ * @reentrant
+ *      Yes
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       node    NUMA node, or QZ_AUTO_SELECT_NUMA_NODE (-1) for
+ *                          the process budget
+ * @param[in]       bytes   Budget in bytes, 0 for none
+ *
+ * @retval QZ_OK            Function executed successfully
+ * @retval QZ_PARAMS        node is out of range
+ *
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzGetMemStats(), qzSetMemPoolLimit()
+ *
+ *****************************************************************************/
+QATZIP_API int qzSetMemBudget(int node, size_t bytes);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Get memory accounting
+ *
+ * @description
+ *      Fill in the bytes QATzip holds by NUMA node and purpose, the USDM
+ *    memory behind them and the budget set by qzSetMemBudget. Pool blocks
+ *    are counted at the size of their class.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      None
+ * @blocking
+ *      No
+ * @reentrant
+ *      Yes
+ * @threadSafe
+ *      Yes
+ *
+ * @param[out]      stats   Pointer to QATzip memory accounting
+ *
+ * @retval QZ_OK            Function executed successfully
+ * @retval QZ_PARAMS        *stats is NULL
+ *
+ * @pre
+ *      None
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzSetMemBudget(), qzGetStatus()
+ *
+ *****************************************************************************/
+QATZIP_API int qzGetMemStats(QzMemStats_T *stats);
+
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Set up instances ahead of the first request
+ *
+ * @description
+ *      Allocate the buffers and start the QAT sessions of the instances on
+ *    the selected NUMA nodes for the session's parameters, so that the first
+ *    requests don't pay for it. The instances are set up in parallel. Those
+ *    already set up are counted as ready and those held by other sessions
+ *    are left alone.
+ *
+ * @context
+ *      This function shall not be called in an interrupt context.
+ * @assumptions
+ *      None
+ * @sideEffects
+ *      Pinned memory is allocated for the instances
+ * @blocking
+ *      Yes
+ * @reentrant
+ *      No
+ * @threadSafe
+ *      Yes
+ *
+ * @param[in]       sess     Session handle, set up by qzSetupSession
+ * @param[in]       flags    QZ_PREWARM_ALL or QZ_PREWARM_NODE bits, with
+ *                           QZ_PREWARM_MEM_ONLY to skip the QAT sessions
+ * @param[out]      report   Readiness report, may be NULL
+ *
+ * @retval QZ_OK             At least one instance is ready
+ * @retval QZ_FAIL           No instance could be set up
+ * @retval QZ_PARAMS         sess is NULL or not set up
+ * @retval QZ_NO_HW          No QAT hardware, see qzInit
+ * @retval QZ_NOSW_LOW_MEM   Not enough memory to run the setup
+ *
+ * @pre
+ *      qzSetupSession has been called on sess
+ * @post
+ *      None
+ * @note
+ *      Only a synchronous version of this function is provided.
+ *
+ * @see
+ *      qzInit(), qzSetupSession(), qzSetMemBudget()
+ *
+ *****************************************************************************/
+QATZIP_API int qzPrewarm(QzSession_T *sess, unsigned int flags,
+                         QzPrewarmReport_T *report);
+
 /**
  *****************************************************************************
  * @ingroup qatZip
@@ -2371,13 +3260,31 @@ typedef struct QzStream_S {
     QzCrcType_T crc_type;
     /**< Checksum type in Adler, CRC32 or none */
     unsigned int crc_32;
-    /**< Checksum value */
+    /**< Checksum value: CRC32 of the data, Adler-32 for zlib streams and
+     *   XXH32 for LZ4 frames. Decompression gives it for zlib and LZ4 only */
     unsigned long long reserved;
     /**< Reserved for future use */
     void *opaque;
     /**< Internal storage managed by QATzip */
 } QzStream_T;
 
+/**
+ *****************************************************************************
+ * @ingroup qatZip
+ *      Flush modes of qzCompressStream
+ *
+ * @description
+ *      Values of the last parameter of qzCompressStream. QZ_SYNC_FLUSH and
+ *    QZ_FULL_FLUSH compress the data held in the stream at once, as blocks
+ *    which don't end the stream, and hand out all of their output. Hardware
+ *    requests don't share history, so both give the same output.
+ *
+ *****************************************************************************/
+#define QZ_NO_FLUSH             (0)
+#define QZ_FINISH               (1)
+#define QZ_SYNC_FLUSH           (2)
+#define QZ_FULL_FLUSH           (3)
+
 /**
  *****************************************************************************
  * @ingroup qatZip
@@ -2393,11 +3300,23 @@ typedef struct QzStream_S {
  *    reaching the end of input data - as indicated by last parameter.
  *
  *    The resulting compressed block of data will be composed of one or more
- *    gzip blocks, per RFC 1952, or deflate blocks, per RFC 1951.
+ *    gzip blocks, per RFC 1952, deflate blocks, per RFC 1951, or LZ4 frames,
+ *    as selected by the session's data format. For zlib it is one zlib
+ *    stream, per RFC 1950, from the first call up to the one with last set,
+ *    whether single_member is set or not.
  *
  *    This function will place completed compression blocks in the *out
  *    of QzStream_T structure and put checksum for compressed input data
- *    in crc32 of QzStream_T structure.
+ *    in crc32 of QzStream_T structure. That is the Adler-32 of all input
+ *    for zlib streams and its XXH32 for LZ4 frames.
+ *
+ *    With last set to QZ_SYNC_FLUSH or QZ_FULL_FLUSH, the input held so far
+ *    is compressed without waiting for a full buffer, and the stream goes
+ *    on. For raw deflate the output is byte aligned non-final blocks; gzip
+ *    and LZ4 end their current member or frame, or with single_member set
+ *    leave it open after blocks which can be decoded up to there, as zlib
+ *    always does. The call has flushed everything once pending_in and
+ *    pending_out are both zero, otherwise call it again with the flush.
  *
  *    The caller must check the updated in_sz of QzStream_T. This value will
  *    be the number of consumed bytes on exit. The calling API may have to
@@ -2418,6 +3337,10 @@ typedef struct QzStream_S {
  *    will be the number of processed bytes held in QATzip. The calling API
  *    may have to process the destination buffer and call again.
  *
+ *    With strm_pipeline above 1 the stream is compressed by a worker thread
+ *    with its own session. Every call for the stream must pass the session
+ *    of its first call, until qzEndStream.
+ *
  * @context
  *      This function shall not be called in an interrupt context.
  * @assumptions
@@ -2434,14 +3357,17 @@ typedef struct QzStream_S {
  * @param[in]       sess     Session handle
  *                           (pointer to opaque instance and session data)
  * @param[in,out]   strm     Stream handle
- * @param[in]       last     1 for 'No more data to be compressed'
- *                           0 for 'More data to be compressed'
+ * @param[in]       last     1 (QZ_FINISH) for 'No more data to be compressed'
+ *                           0 (QZ_NO_FLUSH) for 'More data to be compressed'
+ *                           QZ_SYNC_FLUSH or QZ_FULL_FLUSH for 'More data
+ *                           to come, compress what is held now'
  *                           (always set to 1 in the Microsoft(R)
  *                           Windows(TM) QATzip implementation)
  *
  * @retval QZ_OK             Function executed successfully
  * @retval QZ_FAIL           Function did not succeed
- * @retval QZ_PARAMS         *sess is NULL or member of params is invalid
+ * @retval QZ_PARAMS         *sess is NULL, member of params is invalid
+ *                           or a pipelined stream is given another session
  * @pre
  *      None
  * @post
@@ -2471,7 +3397,9 @@ int qzCompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last);
  *    reaching the end of input data - as indicated by last parameter.
  *
  *    The input compressed block of data will be composed of one or more
- *    gzip blocks, per RFC 1952, or deflate blocks, per RFC 1951.
+ *    gzip blocks, per RFC 1952, deflate blocks, per RFC 1951, zlib streams,
+ *    per RFC 1950, or LZ4 frames. A frame cut at the end of the input is
+ *    kept until the rest of it comes in.
  *
  *    This function will place completed decompression blocks in the *out
  *    of QzStream_T structure and put checksum for decompressed data in
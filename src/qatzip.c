@@ -41,12 +41,16 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <assert.h>
 #include <sys/time.h>
 #include <bits/types.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <numa.h>
 #define XXH_NAMESPACE QATZIP_
 #include "xxhash.h"
 
@@ -83,8 +87,19 @@ const unsigned int g_polling_interval[] = { 10, 10, 20, 30, 60, 100, 200, 400,
 #define POLLING_LIST_NUM          (sizeof(g_polling_interval) \
                                     / sizeof(unsigned int))
 #define MAX_GRAB_RETRY            (10)
-
-#define GET_BUFFER_SLEEP_NSEC   10
+/* Rounds spent on instances of the caller's NUMA node before remote ones */
+#define LOCAL_GRAB_RETRY          (MAX_GRAB_RETRY / 2)
+
+#define GET_BUFFER_WAIT_NSEC    1000000
+/* Bound of an event wait, a sharer may have taken the event */
+#define QZ_EVENT_WAIT_MSEC      1
+/* Central poller: deepest backoff step, idle wait and sessions' wait bound */
+#define CENTRAL_POLL_MAX_IDX    5
+#define CENTRAL_IDLE_NSEC       100000000
+#define CENTRAL_WAIT_NSEC       10000000
+/* qzPrewarm: setup threads and rounds waiting for a held instance */
+#define PREWARM_MAX_THREADS     16
+#define PREWARM_LOCK_RETRY      MAX_GRAB_RETRY
 #define QAT_SECTION_NAME_SIZE   32
 #define POLL_EVENT_INTERVAL_TIME 1000
 # define NSEC_TO_SEC 1000000000L
@@ -108,6 +123,10 @@ QzSessionParamsInternal_T g_sess_params_internal_default = {
     .req_cnt_thrshold  = QZ_REQ_THRESHOLD_DEFAULT,
     .wait_cnt_thrshold = QZ_WAIT_CNT_THRESHOLD_DEFAULT,
     .polling_mode      = QZ_PERIODICAL_POLLING,
+    .share_inst        = QZ_SHARE_INST_DEFAULT,
+    .coalesce_usec     = QZ_COALESCE_USEC_DEFAULT,
+    .strm_pipeline     = QZ_STRM_PIPELINE_DEFAULT,
+    .single_member     = QZ_SINGLE_MEMBER_DEFAULT,
     .lz4s_mini_match   = 3,
     .qzCallback        = NULL,
     .qzCallback_external = NULL,
@@ -209,6 +228,7 @@ static void clearDevices(QzHardware_T *qat_hw)
 static void dcCallback(void *cbtag, CpaStatus stat)
 {
     long tag, i, j;
+    QzSess_T *owner;
 
     tag = (long)cbtag;
     j = GET_LOWER_16BITS(tag);
@@ -234,6 +254,21 @@ static void dcCallback(void *cbtag, CpaStatus stat)
 
     g_process.qz_inst[i].stream[j].sink1++;
     g_process.qz_inst[i].stream[j].job_status = stat;
+
+    /* hand the buffer to the owning session, in the slot of its seq */
+    owner = g_process.qz_inst[i].stream[j].owner;
+    if (likely(NULL != owner)) {
+        __atomic_store_n(&owner->cq[QZ_CQ_IDX(g_process.qz_inst[i].stream[j].seq)],
+                         (int)j + 1, __ATOMIC_RELEASE);
+        if (QZ_CENTRAL_POLLING == owner->sess_params.polling_mode) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&owner->cq_waiters, __ATOMIC_RELAXED)) {
+                __atomic_fetch_add(&owner->cq_events, 1, __ATOMIC_SEQ_CST);
+                syscall(SYS_futex, &owner->cq_events, FUTEX_WAKE_PRIVATE, 1,
+                        NULL, NULL, 0);
+            }
+        }
+    }
     goto done;
 
 print_err:
@@ -360,9 +395,110 @@ static inline int qzCheckInstCap(CpaDcInstanceCapabilities *inst_cap,
     return QZ_OK;
 }
 
-static int qzGrabInstance(int hint, const QzSessionParamsInternal_T *params)
+/* NUMA node of the calling thread, -1 if it can't be determined */
+static inline int qzGetCurrentNumaNode(void)
+{
+    int cpu_id = sched_getcpu();
+
+    if (cpu_id < 0) {
+        return -1;
+    }
+
+    return numa_node_of_cpu(cpu_id);
+}
+
+/* NUMA node the instance's memory should come from */
+static inline int qzGetInstNumaNode(int i)
+{
+    Cpa32U node = g_process.qz_inst[i].instance_info.nodeAffinity;
+
+    if (numa_available() < 0 || node >= (Cpa32U)numa_num_configured_nodes()) {
+        return QZ_AUTO_SELECT_NUMA_NODE;
+    }
+
+    return (int)node;
+}
+
+static inline int qzIsInstUsable(int i, const QzSessionParamsInternal_T *params)
+{
+    /* Before locking the instance, we need to ensure that
+     * the instance supports the data format.
+     */
+    if (QZ_OK != qzCheckInstCap(&g_process.qz_inst[i].instance_cap, params)) {
+        return 0;
+    }
+
+    if (CPA_STATUS_SUCCESS != g_process.qz_inst[i].heartbeat) {
+        return 0;
+    }
+
+    /* Over the memory budget, leave the instances without buffers alone
+     * and share those already set up
+     */
+    if (!g_process.qz_inst[i].mem_setup &&
+        qzMemBudgetAvail(qzGetInstNumaNode(i)) < QZ_INST_MIN_BUFF *
+        (params->hw_buff_sz + DEST_SZ(params->hw_buff_sz))) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static inline int qzIsInstLocal(int i, int node)
 {
-    int i, j, rc, f;
+    return (node < 0 ||
+            g_process.qz_inst[i].instance_info.nodeAffinity == (Cpa32U)node);
+}
+
+/* Instance i already runs a cpa session matching setup */
+static inline int qzIsInstReady(int i, const CpaDcSessionSetupData *setup)
+{
+    return (g_process.qz_inst[i].mem_setup &&
+            g_process.qz_inst[i].cpa_sess_setup &&
+            !memcmp(&g_process.qz_inst[i].session_setup_data, setup,
+                    sizeof(CpaDcSessionSetupData)));
+}
+
+/* Try to lock instance i. When share_setup is given, the session joins the
+ * instance's other sharers, which only works while the instance's cpa
+ * session matches, otherwise it falls back to an exclusive lock so that
+ * the caller can set the instance up before calling qzShareInstance.
+ */
+static inline int qzTryLockInstance(int i,
+                                    const CpaDcSessionSetupData *share_setup)
+{
+    unsigned int *lock = &g_process.qz_inst[i].lock;
+    unsigned int users;
+
+    if (NULL != share_setup) {
+        users = *lock;
+        while (0 != users && 0 == (users & QZ_INST_EXCLUSIVE)) {
+            if (__sync_bool_compare_and_swap(lock, users, users + 1)) {
+                /* setup data can't change while we are one of the users */
+                if (qzIsInstReady(i, share_setup)) {
+                    atomic_fetch_add(&g_process.inst_grab_shared, 1);
+                    return 1;
+                }
+                __sync_fetch_and_sub(lock, 1);
+                break;
+            }
+            users = *lock;
+        }
+    }
+
+    return __sync_bool_compare_and_swap(lock, 0, QZ_INST_EXCLUSIVE);
+}
+
+/* Grab a free instance, starting from hint. Instances on the NUMA node of
+ * the calling thread are preferred, remote instances are only taken when
+ * the local ones stay busy for LOCAL_GRAB_RETRY rounds or there is no
+ * usable local instance at all. With share_setup the instance may also be
+ * one that other sharing sessions are using.
+ */
+static int qzGrabInstance(int hint, const QzSessionParamsInternal_T *params,
+                          const CpaDcSessionSetupData *share_setup)
+{
+    int i, j, k, node, local_cnt;
 
     if (QZ_NONE == g_process.qz_init_status) {
         return -1;
@@ -372,73 +508,508 @@ static int qzGrabInstance(int hint, const QzSessionParamsInternal_T *params)
         hint = 0;
     }
 
-    /*otherwise loop through all of them*/
+    node = qzGetCurrentNumaNode();
 
-    f = 0;
     for (j = 0; j < MAX_GRAB_RETRY; j++) {
-        for (i = 0; i < g_process.num_instances; i++) {
-            if (f == 0) { i = hint; f = 1; } ;
-            /* Before locking the instance, we need to ensure that
-             * the instance supports the data format.
-             */
-            if (QZ_OK != qzCheckInstCap(&g_process.qz_inst[i].instance_cap,
-                                        params)) {
+        local_cnt = 0;
+        for (k = 0; k < g_process.num_instances; k++) {
+            i = (hint + k) % g_process.num_instances;
+            if (!qzIsInstUsable(i, params) || !qzIsInstLocal(i, node)) {
                 continue;
             }
 
-            if (CPA_STATUS_SUCCESS != g_process.qz_inst[i].heartbeat) {
+            local_cnt++;
+            if (qzTryLockInstance(i, share_setup)) {
+                atomic_fetch_add(&g_process.inst_grab_local, 1);
+                return i;
+            }
+        }
+
+        if (local_cnt > 0 && j < LOCAL_GRAB_RETRY) {
+            continue;
+        }
+
+        for (k = 0; k < g_process.num_instances; k++) {
+            i = (hint + k) % g_process.num_instances;
+            if (!qzIsInstUsable(i, params) || qzIsInstLocal(i, node)) {
                 continue;
             }
-            rc = __sync_lock_test_and_set(&(g_process.qz_inst[i].lock), 1);
-            if (0 ==  rc) {
+
+            if (qzTryLockInstance(i, share_setup)) {
+                QZ_DEBUG("Grab remote instance %d on node %u for node %d\n", i,
+                         g_process.qz_inst[i].instance_info.nodeAffinity, node);
+                atomic_fetch_add(&g_process.inst_grab_remote, 1);
                 return i;
             }
         }
+    }
+    return -1;
+}
+
+/* Setup data to share an instance with, NULL to lock it exclusively */
+static inline const CpaDcSessionSetupData *qzShareSetup(const QzSess_T *qz_sess)
+{
+    return qz_sess->sess_params.share_inst ? &qz_sess->session_setup_data : NULL;
+}
 
+/* Turn an exclusive lock of a set up instance into a shared one */
+static inline void qzShareInstance(int i)
+{
+    if (QZ_INST_EXCLUSIVE == g_process.qz_inst[i].lock) {
+        __atomic_store_n(&g_process.qz_inst[i].lock, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Whether buffer j of instance i belongs to qz_sess. Without sharing the
+ * locking session owns every buffer of the instance.
+ */
+static inline int qzIsStreamOwner(int i, int j, const QzSess_T *qz_sess)
+{
+    return (QZ_INST_EXCLUSIVE == g_process.qz_inst[i].lock ||
+            qz_sess == g_process.qz_inst[i].stream[j].owner);
+}
+
+static int qzSetupStreamBuffers(int i, int j);
+static void qzFreeStreamBuffers(int i, int j);
+
+/* Flip one of the first n bits of bitmap, a clear one to set it when set
+ * is given, else a set one. Returns the bit, -1 if there is none.
+ */
+static inline int qzClaimBit(uint64_t *bitmap, unsigned int n, int set)
+{
+    int w, bit;
+    uint64_t word, avail, valid;
+
+    for (w = 0; w * 64 < n; w++) {
+        valid = (n - w * 64 >= 64) ? ~0ULL : (1ULL << (n - w * 64)) - 1;
+        word = bitmap[w];
+        avail = (set ? ~word : word) & valid;
+        while (0 != avail) {
+            bit = __builtin_ctzll(avail);
+            if (__sync_bool_compare_and_swap(&bitmap[w], word,
+                                             word ^ (1ULL << bit))) {
+                return bit + w * 64;
+            }
+            word = bitmap[w];
+            avail = (set ? ~word : word) & valid;
+        }
     }
     return -1;
 }
 
-static int getUnusedBuffer(unsigned long i, int j)
+/* Set up one more stream buffer of instance i and hand it out claimed, -1
+ * if the ring is full or out of memory
+ */
+static int qzGrowRing(unsigned long i)
 {
-    int k;
-    Cpa16U max;
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    int j;
+
+    if (inst->ready_cnt >= inst->dest_count ||
+        (0 != inst->grow_ns && qzNowNs() < inst->grow_ns)) {
+        return -1;
+    }
+
+    j = qzClaimBit(inst->ready_streams, inst->dest_count, 1);
+    if (-1 == j) {
+        return -1;
+    }
+    if (0 != qzSetupStreamBuffers(i, j)) {
+        __sync_fetch_and_and(&inst->ready_streams[j / 64], ~(1ULL << (j % 64)));
+        inst->grow_ns = qzNowNs() + QZ_RING_GROW_BACKOFF_NS;
+        atomic_fetch_add(&g_process.ring_denials, 1);
+        QZ_DEBUG("Inst %lu ring held at %u buffers\n", i, inst->ready_cnt);
+        return -1;
+    }
+    inst->grow_ns = 0;
+    __sync_fetch_and_add(&inst->ready_cnt, 1);
+    atomic_fetch_add(&g_process.ring_grows, 1);
+    return j;
+}
+
+/* Free the stream buffers of instance i left unclaimed since the last
+ * trim, at most once per QZ_RING_IDLE_NS, keeping QZ_INST_MIN_BUFF and
+ * those reserved
+ */
+static void qzTrimRing(int i)
+{
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    unsigned long now, next = inst->trim_ns;
+    int j;
+
+    unsigned int keep = (inst->reserved > QZ_INST_MIN_BUFF) ?
+                        inst->reserved : QZ_INST_MIN_BUFF;
+
+    if (inst->ready_cnt <= keep) {
+        return;
+    }
+    now = qzNowNs();
+    if (now < next ||
+        !__sync_bool_compare_and_swap(&inst->trim_ns, next,
+                                      now + QZ_RING_IDLE_NS)) {
+        return;
+    }
 
-    max = g_process.qz_inst[i].dest_count;
-    if (j < 0) {
-        j = 0;
-    } else if (j >= max) {
-        j = GET_LOWER_16BITS(max);
+    for (j = 0; j < inst->dest_count && inst->ready_cnt > keep; j++) {
+        if (0 == (inst->ready_streams[j / 64] & (1ULL << (j % 64))) ||
+            0 == (inst->free_streams[j / 64] & (1ULL << (j % 64)))) {
+            continue;
+        }
+        if (inst->stream[j].src1 != inst->stream[j].idle_mark) {
+            inst->stream[j].idle_mark = inst->stream[j].src1;
+            continue;
+        }
+        /* take it off the free bitmap first, so no one claims it */
+        if (0 == (__sync_fetch_and_and(&inst->free_streams[j / 64],
+                                       ~(1ULL << (j % 64))) &
+                  (1ULL << (j % 64)))) {
+            continue;
+        }
+        if (inst->stream[j].src1 != inst->stream[j].idle_mark) {
+            inst->stream[j].idle_mark = inst->stream[j].src1;
+            __sync_fetch_and_or(&inst->free_streams[j / 64], 1ULL << (j % 64));
+            continue;
+        }
+        qzFreeStreamBuffers(i, j);
+        __sync_fetch_and_sub(&inst->ready_cnt, 1);
+        __sync_fetch_and_and(&inst->ready_streams[j / 64], ~(1ULL << (j % 64)));
+        atomic_fetch_add(&g_process.ring_trims, 1);
     }
+}
+
+/* Claim an unused stream buffer of instance i for qz_sess in O(1) from the
+ * instance's free buffer bitmap, growing the ring when all of them are in
+ * use. -1 if none could be had.
+ */
+static int getUnusedBuffer(unsigned long i, QzSess_T *qz_sess)
+{
+    int j;
+    QzInstance_T *inst = &g_process.qz_inst[i];
 
-    for (k = j; k < max; k++) {
-        if ((g_process.qz_inst[i].stream[k].src1 ==
-             g_process.qz_inst[i].stream[k].src2) &&
-            (g_process.qz_inst[i].stream[k].src1 ==
-             g_process.qz_inst[i].stream[k].sink1) &&
-            (g_process.qz_inst[i].stream[k].src1 ==
-             g_process.qz_inst[i].stream[k].sink2)) {
-            return k;
+    j = qzClaimBit(inst->free_streams, inst->dest_count, 0);
+    if (unlikely(-1 == j)) {
+        j = qzGrowRing(i);
+        if (-1 == j) {
+            return -1;
         }
     }
 
-    for (k = 0; k < max; k++) {
-        if ((g_process.qz_inst[i].stream[k].src1 ==
-             g_process.qz_inst[i].stream[k].src2) &&
-            (g_process.qz_inst[i].stream[k].src1 ==
-             g_process.qz_inst[i].stream[k].sink1) &&
-            (g_process.qz_inst[i].stream[k].src1 ==
-             g_process.qz_inst[i].stream[k].sink2)) {
-            return k;
+    inst->stream[j].src1++;
+    inst->stream[j].owner = qz_sess;
+    return j;
+}
+
+/* Return stream buffer j of instance i once all its counters are equal
+ * again, and wake up a submitter waiting for one.
+ */
+void putUnusedBuffer(int i, int j)
+{
+    QzInstance_T *inst = &g_process.qz_inst[i];
+
+    __sync_fetch_and_or(&inst->free_streams[j / 64], 1ULL << (j % 64));
+    __sync_fetch_and_add(&inst->free_seq, 1);
+    if (unlikely(0 != inst->free_waiters)) {
+        syscall(SYS_futex, &inst->free_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/* Like getUnusedBuffer, but sleeps on the instance's futex until a buffer
+ * is returned. The timeout only guards against a buffer that is never
+ * handed back through putUnusedBuffer.
+ */
+static int waitUnusedBuffer(unsigned long i, QzSess_T *qz_sess)
+{
+    int j;
+    unsigned int seq;
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    struct timespec timeout = { 0, GET_BUFFER_WAIT_NSEC };
+
+    j = getUnusedBuffer(i, qz_sess);
+    while (unlikely(-1 == j)) {
+        __sync_fetch_and_add(&inst->free_waiters, 1);
+        seq = __atomic_load_n(&inst->free_seq, __ATOMIC_SEQ_CST);
+        j = getUnusedBuffer(i, qz_sess);
+        if (-1 == j) {
+            syscall(SYS_futex, &inst->free_seq, FUTEX_WAIT_PRIVATE, seq,
+                    &timeout, NULL, 0);
+            j = getUnusedBuffer(i, qz_sess);
         }
+        __sync_fetch_and_sub(&inst->free_waiters, 1);
     }
 
-    return -1;
+    return j;
+}
+
+/* Poll instance i for responses. Sharers of an instance don't poll it at
+ * the same time, the callbacks of one poller complete the buffers of all.
+ */
+static inline CpaStatus qzPollInstance(int i)
+{
+    CpaStatus sts;
+
+    if (__sync_lock_test_and_set(&g_process.qz_inst[i].poll_lock, 1)) {
+        return CPA_STATUS_RETRY;
+    }
+
+    sts = icp_sal_DcPollInstance(g_process.dc_inst_handle[i], 0);
+    __sync_lock_release(&g_process.qz_inst[i].poll_lock);
+    return sts;
+}
+
+/* Epoll fd for response events of instance i, -1 if it has none. Only
+ * instances configured for epoll mode hand out an event fd.
+ */
+static int qzInstEventFd(int i)
+{
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    int state = __atomic_load_n(&inst->event_state, __ATOMIC_ACQUIRE);
+
+    if (likely(QZ_EVENT_UNTRIED != state)) {
+        return (QZ_EVENT_READY == state) ? inst->epoll_fd : -1;
+    }
+    if (!__sync_bool_compare_and_swap(&inst->event_state, QZ_EVENT_UNTRIED,
+                                      QZ_EVENT_SETUP)) {
+        return -1;
+    }
+
+    inst->epoll_fd = -1;
+    if (CPA_STATUS_SUCCESS ==
+        icp_sal_DcGetFileDescriptor(g_process.dc_inst_handle[i],
+                                    &inst->event_fd)) {
+        inst->epoll_fd = qzEventOpen(inst->event_fd);
+        if (inst->epoll_fd < 0) {
+            icp_sal_DcPutFileDescriptor(g_process.dc_inst_handle[i],
+                                        inst->event_fd);
+        }
+    }
+    QZ_DEBUG("Instance %d event fd %s\n", i,
+             inst->epoll_fd < 0 ? "unavailable" : "ready");
+    __atomic_store_n(&inst->event_state,
+                     inst->epoll_fd < 0 ? QZ_EVENT_NONE : QZ_EVENT_READY,
+                     __ATOMIC_RELEASE);
+    return inst->epoll_fd;
+}
+
+/* Sleep until instance i signals responses. Returns -1 without waiting if
+ * nothing is in flight or the instance has no event fd. The wait is
+ * bounded as a sharer polling the instance may consume the event.
+ */
+static inline int qzWaitInstEvent(int i, QzSess_T *qz_sess)
+{
+    int epoll_fd;
+
+    if (qz_sess->processed >= qz_sess->submitted) {
+        return -1;
+    }
+    epoll_fd = qzInstEventFd(i);
+    if (unlikely(epoll_fd < 0)) {
+        return -1;
+    }
+    return (qzEventWait(epoll_fd, QZ_EVENT_WAIT_MSEC) < 0) ? -1 : 0;
+}
+
+/* Stream buffer holding the response for seq_in, -1 if it isn't back yet */
+static inline int qzGetCompletion(QzSess_T *qz_sess)
+{
+    return __atomic_load_n(&qz_sess->cq[QZ_CQ_IDX(qz_sess->seq_in)],
+                           __ATOMIC_ACQUIRE) - 1;
+}
+
+/* QZ_CENTRAL_POLLING: a thread per instance polls it while sessions wait
+ * for responses from it, dcCallback wakes the owners of the responses.
+ */
+static void *qzCentralPoller(void *arg)
+{
+    int i = (int)(long)arg;
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    struct timespec idle = {0, CENTRAL_IDLE_NSEC};
+    unsigned int idx = 0;
+    int epoll_fd;
+
+    while (!__atomic_load_n(&g_process.central_exit, __ATOMIC_ACQUIRE)) {
+        if (0 == __atomic_load_n(&inst->central_waiters, __ATOMIC_ACQUIRE)) {
+            syscall(SYS_futex, &inst->central_waiters, FUTEX_WAIT_PRIVATE, 0,
+                    &idle, NULL, 0);
+            idx = 0;
+            continue;
+        }
+
+        if (CPA_STATUS_SUCCESS == qzPollInstance(i)) {
+            idx = 0;
+            continue;
+        }
+
+        /* nothing back yet, or a sharer is polling it */
+        epoll_fd = qzInstEventFd(i);
+        if (epoll_fd >= 0) {
+            (void)qzEventWait(epoll_fd, QZ_EVENT_WAIT_MSEC);
+        } else {
+            usleep(g_polling_interval[idx]);
+            idx = (idx < CENTRAL_POLL_MAX_IDX) ? idx + 1 : idx;
+        }
+    }
+    return NULL;
+}
+
+/* The forked child has none of the parent's pollers */
+static void qzCentralAtForkChild(void)
+{
+    int i;
+
+    if (NULL == g_process.qz_inst) {
+        return;
+    }
+    for (i = 0; i < g_process.num_instances; i++) {
+        g_process.qz_inst[i].central_state = QZ_CENTRAL_IDLE;
+        g_process.qz_inst[i].central_waiters = 0;
+    }
+}
+
+static int qzCentralStart(int i)
+{
+    static pthread_mutex_t central_lock = PTHREAD_MUTEX_INITIALIZER;
+    static int atfork_registered = 0;
+    QzInstance_T *inst = &g_process.qz_inst[i];
+
+    pthread_mutex_lock(&central_lock);
+    if (!atfork_registered) {
+        atfork_registered = !pthread_atfork(NULL, NULL, qzCentralAtForkChild);
+    }
+    if (QZ_CENTRAL_IDLE == inst->central_state) {
+        if (0 == pthread_create(&inst->central_poller, NULL, qzCentralPoller,
+                                (void *)(long)i)) {
+            QZ_DEBUG("Started central poller of instance %d\n", i);
+            __atomic_store_n(&inst->central_state, QZ_CENTRAL_RUNNING,
+                             __ATOMIC_RELEASE);
+        } else {
+            QZ_ERROR("Failed to start central poller of instance %d\n", i);
+            inst->central_state = QZ_CENTRAL_FAILED;
+        }
+    }
+    pthread_mutex_unlock(&central_lock);
+    return QZ_CENTRAL_RUNNING == inst->central_state;
+}
+
+static void qzCentralStop(void)
+{
+    int i;
+
+    if (NULL == g_process.qz_inst) {
+        return;
+    }
+    __atomic_store_n(&g_process.central_exit, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < g_process.num_instances; i++) {
+        if (QZ_CENTRAL_RUNNING != g_process.qz_inst[i].central_state) {
+            continue;
+        }
+        syscall(SYS_futex, &g_process.qz_inst[i].central_waiters,
+                FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        pthread_join(g_process.qz_inst[i].central_poller, NULL);
+        g_process.qz_inst[i].central_state = QZ_CENTRAL_IDLE;
+    }
+}
+
+/* Wait for the poller of instance i to complete a request of the session.
+ * Returns -1 without waiting if nothing is in flight or there is no
+ * poller. If there is none or it doesn't answer in time, the session
+ * polls the instance by itself next.
+ */
+static int qzCentralWait(int i, QzSess_T *qz_sess)
+{
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    struct timespec timeout = {0, CENTRAL_WAIT_NSEC};
+    unsigned int events;
+
+    if (qz_sess->processed >= qz_sess->submitted) {
+        return -1;
+    }
+    if (unlikely(QZ_CENTRAL_RUNNING !=
+                 __atomic_load_n(&inst->central_state, __ATOMIC_ACQUIRE) &&
+                 !qzCentralStart(i))) {
+        qz_sess->central_self_poll = 1;
+        return -1;
+    }
+
+    __atomic_fetch_add(&qz_sess->cq_waiters, 1, __ATOMIC_SEQ_CST);
+    events = __atomic_load_n(&qz_sess->cq_events, __ATOMIC_SEQ_CST);
+    if (0 == __atomic_fetch_add(&inst->central_waiters, 1, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &inst->central_waiters, FUTEX_WAKE_PRIVATE, 1,
+                NULL, NULL, 0);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (-1 == qzGetCompletion(qz_sess) &&
+        0 != syscall(SYS_futex, &qz_sess->cq_events, FUTEX_WAIT_PRIVATE,
+                     events, &timeout, NULL, 0) &&
+        ETIMEDOUT == errno) {
+        qz_sess->central_self_poll = 1;
+    }
+    __atomic_fetch_sub(&inst->central_waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_sub(&qz_sess->cq_waiters, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/* Poll instance i for the session, unless its central poller does */
+static inline CpaStatus qzSessPoll(int i, QzSess_T *qz_sess)
+{
+    if (QZ_CENTRAL_POLLING == qz_sess->sess_params.polling_mode) {
+        if (likely(!qz_sess->central_self_poll)) {
+            return CPA_STATUS_SUCCESS;
+        }
+        qz_sess->central_self_poll = 0;
+    }
+    return qzPollInstance(i);
+}
+
+/* Reserve cnt stream buffers of instance i for a single thread request,
+ * which only drains its responses after submitting all of them. Sharers
+ * together may not reserve more buffers than the instance has.
+ */
+static int qzReserveStreams(int i, unsigned int cnt)
+{
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    unsigned int reserved;
+    int j;
+
+    do {
+        reserved = inst->reserved;
+        if (reserved + cnt > inst->dest_count) {
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&inst->reserved,
+                                           reserved, reserved + cnt));
+
+    /* The ring has to hold all reserved buffers, as the session won't
+     * drain its responses before it claimed them.
+     */
+    while (inst->ready_cnt < reserved + cnt) {
+        j = qzGrowRing(i);
+        if (-1 == j) {
+            if (inst->ready_cnt >= reserved + cnt) {
+                break;
+            }
+            __sync_fetch_and_sub(&inst->reserved, cnt);
+            return 0;
+        }
+        putUnusedBuffer(i, j);
+    }
+    return 1;
+}
+
+static inline void qzUnreserveStreams(int i, unsigned int cnt)
+{
+    __sync_fetch_and_sub(&g_process.qz_inst[i].reserved, cnt);
 }
 
 static void qzReleaseInstance(int i)
 {
-    __sync_lock_release(&(g_process.qz_inst[i].lock));
+    if (g_process.qz_inst[i].mem_setup) {
+        qzTrimRing(i);
+    }
+    if (QZ_INST_EXCLUSIVE == g_process.qz_inst[i].lock) {
+        __sync_lock_release(&(g_process.qz_inst[i].lock));
+    } else {
+        __sync_fetch_and_sub(&(g_process.qz_inst[i].lock), 1);
+    }
 }
 
 static void init_timers(void)
@@ -525,6 +1096,8 @@ static void exitFunc(void)
         pthread_key_delete(g_process.async_req_key);
     }
 
+    qzCentralStop();
+
     for (i = 0; i <  g_process.num_instances; i++) {
         removeSession(i);
         cleanUpInstMem(i);
@@ -839,93 +1412,166 @@ done:
     return rc;
 }
 
-/* Free up the DMAable memory buffers used by QAT
- * internally, those buffers are source buffer,
- * intermediate buffer and destination buffer
+/* Instance buffers live as long as the instance and have sizes such as
+ * DEST_SZ(hw_buff_sz) that the slab classes would round up to the next
+ * power of two, so they skip the slab pool
  */
-void cleanUpInstMem(int i)
+static inline void *qzInstMalloc(size_t sz, int numa, int pinned)
 {
-    int j;
+    return qzMallocDirect(sz, numa, pinned, QZ_MEM_INST);
+}
 
-    /*intermediate buffers*/
-    if (NULL != g_process.qz_inst[i].intermediate_buffers) {
-        for (j = 0; j < g_process.qz_inst[i].intermediate_cnt; j++) {
-            if (NULL != g_process.qz_inst[i].intermediate_buffers[j]) {
-                if (NULL != g_process.qz_inst[i].intermediate_buffers[j]->pPrivateMetaData) {
-                    qzFree(g_process.qz_inst[i].intermediate_buffers[j]->pPrivateMetaData);
-                    g_process.qz_inst[i].intermediate_buffers[j]->pPrivateMetaData = NULL;
-                }
-                if (NULL != g_process.qz_inst[i].intermediate_buffers[j]->pBuffers) {
-                    if (NULL != g_process.qz_inst[i].intermediate_buffers[j]->pBuffers->pData) {
-                        qzFree(g_process.qz_inst[i].intermediate_buffers[j]->pBuffers->pData);
-                        g_process.qz_inst[i].intermediate_buffers[j]->pBuffers->pData = NULL;
-                    }
-                    qzFree(g_process.qz_inst[i].intermediate_buffers[j]->pBuffers);
-                    g_process.qz_inst[i].intermediate_buffers[j]->pBuffers = NULL;
-                }
-                qzFree(g_process.qz_inst[i].intermediate_buffers[j]);
-                g_process.qz_inst[i].intermediate_buffers[j] = NULL;
-            }
+static inline void qzInstFree(void *m)
+{
+    qzFreeFor(m, QZ_MEM_INST);
+}
+
+/* Free the buffers of stream slot j of instance i, also when only some
+ * of them were set up
+ */
+static void qzFreeStreamBuffers(int i, int j)
+{
+    CpaBufferList *lists[2] = {g_process.qz_inst[i].src_buffers[j],
+                               g_process.qz_inst[i].dest_buffers[j]
+                              };
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        if (NULL == lists[k]) {
+            continue;
         }
-        free(g_process.qz_inst[i].intermediate_buffers);
-        g_process.qz_inst[i].intermediate_buffers = NULL;
+        qzInstFree(lists[k]->pPrivateMetaData);
+        if (NULL != lists[k]->pBuffers) {
+            qzInstFree(lists[k]->pBuffers->pData);
+            qzInstFree(lists[k]->pBuffers);
+        }
+        qzInstFree(lists[k]);
+    }
+    g_process.qz_inst[i].src_buffers[j] = NULL;
+    g_process.qz_inst[i].dest_buffers[j] = NULL;
+    g_process.qz_inst[i].stream[j].orig_src = NULL;
+    g_process.qz_inst[i].stream[j].orig_dest = NULL;
+}
+
+static CpaBufferList *qzStreamBufferList(int numa, Cpa32U meta_sz,
+                                         unsigned int flats, unsigned int sz)
+{
+    CpaBufferList *list;
+
+    list = qzInstMalloc(sizeof(CpaBufferList), numa, PINNED_MEM);
+    if (NULL == list) {
+        return NULL;
+    }
+    list->pPrivateMetaData = NULL;
+    list->pBuffers = NULL;
+    list->numBuffers = (Cpa32U)1;
+
+    if (0 != meta_sz) {
+        list->pPrivateMetaData = qzInstMalloc(meta_sz, numa, PINNED_MEM);
+    }
+    list->pBuffers = qzInstMalloc(flats * sizeof(CpaFlatBuffer), numa,
+                                  PINNED_MEM);
+    if (NULL != list->pBuffers) {
+        list->pBuffers->pData = qzInstMalloc(sz, numa, PINNED_MEM);
+        list->pBuffers->dataLenInBytes = sz;
+    }
+    return list;
+}
+
+/* Set up the pinned buffers of stream slot j of instance i */
+static int qzSetupStreamBuffers(int i, int j)
+{
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    int numa = qzGetInstNumaNode(i);
+    CpaBufferList *src, *dest;
+
+    /* pBuffers[0] of src is the pinned buffer, the rest are for SGL
+     * requests
+     */
+    src = qzStreamBufferList(numa, inst->sgl_meta_size, QZ_SGL_MAX_FLATS,
+                             inst->buff_sz);
+    dest = qzStreamBufferList(numa, inst->buff_meta_size, 1,
+                              DEST_SZ(inst->buff_sz));
+    inst->src_buffers[j] = src;
+    inst->dest_buffers[j] = dest;
+    if (NULL == src || NULL == dest ||
+        (0 != inst->sgl_meta_size && NULL == src->pPrivateMetaData) ||
+        (0 != inst->buff_meta_size && NULL == dest->pPrivateMetaData) ||
+        NULL == src->pBuffers || NULL == src->pBuffers->pData ||
+        NULL == dest->pBuffers || NULL == dest->pBuffers->pData) {
+        qzFreeStreamBuffers(i, j);
+        return -1;
+    }
+
+    /* orig_src and orig_dest point to the internal pinned buffers */
+    inst->stream[j].orig_src = src->pBuffers->pData;
+    inst->stream[j].orig_dest = dest->pBuffers->pData;
+    return 0;
+}
+
+/* Free up the DMAable memory buffers used by QAT
+ * internally, those buffers are source buffer,
+ * intermediate buffer and destination buffer
+ */
+void cleanUpInstMem(int i)
+{
+    int j;
+
+    if (QZ_EVENT_READY == g_process.qz_inst[i].event_state) {
+        qzEventClose(g_process.qz_inst[i].epoll_fd);
+        icp_sal_DcPutFileDescriptor(g_process.dc_inst_handle[i],
+                                    g_process.qz_inst[i].event_fd);
     }
+    g_process.qz_inst[i].event_state = QZ_EVENT_UNTRIED;
 
-    /*src buffers*/
-    if (NULL != g_process.qz_inst[i].src_buffers) {
-        for (j = 0; j < g_process.qz_inst[i].src_count; j++) {
-            if (NULL != g_process.qz_inst[i].src_buffers[j]) {
-                if (NULL != g_process.qz_inst[i].src_buffers[j]->pPrivateMetaData) {
-                    qzFree(g_process.qz_inst[i].src_buffers[j]->pPrivateMetaData);
-                    g_process.qz_inst[i].src_buffers[j]->pPrivateMetaData = NULL;
+    /*intermediate buffers*/
+    if (NULL != g_process.qz_inst[i].intermediate_buffers) {
+        for (j = 0; j < g_process.qz_inst[i].intermediate_cnt; j++) {
+            if (NULL != g_process.qz_inst[i].intermediate_buffers[j]) {
+                if (NULL != g_process.qz_inst[i].intermediate_buffers[j]->pPrivateMetaData) {
+                    qzInstFree(g_process.qz_inst[i].intermediate_buffers[j]->pPrivateMetaData);
+                    g_process.qz_inst[i].intermediate_buffers[j]->pPrivateMetaData = NULL;
                 }
-                if (NULL != g_process.qz_inst[i].src_buffers[j]->pBuffers) {
-                    if (NULL != g_process.qz_inst[i].src_buffers[j]->pBuffers->pData) {
-                        qzFree(g_process.qz_inst[i].src_buffers[j]->pBuffers->pData);
-                        g_process.qz_inst[i].src_buffers[j]->pBuffers->pData = NULL;
+                if (NULL != g_process.qz_inst[i].intermediate_buffers[j]->pBuffers) {
+                    if (NULL != g_process.qz_inst[i].intermediate_buffers[j]->pBuffers->pData) {
+                        qzInstFree(g_process.qz_inst[i].intermediate_buffers[j]->pBuffers->pData);
+                        g_process.qz_inst[i].intermediate_buffers[j]->pBuffers->pData = NULL;
                     }
-                    qzFree(g_process.qz_inst[i].src_buffers[j]->pBuffers);
-                    g_process.qz_inst[i].src_buffers[j]->pBuffers = NULL;
+                    qzInstFree(g_process.qz_inst[i].intermediate_buffers[j]->pBuffers);
+                    g_process.qz_inst[i].intermediate_buffers[j]->pBuffers = NULL;
                 }
-                qzFree(g_process.qz_inst[i].src_buffers[j]);
-                g_process.qz_inst[i].src_buffers[j] = NULL;
+                qzInstFree(g_process.qz_inst[i].intermediate_buffers[j]);
+                g_process.qz_inst[i].intermediate_buffers[j] = NULL;
             }
         }
-        free(g_process.qz_inst[i].src_buffers);
-        g_process.qz_inst[i].src_buffers = NULL;
+        free(g_process.qz_inst[i].intermediate_buffers);
+        g_process.qz_inst[i].intermediate_buffers = NULL;
     }
 
-    /*dest buffers*/
-    if (NULL != g_process.qz_inst[i].dest_buffers) {
+    /*src and dest buffers*/
+    if (NULL != g_process.qz_inst[i].src_buffers &&
+        NULL != g_process.qz_inst[i].dest_buffers) {
         for (j = 0; j < g_process.qz_inst[i].dest_count; j++) {
-            if (NULL != g_process.qz_inst[i].dest_buffers[j]) {
-                if (NULL != g_process.qz_inst[i].dest_buffers[j]->pPrivateMetaData) {
-                    qzFree(g_process.qz_inst[i].dest_buffers[j]->pPrivateMetaData);
-                    g_process.qz_inst[i].dest_buffers[j]->pPrivateMetaData = NULL;
-                }
-                if (NULL != g_process.qz_inst[i].dest_buffers[j]->pBuffers) {
-                    if (NULL != g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData) {
-                        qzFree(g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData);
-                        g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData = NULL;
-                    }
-                    qzFree(g_process.qz_inst[i].dest_buffers[j]->pBuffers);
-                    g_process.qz_inst[i].dest_buffers[j]->pBuffers = NULL;
-                }
-                qzFree(g_process.qz_inst[i].dest_buffers[j]);
-                g_process.qz_inst[i].dest_buffers[j] = NULL;
-            }
+            qzFreeStreamBuffers(i, j);
         }
-        free(g_process.qz_inst[i].dest_buffers);
-        g_process.qz_inst[i].dest_buffers = NULL;
     }
+    free(g_process.qz_inst[i].src_buffers);
+    g_process.qz_inst[i].src_buffers = NULL;
+    free(g_process.qz_inst[i].dest_buffers);
+    g_process.qz_inst[i].dest_buffers = NULL;
 
     /*stream buffer*/
     if (NULL != g_process.qz_inst[i].stream) {
         free(g_process.qz_inst[i].stream);
         g_process.qz_inst[i].stream = NULL;
     }
+    memset(g_process.qz_inst[i].free_streams, 0,
+           sizeof(g_process.qz_inst[i].free_streams));
+    memset(g_process.qz_inst[i].ready_streams, 0,
+           sizeof(g_process.qz_inst[i].ready_streams));
+    g_process.qz_inst[i].ready_cnt = 0;
 
-    qzFree(g_process.qz_inst[i].cpaSess);
+    qzInstFree(g_process.qz_inst[i].cpaSess);
     g_process.qz_inst[i].mem_setup = 0;
 }
 
@@ -954,8 +1600,8 @@ static int getInstMem(int i, QzSessionParamsInternal_T *params)
     CpaStatus rc;
     unsigned int src_sz;
     unsigned int inter_sz;
-    unsigned int dest_sz;
     unsigned char sw_backup;
+    int numa;
 
     rc = QZ_OK;
     /*  WARN: this will mean the first sess will setup down the inst
@@ -964,13 +1610,20 @@ static int getInstMem(int i, QzSessionParamsInternal_T *params)
     */
     src_sz = params->hw_buff_sz;
     inter_sz = INTER_SZ(src_sz);
-    dest_sz = DEST_SZ(src_sz);
     sw_backup = params->sw_backup;
+    /* Keep the DMA buffers on the node the device is attached to */
+    numa = qzGetInstNumaNode(i);
 
-    QZ_MEM_PRINT("getInstMem: Setting up memory for inst %d\n", i);
+    QZ_MEM_PRINT("getInstMem: Setting up memory for inst %d on node %d\n", i,
+                 numa);
     status = cpaDcBufferListGetMetaSize(g_process.dc_inst_handle[i], 1,
                                         &(g_process.qz_inst[i].buff_meta_size));
     QZ_INST_MEM_STATUS_CHECK(status, i);
+    /* src lists may carry a scatter-gather list of caller segments */
+    status = cpaDcBufferListGetMetaSize(g_process.dc_inst_handle[i],
+                                        QZ_SGL_MAX_FLATS,
+                                        &(g_process.qz_inst[i].sgl_meta_size));
+    QZ_INST_MEM_STATUS_CHECK(status, i);
 
     status = cpaDcGetNumIntermediateBuffers(g_process.dc_inst_handle[i],
                                             &(g_process.qz_inst[i].intermediate_cnt));
@@ -983,13 +1636,13 @@ static int getInstMem(int i, QzSessionParamsInternal_T *params)
 
     for (j = 0; j < g_process.qz_inst[i].intermediate_cnt; j++) {
         g_process.qz_inst[i].intermediate_buffers[j] = (CpaBufferList *)
-                qzMalloc(sizeof(CpaBufferList), QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+                qzInstMalloc(sizeof(CpaBufferList), numa, PINNED_MEM);
         QZ_INST_MEM_CHECK(g_process.qz_inst[i].intermediate_buffers[j], i);
 
         if (0 != g_process.qz_inst[i].buff_meta_size) {
             g_process.qz_inst[i].intermediate_buffers[j]->pPrivateMetaData =
-                qzMalloc((size_t)(g_process.qz_inst[i].buff_meta_size),
-                         QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+                qzInstMalloc((size_t)(g_process.qz_inst[i].buff_meta_size),
+                             numa, PINNED_MEM);
             QZ_INST_MEM_CHECK(
                 g_process.qz_inst[i].intermediate_buffers[j]->pPrivateMetaData,
                 i);
@@ -998,11 +1651,11 @@ static int getInstMem(int i, QzSessionParamsInternal_T *params)
         }
 
         g_process.qz_inst[i].intermediate_buffers[j]->pBuffers = (CpaFlatBuffer *)
-                qzMalloc(sizeof(CpaFlatBuffer), QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+                qzInstMalloc(sizeof(CpaFlatBuffer), numa, PINNED_MEM);
         QZ_INST_MEM_CHECK(g_process.qz_inst[i].intermediate_buffers[j]->pBuffers, i);
 
         g_process.qz_inst[i].intermediate_buffers[j]->pBuffers->pData = (Cpa8U *)
-                qzMalloc(inter_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+                qzInstMalloc(inter_sz, numa, PINNED_MEM);
         QZ_INST_MEM_CHECK(g_process.qz_inst[i].intermediate_buffers[j]->pBuffers->pData,
                           i);
 
@@ -1018,6 +1671,8 @@ static int getInstMem(int i, QzSessionParamsInternal_T *params)
         g_process.qz_inst[i].dest_count = NUM_BUFF_8K;
     }
 
+    g_process.qz_inst[i].buff_sz = src_sz;
+
     g_process.qz_inst[i].src_buffers = calloc(1, (size_t)(
                                            g_process.qz_inst[i].src_count *
                                            sizeof(CpaBufferList *)));
@@ -1031,69 +1686,20 @@ static int getInstMem(int i, QzSessionParamsInternal_T *params)
                                          sizeof(QzCpaStream_T));
     QZ_INST_MEM_CHECK(g_process.qz_inst[i].stream, i);
 
-    for (j = 0; j < g_process.qz_inst[i].dest_count; j++) {
-        g_process.qz_inst[i].stream[j].seq   = 0;
-        g_process.qz_inst[i].stream[j].src1  = 0;
-        g_process.qz_inst[i].stream[j].src2  = 0;
-        g_process.qz_inst[i].stream[j].sink1 = 0;
-        g_process.qz_inst[i].stream[j].sink2 = 0;
-
-        g_process.qz_inst[i].src_buffers[j] = (CpaBufferList *)
-                                              qzMalloc(sizeof(CpaBufferList), QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
-        QZ_INST_MEM_CHECK(g_process.qz_inst[i].src_buffers[j], i);
-
-        if (0 != g_process.qz_inst[i].buff_meta_size) {
-            g_process.qz_inst[i].src_buffers[j]->pPrivateMetaData =
-                qzMalloc(g_process.qz_inst[i].buff_meta_size, QZ_AUTO_SELECT_NUMA_NODE,
-                         PINNED_MEM);
-            QZ_INST_MEM_CHECK(g_process.qz_inst[i].src_buffers[j]->pPrivateMetaData, i);
-        } else {
-            g_process.qz_inst[i].src_buffers[j]->pPrivateMetaData = NULL;
-        }
-
-        g_process.qz_inst[i].src_buffers[j]->pBuffers = (CpaFlatBuffer *)
-                qzMalloc(sizeof(CpaFlatBuffer), QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
-        QZ_INST_MEM_CHECK(g_process.qz_inst[i].src_buffers, i);
-
-        g_process.qz_inst[i].src_buffers[j]->pBuffers->pData = (Cpa8U *)
-                qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
-        QZ_INST_MEM_CHECK(g_process.qz_inst[i].src_buffers[j]->pBuffers->pData, i);
-        /* The orig_src points internal pre-allocated pinned buffer. */
-        g_process.qz_inst[i].stream[j].orig_src =
-            g_process.qz_inst[i].src_buffers[j]->pBuffers->pData;
-
-        g_process.qz_inst[i].src_buffers[j]->numBuffers = (Cpa32U)1;
-        g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes = src_sz;
-    }
-
-    for (j = 0; j < g_process.qz_inst[i].dest_count; j++) {
-        g_process.qz_inst[i].dest_buffers[j] = (CpaBufferList *)
-                                               qzMalloc(sizeof(CpaBufferList), QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
-        QZ_INST_MEM_CHECK(g_process.qz_inst[i].dest_buffers[j], i);
-
-        if (0 != g_process.qz_inst[i].buff_meta_size) {
-            g_process.qz_inst[i].dest_buffers[j]->pPrivateMetaData =
-                qzMalloc(g_process.qz_inst[i].buff_meta_size, QZ_AUTO_SELECT_NUMA_NODE,
-                         PINNED_MEM);
-            QZ_INST_MEM_CHECK(g_process.qz_inst[i].dest_buffers[j]->pPrivateMetaData, i);
-        } else {
-            g_process.qz_inst[i].dest_buffers[j]->pPrivateMetaData = NULL;
+    /* The ring starts small, getUnusedBuffer grows it under load */
+    memset(g_process.qz_inst[i].ready_streams, 0,
+           sizeof(g_process.qz_inst[i].ready_streams));
+    for (j = 0; j < QZ_INST_MIN_BUFF; j++) {
+        if (0 != qzSetupStreamBuffers(i, j)) {
+            cleanUpInstMem(i);
+            rc = sw_backup ? QZ_LOW_MEM : QZ_NOSW_LOW_MEM;
+            goto done_inst;
         }
-
-        g_process.qz_inst[i].dest_buffers[j]->pBuffers = (CpaFlatBuffer *)
-                qzMalloc(sizeof(CpaFlatBuffer), QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
-        QZ_INST_MEM_CHECK(g_process.qz_inst[i].dest_buffers, i);
-
-        g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData = (Cpa8U *)
-                qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
-        QZ_INST_MEM_CHECK(g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData, i);
-        /* The orig_dest points internal pre-allocated pinned buffer. */
-        g_process.qz_inst[i].stream[j].orig_dest =
-            g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData;
-
-        g_process.qz_inst[i].dest_buffers[j]->numBuffers = (Cpa32U)1;
-        g_process.qz_inst[i].dest_buffers[j]->pBuffers->dataLenInBytes = dest_sz;
+        g_process.qz_inst[i].ready_streams[j / 64] |= 1ULL << (j % 64);
     }
+    g_process.qz_inst[i].ready_cnt = QZ_INST_MIN_BUFF;
+    g_process.qz_inst[i].grow_ns = 0;
+    g_process.qz_inst[i].trim_ns = 0;
 
     status = cpaDcSetAddressTranslation(g_process.dc_inst_handle[i],
                                         qaeVirtToPhysNUMA);
@@ -1105,6 +1711,9 @@ static int getInstMem(int i, QzSessionParamsInternal_T *params)
                            g_process.qz_inst[i].intermediate_buffers);
     QZ_INST_MEM_STATUS_CHECK(g_process.qz_inst[i].inst_start_status, i);
 
+    memcpy(g_process.qz_inst[i].free_streams,
+           g_process.qz_inst[i].ready_streams,
+           sizeof(g_process.qz_inst[i].free_streams));
     g_process.qz_inst[i].mem_setup = 1;
 
 done_inst:
@@ -1379,8 +1988,8 @@ int qzSetupHW(QzSession_T *sess, int i)
                                 &qz_sess->session_size,
                                 &qz_sess->ctx_size);
         if (CPA_STATUS_SUCCESS == qz_sess->sess_status) {
-            g_process.qz_inst[i].cpaSess = qzMalloc((size_t)(qz_sess->session_size),
-                                                    QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+            g_process.qz_inst[i].cpaSess = qzInstMalloc((size_t)(qz_sess->session_size),
+                                                        qzGetInstNumaNode(i), PINNED_MEM);
             if (NULL ==  g_process.qz_inst[i].cpaSess) {
                 rc = qz_sess->sess_params.sw_backup ? QZ_LOW_MEM : QZ_NOSW_LOW_MEM;
                 goto done_sess;
@@ -1436,7 +2045,7 @@ int qzUpdateCpaSession(QzSession_T *sess, int i)
     }
 
     /* free memory of capSess */
-    qzFree(g_process.qz_inst[i].cpaSess);
+    qzInstFree(g_process.qz_inst[i].cpaSess);
 
     /* As the session setup data has been updated, need to get the size of
      * session again. */
@@ -1449,8 +2058,8 @@ int qzUpdateCpaSession(QzSession_T *sess, int i)
         return QZ_FAIL;
     }
 
-    g_process.qz_inst[i].cpaSess = qzMalloc((size_t)(qz_sess->session_size),
-                                            QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    g_process.qz_inst[i].cpaSess = qzInstMalloc((size_t)(qz_sess->session_size),
+                                                qzGetInstNumaNode(i), PINNED_MEM);
     if (!g_process.qz_inst[i].cpaSess) {
         QZ_ERROR("qzUpdateCpaSession: allocate session failed\n");
         return QZ_FAIL;
@@ -1473,6 +2082,192 @@ int qzUpdateCpaSession(QzSession_T *sess, int i)
     return QZ_OK;
 }
 
+/* qzPrewarm outcome of an instance, counted in QzPrewarmReport_T */
+#define PREWARM_READY       0
+#define PREWARM_BUSY        1
+#define PREWARM_SKIPPED     2
+#define PREWARM_FAILED      3
+
+typedef struct QzPrewarmJob_S {
+    QzSession_T *sess;
+    unsigned int flags;
+    int *inst;
+    int cnt;
+    int next;
+    unsigned int state[4];
+    unsigned int ready_nodes;
+    unsigned long slowest_ns;
+} QzPrewarmJob_T;
+
+static unsigned int qzPrewarmNodeBit(int i)
+{
+    int node = qzGetInstNumaNode(i);
+
+    if (node < 0) {
+        node = 0;
+    } else if (node >= QZ_MEM_MAX_NODES) {
+        node = QZ_MEM_MAX_NODES - 1;
+    }
+
+    return QZ_PREWARM_NODE(node);
+}
+
+/* Set instance i up the way qzGrabSessInstance would for sess, which is
+ * the caller's private copy so that qzSetupHW may write to it.
+ */
+static int qzPrewarmInst(QzSession_T *sess, int i, unsigned int flags)
+{
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    int k, rc = QZ_OK;
+
+    if (!qzIsInstUsable(i, &qz_sess->sess_params)) {
+        return PREWARM_SKIPPED;
+    }
+
+    if ((flags & QZ_PREWARM_MEM_ONLY) ? g_process.qz_inst[i].mem_setup :
+        qzIsInstReady(i, &qz_sess->session_setup_data)) {
+        return PREWARM_READY;
+    }
+
+    for (k = 0; k < PREWARM_LOCK_RETRY; k++) {
+        if (qzTryLockInstance(i, NULL)) {
+            break;
+        }
+        sched_yield();
+    }
+    if (k == PREWARM_LOCK_RETRY) {
+        return PREWARM_BUSY;
+    }
+
+    if (flags & QZ_PREWARM_MEM_ONLY) {
+        if (0 == g_process.qz_inst[i].mem_setup) {
+            rc = getInstMem(i, &qz_sess->sess_params);
+        }
+    } else if (0 == g_process.qz_inst[i].mem_setup ||
+               0 == g_process.qz_inst[i].cpa_sess_setup) {
+        rc = qzSetupHW(sess, i);
+    } else if (memcmp(&g_process.qz_inst[i].session_setup_data,
+                      &qz_sess->session_setup_data,
+                      sizeof(CpaDcSessionSetupData))) {
+        rc = qzUpdateCpaSession(sess, i);
+    }
+    qzReleaseInstance(i);
+
+    if (QZ_OK != rc) {
+        QZ_ERROR("qzPrewarm: setup of instance %d failed: %d\n", i, rc);
+        return PREWARM_FAILED;
+    }
+
+    return PREWARM_READY;
+}
+
+static void *qzPrewarmWorker(void *arg)
+{
+    QzPrewarmJob_T *job = (QzPrewarmJob_T *)arg;
+    QzSession_T sess = *job->sess;
+    QzSess_T *qz_sess;
+    unsigned long start;
+    int k, state;
+
+    qz_sess = malloc(sizeof(QzSess_T));
+    if (NULL == qz_sess) {
+        return NULL;
+    }
+    memcpy(qz_sess, job->sess->internal, sizeof(QzSess_T));
+    sess.internal = qz_sess;
+
+    while ((k = __sync_fetch_and_add(&job->next, 1)) < job->cnt) {
+        start = qzNowNs();
+        state = qzPrewarmInst(&sess, job->inst[k], job->flags);
+        start = qzNowNs() - start;
+
+        __sync_fetch_and_add(&job->state[state], 1);
+        if (PREWARM_READY == state) {
+            __sync_fetch_and_or(&job->ready_nodes,
+                                qzPrewarmNodeBit(job->inst[k]));
+        }
+        while (start > job->slowest_ns &&
+               !__sync_bool_compare_and_swap(&job->slowest_ns,
+                                             job->slowest_ns, start)) {
+        }
+    }
+
+    free(qz_sess);
+    return NULL;
+}
+
+int qzPrewarm(QzSession_T *sess, unsigned int flags,
+              QzPrewarmReport_T *report)
+{
+    QzPrewarmJob_T job;
+    pthread_t th[PREWARM_MAX_THREADS];
+    unsigned int nodes = flags & ~QZ_PREWARM_MEM_ONLY;
+    unsigned long start = qzNowNs();
+    int i, n, th_cnt = 0;
+    int rc = QZ_OK;
+
+    if (NULL != report) {
+        memset(report, 0, sizeof(QzPrewarmReport_T));
+    }
+    if (NULL == sess || NULL == sess->internal) {
+        return QZ_PARAMS;
+    }
+    if (QZ_OK != g_process.qz_init_status) {
+        return g_process.qz_init_status;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.sess = sess;
+    job.flags = flags;
+    job.inst = malloc(sizeof(int) * g_process.num_instances);
+    if (NULL == job.inst) {
+        return QZ_NOSW_LOW_MEM;
+    }
+    for (i = 0; i < g_process.num_instances; i++) {
+        if (QZ_PREWARM_ALL == nodes || (nodes & qzPrewarmNodeBit(i))) {
+            job.inst[job.cnt++] = i;
+        }
+    }
+
+    /* Each setup mostly waits on the driver, so run them side by side */
+    n = job.cnt < PREWARM_MAX_THREADS ? job.cnt : PREWARM_MAX_THREADS;
+    for (th_cnt = 0; th_cnt < n; th_cnt++) {
+        if (0 != pthread_create(&th[th_cnt], NULL, qzPrewarmWorker, &job)) {
+            break;
+        }
+    }
+    if (0 == th_cnt) {
+        qzPrewarmWorker(&job);
+    }
+    for (i = 0; i < th_cnt; i++) {
+        pthread_join(th[i], NULL);
+    }
+
+    /* Workers short of memory leave their share to the others */
+    if (job.next < job.cnt) {
+        rc = QZ_NOSW_LOW_MEM;
+    } else if (0 != job.cnt && 0 == job.state[PREWARM_READY]) {
+        rc = QZ_FAIL;
+    }
+
+    if (NULL != report) {
+        report->instances = job.cnt;
+        report->ready = job.state[PREWARM_READY];
+        report->busy = job.state[PREWARM_BUSY];
+        report->skipped = job.state[PREWARM_SKIPPED];
+        report->failed = job.state[PREWARM_FAILED];
+        report->ready_nodes = job.ready_nodes;
+        report->slowest_us = job.slowest_ns / 1000;
+        report->elapsed_us = (qzNowNs() - start) / 1000;
+    }
+    QZ_INFO("qzPrewarm: %d instances, %u ready, %u busy, %u failed\n",
+            job.cnt, job.state[PREWARM_READY], job.state[PREWARM_BUSY],
+            job.state[PREWARM_FAILED]);
+
+    free(job.inst);
+    return rc;
+}
+
 /* The internal function to send the compression request
  * to the QAT hardware.
  * Note:
@@ -1493,9 +2288,6 @@ static void *doCompressIn(void *in)
     QzSession_T *sess = (QzSession_T *)in;
     QzSess_T *qz_sess = (QzSess_T *)sess->internal;
 
-    struct timespec sleep_time;
-    sleep_time.tv_sec = 0;
-    sleep_time.tv_nsec = GET_BUFFER_SLEEP_NSEC;
     QZ_TEST("Always enable CnV\n");
 
     i = qz_sess->inst_hint;
@@ -1522,15 +2314,10 @@ static void *doCompressIn(void *in)
             }
         } else {
             /* HW offload */
-            do {
-                j = getUnusedBuffer(i, j);
-                if (unlikely(-1 == j)) {
-                    nanosleep(&sleep_time, NULL);
-                }
-            } while (-1 == j);
+            j = waitUnusedBuffer(i, qz_sess);
             QZ_DEBUG("getUnusedBuffer returned %d\n", j);
-            g_process.qz_inst[i].stream[j].src1++; /*update stream src1*/
             compBufferSetup(i, j, qz_sess, src_ptr, remaining, hw_buff_sz, src_send_sz);
+            compDestSlotSetup(i, j, qz_sess);
             g_process.qz_inst[i].stream[j].src2++;/*this buffer is in use*/
 
             do {
@@ -1603,6 +2390,183 @@ err_exit:
     return ((void *)NULL);
 }
 
+/* single_member: deflate requests end in a full flush rather than a final
+ * block, so that their output joins into one member. The header comes with
+ * the first response, the final block and trailer with the last call.
+ */
+static const unsigned char qz_final_block[] = {0x03, 0x00};
+
+static inline int qzMemberMode(QzSess_T *qz_sess)
+{
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+
+    return (qz_sess->sess_params.single_member || qz_sess->strm_member) &&
+           (DEFLATE_GZIP == data_fmt || DEFLATE_GZIP_EXT == data_fmt ||
+            DEFLATE_ZLIB == data_fmt || LZ4_FH == data_fmt);
+}
+
+static unsigned long qzMemberHeaderSz(DataFormatInternal_T data_fmt)
+{
+    switch (data_fmt) {
+    case DEFLATE_ZLIB:
+        return stdZlibHeaderSz();
+    case LZ4_FH:
+        return qzLZ4StreamHeaderSz();
+    default:
+        return stdGzipHeaderSz();
+    }
+}
+
+static unsigned long qzMemberTrailerSz(DataFormatInternal_T data_fmt)
+{
+    return (IS_DEFLATE(data_fmt) ? sizeof(qz_final_block) : 0) +
+           outputFooterSz(data_fmt);
+}
+
+static void qzMemberOpen(QzSess_T *qz_sess, unsigned char *ptr,
+                         CpaDcRqResults *resl)
+{
+    switch (qz_sess->sess_params.data_fmt) {
+    case DEFLATE_ZLIB:
+        stdZlibHeaderGen(ptr, resl);
+        break;
+    case LZ4_FH:
+        qzLZ4StreamHeaderGen(ptr);
+        XXH32_reset(qz_sess->member_xxh32, 0);
+        break;
+    default:
+        stdGzipHeaderGen(ptr, resl);
+        break;
+    }
+    qz_sess->member_open = 1;
+    qz_sess->member_sum = 0;
+    qz_sess->member_len = 0;
+}
+
+/* Responses come in order, so the input of this one starts at qz_in_len */
+static void qzMemberAdd(QzSess_T *qz_sess, CpaDcRqResults *resl)
+{
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+
+    if (LZ4_FH == data_fmt) {
+        XXH32_update(qz_sess->member_xxh32, qz_sess->src + qz_sess->qz_in_len,
+                     resl->consumed);
+    } else {
+        qz_sess->member_sum = qzChecksumCombine(data_fmt, qz_sess->member_sum,
+                                                resl->checksum,
+                                                resl->consumed);
+    }
+    qz_sess->member_len += resl->consumed;
+}
+
+static void qzMemberClose(QzSess_T *qz_sess, unsigned char *ptr)
+{
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+    CpaDcRqResults res = {0};
+
+    if (IS_DEFLATE(data_fmt)) {
+        memcpy(ptr, qz_final_block, sizeof(qz_final_block));
+        ptr += sizeof(qz_final_block);
+        res.checksum = qz_sess->member_sum;
+    } else {
+        res.checksum = XXH32_digest(qz_sess->member_xxh32);
+    }
+    res.consumed = GET_LOWER_32BITS(qz_sess->member_len);
+    outputFooterGen(ptr, &res, data_fmt);
+    qz_sess->member_open = 0;
+}
+
+/* Process the compression response in stream buffer j of instance i,
+ * returns QZ_FAIL if the call can't go on
+ */
+static int compOutRespond(QzSession_T *sess, int i, int j,
+                          long *dest_avail_len)
+{
+    int rc;
+    CpaDcRqResults *resl;
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+
+    if (unlikely(QZ_BUF_ERROR == sess->thd_sess_stat)) {
+        compOutSkipErrorRespond(i, j, qz_sess);
+        return QZ_OK;
+    }
+
+    /*  res.status is passed into QAT by cpaDcCompressData2, and changed in
+    *   dcCompression_ProcessCallback, it's type is CpaDcReqStatus.
+    *   job_status is from the dccallback, it's type is CpaStatus.
+    *   Generally, the res.status should have more detailed info about device error
+    *   we assume fallback feature will always call callback func, as well as
+    *   cpaDcCompressData2 return success. res.status and job_status should
+    *   all return Error status, but with different error number.
+    */
+    resl = &g_process.qz_inst[i].stream[j].res;
+    if (unlikely(CPA_STATUS_SUCCESS != g_process.qz_inst[i].stream[j].job_status ||
+                 CPA_DC_OK != resl->status)) {
+        QZ_DEBUG("Error(%d) in callback: %d, %d, ReqStatus: %d\n",
+                 g_process.qz_inst[i].stream[j].job_status, i, j,
+                 g_process.qz_inst[i].stream[j].res.status);
+        /* polled error/dummy respond , fallback to sw */
+        rc = compOutSWFallback(i, j, sess, dest_avail_len);
+        if (QZ_FAIL == rc) {
+            QZ_ERROR("Error in SW CompOut:inst %d, buffer %d, seq %ld\n", i, j,
+                     qz_sess->seq_in);
+            return QZ_FAIL;
+        }
+        if (QZ_BUF_ERROR == rc) {
+            return QZ_OK;
+        }
+    } else {
+        /* polled HW respond */
+        QZ_DEBUG("\tHW CompOut: consumed = %d, produced = %d, seq_in = %ld\n",
+                 resl->consumed, resl->produced, g_process.qz_inst[i].stream[j].seq);
+
+        unsigned int hdr_sz = outputHeaderSz(data_fmt);
+        unsigned int ftr_sz = outputFooterSz(data_fmt);
+
+        if (qz_sess->member_on) {
+            hdr_sz = qz_sess->member_open ? 0 : qzMemberHeaderSz(data_fmt);
+            ftr_sz = 0;
+        }
+        if (QZ_OK != compOutCheckDestLen(i, j, sess, dest_avail_len,
+                                         hdr_sz + resl->produced + ftr_sz)) {
+            return QZ_OK;
+        }
+
+        /* Update qz_sess info and clean dest buffer */
+        if (!qz_sess->member_on) {
+            outputHeaderGen(qz_sess->next_dest, resl, data_fmt);
+        } else if (!qz_sess->member_open) {
+            qzMemberOpen(qz_sess, qz_sess->next_dest, resl);
+        }
+        qz_sess->next_dest += hdr_sz;
+        qz_sess->qz_out_len += hdr_sz;
+
+        compOutValidDestBufferCleanUp(i, j, qz_sess, resl->produced);
+        qz_sess->next_dest += resl->produced;
+        if (qz_sess->member_on) {
+            qzMemberAdd(qz_sess, resl);
+        }
+        qz_sess->qz_in_len += resl->consumed;
+
+        if (likely(NULL != qz_sess->crc32 && IS_DEFLATE(data_fmt))) {
+            *(qz_sess->crc32) = qzChecksumCombine(data_fmt, *(qz_sess->crc32),
+                                                  resl->checksum,
+                                                  resl->consumed);
+        }
+        qz_sess->qz_out_len += resl->produced;
+        if (!qz_sess->member_on) {
+            outputFooterGen(qz_sess->next_dest, resl, data_fmt);
+        }
+        qz_sess->next_dest += ftr_sz;
+        qz_sess->qz_out_len += ftr_sz;
+    }
+
+    /* process finished! */
+    compOutProcessedRespond(i, j, qz_sess);
+    return QZ_OK;
+}
+
 /* The internal function to g_process the compression response
  * from the QAT hardware
  *   sess->thd_sess_stat only carry QZ_OK and QZ_FAIL and QZ_BUF_ERROR
@@ -1610,16 +2574,13 @@ err_exit:
 static void *doCompressOut(void *in)
 {
     int i = 0, j = 0;
-    int rc = 0;
     int good = -1;
-    CpaDcRqResults *resl;
     CpaStatus sts;
     unsigned int sleep_cnt = 0;
     QzSession_T *sess = (QzSession_T *) in;
     QzSess_T *qz_sess = (QzSess_T *) sess->internal;
     long dest_avail_len = (long)(*qz_sess->dest_sz - qz_sess->qz_out_len);
     i = qz_sess->inst_hint;
-    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
     QzPollingMode_T polling_mode = qz_sess->sess_params.polling_mode;
 
     while ((qz_sess->last_submitted == 0) ||
@@ -1630,101 +2591,36 @@ static void *doCompressOut(void *in)
         *   which is not just for RestoreSrcCpastreamBuffer, but also
         *   make src1, src2, sink1, sink2 equal, and all switch.
         */
-        sts = icp_sal_DcPollInstance(g_process.dc_inst_handle[i], 0);
+        sts = qzSessPoll(i, qz_sess);
         if (unlikely(CPA_STATUS_FAIL == sts)) {
             /* this will cause the in-flight request is not finished */
             QZ_ERROR("Error in DcPoll: %d\n", sts);
             goto err_exit;
         }
 
-        /*fake a retrieve*/
-        for (j = 0; j <  g_process.qz_inst[i].dest_count; j++) {
-            if ((g_process.qz_inst[i].stream[j].seq ==
-                 qz_sess->seq_in)                    &&
-                (g_process.qz_inst[i].stream[j].src1 ==
-                 g_process.qz_inst[i].stream[j].src2) &&
-                (g_process.qz_inst[i].stream[j].sink1 ==
-                 g_process.qz_inst[i].stream[j].src1)  &&
-                (g_process.qz_inst[i].stream[j].sink1 ==
-                 g_process.qz_inst[i].stream[j].sink2 + 1)) {
-
-                good = 1;
-                QZ_DEBUG("doCompressOut: Processing seqnumber %2.2d "
-                         "%2.2d %4.4ld, PID: %d, TID: %lu\n",
-                         i, j, g_process.qz_inst[i].stream[j].seq,
-                         getpid(), pthread_self());
-
-                if (unlikely(QZ_BUF_ERROR == sess->thd_sess_stat)) {
-                    compOutSkipErrorRespond(i, j, qz_sess);
-                    continue;
-                }
-
-                /*  res.status is passed into QAT by cpaDcCompressData2, and changed in
-                *   dcCompression_ProcessCallback, it's type is CpaDcReqStatus.
-                *   job_status is from the dccallback, it's type is CpaStatus.
-                *   Generally, the res.status should have more detailed info about device error
-                *   we assume fallback feature will always call callback func, as well as
-                *   cpaDcCompressData2 return success. res.status and job_status should
-                *   all return Error status, but with different error number.
-                */
-                resl = &g_process.qz_inst[i].stream[j].res;
-                if (unlikely(CPA_STATUS_SUCCESS != g_process.qz_inst[i].stream[j].job_status ||
-                             CPA_DC_OK != resl->status)) {
-                    QZ_DEBUG("Error(%d) in callback: %d, %d, ReqStatus: %d\n",
-                             g_process.qz_inst[i].stream[j].job_status, i, j,
-                             g_process.qz_inst[i].stream[j].res.status);
-                    /* polled error/dummy respond , fallback to sw */
-                    rc = compOutSWFallback(i, j, sess, &dest_avail_len);
-                    if (QZ_FAIL == rc) {
-                        QZ_ERROR("Error in SW CompOut:inst %d, buffer %d, seq %ld\n", i, j,
-                                 qz_sess->seq_in);
-                        goto err_exit;
-                    }
-                    if (QZ_BUF_ERROR == rc) {
-                        continue;
-                    }
-                } else {
-                    /* polled HW respond */
-                    QZ_DEBUG("\tHW CompOut: consumed = %d, produced = %d, seq_in = %ld\n",
-                             resl->consumed, resl->produced, g_process.qz_inst[i].stream[j].seq);
-
-                    unsigned int dest_receive_sz = outputHeaderSz(data_fmt) + resl->produced +
-                                                   outputFooterSz(data_fmt);
-                    if (QZ_OK != compOutCheckDestLen(i, j, sess, &dest_avail_len,
-                                                     dest_receive_sz)) {
-                        continue;
-                    }
-
-                    /* Update qz_sess info and clean dest buffer */
-                    outputHeaderGen(qz_sess->next_dest, resl, data_fmt);
-                    qz_sess->next_dest += outputHeaderSz(data_fmt);
-                    qz_sess->qz_out_len += outputHeaderSz(data_fmt);
-
-                    compOutValidDestBufferCleanUp(i, j, qz_sess, resl->produced);
-                    qz_sess->next_dest += resl->produced;
-                    qz_sess->qz_in_len += resl->consumed;
-
-                    if (likely(NULL != qz_sess->crc32 && IS_DEFLATE(data_fmt))) {
-                        if (0 == *(qz_sess->crc32)) {
-                            *(qz_sess->crc32) = resl->checksum;
-                        } else {
-                            *(qz_sess->crc32) = crc32_combine(*(qz_sess->crc32), resl->checksum,
-                                                              resl->consumed);
-                        }
-                    }
-                    qz_sess->qz_out_len += resl->produced;
-                    outputFooterGen(qz_sess->next_dest, resl, data_fmt);
-                    qz_sess->next_dest += outputFooterSz(data_fmt);
-                    qz_sess->qz_out_len += outputFooterSz(data_fmt);
-                }
+        /* retrieve the responses in order from the completion queue */
+        while (-1 != (j = qzGetCompletion(qz_sess))) {
+            good = 1;
+            QZ_DEBUG("doCompressOut: Processing seqnumber %2.2d "
+                     "%2.2d %4.4ld, PID: %d, TID: %lu\n",
+                     i, j, g_process.qz_inst[i].stream[j].seq,
+                     getpid(), pthread_self());
 
-                /* process finished! */
-                compOutProcessedRespond(i, j, qz_sess);
-                break;
+            if (unlikely(QZ_FAIL == compOutRespond(sess, i, j, &dest_avail_len))) {
+                goto err_exit;
             }
         }
 
-        if (QZ_PERIODICAL_POLLING == polling_mode) {
+        if (QZ_EVENT_POLLING == polling_mode && 0 == good &&
+            0 == qzWaitInstEvent(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_ADAPTIVE_POLLING == polling_mode && 0 == good &&
+                   0 == qzPollModelSleep(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_CENTRAL_POLLING == polling_mode && 0 == good &&
+                   0 == qzCentralWait(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_BUSY_POLLING != polling_mode) {
             if (0 == good) {
                 qz_sess->polling_idx = (qz_sess->polling_idx >= POLLING_LIST_NUM - 1) ?
                                        (POLLING_LIST_NUM - 1) :
@@ -1756,6 +2652,9 @@ err_exit:
     qz_sess->last_processed = 1;
     /*clean stream buffer*/
     for (j = 0; j < g_process.qz_inst[i].dest_count; j++) {
+        if (!qzIsStreamOwner(i, j, qz_sess)) {
+            continue;
+        }
         RestoreSrcCpastreamBuffer(i, j);
         RestoreDestCpastreamBuffer(i, j);
         ResetCpastreamSink(i, j);
@@ -1794,10 +2693,19 @@ static void resetQzsess(QzSession_T *sess, const unsigned char *src,
 
     qz_sess->seq = 0;
     qz_sess->seq_in = 0;
+    memset(qz_sess->cq, 0, sizeof(qz_sess->cq));
+    memset(qz_sess->due_ns, 0, sizeof(qz_sess->due_ns));
+    qz_sess->poll_empty_ns = 0;
+    qz_sess->poll_predicted = 0;
+    qz_sess->central_self_poll = 0;
     qz_sess->src = (unsigned char *)src;
     qz_sess->src_sz = src_len;
+    qz_sess->src_iov = NULL;
+    qz_sess->src_iov_cnt = 0;
     qz_sess->dest_sz = dest_len;
     qz_sess->next_dest = (unsigned char *)dest;
+    qz_sess->dest_base = (unsigned char *)dest;
+    qz_sess->slot_off = 0;
     qz_sess->last = last;
 }
 
@@ -1838,62 +2746,123 @@ static int lz4sPostProcess(QzSession_T *sess, const unsigned char *src,
     return QZ_OK;
 }
 
-/* The QATzip compression API */
-int qzCompress(QzSession_T *sess, const unsigned char *src,
-               unsigned int *src_len, unsigned char *dest,
-               unsigned int *dest_len, unsigned int last)
+static void *qzSubmitWorkerLoop(void *arg)
 {
-    return qzCompressExt(sess, src, src_len, dest, dest_len, last, NULL);
+    QzSubmitWorker_T *worker = (QzSubmitWorker_T *)arg;
+
+    while (1) {
+        if (0 != sem_wait(&worker->job_sem)) {
+            continue;
+        }
+        if (worker->exit) {
+            break;
+        }
+        worker->job(worker->arg);
+        sem_post(&worker->done_sem);
+    }
+    return NULL;
 }
 
-int qzCompressExt(QzSession_T *sess, const unsigned char *src,
-                  unsigned int *src_len, unsigned char *dest,
-                  unsigned int *dest_len, unsigned int last, uint64_t *ext_rc)
+static QzSubmitWorker_T *qzSubmitWorkerCreate(void)
 {
-    if (NULL == sess || (last != 0 && last != 1)) {
-        if (NULL != src_len) {
-            *src_len = 0;
-        }
-        if (NULL != dest_len) {
-            *dest_len = 0;
-        }
-        return QZ_PARAMS;
+    QzSubmitWorker_T *worker = calloc(1, sizeof(QzSubmitWorker_T));
+
+    if (unlikely(NULL == worker)) {
+        return NULL;
     }
+    if (unlikely(0 != sem_init(&worker->job_sem, 0, 0))) {
+        goto free_worker;
+    }
+    if (unlikely(0 != sem_init(&worker->done_sem, 0, 0))) {
+        goto destroy_job_sem;
+    }
+    if (unlikely(0 != pthread_create(&worker->thread, NULL,
+                                     qzSubmitWorkerLoop, (void *)worker))) {
+        goto destroy_done_sem;
+    }
+    worker->pid = getpid();
+    return worker;
 
-    return qzCompressCrcExt(sess, src, src_len, dest, dest_len, last, NULL, ext_rc);
+destroy_done_sem:
+    sem_destroy(&worker->done_sem);
+destroy_job_sem:
+    sem_destroy(&worker->job_sem);
+free_worker:
+    free(worker);
+    return NULL;
 }
 
-int qzCompressCrc(QzSession_T *sess, const unsigned char *src,
-                  unsigned int *src_len, unsigned char *dest,
-                  unsigned int *dest_len, unsigned int last,
-                  unsigned long *crc)
+static void qzSubmitWorkerDestroy(QzSess_T *qz_sess)
 {
-    return qzCompressCrcExt(sess, src, src_len, dest, dest_len, last, crc, NULL);
+    QzSubmitWorker_T *worker = qz_sess->submit_worker;
+
+    if (NULL == worker) {
+        return;
+    }
+    /* A forked child inherits the struct but not the thread */
+    if (worker->pid == getpid()) {
+        worker->exit = 1;
+        sem_post(&worker->job_sem);
+        pthread_join(worker->thread, NULL);
+        sem_destroy(&worker->job_sem);
+        sem_destroy(&worker->done_sem);
+    }
+    free(worker);
+    qz_sess->submit_worker = NULL;
 }
 
-int qzCompressCrcExt(QzSession_T *sess, const unsigned char *src,
-                     unsigned int *src_len, unsigned char *dest,
-                     unsigned int *dest_len, unsigned int last,
-                     unsigned long *crc, uint64_t *ext_rc)
+/* Run the submit side of a threaded call on the session's worker thread,
+ * started on first use. Falls back to a thread per call if it can't start.
+ */
+static void qzSubmitStart(QzSession_T *sess, void *(*job)(void *))
 {
-    int i, reqcnt;
-    QzSess_T *qz_sess;
-    int rc;
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    QzSubmitWorker_T *worker = qz_sess->submit_worker;
 
-    if (unlikely(NULL == sess     || \
-                 NULL == src      || \
-                 NULL == src_len  || \
-                 NULL == dest     || \
-                 NULL == dest_len || \
-                 (last != 0 && last != 1))) {
-        rc = QZ_PARAMS;
-        goto err_exit;
+    if (unlikely(NULL != worker && worker->pid != getpid())) {
+        qzSubmitWorkerDestroy(qz_sess);
+        worker = NULL;
+    }
+    if (unlikely(NULL == worker)) {
+        worker = qzSubmitWorkerCreate();
+        qz_sess->submit_worker = worker;
+    }
+
+    if (likely(NULL != worker)) {
+        qz_sess->submit_spawned = 0;
+        worker->job = job;
+        worker->arg = (void *)sess;
+        sem_post(&worker->job_sem);
+    } else {
+        qz_sess->submit_spawned = 1;
+        pthread_create(&(qz_sess->c_th_i), NULL, job, (void *)sess);
+    }
+}
+
+static void qzSubmitWait(QzSess_T *qz_sess)
+{
+    if (unlikely(qz_sess->submit_spawned)) {
+        pthread_join(qz_sess->c_th_i, NULL);
+        return;
+    }
+    while (0 != sem_wait(&qz_sess->submit_worker->done_sem)) {
+        if (EINTR != errno) {
+            break;
+        }
     }
+}
+
+/* Make sure the process and the session are set up for compression */
+static int qzCompressSessionSetup(QzSession_T *sess)
+{
+    int rc;
+    QzSess_T *qz_sess;
+    DataFormatInternal_T data_fmt;
 
     /*check if init called*/
     rc = qzInit(sess, getSwBackup(sess));
     if (QZ_INIT_FAIL(rc)) {
-        goto err_exit;
+        return rc;
     }
     /*check if setupSession called*/
     if (NULL == sess->internal || QZ_NONE == sess->hw_session_stat) {
@@ -1907,7 +2876,7 @@ int qzCompressCrcExt(QzSession_T *sess, const unsigned char *src,
             rc = qzSetupSessionDeflate(sess, NULL);
         }
         if (unlikely(QZ_SETUP_SESSION_FAIL(rc))) {
-            goto err_exit;
+            return rc;
         }
     }
 
@@ -1915,7 +2884,7 @@ int qzCompressCrcExt(QzSession_T *sess, const unsigned char *src,
     if (g_sess_params_internal_default.data_fmt == DEFLATE_ZLIB) {
         qz_sess->sess_params.data_fmt = DEFLATE_ZLIB;
     }
-    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+    data_fmt = qz_sess->sess_params.data_fmt;
     if (unlikely(data_fmt != DEFLATE_4B &&
                  data_fmt != DEFLATE_RAW &&
                  data_fmt != DEFLATE_GZIP &&
@@ -1924,105 +2893,148 @@ int qzCompressCrcExt(QzSession_T *sess, const unsigned char *src,
                  data_fmt != DEFLATE_ZLIB &&
                  data_fmt != LZ4S_BK)) {
         QZ_ERROR("Unknown data format: %d\n", data_fmt);
-        rc = QZ_UNSUPPORTED_FMT;
-        goto err_exit;
-    }
-    QZ_DEBUG("qzCompressCrc data_fmt: %d, input crc32 is 0x%lX\n",
-             data_fmt, crc ? *crc : 0);
-
-    qz_sess->crc32 = crc;
-
-    if (*src_len < qz_sess->sess_params.input_sz_thrshold
-         || g_process.qz_init_status == QZ_NO_HW
-         || sess->hw_session_stat == QZ_NO_HW
-#if !((CPA_DC_API_VERSION_NUM_MAJOR >= 3) && (CPA_DC_API_VERSION_NUM_MINOR >= 0))
-         || qz_sess->sess_params.comp_lvl == 9
-#endif
-       ) {
-        QZ_INFO("compression src_len=%u, sess_params.input_sz_thrshold = %u, "
-                "process.qz_init_status = %d, sess->hw_session_stat = %ld, "
-                " switch to software.\n",
-                *src_len, qz_sess->sess_params.input_sz_thrshold,
-                g_process.qz_init_status, sess->hw_session_stat);
-        goto sw_compression;
-    } else if (sess->hw_session_stat != QZ_OK &&
-               sess->hw_session_stat != QZ_NO_INST_ATTACH) {
-        rc = sess->hw_session_stat;
-        goto err_exit;
+        return QZ_UNSUPPORTED_FMT;
     }
 
-    if (qz_sess->sess_params.is_sensitive_mode == true &&
-        chooseLSMPath(qz_sess) == LSM_SW) {
-        rc = compLSMFallback(sess, src, src_len, dest, dest_len, last);
-        return rc;
-    }
+    return QZ_OK;
+}
 
-    unsigned long start_time_stamp, end_time_stamp;
-    start_time_stamp = rdtsc();
+/* Grab an instance with its HW resources ready for the session. Returns -1
+ * with *rc QZ_OK if the call should fall back to software.
+ */
+static int qzGrabSessInstance(QzSession_T *sess, int *rc)
+{
+    int i;
+    QzSess_T *qz_sess = (QzSess_T *)(sess->internal);
 
-    i = qzGrabInstance(qz_sess->inst_hint, &(qz_sess->sess_params));
+    *rc = QZ_OK;
+    i = qzGrabInstance(qz_sess->inst_hint, &(qz_sess->sess_params),
+                       qzShareSetup(qz_sess));
     if (unlikely(i == -1)) {
-        if (qz_sess->sess_params.sw_backup == 1) {
-            goto sw_compression;
-        } else {
+        /*Make this a s/w compression*/
+        if (qz_sess->sess_params.sw_backup != 1) {
             sess->hw_session_stat = QZ_NO_INST_ATTACH;
-            rc = QZ_NOSW_NO_INST_ATTACH;
-            goto err_exit;
+            *rc = QZ_NOSW_NO_INST_ATTACH;
         }
-        /*Make this a s/w compression*/
+        return -1;
     }
 
-    QZ_INFO("qzCompress: inst is %d\n", i);
+    QZ_INFO("qzGrabSessInstance: inst is %d\n", i);
     qz_sess->inst_hint = i;
 
     if (likely(0 ==  g_process.qz_inst[i].mem_setup ||
                0 ==  g_process.qz_inst[i].cpa_sess_setup)) {
-        QZ_INFO("Getting HW resources  for inst %d\n", i);
-        rc = qzSetupHW(sess, i);
-        if (unlikely(QZ_OK != rc)) {
-            qzReleaseInstance(i);
-            if (qz_sess->sess_params.sw_backup == 1) {
-                goto sw_compression;
-            } else {
-                goto err_exit;
-            }
-        }
+        QZ_INFO("Getting HW resources for inst %d\n", i);
+        *rc = qzSetupHW(sess, i);
     } else if (memcmp(&g_process.qz_inst[i].session_setup_data,
                       &qz_sess->session_setup_data, sizeof(CpaDcSessionSetupData))) {
         /* session_setup_data of qz_sess is not same with instance i,
            need to update cpa session of instance i. */
-        rc = qzUpdateCpaSession(sess, i);
-        if (QZ_OK != rc) {
-            qzReleaseInstance(i);
-            if (qz_sess->sess_params.sw_backup == 1) {
-                goto sw_compression;
-            } else {
-                goto err_exit;
-            }
+        *rc = qzUpdateCpaSession(sess, i);
+    }
+    if (unlikely(QZ_OK != *rc)) {
+        qzReleaseInstance(i);
+        if (qz_sess->sess_params.sw_backup == 1) {
+            *rc = QZ_OK;
+        }
+        return -1;
+    }
+
+    if (qz_sess->sess_params.share_inst) {
+        qzShareInstance(i);
+    }
+
+    return i;
+}
+
+static int qzBatchCanUseHW(QzSession_T *sess, QzDirection_T dir);
+static int qzCoalesceCompress(QzSession_T *sess, const unsigned char *src,
+                              unsigned int *src_len, unsigned char *dest,
+                              unsigned int *dest_len, unsigned long *crc);
+
+/* The QATzip compression API */
+int qzCompress(QzSession_T *sess, const unsigned char *src,
+               unsigned int *src_len, unsigned char *dest,
+               unsigned int *dest_len, unsigned int last)
+{
+    return qzCompressExt(sess, src, src_len, dest, dest_len, last, NULL);
+}
+
+int qzCompressExt(QzSession_T *sess, const unsigned char *src,
+                  unsigned int *src_len, unsigned char *dest,
+                  unsigned int *dest_len, unsigned int last, uint64_t *ext_rc)
+{
+    if (NULL == sess || (last != 0 && last != 1)) {
+        if (NULL != src_len) {
+            *src_len = 0;
         }
+        if (NULL != dest_len) {
+            *dest_len = 0;
+        }
+        return QZ_PARAMS;
     }
 
+    return qzCompressCrcExt(sess, src, src_len, dest, dest_len, last, NULL, ext_rc);
+}
+
+int qzCompressCrc(QzSession_T *sess, const unsigned char *src,
+                  unsigned int *src_len, unsigned char *dest,
+                  unsigned int *dest_len, unsigned int last,
+                  unsigned long *crc)
+{
+    return qzCompressCrcExt(sess, src, src_len, dest, dest_len, last, crc, NULL);
+}
+
+/* The hardware path of qzCompressCrcExt and qzCompressV on instance i,
+ * whose source is src, or the src_cnt segments of src_iov. Whatever the
+ * hardware leaves goes to software in one piece.
+ */
+static int qzCompressHW(QzSession_T *sess, int i, const unsigned char *src,
+                        const QzIovec_T *src_iov, unsigned int src_cnt,
+                        unsigned int *src_len, unsigned char *dest,
+                        unsigned int *dest_len, unsigned int last,
+                        unsigned long start_time_stamp, uint64_t *ext_rc)
+{
+    int reqcnt, rc;
+    unsigned char *flat = NULL;
+    unsigned long end_time_stamp;
+    QzSess_T *qz_sess = (QzSess_T *)(sess->internal);
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+    int member = qzMemberMode(qz_sess);
+    unsigned long trailer_sz = member ? qzMemberTrailerSz(data_fmt) : 0;
+
 #ifdef QATZIP_DEBUG
     insertThread((unsigned int)pthread_self(), COMPRESSION, HW);
 #endif
     resetQzsess(sess, src, src_len, dest, dest_len, last);
+    qz_sess->src_iov = src_iov;
+    qz_sess->src_iov_cnt = src_cnt;
+    qz_sess->member_on = member;
 
     reqcnt = *src_len / qz_sess->sess_params.hw_buff_sz;
     if (*src_len % qz_sess->sess_params.hw_buff_sz) {
         reqcnt++;
     }
 
-    if (reqcnt > qz_sess->sess_params.req_cnt_thrshold) {
-        pthread_create(&(qz_sess->c_th_i), NULL, doCompressIn, (void *)sess);
+    /* On a shared instance the single thread path needs its buffers
+     * reserved, as it can't drain responses while waiting for a buffer.
+     */
+    if (reqcnt > qz_sess->sess_params.req_cnt_thrshold ||
+        !qzReserveStreams(i, reqcnt)) {
+        qzSubmitStart(sess, doCompressIn);
         doCompressOut((void *)sess);
-        pthread_join(qz_sess->c_th_i, NULL);
+        qzSubmitWait(qz_sess);
     } else {
         qz_sess->single_thread = 1;
         doCompressIn((void *)sess);
         doCompressOut((void *)sess);
+        qzUnreserveStreams(i, reqcnt);
     }
 
     qzReleaseInstance(i);
+    qz_sess->member_on = 0;
+    qz_sess->src_iov = NULL;
+    qz_sess->src_iov_cnt = 0;
 
     end_time_stamp = rdtsc();
     if (qz_sess->sess_params.is_sensitive_mode == true) {
@@ -2036,6 +3048,15 @@ int qzCompressCrcExt(QzSession_T *sess, const unsigned char *src,
         */
         QZ_ERROR("The thread : %lu, Compress API failed! fatal error!\n",
                  pthread_self());
+        qz_sess->member_open = 0;
+        goto err_exit;
+    }
+    if (member && qz_sess->member_open &&
+        QZ_OK != sess->thd_sess_stat && QZ_BUF_ERROR != rc) {
+        QZ_ERROR("The thread : %lu, Compress API failed with a member open!\n",
+                 pthread_self());
+        qz_sess->member_open = 0;
+        rc = QZ_FAIL;
         goto err_exit;
     }
     /* if failure need to fallback to sw */
@@ -2046,17 +3067,42 @@ int qzCompressCrcExt(QzSession_T *sess, const unsigned char *src,
         unsigned char *sw_dest = qz_sess->next_dest;
         unsigned int sw_dest_len = *dest_len - (qz_sess->next_dest - dest);
 
+        /* the rest of a segmented source is gathered first */
+        if (NULL != src_iov) {
+            flat = qzMalloc(sw_src_len ? sw_src_len : 1,
+                            QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+            if (NULL != flat) {
+                qzIovCopy(flat, src_iov, src_cnt, qz_sess->qz_in_len,
+                          sw_src_len);
+            }
+            sw_src = flat;
+        }
+
         QZ_DEBUG("SW Comp Sending %u bytes, the rest comp all fallback to SW",
                  sw_src_len);
-        rc = qzSWCompress(sess, sw_src, &sw_src_len, sw_dest, &sw_dest_len, last);
-        if (QZ_OK == rc) {
-            qz_sess->qz_in_len += sw_src_len;
-            qz_sess->qz_out_len += sw_dest_len;
-            qz_sess->next_dest += sw_dest_len;
-            sess->thd_sess_stat = rc;
+        if (NULL == sw_src) {
+            QZ_ERROR("SW Comp fallback failure! no memory!\n");
         } else {
-            QZ_ERROR("SW Comp fallback failure! compress error!\n");
+            rc = qzSWCompress(sess, sw_src, &sw_src_len, sw_dest, &sw_dest_len,
+                              last);
+            if (QZ_OK == rc) {
+                qz_sess->qz_in_len += sw_src_len;
+                qz_sess->qz_out_len += sw_dest_len;
+                qz_sess->next_dest += sw_dest_len;
+                sess->thd_sess_stat = rc;
+            } else {
+                QZ_ERROR("SW Comp fallback failure! compress error!\n");
+            }
         }
+        qzFree(flat);
+    }
+
+    /* the trailer room was held back from the HW requests */
+    if (member && last && qz_sess->member_open &&
+        QZ_OK == sess->thd_sess_stat && qz_sess->qz_in_len == *src_len) {
+        qzMemberClose(qz_sess, qz_sess->next_dest);
+        qz_sess->next_dest += trailer_sz;
+        qz_sess->qz_out_len += trailer_sz;
     }
 
     *dest_len = qz_sess->next_dest - dest;
@@ -2082,63 +3128,324 @@ int qzCompressCrcExt(QzSession_T *sess, const unsigned char *src,
 
     return sess->thd_sess_stat;
 
-sw_compression:
-    QZ_INFO("The thread : %lu, Compress API SW fallback due to HW limitaions!\n",
-            pthread_self());
-    return qzSWCompress(sess, src, src_len, dest, dest_len, last);
 err_exit:
-    if (NULL != src_len) {
-        *src_len = 0;
-    }
-    if (NULL != dest_len) {
-        *dest_len = 0;
-    }
+    *src_len = 0;
+    *dest_len = 0;
     return rc;
 }
 
-/* The internal function to send the decompression request
- * to the QAT hardware
- *     sess->thd_sess_stat carry QZ_OK && QZ_DATA_ERROR && QZ_BUF_ERROR && QZ_FAIL
- */
-static void *doDecompressIn(void *in)
+int qzCompressCrcExt(QzSession_T *sess, const unsigned char *src,
+                     unsigned int *src_len, unsigned char *dest,
+                     unsigned int *dest_len, unsigned int last,
+                     unsigned long *crc, uint64_t *ext_rc)
 {
-    unsigned long i, tag;
-    int rc = 0;
-    int j;
-    unsigned int done = 0;
-    unsigned int remaining;
-    unsigned int src_avail_len, dest_avail_len;
-    unsigned int tmp_src_avail_len, tmp_dest_avail_len;
-    unsigned char *src_ptr;
-    unsigned char *dest_ptr;
-
-    QzGzH_T hdr = {{0}, 0};
-    QzSession_T *sess = (QzSession_T *)in;
-    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
-    struct timespec sleep_time;
+    int i;
+    QzSess_T *qz_sess;
+    int rc;
+    int member;
+    unsigned long trailer_sz;
 
-    sleep_time.tv_sec = 0;
-    sleep_time.tv_nsec = GET_BUFFER_SLEEP_NSEC;
-    i = qz_sess->inst_hint;
-    j = -1;
+    if (unlikely(NULL == sess     || \
+                 NULL == src      || \
+                 NULL == src_len  || \
+                 NULL == dest     || \
+                 NULL == dest_len || \
+                 (last != 0 && last != 1))) {
+        rc = QZ_PARAMS;
+        goto err_exit;
+    }
 
-    /* For offlod request, src_ptr, dest_ptr, remaining and src_avail_len, dest_avail_len will update */
-    src_ptr = qz_sess->src + qz_sess->qz_in_len;
-    dest_ptr = qz_sess->next_dest;
-    remaining = *qz_sess->src_sz - qz_sess->qz_in_len;
-    src_avail_len = remaining;
-    dest_avail_len = (long)(*qz_sess->dest_sz - qz_sess->qz_out_len);
-    QZ_DEBUG("doDecompressIn: Need to g_process %d bytes\n", remaining);
+    rc = qzCompressSessionSetup(sess);
+    if (unlikely(QZ_OK != rc)) {
+        goto err_exit;
+    }
 
-    /* rc will only maintain in this function, thd_sess_stat will return the error status */
-    while (!done) {
-        QZ_DEBUG("src_avail_len is %u, dest_avail_len is %u\n",
-                 src_avail_len, dest_avail_len);
+    qz_sess = (QzSess_T *)(sess->internal);
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+    QZ_DEBUG("qzCompressCrc data_fmt: %d, input crc32 is 0x%lX\n",
+             data_fmt, crc ? *crc : 0);
 
-        rc = checkHeader(qz_sess, src_ptr, src_avail_len, dest_avail_len, &hdr);
-        if (QZ_OK != rc && QZ_FORCE_SW != rc) {
-            sess->thd_sess_stat = rc;
-            goto err_exit;
+    qz_sess->crc32 = crc;
+    member = qzMemberMode(qz_sess);
+    trailer_sz = member ? qzMemberTrailerSz(data_fmt) : 0;
+
+    if (member && qz_sess->member_open && 0 == *src_len) {
+        /* nothing more to add, only close the member */
+        if (last) {
+            if (*dest_len < trailer_sz) {
+                *dest_len = 0;
+                return QZ_BUF_ERROR;
+            }
+            qzMemberClose(qz_sess, dest);
+            sess->total_out += trailer_sz;
+        }
+        *dest_len = last ? trailer_sz : 0;
+        return QZ_OK;
+    }
+
+    /* a member software has started is finished in software */
+    if (member && DeflateNull != qz_sess->deflate_stat) {
+        goto sw_compression;
+    }
+
+    if (!member &&
+        *src_len < qz_sess->sess_params.input_sz_thrshold &&
+        0 != *src_len && 1 == last && qz_sess->sess_params.coalesce_usec &&
+        qzBatchCanUseHW(sess, QZ_DIR_COMPRESS)) {
+        rc = qzCoalesceCompress(sess, src, src_len, dest, dest_len, crc);
+        if (QZ_NONE != rc) {
+            return rc;
+        }
+    }
+
+    if ((*src_len < qz_sess->sess_params.input_sz_thrshold &&
+         !(member && 0 != *src_len))
+         || g_process.qz_init_status == QZ_NO_HW
+         || sess->hw_session_stat == QZ_NO_HW
+#if !((CPA_DC_API_VERSION_NUM_MAJOR >= 3) && (CPA_DC_API_VERSION_NUM_MINOR >= 0))
+         || qz_sess->sess_params.comp_lvl == 9
+#endif
+       ) {
+        QZ_INFO("compression src_len=%u, sess_params.input_sz_thrshold = %u, "
+                "process.qz_init_status = %d, sess->hw_session_stat = %ld, "
+                " switch to software.\n",
+                *src_len, qz_sess->sess_params.input_sz_thrshold,
+                g_process.qz_init_status, sess->hw_session_stat);
+        goto sw_compression;
+    } else if (sess->hw_session_stat != QZ_OK &&
+               sess->hw_session_stat != QZ_NO_INST_ATTACH) {
+        rc = sess->hw_session_stat;
+        goto err_exit;
+    }
+
+    if (!member && qz_sess->sess_params.is_sensitive_mode == true &&
+        chooseLSMPath(qz_sess) == LSM_SW) {
+        rc = compLSMFallback(sess, src, src_len, dest, dest_len, last);
+        return rc;
+    }
+
+    if (member) {
+        if (LZ4_FH == data_fmt && NULL == qz_sess->member_xxh32) {
+            qz_sess->member_xxh32 = XXH32_createState();
+            if (unlikely(NULL == qz_sess->member_xxh32)) {
+                rc = QZ_NOSW_LOW_MEM;
+                goto err_exit;
+            }
+        }
+        if (last) {
+            if (*dest_len < trailer_sz) {
+                rc = QZ_BUF_ERROR;
+                goto err_exit;
+            }
+            *dest_len -= trailer_sz;
+        }
+    }
+
+    unsigned long start_time_stamp;
+    start_time_stamp = rdtsc();
+
+    i = qzGrabSessInstance(sess, &rc);
+    if (unlikely(i == -1)) {
+        if (member && last) {
+            *dest_len += trailer_sz;
+        }
+        if (QZ_OK == rc) {
+            goto sw_compression;
+        }
+        goto err_exit;
+    }
+
+    return qzCompressHW(sess, i, src, NULL, 0, src_len, dest, dest_len, last,
+                        start_time_stamp, ext_rc);
+
+sw_compression:
+    QZ_INFO("The thread : %lu, Compress API SW fallback due to HW limitaions!\n",
+            pthread_self());
+    if (member && qz_sess->member_open) {
+        QZ_ERROR("The thread : %lu, software can't continue an open member!\n",
+                 pthread_self());
+        qz_sess->member_open = 0;
+        rc = QZ_FAIL;
+        goto err_exit;
+    }
+    if (*src_len < qz_sess->sess_params.input_sz_thrshold) {
+        atomic_fetch_add(&g_process.small_sw, 1);
+    }
+    return qzSWCompress(sess, src, src_len, dest, dest_len, last);
+err_exit:
+    if (NULL != src_len) {
+        *src_len = 0;
+    }
+    if (NULL != dest_len) {
+        *dest_len = 0;
+    }
+    return rc;
+}
+
+/* Gather the segments into one buffer, pinned if possible so that a HW
+ * request can read it in place. Released by qzFree.
+ */
+static unsigned char *qzIovFlatten(const QzIovec_T *iov, unsigned int cnt,
+                                   unsigned int len)
+{
+    unsigned char *buf;
+
+    buf = qzMalloc(len ? len : 1, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (likely(NULL != buf)) {
+        qzIovCopy(buf, iov, cnt, 0, len);
+    }
+    return buf;
+}
+
+static int qzCheckIov(const QzIovec_T *iov, unsigned int cnt,
+                      unsigned int *len)
+{
+    unsigned long total;
+    unsigned int k;
+
+    if (NULL == iov || 0 == cnt) {
+        return QZ_PARAMS;
+    }
+    for (k = 0; k < cnt; k++) {
+        if (NULL == iov[k].buf && 0 != iov[k].len) {
+            return QZ_PARAMS;
+        }
+    }
+    total = qzIovLen(iov, cnt);
+    if (total > UINT_MAX) {
+        return QZ_PARAMS;
+    }
+    *len = (unsigned int)total;
+    return QZ_OK;
+}
+
+int qzCompressV(QzSession_T *sess, const QzIovec_T *src_iov,
+                unsigned int src_cnt, unsigned int *src_len,
+                unsigned char *dest, unsigned int *dest_len,
+                unsigned int last, unsigned long *crc)
+{
+    int i;
+    int rc;
+    unsigned int total = 0;
+    unsigned char *flat = NULL;
+    unsigned long start_time_stamp;
+    QzSess_T *qz_sess;
+
+    if (unlikely(NULL == sess     || \
+                 NULL == src_len  || \
+                 NULL == dest     || \
+                 NULL == dest_len || \
+                 (last != 0 && last != 1))) {
+        rc = QZ_PARAMS;
+        goto err_exit;
+    }
+
+    rc = qzCheckIov(src_iov, src_cnt, &total);
+    if (unlikely(QZ_OK != rc)) {
+        goto err_exit;
+    }
+
+    /* A single segment is an ordinary call */
+    if (1 == src_cnt) {
+        *src_len = total;
+        return qzCompressCrcExt(sess, src_iov[0].buf, src_len, dest, dest_len,
+                                last, crc, NULL);
+    }
+
+    rc = qzCompressSessionSetup(sess);
+    if (unlikely(QZ_OK != rc)) {
+        goto err_exit;
+    }
+
+    /* sensitive mode, single members and LZ4s post-processing are left to
+     * qzCompressCrcExt
+     */
+    qz_sess = (QzSess_T *)(sess->internal);
+    if (total < qz_sess->sess_params.input_sz_thrshold ||
+        qz_sess->sess_params.is_sensitive_mode == true ||
+        qzMemberMode(qz_sess) ||
+        (LZ4S_BK == qz_sess->sess_params.data_fmt &&
+         qz_sess->sess_params.qzCallback) ||
+        !qzBatchCanUseHW(sess, QZ_DIR_COMPRESS)) {
+        goto flatten;
+    }
+
+    qz_sess->crc32 = crc;
+    start_time_stamp = rdtsc();
+    i = qzGrabSessInstance(sess, &rc);
+    if (unlikely(i == -1)) {
+        if (QZ_OK == rc) {
+            goto flatten;
+        }
+        goto err_exit;
+    }
+
+    rc = qzCompressHW(sess, i, NULL, src_iov, src_cnt, &total, dest,
+                      dest_len, last, start_time_stamp, NULL);
+    *src_len = total;
+    return rc;
+
+flatten:
+    /* the paths qzCompressV doesn't drive need the source in one piece */
+    flat = qzIovFlatten(src_iov, src_cnt, total);
+    if (unlikely(NULL == flat)) {
+        rc = QZ_NOSW_LOW_MEM;
+        goto err_exit;
+    }
+    *src_len = total;
+    rc = qzCompressCrcExt(sess, flat, src_len, dest, dest_len, last, crc, NULL);
+    qzFree(flat);
+    return rc;
+
+err_exit:
+    if (NULL != src_len) {
+        *src_len = 0;
+    }
+    if (NULL != dest_len) {
+        *dest_len = 0;
+    }
+    return rc;
+}
+
+/* The internal function to send the decompression request
+ * to the QAT hardware
+ *     sess->thd_sess_stat carry QZ_OK && QZ_DATA_ERROR && QZ_BUF_ERROR && QZ_FAIL
+ */
+static void *doDecompressIn(void *in)
+{
+    unsigned long i, tag;
+    int rc = 0;
+    int j;
+    unsigned int done = 0;
+    unsigned int remaining;
+    unsigned int src_avail_len, dest_avail_len;
+    unsigned int tmp_src_avail_len, tmp_dest_avail_len;
+    unsigned char *src_ptr;
+    unsigned char *dest_ptr;
+
+    QzGzH_T hdr = {{0}, 0};
+    QzSession_T *sess = (QzSession_T *)in;
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    i = qz_sess->inst_hint;
+    j = -1;
+
+    /* For offlod request, src_ptr, dest_ptr, remaining and src_avail_len, dest_avail_len will update */
+    src_ptr = qz_sess->src + qz_sess->qz_in_len;
+    dest_ptr = qz_sess->next_dest;
+    remaining = *qz_sess->src_sz - qz_sess->qz_in_len;
+    src_avail_len = remaining;
+    dest_avail_len = (long)(*qz_sess->dest_sz - qz_sess->qz_out_len);
+    QZ_DEBUG("doDecompressIn: Need to g_process %d bytes\n", remaining);
+
+    /* rc will only maintain in this function, thd_sess_stat will return the error status */
+    while (!done) {
+        QZ_DEBUG("src_avail_len is %u, dest_avail_len is %u\n",
+                 src_avail_len, dest_avail_len);
+
+        rc = checkHeader(qz_sess, src_ptr, src_avail_len, dest_avail_len, &hdr);
+        if (QZ_OK != rc && QZ_FORCE_SW != rc) {
+            sess->thd_sess_stat = rc;
+            goto err_exit;
         }
 
         if (g_process.qz_inst[i].heartbeat != CPA_STATUS_SUCCESS ||
@@ -2155,30 +3462,27 @@ static void *doDecompressIn(void *in)
             }
         } else {
             /*HW decompression*/
-            do {
-                j = getUnusedBuffer(i, j);
-
-                /* if decompres is in single thread mode, no body gone consume the
-                 * buffer, it shows something wrong in program, need to exit with
-                 * error, otherwise, program will hang at the nanosleep, it would
-                 * never get the avaliable buffer.
-                 */
-                if (qz_sess->single_thread) {
-                    if (unlikely((-1 == j) ||
-                                 ((0 == qz_sess->seq % qz_sess->sess_params.req_cnt_thrshold) &&
-                                  (qz_sess->seq > qz_sess->seq_in)))) {
-                        return ((void *) NULL);
-                    }
-                } else {
-                    if (unlikely(-1 == j)) {
-                        nanosleep(&sleep_time, NULL);
-                    }
+            /* if decompres is in single thread mode, no body gone consume the
+             * buffer, it shows something wrong in program, need to exit with
+             * error, otherwise, program will hang waiting for a buffer, it would
+             * never get the avaliable buffer.
+             * The batch check comes first, as getUnusedBuffer claims the buffer.
+             */
+            if (qz_sess->single_thread) {
+                if ((0 == qz_sess->seq % qz_sess->sess_params.req_cnt_thrshold) &&
+                    (qz_sess->seq > qz_sess->seq_in)) {
+                    return ((void *) NULL);
+                }
+                j = getUnusedBuffer(i, qz_sess);
+                if (unlikely(-1 == j)) {
+                    return ((void *) NULL);
                 }
-            } while (-1 == j);
+            } else {
+                j = waitUnusedBuffer(i, qz_sess);
+            }
 
             QZ_DEBUG("getUnusedBuffer returned %d\n", j);
 
-            g_process.qz_inst[i].stream[j].src1++;/*this buffer is in use*/
             decompBufferSetup(i, j, qz_sess, src_ptr, dest_ptr, src_avail_len, &hdr,
                               &tmp_src_avail_len, &tmp_dest_avail_len);
             g_process.qz_inst[i].stream[j].src2++;/*this buffer is in use*/
@@ -2258,6 +3562,80 @@ err_exit:
     return ((void *)NULL);
 }
 
+/* Process the decompression response in stream buffer j of instance i,
+ * returns QZ_FAIL if the call can't go on
+ */
+static int decompOutRespond(QzSession_T *sess, int i, int j,
+                            unsigned int *dest_avail_len)
+{
+    int rc;
+    unsigned int src_send_sz;
+    CpaDcRqResults *resl;
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+
+    if (unlikely(QZ_DATA_ERROR == sess->thd_sess_stat)) {
+        decompOutSkipErrorRespond(i, j, qz_sess);
+        return QZ_OK;
+    }
+
+    if (unlikely(CPA_STATUS_SUCCESS != g_process.qz_inst[i].stream[j].job_status)) {
+        QZ_DEBUG("Error(%d) in callback: %d, %d, ReqStatus: %d\n",
+                 g_process.qz_inst[i].stream[j].job_status, i, j,
+                 g_process.qz_inst[i].stream[j].res.status);
+        /* polled error/dummy respond , fallback to sw */
+        rc = decompOutSWFallback(i, j, sess, dest_avail_len);
+        if (QZ_FAIL == rc) {
+            QZ_ERROR("Error in SW deCompOut:inst %d, buffer %d, seq %ld\n", i, j,
+                     qz_sess->seq_in);
+            /* Need to swap buffer, even sw fallback failed */
+            swapDataBuffer(i, j);
+            return QZ_FAIL;
+        }
+    } else {
+        resl = &g_process.qz_inst[i].stream[j].res;
+        QZ_DEBUG("\tHW DecompOut: consumed = %d, produced = %d, seq_in = %ld, src_send_sz = %u\n",
+                 resl->consumed, resl->produced, g_process.qz_inst[i].stream[j].seq,
+                 g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes);
+
+        /* A zlib stream going on past the buffer, as qzCompressStream
+         * writes, is left to the software fallback from its header
+         */
+        if (DEFLATE_ZLIB == data_fmt && CPA_TRUE != resl->endOfLastBlock &&
+            resl->consumed >=
+            g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes) {
+            QZ_DEBUG("\tHW DecompOut: zlib stream doesn't end in buffer\n");
+            decompOutSkipErrorRespond(i, j, qz_sess);
+            qz_sess->stop_submitting = 1;
+            qz_sess->last_submitted = 1;
+            sess->thd_sess_stat = QZ_FAIL;
+            return QZ_OK;
+        }
+
+        /* update the qz_sess info and clean dest buffer */
+        decompOutValidDestBufferCleanUp(i, j, qz_sess, resl, *dest_avail_len);
+        if (QZ_OK != decompOutCheckSum(i, j, sess, resl)) {
+            return QZ_OK;
+        }
+        /*
+        changed src_send_sz to actual data consumed by HW.
+        */
+        src_send_sz = resl->consumed;
+        qz_sess->next_dest += resl->produced;
+        qz_sess->qz_in_len += (outputHeaderSz(data_fmt) + src_send_sz +
+                               outputFooterSz(data_fmt));
+        qz_sess->qz_out_len += resl->produced;
+        *dest_avail_len -= resl->produced;
+        if (resl->endOfLastBlock == CPA_TRUE) {
+            QZ_DEBUG("\tHW DecompOut: endOfLastBlock \n");
+            setDeflateEndOfStream(qz_sess, 1);
+        }
+    }
+
+    decompOutProcessedRespond(i, j, qz_sess);
+    return QZ_OK;
+}
+
 /* The internal function to g_process the decompression response
  * from the QAT hardware
  */
@@ -2271,16 +3649,12 @@ err_exit:
 static void *__attribute__((cold)) doDecompressOut(void *in)
 {
     int i = 0, j = 0, good;
-    int rc = 0;
-    CpaDcRqResults *resl;
     CpaStatus sts;
     unsigned int sleep_cnt = 0;
     unsigned int done = 0;
-    unsigned int src_send_sz;
     unsigned int dest_avail_len;
     QzSession_T *sess = (QzSession_T *)in;
     QzSess_T *qz_sess = (QzSess_T *)sess->internal;
-    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
     QzPollingMode_T polling_mode = qz_sess->sess_params.polling_mode;
 
     i = qz_sess->inst_hint;
@@ -2289,74 +3663,22 @@ static void *__attribute__((cold)) doDecompressOut(void *in)
     while (!done) {
         /* Poll for responses */
         good = 0;
-        sts = icp_sal_DcPollInstance(g_process.dc_inst_handle[i], 0);
+        sts = qzSessPoll(i, qz_sess);
         if (unlikely(CPA_STATUS_FAIL == sts)) {
             /* if this error, we don't know which buffer is swapped */
             QZ_ERROR("Error in DcPoll: %d\n", sts);
             goto err_exit;
         }
 
-        /*fake a retrieve*/
-        for (j = 0; j <  g_process.qz_inst[i].dest_count; j++) {
-            if ((g_process.qz_inst[i].stream[j].seq ==
-                 qz_sess->seq_in) &&
-                (g_process.qz_inst[i].stream[j].src1 ==
-                 g_process.qz_inst[i].stream[j].src2) &&
-                (g_process.qz_inst[i].stream[j].sink1 ==
-                 g_process.qz_inst[i].stream[j].src1) &&
-                (g_process.qz_inst[i].stream[j].sink1 ==
-                 g_process.qz_inst[i].stream[j].sink2 + 1)) {
-                good = 1;
-
-                QZ_DEBUG("doDecompressOut: Processing seqnumber %2.2d %2.2d %4.4ld\n",
-                         i, j, g_process.qz_inst[i].stream[j].seq);
-
-                if (unlikely(QZ_DATA_ERROR == sess->thd_sess_stat)) {
-                    decompOutSkipErrorRespond(i, j, qz_sess);
-                    continue;
-                }
+        /* retrieve the responses in order from the completion queue */
+        while (-1 != (j = qzGetCompletion(qz_sess))) {
+            good = 1;
 
-                if (unlikely(CPA_STATUS_SUCCESS != g_process.qz_inst[i].stream[j].job_status)) {
-                    QZ_DEBUG("Error(%d) in callback: %d, %d, ReqStatus: %d\n",
-                             g_process.qz_inst[i].stream[j].job_status, i, j,
-                             g_process.qz_inst[i].stream[j].res.status);
-                    /* polled error/dummy respond , fallback to sw */
-                    rc = decompOutSWFallback(i, j, sess, &dest_avail_len);
-                    if (QZ_FAIL == rc) {
-                        QZ_ERROR("Error in SW deCompOut:inst %d, buffer %d, seq %ld\n", i, j,
-                                 qz_sess->seq_in);
-                        /* Need to swap buffer, even sw fallback failed */
-                        swapDataBuffer(i, j);
-                        goto err_exit;
-                    }
-                } else {
-                    resl = &g_process.qz_inst[i].stream[j].res;
-                    QZ_DEBUG("\tHW DecompOut: consumed = %d, produced = %d, seq_in = %ld, src_send_sz = %u\n",
-                             resl->consumed, resl->produced, g_process.qz_inst[i].stream[j].seq,
-                             g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes);
-
-                    /* update the qz_sess info and clean dest buffer */
-                    decompOutValidDestBufferCleanUp(i, j, qz_sess, resl, dest_avail_len);
-                    if (QZ_OK != decompOutCheckSum(i, j, sess, resl)) {
-                        continue;
-                    }
-                    /*
-                    changed src_send_sz to actual data consumed by HW.
-                    */
-                    src_send_sz = resl->consumed;
-                    qz_sess->next_dest += resl->produced;
-                    qz_sess->qz_in_len += (outputHeaderSz(data_fmt) + src_send_sz +
-                                           outputFooterSz(data_fmt));
-                    qz_sess->qz_out_len += resl->produced;
-                    dest_avail_len -= resl->produced;
-                    if (resl->endOfLastBlock == CPA_TRUE) {
-                        QZ_DEBUG("\tHW DecompOut: endOfLastBlock \n");
-                        setDeflateEndOfStream(qz_sess, 1);
-                    }
-                }
+            QZ_DEBUG("doDecompressOut: Processing seqnumber %2.2d %2.2d %4.4ld\n",
+                     i, j, g_process.qz_inst[i].stream[j].seq);
 
-                decompOutProcessedRespond(i, j, qz_sess);
-                break;
+            if (unlikely(QZ_FAIL == decompOutRespond(sess, i, j, &dest_avail_len))) {
+                goto err_exit;
             }
         }
 
@@ -2366,7 +3688,16 @@ static void *__attribute__((cold)) doDecompressOut(void *in)
             done = (qz_sess->last_submitted) && (qz_sess->processed == qz_sess->submitted);
         }
 
-        if (QZ_PERIODICAL_POLLING == polling_mode) {
+        if (QZ_EVENT_POLLING == polling_mode && 0 == good &&
+            0 == qzWaitInstEvent(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_ADAPTIVE_POLLING == polling_mode && 0 == good &&
+                   0 == qzPollModelSleep(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_CENTRAL_POLLING == polling_mode && 0 == good &&
+                   0 == qzCentralWait(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_BUSY_POLLING != polling_mode) {
             if (0 == good) {
                 qz_sess->polling_idx = (qz_sess->polling_idx >= POLLING_LIST_NUM - 1) ?
                                        (POLLING_LIST_NUM - 1) :
@@ -2393,6 +3724,9 @@ err_exit:
     sess->thd_sess_stat = QZ_FAIL;
     /* clean stream buffer */
     for (j = 0; j < g_process.qz_inst[i].dest_count; j++) {
+        if (!qzIsStreamOwner(i, j, qz_sess)) {
+            continue;
+        }
         RestoreSrcCpastreamBuffer(i, j);
         RestoreDestCpastreamBuffer(i, j);
         ResetCpastreamSink(i, j);
@@ -2418,59 +3752,17 @@ static void *doQzDecompressSingleThread(void *in)
     return NULL;
 }
 
-/* The QATzip decompression API */
-int qzDecompress(QzSession_T *sess, const unsigned char *src,
-                 unsigned int *src_len, unsigned char *dest,
-                 unsigned int *dest_len)
-{
-    return qzDecompressCrcExt(sess, src, src_len, dest, dest_len, NULL, NULL);
-}
-
-int qzDecompressExt(QzSession_T *sess, const unsigned char *src,
-                    unsigned int *src_len, unsigned char *dest,
-                    unsigned int *dest_len, uint64_t *ext_rc)
-{
-    return qzDecompressCrcExt(sess, src, src_len, dest, dest_len, NULL, ext_rc);
-}
-
-int qzDecompressCrc(QzSession_T *sess,
-                    const unsigned char *src,
-                    unsigned int *src_len,
-                    unsigned char *dest,
-                    unsigned int *dest_len,
-                    unsigned long *crc)
+/* Make sure the process and the session are set up for decompression */
+static int qzDecompressSessionSetup(QzSession_T *sess)
 {
-    return qzDecompressCrcExt(sess, src, src_len, dest, dest_len, crc, NULL);
-}
-
-int qzDecompressCrcExt(QzSession_T *sess, const unsigned char *src,
-                       unsigned int *src_len, unsigned char *dest,
-                       unsigned int *dest_len, unsigned long *crc,
-                       uint64_t *ext_rc)
-{
-    int rc;
-    int i, reqcnt;
-    QzSess_T *qz_sess;
-    QzGzH_T *hdr = (QzGzH_T *)src;
-
-    if (unlikely(NULL == sess                 || \
-                 NULL == src                  || \
-                 NULL == src_len              || \
-                 NULL == dest                 || \
-                 NULL == dest_len)) {
-        rc = QZ_PARAMS;
-        goto err_exit;
-    }
-
-    if (0 == *src_len) {
-        *dest_len = 0;
-        return QZ_OK;
-    }
+    int rc;
+    QzSess_T *qz_sess;
+    DataFormatInternal_T data_fmt;
 
     /*check if init called*/
     rc = qzInit(sess, getSwBackup(sess));
     if (QZ_INIT_FAIL(rc)) {
-        goto err_exit;
+        return rc;
     }
     /*check if setupSession called*/
     if (NULL == sess->internal || QZ_NONE == sess->hw_session_stat) {
@@ -2484,7 +3776,7 @@ int qzDecompressCrcExt(QzSession_T *sess, const unsigned char *src,
             rc = qzSetupSessionDeflate(sess, NULL);
         }
         if (unlikely(QZ_SETUP_SESSION_FAIL(rc))) {
-            goto err_exit;
+            return rc;
         }
     }
 
@@ -2495,7 +3787,7 @@ int qzDecompressCrcExt(QzSession_T *sess, const unsigned char *src,
     // by default end of stream is set to 0
     setDeflateEndOfStream(qz_sess, 0);
 
-    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+    data_fmt = qz_sess->sess_params.data_fmt;
     if (unlikely(data_fmt != DEFLATE_RAW &&
                  data_fmt != DEFLATE_4B &&
                  data_fmt != DEFLATE_GZIP &&
@@ -2503,10 +3795,69 @@ int qzDecompressCrcExt(QzSession_T *sess, const unsigned char *src,
                  data_fmt != DEFLATE_ZLIB &&
                  data_fmt != DEFLATE_GZIP_EXT)) {
         QZ_ERROR("Unknown/unsupported data format: %d\n", data_fmt);
-        rc = QZ_UNSUPPORTED_FMT;
+        return QZ_UNSUPPORTED_FMT;
+    }
+
+    return QZ_OK;
+}
+
+/* The QATzip decompression API */
+int qzDecompress(QzSession_T *sess, const unsigned char *src,
+                 unsigned int *src_len, unsigned char *dest,
+                 unsigned int *dest_len)
+{
+    return qzDecompressCrcExt(sess, src, src_len, dest, dest_len, NULL, NULL);
+}
+
+int qzDecompressExt(QzSession_T *sess, const unsigned char *src,
+                    unsigned int *src_len, unsigned char *dest,
+                    unsigned int *dest_len, uint64_t *ext_rc)
+{
+    return qzDecompressCrcExt(sess, src, src_len, dest, dest_len, NULL, ext_rc);
+}
+
+int qzDecompressCrc(QzSession_T *sess,
+                    const unsigned char *src,
+                    unsigned int *src_len,
+                    unsigned char *dest,
+                    unsigned int *dest_len,
+                    unsigned long *crc)
+{
+    return qzDecompressCrcExt(sess, src, src_len, dest, dest_len, crc, NULL);
+}
+
+int qzDecompressCrcExt(QzSession_T *sess, const unsigned char *src,
+                       unsigned int *src_len, unsigned char *dest,
+                       unsigned int *dest_len, unsigned long *crc,
+                       uint64_t *ext_rc)
+{
+    int rc;
+    int i, reqcnt;
+    QzSess_T *qz_sess;
+    QzGzH_T *hdr = (QzGzH_T *)src;
+
+    if (unlikely(NULL == sess                 || \
+                 NULL == src                  || \
+                 NULL == src_len              || \
+                 NULL == dest                 || \
+                 NULL == dest_len)) {
+        rc = QZ_PARAMS;
+        goto err_exit;
+    }
+
+    if (0 == *src_len) {
+        *dest_len = 0;
+        return QZ_OK;
+    }
+
+    rc = qzDecompressSessionSetup(sess);
+    if (unlikely(QZ_OK != rc)) {
         goto err_exit;
     }
 
+    qz_sess = (QzSess_T *)(sess->internal);
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+
     QZ_DEBUG("qzDecompress data_fmt: %d\n", data_fmt);
     if ((data_fmt == DEFLATE_GZIP_EXT &&
          hdr->extra.qz_e.src_sz < qz_sess->sess_params.input_sz_thrshold) ||
@@ -2534,140 +3885,667 @@ int qzDecompressCrcExt(QzSession_T *sess, const unsigned char *src,
         goto err_exit;
     }
 
-    if (qz_sess->sess_params.is_sensitive_mode == true &&
-        chooseLSMPath(qz_sess) == LSM_SW) {
-        rc = decompLSMFallback(sess, src, src_len, dest, dest_len);
-        return rc;
+    if (qz_sess->sess_params.is_sensitive_mode == true &&
+        chooseLSMPath(qz_sess) == LSM_SW) {
+        rc = decompLSMFallback(sess, src, src_len, dest, dest_len);
+        return rc;
+    }
+
+    unsigned long start_time_stamp, end_time_stamp;
+    start_time_stamp = rdtsc();
+
+    i = qzGrabSessInstance(sess, &rc);
+    if (unlikely(i == -1)) {
+        if (QZ_OK == rc) {
+            goto sw_decompression;
+        }
+        goto err_exit;
+    }
+
+#ifdef QATZIP_DEBUG
+    insertThread((unsigned int)pthread_self(), DECOMPRESSION, HW);
+#endif
+    resetQzsess(sess, src, src_len, dest, dest_len, 0);
+
+    reqcnt = *src_len / (qz_sess->sess_params.hw_buff_sz / 2);
+    if (*src_len % (qz_sess->sess_params.hw_buff_sz / 2)) {
+        reqcnt++;
+    }
+
+    if (reqcnt > qz_sess->sess_params.req_cnt_thrshold) {
+        qz_sess->single_thread = 0;
+        qzSubmitStart(sess, doDecompressIn);
+        doDecompressOut((void *)sess);
+        qzSubmitWait(qz_sess);
+    } else {
+        qz_sess->single_thread = 1;
+        doQzDecompressSingleThread((void *)sess);
+    }
+
+    qzReleaseInstance(i);
+
+    end_time_stamp = rdtsc();
+    if (qz_sess->sess_params.is_sensitive_mode == true) {
+        metrixUpdate(&qz_sess->RRT, (end_time_stamp - start_time_stamp));
+    }
+
+    QZ_DEBUG("PRoduced %lu bytes\n", sess->total_out);
+
+    rc = sess->thd_sess_stat;
+    if (qz_sess->seq != qz_sess->seq_in) {
+        /*  this means the HW get data already error, qz_in_len and
+            qz_out_len can't corresponding
+        */
+        QZ_ERROR("The thread : %lu, Decompress API failed! error status %d!\n",
+                 pthread_self(), rc);
+        goto err_exit;
+    }
+    /* if failure need to fallback to sw */
+    if (QZ_OK != sess->thd_sess_stat &&
+        QZ_BUF_ERROR != sess->thd_sess_stat &&
+        QZ_DATA_ERROR != sess->thd_sess_stat &&
+        qz_sess->sess_params.sw_backup == 1) {
+        const unsigned char *sw_src = src + qz_sess->qz_in_len;
+        unsigned int sw_src_len = *src_len - qz_sess->qz_in_len;
+        unsigned char *sw_dest = qz_sess->next_dest;
+        unsigned int sw_dest_len = *dest_len - (qz_sess->next_dest - dest);
+        QZ_DEBUG("SW deComp Sending %u bytes, the rest decomp all fallback to SW",
+                 sw_src_len);
+        rc = qzSWDecompressMulti(sess, sw_src, &sw_src_len, sw_dest, &sw_dest_len);
+        if (QZ_OK == rc) {
+            qz_sess->qz_in_len += sw_src_len;
+            qz_sess->qz_out_len += sw_dest_len;
+            qz_sess->next_dest += sw_dest_len;
+            sess->thd_sess_stat = rc;
+        } else {
+            QZ_ERROR("SW deComp fallback failure! decompress error!\n");
+        }
+    }
+
+    *src_len = GET_LOWER_32BITS(qz_sess->qz_in_len);
+    *dest_len = qz_sess->next_dest - dest;
+    assert(*dest_len == qz_sess->qz_out_len);
+    sess->total_in += qz_sess->qz_in_len;
+    sess->total_out += qz_sess->qz_out_len;
+
+    QZ_INFO("*** total_in=%lu total_out=%lu src_len=%u dest_len=%u rc=%d ***\n",
+            sess->total_in, sess->total_out, *src_len, *dest_len, rc);
+
+    return sess->thd_sess_stat;
+
+sw_decompression:
+    QZ_INFO("The thread : %lu, DeCompress API SW fallback due to HW limitations!\n",
+            pthread_self());
+    return qzSWDecompressMulti(sess, src, src_len, dest, dest_len);
+err_exit:
+    if (NULL != src_len) {
+        *src_len = 0;
+    }
+    if (NULL != dest_len) {
+        *dest_len = 0;
+    }
+    return rc;
+}
+
+/* Compressed input is parsed by header and footer, so the segments are
+ * gathered once into a pinned buffer which the HW then reads in place.
+ */
+int qzDecompressV(QzSession_T *sess, const QzIovec_T *src_iov,
+                  unsigned int src_cnt, unsigned int *src_len,
+                  unsigned char *dest, unsigned int *dest_len,
+                  unsigned long *crc)
+{
+    int rc;
+    unsigned int total = 0;
+    unsigned char *flat;
+
+    if (unlikely(NULL == sess     || \
+                 NULL == src_len  || \
+                 NULL == dest     || \
+                 NULL == dest_len)) {
+        rc = QZ_PARAMS;
+        goto err_exit;
+    }
+
+    rc = qzCheckIov(src_iov, src_cnt, &total);
+    if (unlikely(QZ_OK != rc)) {
+        goto err_exit;
+    }
+
+    *src_len = total;
+    if (1 == src_cnt) {
+        return qzDecompressCrcExt(sess, src_iov[0].buf, src_len, dest,
+                                  dest_len, crc, NULL);
+    }
+
+    flat = qzIovFlatten(src_iov, src_cnt, total);
+    if (unlikely(NULL == flat)) {
+        rc = QZ_NOSW_LOW_MEM;
+        goto err_exit;
+    }
+    rc = qzDecompressCrcExt(sess, flat, src_len, dest, dest_len, crc, NULL);
+    qzFree(flat);
+    return rc;
+
+err_exit:
+    if (NULL != src_len) {
+        *src_len = 0;
+    }
+    if (NULL != dest_len) {
+        *dest_len = 0;
+    }
+    return rc;
+}
+
+/* Batched compression and decompression. Messages that fit in a single
+ * request are submitted back to back on one instance and their responses
+ * collected together, the rest go through qzCompress/qzDecompress.
+ */
+static int qzBatchCanUseHW(QzSession_T *sess, QzDirection_T dir)
+{
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+
+    if (g_process.qz_init_status == QZ_NO_HW                 ||
+        (sess->hw_session_stat != QZ_OK &&
+         sess->hw_session_stat != QZ_NO_INST_ATTACH)         ||
+        qz_sess->sess_params.is_sensitive_mode == true) {
+        return 0;
+    }
+
+    if (QZ_DIR_COMPRESS == dir) {
+        return (qz_sess->sess_params.data_fmt != LZ4S_BK
+#if !((CPA_DC_API_VERSION_NUM_MAJOR >= 3) && (CPA_DC_API_VERSION_NUM_MINOR >= 0))
+                && qz_sess->sess_params.comp_lvl != 9
+#endif
+               );
+    }
+    return (qz_sess->inflate_stat != InflateOK);
+}
+
+/* Coalesced requests are the ones below input_sz_thrshold */
+static int qzBatchCanCompress(QzSess_T *qz_sess, const QzBatchReq_T *req,
+                              int coalesced)
+{
+    return (NULL != req->src && NULL != req->dest && 0 != req->src_len &&
+            (coalesced ||
+             req->src_len >= qz_sess->sess_params.input_sz_thrshold) &&
+            req->src_len <= qz_sess->sess_params.hw_buff_sz);
+}
+
+/* The message has to be a single block, as its header says how much
+ * room the block needs before anything is submitted.
+ */
+static int qzBatchCanDecompress(QzSess_T *qz_sess, QzBatchReq_T *req,
+                                QzGzH_T *hdr)
+{
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+
+    if (NULL == req->src || NULL == req->dest || 0 == req->src_len ||
+        (data_fmt != DEFLATE_GZIP && data_fmt != DEFLATE_GZIP_EXT &&
+         data_fmt != DEFLATE_4B && data_fmt != LZ4_FH)            ||
+        !isQATProcessable(req->src, &req->src_len, qz_sess)) {
+        return 0;
+    }
+
+    qz_sess->force_sw = 0;
+    if (QZ_OK != checkHeader(qz_sess, (unsigned char *)req->src, req->src_len,
+                             req->dest_len, hdr)) {
+        return 0;
+    }
+    if (data_fmt == DEFLATE_GZIP_EXT &&
+        hdr->extra.qz_e.src_sz < qz_sess->sess_params.input_sz_thrshold) {
+        return 0;
+    }
+
+    return (outputHeaderSz(data_fmt) + hdr->extra.qz_e.dest_sz +
+            outputFooterSz(data_fmt) == req->src_len);
+}
+
+/* Point the per call state of the session at request req */
+static void qzBatchSwitch(QzSession_T *sess, QzBatchReq_T *req,
+                          unsigned long *crc)
+{
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+
+    sess->thd_sess_stat = QZ_OK;
+    qz_sess->stop_submitting = 0;
+    qz_sess->force_sw = 0;
+    qz_sess->qz_in_len = 0;
+    qz_sess->qz_out_len = 0;
+    qz_sess->src = (unsigned char *)req->src;
+    qz_sess->src_sz = &req->src_len;
+    qz_sess->dest_sz = &req->dest_len;
+    qz_sess->next_dest = req->dest;
+    qz_sess->crc32 = crc;
+    qz_sess->last = 1;
+}
+
+/* Record the outcome of the request the per call state points at */
+static void qzBatchDone(QzSession_T *sess, QzBatchReq_T *req)
+{
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+
+    req->src_len = GET_LOWER_32BITS(qz_sess->qz_in_len);
+    req->dest_len = qz_sess->next_dest - req->dest;
+    req->status = sess->thd_sess_stat;
+}
+
+static CpaStatus qzBatchSubmit(QzSession_T *sess, int i, int j,
+                               QzBatchReq_T *req, QzGzH_T *hdr,
+                               QzDirection_T dir)
+{
+    CpaStatus rc;
+    unsigned int tmp_src_avail_len, tmp_dest_avail_len;
+    unsigned long tag = ((unsigned long)i << 16) | (unsigned long)j;
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    QzInstance_T *inst = &g_process.qz_inst[i];
+    CpaBoolean need_cont_mem =
+        inst->instance_info.requiresPhysicallyContiguousMemory;
+
+    if (QZ_DIR_COMPRESS == dir) {
+        compBufferSetup(i, j, qz_sess, (unsigned char *)req->src, req->src_len,
+                        qz_sess->sess_params.hw_buff_sz, req->src_len);
+        /* Each request starts a message of its own, so its output can go
+         * straight to the message's dest, as for the first request of a call.
+         */
+        if (!inst->stream[j].dest_need_reset &&
+            (!need_cont_mem || qzMemFindAddr(req->dest))) {
+            inst->dest_buffers[j]->pBuffers->pData =
+                req->dest + outputHeaderSz(qz_sess->sess_params.data_fmt);
+            inst->stream[j].dest_need_reset = 1;
+        }
+    } else {
+        decompBufferSetup(i, j, qz_sess, (unsigned char *)req->src, req->dest,
+                          req->src_len, hdr, &tmp_src_avail_len,
+                          &tmp_dest_avail_len);
+    }
+    inst->stream[j].src2++;/*this buffer is in use*/
+
+    do {
+        if (QZ_DIR_COMPRESS == dir) {
+            rc = cpaDcCompressData2(g_process.dc_inst_handle[i], inst->cpaSess,
+                                    inst->src_buffers[j], inst->dest_buffers[j],
+                                    &inst->stream[j].opData, &inst->stream[j].res,
+                                    (void *)(tag));
+        } else {
+            rc = cpaDcDecompressData(g_process.dc_inst_handle[i], inst->cpaSess,
+                                     inst->src_buffers[j], inst->dest_buffers[j],
+                                     &inst->stream[j].res, CPA_DC_FLUSH_FINAL,
+                                     (void *)(tag));
+        }
+        if (unlikely(CPA_STATUS_RETRY == rc)) {
+            inst->num_retries++;
+            usleep(g_polling_interval[qz_sess->polling_idx]);
+        }
+
+        if (unlikely(inst->num_retries > MAX_NUM_RETRY)) {
+            QZ_WARN("instance %d retry count:%d exceed the max count: %d\n",
+                    i, inst->num_retries, MAX_NUM_RETRY);
+            break;
+        }
+    } while (rc == CPA_STATUS_RETRY);
+
+    inst->num_retries = 0;
+
+    if (unlikely(CPA_STATUS_SUCCESS != rc)) {
+        QZ_WARN("Inst %d, buffer %d, Error in batch offload: %d\n", i, j, rc);
+        if (QZ_DIR_COMPRESS == dir) {
+            compInBufferCleanUp(i, j);
+        } else {
+            decompInBufferCleanUp(i, j);
+        }
+    }
+    return rc;
+}
+
+/* Run the HW eligible requests of the batch through instance i. Requests
+ * the batch couldn't take on are left with status QZ_NONE.
+ */
+static void qzBatchRun(QzSession_T *sess, int i, QzBatchReq_T *reqs,
+                       unsigned int count, QzDirection_T dir, int coalesced)
+{
+    int j, rc, good;
+    int stop = 0;
+    unsigned int m = 0;
+    long comp_avail_len;
+    unsigned int decomp_avail_len;
+    CpaStatus sts;
+    QzBatchReq_T *req;
+    QzGzH_T hdr = {{0}, 0};
+    unsigned int req_of[QZ_CQ_SIZE];
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    QzPollingMode_T polling_mode = qz_sess->sess_params.polling_mode;
+
+    resetQzsess(sess, reqs[0].src, &reqs[0].src_len, reqs[0].dest,
+                &reqs[0].dest_len, 1);
+    qz_sess->single_thread = 1;
+
+    while (1) {
+        /* submit requests as long as there are free stream buffers, but
+         * only wait for one if none of ours are in flight.
+         */
+        for (; m < count && !stop; m++) {
+            req = &reqs[m];
+            if (QZ_DIR_COMPRESS == dir ?
+                !qzBatchCanCompress(qz_sess, req, coalesced) :
+                !qzBatchCanDecompress(qz_sess, req, &hdr)) {
+                continue;
+            }
+            if (g_process.qz_inst[i].heartbeat != CPA_STATUS_SUCCESS) {
+                stop = 1;
+                break;
+            }
+
+            j = getUnusedBuffer(i, qz_sess);
+            if (-1 == j) {
+                if (qz_sess->processed != qz_sess->submitted) {
+                    break;
+                }
+                j = waitUnusedBuffer(i, qz_sess);
+            }
+
+            qzBatchSwitch(sess, req,
+                          QZ_DIR_COMPRESS == dir ? &req->crc : NULL);
+            if (CPA_STATUS_SUCCESS != qzBatchSubmit(sess, i, j, req, &hdr, dir)) {
+                stop = 1;
+                break;
+            }
+            req_of[QZ_CQ_IDX(qz_sess->seq)] = m;
+            qz_sess->seq++;
+            qz_sess->submitted++;
+        }
+
+        if (qz_sess->processed == qz_sess->submitted) {
+            break;
+        }
+
+        /* Poll for responses */
+        good = 0;
+        sts = qzSessPoll(i, qz_sess);
+        if (unlikely(CPA_STATUS_FAIL == sts)) {
+            QZ_ERROR("Error in DcPoll: %d\n", sts);
+            goto err_exit;
+        }
+
+        /* retrieve the responses in order from the completion queue */
+        while (-1 != (j = qzGetCompletion(qz_sess))) {
+            good = 1;
+            req = &reqs[req_of[QZ_CQ_IDX(qz_sess->seq_in)]];
+            if (QZ_DIR_COMPRESS == dir) {
+                qzBatchSwitch(sess, req, &req->crc);
+                comp_avail_len = req->dest_len;
+                rc = compOutRespond(sess, i, j, &comp_avail_len);
+            } else {
+                qzBatchSwitch(sess, req, NULL);
+                decomp_avail_len = req->dest_len;
+                rc = decompOutRespond(sess, i, j, &decomp_avail_len);
+            }
+            if (unlikely(QZ_FAIL == rc)) {
+                goto err_exit;
+            }
+            qzBatchDone(sess, req);
+        }
+
+        if (QZ_EVENT_POLLING == polling_mode && 0 == good &&
+            0 == qzWaitInstEvent(i, qz_sess)) {
+            continue;
+        } else if (QZ_ADAPTIVE_POLLING == polling_mode && 0 == good &&
+                   0 == qzPollModelSleep(i, qz_sess)) {
+            continue;
+        } else if (QZ_CENTRAL_POLLING == polling_mode && 0 == good &&
+                   0 == qzCentralWait(i, qz_sess)) {
+            continue;
+        } else if (QZ_BUSY_POLLING != polling_mode) {
+            if (0 == good) {
+                qz_sess->polling_idx = (qz_sess->polling_idx >= POLLING_LIST_NUM - 1) ?
+                                       (POLLING_LIST_NUM - 1) :
+                                       (qz_sess->polling_idx + 1);
+                usleep(g_polling_interval[qz_sess->polling_idx]);
+            } else {
+                qz_sess->polling_idx = (qz_sess->polling_idx == 0) ? (0) :
+                                       (qz_sess->polling_idx - 1);
+            }
+        }
+    }
+
+    return;
+
+err_exit:
+    /* as doCompressOut/doDecompressOut do, give up on what is in flight */
+    for (j = 0; j < g_process.qz_inst[i].dest_count; j++) {
+        if (!qzIsStreamOwner(i, j, qz_sess)) {
+            continue;
+        }
+        RestoreSrcCpastreamBuffer(i, j);
+        RestoreDestCpastreamBuffer(i, j);
+        ResetCpastreamSink(i, j);
+    }
+    for (; qz_sess->seq_in < qz_sess->seq; qz_sess->seq_in++) {
+        req = &reqs[req_of[QZ_CQ_IDX(qz_sess->seq_in)]];
+        req->src_len = 0;
+        req->dest_len = 0;
+        req->status = QZ_FAIL;
+    }
+    qz_sess->processed = qz_sess->submitted;
+}
+
+/* Hand the requests the batch didn't take on to the single call APIs, and
+ * return the first failure of the batch.
+ */
+static int qzBatchFinish(QzSession_T *sess, QzBatchReq_T *reqs,
+                         unsigned int count, QzDirection_T dir)
+{
+    int rc = QZ_OK;
+    unsigned int m;
+    QzBatchReq_T *req;
+
+    for (m = 0; m < count; m++) {
+        req = &reqs[m];
+        if (QZ_NONE == req->status) {
+            if (QZ_DIR_COMPRESS == dir) {
+                req->status = qzCompressCrcExt(sess, req->src, &req->src_len,
+                                               req->dest, &req->dest_len, 1,
+                                               &req->crc, NULL);
+            } else {
+                req->status = qzDecompressCrcExt(sess, req->src, &req->src_len,
+                                                 req->dest, &req->dest_len,
+                                                 NULL, NULL);
+            }
+        }
+        if (QZ_OK == rc && QZ_OK != req->status) {
+            rc = req->status;
+        }
+    }
+    return rc;
+}
+
+static int qzBatch(QzSession_T *sess, QzBatchReq_T *reqs,
+                   unsigned int count, QzDirection_T dir)
+{
+    int i, rc;
+    unsigned int m;
+
+    if (unlikely(NULL == sess || (NULL == reqs && 0 != count))) {
+        return QZ_PARAMS;
     }
 
-    unsigned long start_time_stamp, end_time_stamp;
-    start_time_stamp = rdtsc();
+    for (m = 0; m < count; m++) {
+        reqs[m].status = QZ_NONE;
+    }
+    if (0 == count) {
+        return QZ_OK;
+    }
 
-    i = qzGrabInstance(qz_sess->inst_hint, &(qz_sess->sess_params));
-    if (unlikely(i == -1)) {
-        if (qz_sess->sess_params.sw_backup == 1) {
-            QZ_INFO("Don't grab HW instance, fallback to sw\n");
-            goto sw_decompression;
-        } else {
-            sess->hw_session_stat = QZ_NO_INST_ATTACH;
-            rc = QZ_NOSW_NO_INST_ATTACH;
-            goto err_exit;
+    rc = (QZ_DIR_COMPRESS == dir) ? qzCompressSessionSetup(sess) :
+         qzDecompressSessionSetup(sess);
+    if (unlikely(QZ_OK != rc)) {
+        for (m = 0; m < count; m++) {
+            reqs[m].src_len = 0;
+            reqs[m].dest_len = 0;
+            reqs[m].status = rc;
         }
-        /*Make this a s/w compression*/
+        return rc;
     }
-    QZ_INFO("qzDecompress: inst is %d\n", i);
-    qz_sess->inst_hint = i;
 
-    if (likely(0 ==  g_process.qz_inst[i].mem_setup ||
-               0 ==  g_process.qz_inst[i].cpa_sess_setup)) {
-        QZ_INFO("Getting HW resources for inst %d\n", i);
-        rc = qzSetupHW(sess, i);
-        if (unlikely(QZ_OK != rc)) {
+    if (qzBatchCanUseHW(sess, dir)) {
+        i = qzGrabSessInstance(sess, &rc);
+        if (-1 != i) {
+            qzBatchRun(sess, i, reqs, count, dir, 0);
             qzReleaseInstance(i);
-            if (qz_sess->sess_params.sw_backup == 1) {
-                goto sw_decompression;
-            } else {
-                goto err_exit;
-            }
         }
-    } else if (memcmp(&g_process.qz_inst[i].session_setup_data,
-                      &qz_sess->session_setup_data, sizeof(CpaDcSessionSetupData))) {
-        /* session_setup_data of qz_sess is not same with instance i,
-           need to update cpa session of instance i. */
-        rc = qzUpdateCpaSession(sess, i);
-        if (QZ_OK != rc) {
-            qzReleaseInstance(i);
-            if (qz_sess->sess_params.sw_backup == 1) {
-                goto sw_decompression;
-            } else {
-                goto err_exit;
+        for (m = 0; m < count; m++) {
+            if (QZ_NONE != reqs[m].status) {
+                sess->total_in += reqs[m].src_len;
+                sess->total_out += reqs[m].dest_len;
             }
         }
     }
 
-#ifdef QATZIP_DEBUG
-    insertThread((unsigned int)pthread_self(), DECOMPRESSION, HW);
-#endif
-    resetQzsess(sess, src, src_len, dest, dest_len, 0);
+    return qzBatchFinish(sess, reqs, count, dir);
+}
 
-    reqcnt = *src_len / (qz_sess->sess_params.hw_buff_sz / 2);
-    if (*src_len % (qz_sess->sess_params.hw_buff_sz / 2)) {
-        reqcnt++;
-    }
+int qzCompressBatch(QzSession_T *sess, QzBatchReq_T *reqs, unsigned int count)
+{
+    return qzBatch(sess, reqs, count, QZ_DIR_COMPRESS);
+}
 
-    if (reqcnt > qz_sess->sess_params.req_cnt_thrshold) {
-        qz_sess->single_thread = 0;
-        pthread_create(&(qz_sess->c_th_i), NULL, doDecompressIn, (void *)sess);
-        doDecompressOut((void *)sess);
-        pthread_join(qz_sess->c_th_i, NULL);
-    } else {
-        qz_sess->single_thread = 1;
-        doQzDecompressSingleThread((void *)sess);
-    }
+int qzDecompressBatch(QzSession_T *sess, QzBatchReq_T *reqs,
+                      unsigned int count)
+{
+    return qzBatch(sess, reqs, count, QZ_DIR_DECOMPRESS);
+}
 
-    qzReleaseInstance(i);
+/* Groups of small compression requests waiting to be coalesced, a leader
+ * collects the requests of its group for up to coalesce_usec and submits
+ * them as a batch, the other requests wait for it to hand back results.
+ */
+static QzCoalesceGroup_T g_coalesce[QZ_COALESCE_GROUPS];
+static pthread_mutex_t g_coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_coalesce_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_coalesce_done = PTHREAD_COND_INITIALIZER;
 
-    end_time_stamp = rdtsc();
-    if (qz_sess->sess_params.is_sensitive_mode == true) {
-        metrixUpdate(&qz_sess->RRT, (end_time_stamp - start_time_stamp));
-    }
+static void qzCoalesceKey(QzSess_T *qz_sess, QzCoalesceKey_T *key)
+{
+    memset(key, 0, sizeof(QzCoalesceKey_T));
+    memcpy(&key->setup, &qz_sess->session_setup_data,
+           sizeof(CpaDcSessionSetupData));
+    key->data_fmt = qz_sess->sess_params.data_fmt;
+    key->sw_backup = qz_sess->sess_params.sw_backup;
+}
 
-    QZ_DEBUG("PRoduced %lu bytes\n", sess->total_out);
+/* The group collecting requests with key, or an idle one to start it.
+ * NULL if the group is full or all groups are busy, g_coalesce_lock held.
+ */
+static QzCoalesceGroup_T *qzCoalesceGroup(const QzCoalesceKey_T *key)
+{
+    int k;
+    QzCoalesceGroup_T *idle = NULL;
 
-    rc = sess->thd_sess_stat;
-    if (qz_sess->seq != qz_sess->seq_in) {
-        /*  this means the HW get data already error, qz_in_len and
-            qz_out_len can't corresponding
-        */
-        QZ_ERROR("The thread : %lu, Decompress API failed! error status %d!\n",
-                 pthread_self(), rc);
-        goto err_exit;
-    }
-    /* if failure need to fallback to sw */
-    if (QZ_OK != sess->thd_sess_stat &&
-        QZ_BUF_ERROR != sess->thd_sess_stat &&
-        QZ_DATA_ERROR != sess->thd_sess_stat &&
-        qz_sess->sess_params.sw_backup == 1) {
-        const unsigned char *sw_src = src + qz_sess->qz_in_len;
-        unsigned int sw_src_len = *src_len - qz_sess->qz_in_len;
-        unsigned char *sw_dest = qz_sess->next_dest;
-        unsigned int sw_dest_len = *dest_len - (qz_sess->next_dest - dest);
-        QZ_DEBUG("SW deComp Sending %u bytes, the rest decomp all fallback to SW",
-                 sw_src_len);
-        rc = qzSWDecompressMulti(sess, sw_src, &sw_src_len, sw_dest, &sw_dest_len);
-        if (QZ_OK == rc) {
-            qz_sess->qz_in_len += sw_src_len;
-            qz_sess->qz_out_len += sw_dest_len;
-            qz_sess->next_dest += sw_dest_len;
-            sess->thd_sess_stat = rc;
-        } else {
-            QZ_ERROR("SW deComp fallback failure! decompress error!\n");
+    for (k = 0; k < QZ_COALESCE_GROUPS; k++) {
+        if (0 == g_coalesce[k].count) {
+            idle = (NULL == idle) ? &g_coalesce[k] : idle;
+        } else if (!memcmp(&g_coalesce[k].key, key, sizeof(QzCoalesceKey_T))) {
+            return (g_coalesce[k].count < QZ_COALESCE_MAX) ? &g_coalesce[k] : NULL;
         }
     }
+    if (NULL != idle) {
+        memcpy(&idle->key, key, sizeof(QzCoalesceKey_T));
+    }
+    return idle;
+}
 
-    *src_len = GET_LOWER_32BITS(qz_sess->qz_in_len);
-    *dest_len = qz_sess->next_dest - dest;
-    assert(*dest_len == qz_sess->qz_out_len);
-    sess->total_in += qz_sess->qz_in_len;
-    sess->total_out += qz_sess->qz_out_len;
+/* Compress a request below input_sz_thrshold together with those of other
+ * threads. Returns QZ_NONE if it is left to software.
+ */
+static int qzCoalesceCompress(QzSession_T *sess, const unsigned char *src,
+                              unsigned int *src_len, unsigned char *dest,
+                              unsigned int *dest_len, unsigned long *crc)
+{
+    int i, rc;
+    unsigned int k, n;
+    struct timespec deadline;
+    QzCoalesceKey_T key;
+    QzCoalesceGroup_T *group;
+    QzCoalesceReq_T self;
+    QzCoalesceReq_T *batch[QZ_COALESCE_MAX];
+    QzBatchReq_T reqs[QZ_COALESCE_MAX];
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
 
-    QZ_INFO("*** total_in=%lu total_out=%lu src_len=%u dest_len=%u rc=%d ***\n",
-            sess->total_in, sess->total_out, *src_len, *dest_len, rc);
+    memset(&self, 0, sizeof(QzCoalesceReq_T));
+    self.req.src = src;
+    self.req.src_len = *src_len;
+    self.req.dest = dest;
+    self.req.dest_len = *dest_len;
+    self.req.crc = (NULL != crc) ? *crc : 0;
+    self.req.status = QZ_NONE;
+    qzCoalesceKey(qz_sess, &key);
+
+    pthread_mutex_lock(&g_coalesce_lock);
+    group = qzCoalesceGroup(&key);
+    if (NULL == group) {
+        pthread_mutex_unlock(&g_coalesce_lock);
+        return QZ_NONE;
+    }
+    group->reqs[group->count++] = &self;
+
+    if (group->leader) {
+        if (QZ_COALESCE_MAX == group->count) {
+            pthread_cond_broadcast(&g_coalesce_full);
+        }
+        while (!self.done) {
+            pthread_cond_wait(&g_coalesce_done, &g_coalesce_lock);
+        }
+        pthread_mutex_unlock(&g_coalesce_lock);
+    } else {
+        group->leader = 1;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)qz_sess->sess_params.coalesce_usec * 1000;
+        if (deadline.tv_nsec >= NSEC_TO_SEC) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= NSEC_TO_SEC;
+        }
+        while (group->count < QZ_COALESCE_MAX) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&g_coalesce_full,
+                                                    &g_coalesce_lock, &deadline)) {
+                break;
+            }
+        }
+        n = group->count;
+        memcpy(batch, group->reqs, n * sizeof(QzCoalesceReq_T *));
+        group->count = 0;
+        group->leader = 0;
+        pthread_mutex_unlock(&g_coalesce_lock);
+
+        for (k = 0; k < n; k++) {
+            reqs[k] = batch[k]->req;
+        }
+        i = qzGrabSessInstance(sess, &rc);
+        if (-1 != i) {
+            qzBatchRun(sess, i, reqs, n, QZ_DIR_COMPRESS, 1);
+            qzReleaseInstance(i);
+        }
 
-    return sess->thd_sess_stat;
+        pthread_mutex_lock(&g_coalesce_lock);
+        for (k = 0; k < n; k++) {
+            batch[k]->req = reqs[k];
+            batch[k]->done = 1;
+        }
+        pthread_cond_broadcast(&g_coalesce_done);
+        pthread_mutex_unlock(&g_coalesce_lock);
+    }
 
-sw_decompression:
-    QZ_INFO("The thread : %lu, DeCompress API SW fallback due to HW limitations!\n",
-            pthread_self());
-    return qzSWDecompressMulti(sess, src, src_len, dest, dest_len);
-err_exit:
-    if (NULL != src_len) {
-        *src_len = 0;
+    if (QZ_NONE == self.req.status) {
+        return QZ_NONE;
     }
-    if (NULL != dest_len) {
-        *dest_len = 0;
+    atomic_fetch_add(&g_process.small_coalesced, 1);
+    *src_len = self.req.src_len;
+    *dest_len = self.req.dest_len;
+    if (NULL != crc) {
+        *crc = self.req.crc;
     }
-    return rc;
+    sess->total_in += self.req.src_len;
+    sess->total_out += self.req.dest_len;
+    return self.req.status;
 }
 
 int qzTeardownSession(QzSession_T *sess)
@@ -2690,6 +4568,12 @@ int qzTeardownSession(QzSession_T *sess)
             qz_sess->deflate_strm = NULL;
         }
 
+        if (unlikely(NULL != qz_sess->member_xxh32)) {
+            XXH32_freeState(qz_sess->member_xxh32);
+            qz_sess->member_xxh32 = NULL;
+        }
+        qz_sess->member_open = 0;
+
         if (unlikely(NULL != qz_sess->RRT.latency_array)) {
             free(qz_sess->RRT.latency_array);
             qz_sess->RRT.latency_array = NULL;
@@ -2710,6 +4594,8 @@ int qzTeardownSession(QzSession_T *sess)
             qz_sess->qzdeflateExtData = NULL;
         }
 
+        qzSubmitWorkerDestroy(qz_sess);
+
         // Delete the async relative job and queue
         if (NULL != qz_sess->async_ctrl) {
             AsyncCtrlDestructor(sess);
@@ -2736,7 +4622,7 @@ void removeSession(int i)
                                     g_process.qz_inst[i].cpaSess);
         if (CPA_STATUS_SUCCESS == status) {
             /* Deallocate session memory */
-            qzFree(g_process.qz_inst[i].cpaSess);
+            qzInstFree(g_process.qz_inst[i].cpaSess);
             g_process.qz_inst[i].cpaSess = NULL;
             g_process.qz_inst[i].cpa_sess_setup = 0;
         } else {
@@ -2756,10 +4642,65 @@ int qzClose(QzSession_T *sess)
 
 int qzGetStatus(QzSession_T *sess, QzStatus_T *status)
 {
+    QzSess_T *qz_sess;
+
     if (sess == NULL || status == NULL) {
         return QZ_PARAMS;
     }
 
+    memset(status, 0, sizeof(QzStatus_T));
+    qz_sess = (QzSess_T *)sess->internal;
+    status->qat_service_init = (QZ_OK == g_process.qz_init_status) ? 1 : 0;
+    status->qat_instance_attach = (NULL != qz_sess &&
+                                   qz_sess->inst_hint >= 0) ? 1 : 0;
+    status->hw_session_status = sess->hw_session_stat;
+    qzMemGetStatus(&status->memory_alloced, &status->using_huge_pages);
+
+    return QZ_OK;
+}
+
+int qzGetProcessStats(QzProcessStats_T *stats)
+{
+    if (NULL == stats) {
+        return QZ_PARAMS;
+    }
+
+    stats->inst_grab_local = atomic_load(&g_process.inst_grab_local);
+    stats->inst_grab_remote = atomic_load(&g_process.inst_grab_remote);
+    stats->inst_grab_shared = atomic_load(&g_process.inst_grab_shared);
+    stats->small_coalesced = atomic_load(&g_process.small_coalesced);
+    stats->small_sw = atomic_load(&g_process.small_sw);
+    stats->bytes_copied = atomic_load(&g_process.bytes_copied);
+    stats->bytes_zero_copy = atomic_load(&g_process.bytes_zero_copy);
+    stats->ring_grows = atomic_load(&g_process.ring_grows);
+    stats->ring_trims = atomic_load(&g_process.ring_trims);
+
+    return QZ_OK;
+}
+
+int qzGetPollModel(QzSession_T *sess, QzPollModel_T *model)
+{
+    QzSess_T *qz_sess;
+    QzInstance_T *inst;
+
+    if (NULL == sess || NULL == model) {
+        return QZ_PARAMS;
+    }
+
+    qz_sess = (QzSess_T *)sess->internal;
+    if (NULL == qz_sess || qz_sess->inst_hint < 0 ||
+        NULL == g_process.qz_inst) {
+        return QZ_FAIL;
+    }
+
+    inst = &g_process.qz_inst[qz_sess->inst_hint];
+    model->comp_ns_per_kb = inst->poll_est[QZ_DIR_COMPRESS].ns_per_kb;
+    model->decomp_ns_per_kb = inst->poll_est[QZ_DIR_DECOMPRESS].ns_per_kb;
+    model->comp_samples = inst->poll_est[QZ_DIR_COMPRESS].samples;
+    model->decomp_samples = inst->poll_est[QZ_DIR_DECOMPRESS].samples;
+    model->predicted_sleeps = inst->predicted_sleeps;
+    model->early_polls = inst->early_polls;
+
     return QZ_OK;
 }
 
@@ -3132,9 +5073,6 @@ static int AsyncCompressIn(QzAsyncReq_T *req)
     QzSession_T *sess = req->sess;
     QzSess_T *qz_sess = (QzSess_T *)sess->internal;
 
-    struct timespec sleep_time;
-    sleep_time.tv_sec = 0;
-    sleep_time.tv_nsec = GET_BUFFER_SLEEP_NSEC;
     QZ_DEBUG("Always enable CnV\n");
 
     i = qz_sess->inst_hint;
@@ -3160,15 +5098,9 @@ static int AsyncCompressIn(QzAsyncReq_T *req)
     // don't support the sw fallback for async API
     while (!done) {
         /* HW offload */
-        do {
-            j = getUnusedBuffer(i, j);
-            if (unlikely(-1 == j)) {
-                nanosleep(&sleep_time, NULL);
-            }
-        } while (-1 == j);
+        j = waitUnusedBuffer(i, qz_sess);
         QZ_DEBUG("getUnusedBuffer returned %d\n", j);
 
-        g_process.qz_inst[i].stream[j].src1++; /*update stream src1*/
         compBufferSetup(i, j, qz_sess, src_ptr, remaining, hw_buff_sz, src_send_sz);
         g_process.qz_inst[i].stream[j].req = req;
         g_process.qz_inst[i].stream[j].src2++;/*this buffer is in use*/
@@ -3269,7 +5201,7 @@ static void *AsyncCompressOut(void *in)
         *   which is not just for RestoreSrcCpastreamBuffer, but also
         *   make src1, src2, sink1, sink2 equal, and all switch.
         */
-        sts = icp_sal_DcPollInstance(g_process.dc_inst_handle[i], 0);
+        sts = qzSessPoll(i, qz_sess);
         if (unlikely(CPA_STATUS_FAIL == sts)) {
             /* this will cause the in-flight request is not finished */
             QZ_ERROR("Error in DcPoll: %d\n", sts);
@@ -3280,129 +5212,123 @@ static void *AsyncCompressOut(void *in)
             goto err_exit;
         }
 
-        /*fake a retrieve*/
-        for (j = 0; j <  g_process.qz_inst[i].dest_count; j++) {
-            if ((g_process.qz_inst[i].stream[j].seq ==
-                 qz_sess->seq_in)                    &&
-                (g_process.qz_inst[i].stream[j].src1 ==
-                 g_process.qz_inst[i].stream[j].src2) &&
-                (g_process.qz_inst[i].stream[j].sink1 ==
-                 g_process.qz_inst[i].stream[j].src1)  &&
-                (g_process.qz_inst[i].stream[j].sink1 ==
-                 g_process.qz_inst[i].stream[j].sink2 + 1)) {
-
-                good = 1;
-                QZ_DEBUG("doCompressOut: Processing seqnumber %2.2d "
-                         "%2.2d %4.4ld, PID: %d, TID: %lu\n",
-                         i, j, g_process.qz_inst[i].stream[j].seq,
-                         getpid(), pthread_self());
-
-                req = g_process.qz_inst[i].stream[j].req;
-
-                /* Exception handling */
-                if ((sess->thd_sess_stat == QZ_BUF_ERROR || sess->thd_sess_stat == QZ_FAIL)) {
-                    /* The preview error request have complete, send failed status to callback
-                     * function, and change the session status to ok, start process new request
-                     */
-                    if (req_prv != NULL && req != req_prv) {
-                        CallAsyncbackfn(&req_prv, QZ_FAIL, sess);
-                    } else {
-                        compOutSkipErrorRespond(i, j, qz_sess);
-                        req_prv = req;
-                        /* if process equel to submit, it means a request definatly complete */
-                        if (qz_sess->processed == qz_sess->submitted) {
-                            CallAsyncbackfn(&req_prv, QZ_FAIL, sess);
-                        }
-                        /* if issue is from submit, only check if all submit processed */
-                        if (qz_sess->stop_submitting) {
-                            qz_sess->stop_submitting = 0;
-                        }
-                        continue;
-                    }
-                }
+        /* retrieve the responses in order from the completion queue */
+        while (-1 != (j = qzGetCompletion(qz_sess))) {
+            good = 1;
+            QZ_DEBUG("doCompressOut: Processing seqnumber %2.2d "
+                     "%2.2d %4.4ld, PID: %d, TID: %lu\n",
+                     i, j, g_process.qz_inst[i].stream[j].seq,
+                     getpid(), pthread_self());
 
-                resl = &g_process.qz_inst[i].stream[j].res;
-                /*  res.status is passed into QAT by cpaDcCompressData2, and changed in
-                *   dcCompression_ProcessCallback, it's type is CpaDcReqStatus.
-                *   job_status is from the dccallback, it's type is CpaStatus.
-                *   Generally, the res.status should have more detailed info about device error
-                *   we assume fallback feature will always call callback func, as well as
-                *   cpaDcCompressData2 return success. res.status and job_status should
-                *   all return Error status, but with different error number.
-                */
-                if (unlikely(CPA_STATUS_SUCCESS != g_process.qz_inst[i].stream[j].job_status ||
-                             CPA_DC_OK != resl->status)) {
-                    QZ_DEBUG("Error(%d) in callback: %d, %d, ReqStatus: %d\n",
-                             g_process.qz_inst[i].stream[j].job_status, i, j,
-                             g_process.qz_inst[i].stream[j].res.status);
+            req = g_process.qz_inst[i].stream[j].req;
+
+            /* Exception handling */
+            if ((sess->thd_sess_stat == QZ_BUF_ERROR || sess->thd_sess_stat == QZ_FAIL)) {
+                /* The preview error request have complete, send failed status to callback
+                 * function, and change the session status to ok, start process new request
+                 */
+                if (req_prv != NULL && req != req_prv) {
+                    CallAsyncbackfn(&req_prv, QZ_FAIL, sess);
+                } else {
                     compOutSkipErrorRespond(i, j, qz_sess);
-                    /* Even one request failed, we still allow Compressin thread
-                     * to offload new request */
-                    sess->thd_sess_stat = QZ_FAIL;
-                    /* If it's last buffer of request, excute Exception handle directly */
+                    req_prv = req;
+                    /* if process equel to submit, it means a request definatly complete */
                     if (qz_sess->processed == qz_sess->submitted) {
-                        CallAsyncbackfn(&req, QZ_FAIL, sess);
-                        req_prv = NULL;
+                        CallAsyncbackfn(&req_prv, QZ_FAIL, sess);
                     }
-                    continue;
-                }
-
-                /* polled HW respond */
-                QZ_DEBUG("\tHW CompOut: consumed = %d, produced = %d, seq_in = %ld\n",
-                         resl->consumed, resl->produced, g_process.qz_inst[i].stream[j].seq);
-
-                unsigned int dest_receive_sz = outputHeaderSz(data_fmt) + resl->produced +
-                                               outputFooterSz(data_fmt);
-                if (QZ_OK != AsyncCompOutCheckDestLen(i, j, sess, dest_receive_sz)) {
-                    if (qz_sess->processed == qz_sess->submitted) {
-                        CallAsyncbackfn(&req, QZ_FAIL, sess);
-                        req_prv = NULL;
+                    /* if issue is from submit, only check if all submit processed */
+                    if (qz_sess->stop_submitting) {
+                        qz_sess->stop_submitting = 0;
                     }
                     continue;
                 }
+            }
 
-                /* Update qz_sess info and clean dest buffer */
-                outputHeaderGen(req->dest, resl, data_fmt);
-                req->dest += outputHeaderSz(data_fmt);
-                req->req_out_len += outputHeaderSz(data_fmt);
-
-                AsyncCompOutValidDestBufferCleanUp(i, j, resl->produced);
-                req->dest += resl->produced;
-                req->req_in_len += resl->consumed;
-
-                qz_crc32 = req->qzResults->crc != NULL &&
-                           QZ_CRC32_VALID(req->qzResults->crc->valid_flags) ?
-                           (unsigned long *)req->qzResults->crc->in_crc.crc_32 : NULL;
-
-                if (likely(NULL != qz_crc32 && IS_DEFLATE(data_fmt))) {
-                    if (0 == *(qz_crc32)) {
-                        *(qz_crc32) = resl->checksum;
-                    } else {
-                        *(qz_crc32) = crc32_combine(*(qz_crc32),
-                                                    resl->checksum,
-                                                    resl->consumed);
-                    }
+            resl = &g_process.qz_inst[i].stream[j].res;
+            /*  res.status is passed into QAT by cpaDcCompressData2, and changed in
+            *   dcCompression_ProcessCallback, it's type is CpaDcReqStatus.
+            *   job_status is from the dccallback, it's type is CpaStatus.
+            *   Generally, the res.status should have more detailed info about device error
+            *   we assume fallback feature will always call callback func, as well as
+            *   cpaDcCompressData2 return success. res.status and job_status should
+            *   all return Error status, but with different error number.
+            */
+            if (unlikely(CPA_STATUS_SUCCESS != g_process.qz_inst[i].stream[j].job_status ||
+                         CPA_DC_OK != resl->status)) {
+                QZ_DEBUG("Error(%d) in callback: %d, %d, ReqStatus: %d\n",
+                         g_process.qz_inst[i].stream[j].job_status, i, j,
+                         g_process.qz_inst[i].stream[j].res.status);
+                compOutSkipErrorRespond(i, j, qz_sess);
+                /* Even one request failed, we still allow Compressin thread
+                 * to offload new request */
+                sess->thd_sess_stat = QZ_FAIL;
+                /* If it's last buffer of request, excute Exception handle directly */
+                if (qz_sess->processed == qz_sess->submitted) {
+                    CallAsyncbackfn(&req, QZ_FAIL, sess);
+                    req_prv = NULL;
                 }
+                continue;
+            }
 
-                req->req_out_len += resl->produced;
-                outputFooterGen(req->dest, resl, data_fmt);
-                req->dest += outputFooterSz(data_fmt);
-                req->req_out_len += outputFooterSz(data_fmt);
+            /* polled HW respond */
+            QZ_DEBUG("\tHW CompOut: consumed = %d, produced = %d, seq_in = %ld\n",
+                     resl->consumed, resl->produced, g_process.qz_inst[i].stream[j].seq);
 
-                /* process finished! */
-                compOutProcessedRespond(i, j, qz_sess);
-                if (req->req_in_len == req->qzResults->src_len) {
-                    req->qzResults->dest_len = req->req_out_len;
-                    CallAsyncbackfn(&req, QZ_OK, NULL);
+            unsigned int dest_receive_sz = outputHeaderSz(data_fmt) + resl->produced +
+                                           outputFooterSz(data_fmt);
+            if (QZ_OK != AsyncCompOutCheckDestLen(i, j, sess, dest_receive_sz)) {
+                if (qz_sess->processed == qz_sess->submitted) {
+                    CallAsyncbackfn(&req, QZ_FAIL, sess);
                     req_prv = NULL;
-                } else {
-                    req_prv = req;
                 }
-                break;
+                continue;
+            }
+
+            /* Update qz_sess info and clean dest buffer */
+            outputHeaderGen(req->dest, resl, data_fmt);
+            req->dest += outputHeaderSz(data_fmt);
+            req->req_out_len += outputHeaderSz(data_fmt);
+
+            AsyncCompOutValidDestBufferCleanUp(i, j, resl->produced);
+            req->dest += resl->produced;
+            req->req_in_len += resl->consumed;
+
+            qz_crc32 = req->qzResults->crc != NULL &&
+                       QZ_CRC32_VALID(req->qzResults->crc->valid_flags) ?
+                       (unsigned long *)req->qzResults->crc->in_crc.crc_32 : NULL;
+
+            if (likely(NULL != qz_crc32 && IS_DEFLATE(data_fmt))) {
+                *(qz_crc32) = qzChecksumCombine(data_fmt, *(qz_crc32),
+                                                resl->checksum,
+                                                resl->consumed);
+            }
+
+            req->req_out_len += resl->produced;
+            outputFooterGen(req->dest, resl, data_fmt);
+            req->dest += outputFooterSz(data_fmt);
+            req->req_out_len += outputFooterSz(data_fmt);
+
+            /* process finished! */
+            compOutProcessedRespond(i, j, qz_sess);
+            if (req->req_in_len == req->qzResults->src_len) {
+                req->qzResults->dest_len = req->req_out_len;
+                CallAsyncbackfn(&req, QZ_OK, NULL);
+                req_prv = NULL;
+            } else {
+                req_prv = req;
             }
         }
 
-        if (QZ_PERIODICAL_POLLING == polling_mode) {
+        if (QZ_EVENT_POLLING == polling_mode && 0 == good &&
+            0 == qzWaitInstEvent(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_ADAPTIVE_POLLING == polling_mode && 0 == good &&
+                   0 == qzPollModelSleep(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_CENTRAL_POLLING == polling_mode && 0 == good &&
+                   0 == qzCentralWait(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_BUSY_POLLING != polling_mode) {
             if (0 == good) {
                 qz_sess->polling_idx = (qz_sess->polling_idx >= POLLING_LIST_NUM - 1) ?
                                        (POLLING_LIST_NUM - 1) :
@@ -3458,9 +5384,6 @@ static int AsyncDeCompressIn(QzAsyncReq_T *req)
     QzSession_T *sess = req->sess;
     QzSess_T *qz_sess = (QzSess_T *)sess->internal;
 
-    struct timespec sleep_time;
-    sleep_time.tv_sec = 0;
-    sleep_time.tv_nsec = GET_BUFFER_SLEEP_NSEC;
 
     i = qz_sess->inst_hint;
     j = -1;
@@ -3527,16 +5450,10 @@ static int AsyncDeCompressIn(QzAsyncReq_T *req)
             }
         } else {
             /*HW decompression*/
-            do {
-                j = getUnusedBuffer(i, j);
-                if (unlikely(-1 == j)) {
-                    nanosleep(&sleep_time, NULL);
-                }
-            } while (-1 == j);
+            j = waitUnusedBuffer(i, qz_sess);
 
             QZ_DEBUG("getUnusedBuffer returned %d\n", j);
 
-            g_process.qz_inst[i].stream[j].src1++;/*this buffer is in use*/
             decompBufferSetup(i, j, qz_sess, src_ptr, dest_ptr, src_avail_len, &hdr,
                               &tmp_src_avail_len, &tmp_dest_avail_len);
             g_process.qz_inst[i].stream[j].req = req;
@@ -3655,106 +5572,105 @@ static void *AsyncDecompressOut(void *in)
            (qz_sess->processed < qz_sess->submitted)) {
         /* Poll for responses */
         good = 0;
-        sts = icp_sal_DcPollInstance(g_process.dc_inst_handle[i], 0);
+        sts = qzSessPoll(i, qz_sess);
         if (unlikely(CPA_STATUS_FAIL == sts)) {
             /* if this error, we don't know which buffer is swapped */
             QZ_ERROR("Error in DcPoll: %d\n", sts);
             goto err_exit;
         }
 
-        /*fake a retrieve*/
-        for (j = 0; j <  g_process.qz_inst[i].dest_count; j++) {
-            if ((g_process.qz_inst[i].stream[j].seq ==
-                 qz_sess->seq_in) &&
-                (g_process.qz_inst[i].stream[j].src1 ==
-                 g_process.qz_inst[i].stream[j].src2) &&
-                (g_process.qz_inst[i].stream[j].sink1 ==
-                 g_process.qz_inst[i].stream[j].src1) &&
-                (g_process.qz_inst[i].stream[j].sink1 ==
-                 g_process.qz_inst[i].stream[j].sink2 + 1)) {
-                good = 1;
-
-                QZ_DEBUG("doDecompressOut: Processing seqnumber %2.2d %2.2d %4.4ld\n",
-                         i, j, g_process.qz_inst[i].stream[j].seq);
-
-                req = g_process.qz_inst[i].stream[j].req;
-                /* Exception handling */
-                if ((sess->thd_sess_stat == QZ_DATA_ERROR || sess->thd_sess_stat == QZ_FAIL)) {
-                    /* The preview error request have complete, send failed status to callback
-                     * function, and change the session status to ok, start process new request
-                     */
-                    if (req_prv != NULL && req != req_prv) {
+        /* retrieve the responses in order from the completion queue */
+        while (-1 != (j = qzGetCompletion(qz_sess))) {
+            good = 1;
+
+            QZ_DEBUG("doDecompressOut: Processing seqnumber %2.2d %2.2d %4.4ld\n",
+                     i, j, g_process.qz_inst[i].stream[j].seq);
+
+            req = g_process.qz_inst[i].stream[j].req;
+            /* Exception handling */
+            if ((sess->thd_sess_stat == QZ_DATA_ERROR || sess->thd_sess_stat == QZ_FAIL)) {
+                /* The preview error request have complete, send failed status to callback
+                 * function, and change the session status to ok, start process new request
+                 */
+                if (req_prv != NULL && req != req_prv) {
+                    CallAsyncbackfn(&req_prv, QZ_FAIL, sess);
+                } else {
+                    decompOutSkipErrorRespond(i, j, qz_sess);
+                    req_prv = req;
+                    /* if process equel to submit, it means a request definatly complete */
+                    if (qz_sess->processed == qz_sess->submitted) {
                         CallAsyncbackfn(&req_prv, QZ_FAIL, sess);
-                    } else {
-                        decompOutSkipErrorRespond(i, j, qz_sess);
-                        req_prv = req;
-                        /* if process equel to submit, it means a request definatly complete */
-                        if (qz_sess->processed == qz_sess->submitted) {
-                            CallAsyncbackfn(&req_prv, QZ_FAIL, sess);
-                        }
-                        /* if issue is from submit, only check if all submit processed */
-                        if (qz_sess->stop_submitting) {
-                            qz_sess->stop_submitting = 0;
-                        }
-                        continue;
                     }
+                    /* if issue is from submit, only check if all submit processed */
+                    if (qz_sess->stop_submitting) {
+                        qz_sess->stop_submitting = 0;
+                    }
+                    continue;
                 }
+            }
 
-                if (unlikely(CPA_STATUS_SUCCESS != g_process.qz_inst[i].stream[j].job_status)) {
-                    QZ_DEBUG("Error(%d) in callback: %d, %d, ReqStatus: %d\n",
-                             g_process.qz_inst[i].stream[j].job_status, i, j,
-                             g_process.qz_inst[i].stream[j].res.status);
-                    /* polled error/dummy respond , fallback to sw */
-                    rc = AsyncDecompOutSWFallback(i, j, sess, req);
-                    if (QZ_FAIL == rc) {
-                        QZ_ERROR("Error in SW deCompOut:inst %d, buffer %d, seq %ld\n", i, j,
-                                 qz_sess->seq_in);
-                        decompOutSkipErrorRespond(i, j, qz_sess);
-                        sess->thd_sess_stat = QZ_FAIL;
-                        /* If it's last buffer of request, excute Exception handle directly */
-                        if (qz_sess->processed == qz_sess->submitted) {
-                            CallAsyncbackfn(&req, QZ_FAIL, sess);
-                            req_prv = NULL;
-                        }
-                        continue;
-                    }
-                } else {
-                    resl = &g_process.qz_inst[i].stream[j].res;
-                    QZ_DEBUG("\tHW DecompOut: consumed = %d, produced = %d, seq_in = %ld, src_send_sz = %u\n",
-                             resl->consumed, resl->produced, g_process.qz_inst[i].stream[j].seq,
-                             g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes);
-
-                    /* update the qz_sess info and clean dest buffer */
-                    AsyncDecompOutValidDestBufferCleanUp(i, j, qz_sess, resl, req);
-                    if (QZ_OK != decompOutCheckSum(i, j, sess, resl)) {
-                        if (qz_sess->processed == qz_sess->submitted) {
-                            CallAsyncbackfn(&req, QZ_FAIL, sess);
-                            req_prv = NULL;
-                        }
-                        continue;
+            if (unlikely(CPA_STATUS_SUCCESS != g_process.qz_inst[i].stream[j].job_status)) {
+                QZ_DEBUG("Error(%d) in callback: %d, %d, ReqStatus: %d\n",
+                         g_process.qz_inst[i].stream[j].job_status, i, j,
+                         g_process.qz_inst[i].stream[j].res.status);
+                /* polled error/dummy respond , fallback to sw */
+                rc = AsyncDecompOutSWFallback(i, j, sess, req);
+                if (QZ_FAIL == rc) {
+                    QZ_ERROR("Error in SW deCompOut:inst %d, buffer %d, seq %ld\n", i, j,
+                             qz_sess->seq_in);
+                    decompOutSkipErrorRespond(i, j, qz_sess);
+                    sess->thd_sess_stat = QZ_FAIL;
+                    /* If it's last buffer of request, excute Exception handle directly */
+                    if (qz_sess->processed == qz_sess->submitted) {
+                        CallAsyncbackfn(&req, QZ_FAIL, sess);
+                        req_prv = NULL;
                     }
-
-                    src_send_sz = g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes;
-                    req->dest += resl->produced;
-                    req->req_in_len += (outputHeaderSz(data_fmt) + src_send_sz +
-                                        outputFooterSz(data_fmt));
-                    req->req_out_len += resl->produced;
-                    req->qzResults->dest_len -= resl->produced;
+                    continue;
                 }
+            } else {
+                resl = &g_process.qz_inst[i].stream[j].res;
+                QZ_DEBUG("\tHW DecompOut: consumed = %d, produced = %d, seq_in = %ld, src_send_sz = %u\n",
+                         resl->consumed, resl->produced, g_process.qz_inst[i].stream[j].seq,
+                         g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes);
 
-                decompOutProcessedRespond(i, j, qz_sess);
-                if (req->req_in_len == req->qzResults->src_len) {
-                    req->qzResults->dest_len = req->req_out_len;
-                    CallAsyncbackfn(&req, QZ_OK, NULL);
-                    req_prv = NULL;
-                } else {
-                    req_prv = req;
+                /* update the qz_sess info and clean dest buffer */
+                AsyncDecompOutValidDestBufferCleanUp(i, j, qz_sess, resl, req);
+                if (QZ_OK != decompOutCheckSum(i, j, sess, resl)) {
+                    if (qz_sess->processed == qz_sess->submitted) {
+                        CallAsyncbackfn(&req, QZ_FAIL, sess);
+                        req_prv = NULL;
+                    }
+                    continue;
                 }
-                break;
+
+                src_send_sz = g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes;
+                req->dest += resl->produced;
+                req->req_in_len += (outputHeaderSz(data_fmt) + src_send_sz +
+                                    outputFooterSz(data_fmt));
+                req->req_out_len += resl->produced;
+                req->qzResults->dest_len -= resl->produced;
+            }
+
+            decompOutProcessedRespond(i, j, qz_sess);
+            if (req->req_in_len == req->qzResults->src_len) {
+                req->qzResults->dest_len = req->req_out_len;
+                CallAsyncbackfn(&req, QZ_OK, NULL);
+                req_prv = NULL;
+            } else {
+                req_prv = req;
             }
         }
 
-        if (QZ_PERIODICAL_POLLING == polling_mode) {
+        if (QZ_EVENT_POLLING == polling_mode && 0 == good &&
+            0 == qzWaitInstEvent(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_ADAPTIVE_POLLING == polling_mode && 0 == good &&
+                   0 == qzPollModelSleep(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_CENTRAL_POLLING == polling_mode && 0 == good &&
+                   0 == qzCentralWait(i, qz_sess)) {
+            sleep_cnt++;
+        } else if (QZ_BUSY_POLLING != polling_mode) {
             if (0 == good) {
                 qz_sess->polling_idx = (qz_sess->polling_idx >= POLLING_LIST_NUM - 1) ?
                                        (POLLING_LIST_NUM - 1) :
@@ -3796,7 +5712,7 @@ int GetStableInstance(QzSession_T *sess)
     int i, rc;
     QzSess_T *qz_sess = (QzSess_T *)sess->internal;
 
-    i = qzGrabInstance(qz_sess->inst_hint, &(qz_sess->sess_params));
+    i = qzGrabInstance(qz_sess->inst_hint, &(qz_sess->sess_params), NULL);
     if (unlikely(i == -1)) {
         QZ_DEBUG("Async API didn't grab instance!\n");
         goto exit;
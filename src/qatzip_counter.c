@@ -62,6 +62,7 @@ void dumpCounters(QzInstance_T *inst)
         return;
     }
 
+    QZ_INFO("\t%u of %u buffers set up\n", inst->ready_cnt, inst->dest_count);
     for (i = 0; i < inst->dest_count; i++) {
         QZ_INFO("\tbuffer %d\t ses %ld\t %ld %ld %ld %ld\n",
                 i, inst->stream[i].seq, inst->stream[i].src1,
@@ -74,8 +75,24 @@ void dumpAllCounters(void)
 {
     int i;
 
+    QZ_INFO("Instance grabs: local %lu, remote %lu, shared %lu\n",
+            atomic_load(&g_process.inst_grab_local),
+            atomic_load(&g_process.inst_grab_remote),
+            atomic_load(&g_process.inst_grab_shared));
+    QZ_INFO("Small requests: coalesced %lu, software %lu\n",
+            atomic_load(&g_process.small_coalesced),
+            atomic_load(&g_process.small_sw));
+    QZ_INFO("HW request bytes: copied %lu, zero copy %lu\n",
+            atomic_load(&g_process.bytes_copied),
+            atomic_load(&g_process.bytes_zero_copy));
+    QZ_INFO("Buffer rings: grown %lu, trimmed %lu, denied %lu\n",
+            atomic_load(&g_process.ring_grows),
+            atomic_load(&g_process.ring_trims),
+            atomic_load(&g_process.ring_denials));
+
     for (i = 0; i <  g_process.num_instances; i++) {
-        QZ_INFO("Instance %d\n", i);
+        QZ_INFO("Instance %d, node %u\n", i,
+                g_process.qz_inst[i].instance_info.nodeAffinity);
         dumpCounters(&g_process.qz_inst[i]);
         QZ_INFO("\n");
     }
@@ -51,6 +51,7 @@ extern"C" {
 #include <lz4frame.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <time.h>
 #include "qz_utils.h"
 
 /**
@@ -68,6 +69,18 @@ extern"C" {
  * to reach peak performance
  */
 #define NUM_BUFF_8K          (128)
+/* Stream buffers an instance is set up with, its ring grows on demand up
+ * to NUM_BUFF or NUM_BUFF_8K and is trimmed back when idle
+ */
+#define QZ_INST_MIN_BUFF     (4)
+/* A buffer unclaimed between two trims QZ_RING_IDLE_NS apart is freed */
+#define QZ_RING_IDLE_NS      (1000000000UL)
+/* Wait before growing a ring again once it failed for want of memory */
+#define QZ_RING_GROW_BACKOFF_NS (10000000UL)
+/* Max caller segments a request's src list may carry, a request spread
+ * over more is gathered into the pinned buffer instead
+ */
+#define QZ_SGL_MAX_FLATS     (32)
 #define MAX_NUM_RETRY        ((int)500)
 #define MAX_BUFFERS          ((int)100)
 #define MAX_THREAD_TMR       ((int)100)
@@ -108,6 +121,22 @@ extern"C" {
 
 #define QZ_CEIL_DIV(x, y) (((x) + (y)-1) / (y))
 
+/* one bit per stream buffer of an instance */
+#define QZ_STREAM_BITMAP_WORDS  QZ_CEIL_DIV(NUM_BUFF_8K, 64)
+
+/* A session never has more requests in flight than an instance has
+ * stream buffers, so its completion queue is indexed by seq modulo that.
+ */
+#define QZ_CQ_SIZE              NUM_BUFF_8K
+#define QZ_CQ_IDX(seq)          ((seq) & (QZ_CQ_SIZE - 1))
+#if (QZ_CQ_SIZE & (QZ_CQ_SIZE - 1))
+#error QZ_CQ_SIZE should be a power of 2
+#endif
+
+/* small requests coalesced into one submission, and keys coalescing at once */
+#define QZ_COALESCE_MAX         64
+#define QZ_COALESCE_GROUPS      8
+
 /* macros for lz4 */
 #define QZ_LZ4_MAGIC         0x184D2204U
 #define QZ_LZ4_MAGIC_SKIPPABLE 0x184D2A50U
@@ -124,6 +153,7 @@ extern"C" {
 #define QZ_LZ4_FD_SIZE         11                    //lz4 frame descriptor length
 #define QZ_LZ4_HEADER_SIZE     (QZ_LZ4_MAGIC_SIZE + \
                                 QZ_LZ4_FD_SIZE)      //lz4 frame header length
+#define QZ_LZ4_STREAM_FD_SIZE  3                     //descriptor without content size
 #define QZ_LZ4_CHECKSUM_SIZE   4                     //lz4 checksum length
 #define QZ_LZ4_ENDMARK_SIZE    4                     //lz4 endmark length
 #define QZ_LZ4_FOOTER_SIZE     (QZ_LZ4_CHECKSUM_SIZE + \
@@ -151,6 +181,12 @@ extern"C" {
 
 struct QzAsyncReq_S;
 typedef struct QzAsyncReq_S QzAsyncReq_T;
+struct QzSess_S;
+
+/* Instance lock word: QZ_INST_EXCLUSIVE while one session owns the
+ * instance, otherwise the number of sessions sharing it.
+ */
+#define QZ_INST_EXCLUSIVE    (0x80000000U)
 
 typedef struct QzCpaStream_S {
     signed long seq;
@@ -168,23 +204,67 @@ typedef struct QzCpaStream_S {
     unsigned int orgdatalen;
     CpaDcOpData opData;
     QzAsyncReq_T *req;
+    /* session which claimed the buffer, responses are routed by it */
+    struct QzSess_S *owner;
+    /* submit time and size of the request, for adaptive polling */
+    unsigned long submit_ns;
+    unsigned int submit_bytes;
+    /* src1 at the last ring trim, the buffer is idle while it stays */
+    signed long idle_mark;
 } QzCpaStream_T;
 
+/* Learned service time of an instance in one direction */
+typedef struct QzPollEstimate_S {
+    unsigned long ns_per_kb;
+    unsigned long samples;
+} QzPollEstimate_T;
+
 typedef struct QzInstance_S {
     CpaInstanceInfo2 instance_info;
     CpaDcInstanceCapabilities instance_cap;
     CpaBufferList **intermediate_buffers;
     Cpa32U buff_meta_size;
+    Cpa32U sgl_meta_size;
 
     /* Tracks memory where the intermediate buffers reside. */
     Cpa16U intermediate_cnt;
     CpaBufferList **src_buffers;
     CpaBufferList **dest_buffers;
+    /* slots of the stream buffer ring, only some have buffers */
     Cpa16U src_count;
     Cpa16U dest_count;
+    /* hw_buff_sz the src buffers are set up with */
+    Cpa32U buff_sz;
     QzCpaStream_T *stream;
+    /* bit j is set while stream buffer j is free to be claimed */
+    uint64_t free_streams[QZ_STREAM_BITMAP_WORDS];
+    /* bit j is set while slot j has its buffers or is getting them */
+    uint64_t ready_streams[QZ_STREAM_BITMAP_WORDS];
+    unsigned int ready_cnt;
+    /* no ring growth before grow_ns, no trim before trim_ns */
+    unsigned long grow_ns;
+    unsigned long trim_ns;
+    /* futex word bumped whenever a buffer is freed, and its waiters */
+    unsigned int free_seq;
+    unsigned int free_waiters;
 
     unsigned int lock;
+    /* stream buffers reserved by single thread sessions on a shared instance */
+    unsigned int reserved;
+    /* only one sharer polls the instance at a time */
+    unsigned int poll_lock;
+    /* QZ_ADAPTIVE_POLLING model, indexed by QzDirection_T */
+    QzPollEstimate_T poll_est[2];
+    unsigned long predicted_sleeps;
+    unsigned long early_polls;
+    /* QZ_CENTRAL_POLLING thread, polling while sessions wait on it */
+    pthread_t central_poller;
+    unsigned int central_state;
+    unsigned int central_waiters;
+    /* response event fd for QZ_EVENT_POLLING, set up on first use */
+    int event_state;
+    int event_fd;
+    int epoll_fd;
     /*heartbeat represent device status, which will be changed by polling events thread*/
     CpaStatus heartbeat;
     unsigned char mem_setup;
@@ -218,6 +298,24 @@ typedef struct ProccesData_S {
     pthread_t t_poll_heartbeat;
     /* Define pthread key here, for different thread local variable */
     pthread_key_t async_req_key;
+    /* Instance grabs on the caller's NUMA node and on a remote one */
+    atomic_ulong inst_grab_local;
+    atomic_ulong inst_grab_remote;
+    /* Grabs which joined an instance already shared by other sessions */
+    atomic_ulong inst_grab_shared;
+    /* Requests below input_sz_thrshold coalesced onto HW or sent to SW */
+    atomic_ulong small_coalesced;
+    atomic_ulong small_sw;
+    /* HW request bytes copied through instance buffers or used in place */
+    atomic_ulong bytes_copied;
+    atomic_ulong bytes_zero_copy;
+    /* Stream buffer rings grown, trimmed, or kept from growing for want
+     * of memory
+     */
+    atomic_ulong ring_grows;
+    atomic_ulong ring_trims;
+    atomic_ulong ring_denials;
+    unsigned int central_exit;
 } processData_T;
 
 typedef enum {
@@ -252,6 +350,21 @@ typedef enum DataFormatInternal_E {
     /**< Data is in  deflate wrapped by zlib header and footer */
 } DataFormatInternal_T;
 
+/* Fold the checksum of the next next_len bytes into a running deflate
+ * checksum, Adler-32 for zlib and CRC32 otherwise; 0 is no data yet
+ */
+static inline unsigned long qzChecksumCombine(DataFormatInternal_T data_fmt,
+        unsigned long sum,
+        unsigned long next,
+        unsigned long next_len)
+{
+    if (0 == sum) {
+        return next;
+    }
+    return (DEFLATE_ZLIB == data_fmt) ? adler32_combine(sum, next, next_len) :
+           crc32_combine(sum, next, next_len);
+}
+
 // Include all support session parameters
 typedef struct QzSessionParamsInternal_S {
     QzHuffmanHdr_T huffman_hdr;
@@ -296,6 +409,14 @@ typedef struct QzSessionParamsInternal_S {
     /**< 0 means no busy polling, 1 means busy polling */
     unsigned int is_sensitive_mode;
     /**< 0 means disable sensitive mode, 1 means enable sensitive mode*/
+    unsigned int share_inst;
+    /**< 0 means lock the instance per call, 1 means share it */
+    unsigned int coalesce_usec;
+    /**< Time window for coalescing small compression requests */
+    unsigned int strm_pipeline;
+    /**< Stream buffers rotating in qzCompressStream */
+    unsigned int single_member;
+    /**< One gzip member, zlib stream or LZ4 frame up to last */
     unsigned int lz4s_mini_match;
     /**< Set lz4s dictionary mini match, which would be 3 or 4 */
     unsigned char stop_decompression_stream_end;
@@ -324,6 +445,17 @@ typedef struct LatencyMetrix_S {
 
 /* This mask should change according to QzAsyncOperationType_E enum */
 #define ASYNC_POLLING_MASK 1
+
+/* QzInstance_T event_state */
+#define QZ_EVENT_UNTRIED          0
+#define QZ_EVENT_READY            1
+#define QZ_EVENT_SETUP            2
+#define QZ_EVENT_NONE             (-1)
+
+/* QzInstance_T central_state */
+#define QZ_CENTRAL_IDLE           0
+#define QZ_CENTRAL_RUNNING        1
+#define QZ_CENTRAL_FAILED         2
 #define DEFAULT_ASYNC_QUEUE_SIZE 1024
 
 /* compress is even, decompress is odd */
@@ -356,6 +488,38 @@ typedef struct QzAsynctrl_S {
     sem_t sem;
 } QzAsynctrl_T;
 
+/* Long-lived thread running the submit side of threaded sync calls */
+typedef struct QzSubmitWorker_S {
+    pthread_t thread;
+    pid_t pid;
+    sem_t job_sem;
+    sem_t done_sem;
+    void *(*job)(void *);
+    void *arg;
+    int exit;
+} QzSubmitWorker_T;
+
+/* Small compression requests of sessions with the same key wait in a
+ * coalescing group, until its leader submits them to HW together
+ */
+typedef struct QzCoalesceKey_S {
+    CpaDcSessionSetupData setup;
+    DataFormatInternal_T data_fmt;
+    unsigned char sw_backup;
+} QzCoalesceKey_T;
+
+typedef struct QzCoalesceReq_S {
+    QzBatchReq_T req;
+    int done;
+} QzCoalesceReq_T;
+
+typedef struct QzCoalesceGroup_S {
+    QzCoalesceKey_T key;
+    unsigned int count;
+    int leader;
+    QzCoalesceReq_T *reqs[QZ_COALESCE_MAX];
+} QzCoalesceGroup_T;
+
 typedef struct QzSess_S {
     int inst_hint;   /*which instance we last used*/
     QzSessionParamsInternal_T sess_params;
@@ -370,14 +534,40 @@ typedef struct QzSess_S {
     int stop_submitting;
     signed long seq;
     signed long seq_in;
+    /* stream buffer index + 1 of completed requests, set by dcCallback */
+    int cq[QZ_CQ_SIZE];
+    /* QZ_ADAPTIVE_POLLING: predicted completion time by seq, 0 if unknown,
+     * the last poll which found nothing and whether it followed a
+     * predicted sleep
+     */
+    unsigned long due_ns[QZ_CQ_SIZE];
+    unsigned long poll_empty_ns;
+    unsigned int poll_predicted;
+    /* QZ_CENTRAL_POLLING: futex word bumped by dcCallback while the session
+     * waits, and whether to poll by itself as the poller didn't answer
+     */
+    unsigned int cq_events;
+    unsigned int cq_waiters;
+    unsigned int central_self_poll;
     pthread_t c_th_i;
     pthread_t c_th_o;
+    QzSubmitWorker_T *submit_worker;
+    /* c_th_i was created for this call as the worker is unavailable */
+    unsigned int submit_spawned;
 
     unsigned char *src;
     unsigned int *src_sz;
+    /* qzCompressV: src segments, src is NULL while these are set */
+    const QzIovec_T *src_iov;
+    unsigned int src_iov_cnt;
 
     unsigned int *dest_sz;
     unsigned char *next_dest;
+    /* Sync compression: dest of the call and offset in it of the worst case
+     * slot for the next request's output, see compDestSlotSetup
+     */
+    unsigned char *dest_base;
+    unsigned long slot_off;
 
     int force_sw;
     InflateState_T inflate_stat;
@@ -390,6 +580,17 @@ typedef struct QzSess_S {
     unsigned int single_thread;
     unsigned int polling_idx;
 
+    /* single_member: member_on while a sync HW call adds to the member,
+     * which is open from its header up to the trailer of the last call
+     */
+    unsigned int member_on;
+    unsigned int member_open;
+    /* qzCompressStream of zlib: one stream, whatever single_member says */
+    unsigned int strm_member;
+    unsigned long member_sum;
+    uint64_t member_len;
+    struct XXH32_state_s *member_xxh32;
+
     z_stream *deflate_strm;
     DeflateState_T deflate_stat;
     LZ4F_dctx *dctx;
@@ -411,6 +612,11 @@ typedef struct QzStreamBuf_S {
     unsigned int out_offset;
     unsigned int in_offset;
     unsigned int flush_more;
+    /* strm_pipeline: rotating buffers of qzCompressStream, NULL if serial */
+    struct QzStreamPipe_S *pipe;
+    unsigned int pipe_failed;
+    /* LZ4_FH: XXH32 of the whole stream, the frames only carry their own */
+    struct XXH32_state_s *xxh32;
 } QzStreamBuf_T;
 
 typedef struct ThreadData_S {
@@ -558,13 +764,21 @@ void removeSession(int i);
 void cleanUpInstMem(int i);
 
 void qzMemDestory(void);
+void *qzMallocFor(size_t sz, int numa, int pinned, int purpose);
+void *qzMallocDirect(size_t sz, int numa, int pinned, int purpose);
+void qzFreeFor(void *m, int purpose);
+unsigned long qzMemBudgetAvail(int numa);
+void qzMemGetStatus(unsigned long *kb, unsigned char *huge);
 
 void streamBufferCleanup(void);
+void streamBufferTrim(void);
 
 //lz4 functions
 unsigned long qzLZ4HeaderSz(void);
 unsigned long qzLZ4FooterSz(void);
 void qzLZ4HeaderGen(unsigned char *ptr, CpaDcRqResults *res);
+unsigned long qzLZ4StreamHeaderSz(void);
+void qzLZ4StreamHeaderGen(unsigned char *ptr);
 void qzLZ4FooterGen(unsigned char *ptr, CpaDcRqResults *res);
 unsigned char *findLZ4Footer(const unsigned char *src_ptr,
                              long src_avail_len);
@@ -580,6 +794,7 @@ unsigned long qzLZ4SBlockHeaderSz(void);
 void qzLZ4SBlockHeaderGen(unsigned char *ptr, CpaDcRqResults *res);
 
 int qzSetupSessionInternal(QzSession_T *sess);
+int qzCloneSession(QzSession_T *sess, QzSession_T *src);
 
 int qzCheckParams(QzSessionParams_T *params);
 int qzCheckParamsDeflate(QzSessionParamsDeflate_T *params);
@@ -628,6 +843,7 @@ int decompOutSWFallback(int i, int j, QzSession_T *sess,
     params limitation, when setup buffer, may feed pinned pointer
     or common pointer to pBuffer.
 */
+void putUnusedBuffer(int i, int j);
 void RestoreDestCpastreamBuffer(int i, int j);
 void RestoreSrcCpastreamBuffer(int i, int j);
 void ResetCpastreamSink(int i, int j);
@@ -637,6 +853,10 @@ void ResetCpastreamSink(int i, int j);
 void compBufferSetup(int i, int j, QzSess_T *qz_sess,
                      unsigned char *src_ptr, unsigned int src_remaining,
                      unsigned int hw_buff_sz, unsigned int src_send_sz);
+unsigned long qzIovLen(const QzIovec_T *iov, unsigned int cnt);
+void qzIovCopy(unsigned char *dest, const QzIovec_T *iov, unsigned int cnt,
+               unsigned long off, unsigned int len);
+void compDestSlotSetup(int i, int j, QzSess_T *qz_sess);
 void compInBufferCleanUp(int i, int j);
 void compOutSrcBufferCleanUp(int i, int j);
 void compOutErrorDestBufferCleanUp(int i, int j);
@@ -691,6 +911,23 @@ static inline uint64_t rdtsc()
 
 void metrixReset(LatencyMetrix_T *m);
 void metrixUpdate(LatencyMetrix_T *m, unsigned long val);
+
+int qzEventOpen(int fd);
+int qzEventWait(int epoll_fd, int timeout_ms);
+void qzEventClose(int epoll_fd);
+
+/* Adaptive polling */
+static inline unsigned long qzNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void qzPollModelSubmit(int i, int j, QzSess_T *qz_sess, QzDirection_T dir);
+void qzPollModelComplete(int i, int j, QzSess_T *qz_sess, QzDirection_T dir);
+int qzPollModelSleep(int i, QzSess_T *qz_sess);
 int compLSMFallback(QzSession_T *sess, const unsigned char *src,
                     unsigned int *src_len, unsigned char *dest,
                     unsigned int *dest_len, unsigned int last);
@@ -131,6 +131,29 @@ void qzLZ4HeaderGen(unsigned char *ptr, CpaDcRqResults *res)
                                             0) >> 8) & 0xff);
 }
 
+inline unsigned long qzLZ4StreamHeaderSz(void)
+{
+    return QZ_LZ4_MAGIC_SIZE + QZ_LZ4_STREAM_FD_SIZE;
+}
+
+/* Header of a frame whose content size isn't known when it starts */
+void qzLZ4StreamHeaderGen(unsigned char *ptr)
+{
+    unsigned char *fd = ptr + QZ_LZ4_MAGIC_SIZE;
+
+    assert(ptr != NULL);
+
+    *(uint32_t *)ptr = QZ_LZ4_MAGIC;
+    fd[0] = (unsigned char)(((QZ_LZ4_VERSION  & 0x03) << 6) +
+                            ((QZ_LZ4_BLK_INDEP & 0x01) << 5) +
+                            ((QZ_LZ4_BLK_CKS_FLAG & 0x01) << 4) +
+                            ((QZ_LZ4_CNT_CKS_FLAG & 0x01) << 2) +
+                            (QZ_LZ4_DICT_ID_FLAG & 0x01));
+    fd[1] = (unsigned char)((QZ_LZ4_MAX_BLK_SIZE & 0x07) << 4);
+    fd[2] = (unsigned char)((XXH32(fd, QZ_LZ4_STREAM_FD_SIZE - 1, 0) >> 8) &
+                            0xff);
+}
+
 void qzLZ4FooterGen(unsigned char *ptr, CpaDcRqResults *res)
 {
     QzLZ4F_T *footer = NULL;
@@ -33,6 +33,7 @@
  *
  ***************************************************************************/
 #include <stdlib.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -58,9 +59,123 @@
 #define __STDC_WANT_LIB_EXT1__ 1
 #include <linux/string.h>
 
+#define QZ_MEM_HASH_SIZE     (4096)
+/* Power of two size classes of the slab allocator, 64 B to 2 MB. Larger
+ * allocations go to the USDM allocator directly.
+ */
+#define QZ_SLAB_MIN_SHIFT    (6)
+#define QZ_SLAB_MAX_SHIFT    (21)
+#define QZ_SLAB_CLASSES      (QZ_SLAB_MAX_SHIFT - QZ_SLAB_MIN_SHIFT + 1)
+#define QZ_SLAB_SIZE         (1UL << QZ_SLAB_MAX_SHIFT)
+/* Slabs from the USDM allocator, or mmap'ed when it has none */
+#define QZ_SLAB_KIND_PINNED  (0)
+#define QZ_SLAB_KIND_COMMON  (1)
+#define QZ_SLAB_KINDS        (2)
+/* Blocks kept per thread and class, bounded in bytes for large classes */
+#define QZ_SLAB_TCACHE_MAX   (32)
+#define QZ_SLAB_TCACHE_BYTES (1UL << 20)
+#define QZ_SLAB_RETAIN_DEFAULT (64UL << 20)
+
+typedef struct QzMemNode_S {
+    unsigned long key;
+    unsigned long val;
+    /* node, pinned and purpose of a qzMalloc allocation */
+    int numa;
+    int pinned;
+    int purpose;
+    struct QzMemNode_S *next;
+} QzMemNode_T;
+
+/* Bytes handed out by node, pinned and purpose, and the USDM memory behind
+ * them, see QzMemStats_T
+ */
+typedef struct QzMemAcct_S {
+    atomic_ulong bytes[QZ_MEM_MAX_NODES][2][QZ_MEM_PURPOSES];
+    atomic_ulong usdm[QZ_MEM_MAX_NODES];
+    atomic_ulong usdm_total;
+    atomic_ulong node_budget[QZ_MEM_MAX_NODES];
+    atomic_ulong budget;
+    atomic_ulong budget_denials;
+    atomic_ulong common_fallbacks;
+    /* set once a slab is mapped from hugetlbfs */
+    atomic_int huge;
+} QzMemAcct_T;
+
 static QzPageTable_T g_qz_page_table = {{{0}}};
 static pthread_mutex_t g_qz_table_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Levels emptied in g_qz_page_table, for it to take again. A table only
+ * reuses its own, so that a lookup on a stale level reads its own types.
+ */
+static QzPageRetireQ_T g_qz_retired = {NULL};
+/* Under g_qz_table_lock: size of each qzMalloc allocation not from the
+ * pool, and the number of pinned allocations on each page at the end of
+ * one, so that a page is cleared once the last allocation on it is freed.
+ */
+static QzMemNode_T *g_qz_allocs[QZ_MEM_HASH_SIZE];
+static QzMemNode_T *g_qz_edges[QZ_MEM_HASH_SIZE];
 static atomic_int g_table_init = 0;
+static QzMemAcct_T g_qz_mem;
+
+typedef struct QzSlab_S {
+    unsigned char *base;
+    unsigned int shift;
+    unsigned int idx;
+    /* blocks out of the slab, in thread caches or with callers */
+    unsigned int used;
+    /* blocks carved from base so far */
+    unsigned int carved;
+    unsigned int nblocks;
+    void *free_list;
+    struct QzSlab_S *prev;
+    struct QzSlab_S *next;
+} QzSlab_T;
+
+/* Slabs of one kind, NUMA node and size class with free blocks */
+typedef struct QzSlabCentral_S {
+    pthread_mutex_t lock;
+    QzSlab_T *partial;
+    QzSlab_T *full;
+} QzSlabCentral_T;
+
+typedef struct QzSlabCache_S {
+    unsigned int cnt;
+    unsigned int max;
+    void *blocks[QZ_SLAB_TCACHE_MAX];
+} QzSlabCache_T;
+
+typedef struct QzSlabThread_S {
+    unsigned long hits;
+    /* bytes of blocks handed out by this thread and not yet added to
+     * g_qz_mem, by kind, node and purpose
+     */
+    long *acct;
+    QzSlabCache_T cache[];
+} QzSlabThread_T;
+
+typedef struct QzSlabPool_S {
+    int nodes;
+    QzSlabCentral_T *central;
+    pthread_key_t key;
+    /* set when the USDM allocator fails, COMMON_MEM then uses mmap */
+    atomic_int no_usdm;
+    atomic_ulong limit;
+    atomic_ulong slabs;
+    atomic_ulong slab_bytes;
+    atomic_ulong retained;
+    atomic_ulong cache_hits;
+    atomic_ulong central_hits;
+    atomic_ulong slab_allocs;
+    atomic_ulong slab_frees;
+    atomic_ulong direct_allocs;
+} QzSlabPool_T;
+
+/* Slab of each page of the slabs, tagged with 1 to tell it from a level */
+static QzPageTable_T g_qz_slab_table = {{{0}}};
+/* Levels emptied in g_qz_slab_table, under g_qz_table_lock */
+static QzPageRetireQ_T g_qz_slab_retired = {NULL};
+static QzSlabPool_T g_qz_slab;
+static pthread_once_t g_qz_slab_once = PTHREAD_ONCE_INIT;
+static __thread QzSlabThread_T *g_qz_slab_thd;
 static __thread unsigned char *g_a;
 extern processData_T g_process;
 
@@ -106,58 +221,958 @@ int qzMemFindAddr(unsigned char *a)
     al = (unsigned long)a;
     b = (al & PAGE_MASK);
 
-    rc = (PINNED == loadAddr(&g_qz_page_table,
-                             (void *)b)) ? PINNED_MEM : COMMON_MEM;
+    switch ((int64_t)loadAddr(&g_qz_page_table, (void *)b)) {
+    case PINNED:
+    case REGISTERED:
+        rc = PINNED_MEM;
+        break;
+    default:
+        rc = COMMON_MEM;
+        break;
+    }
     if (0 != rc) {
         QZ_MEM_PRINT("Find 0x%lx in page table\n", b);
     }
     return rc;
 }
 
-static void qzMemUnRegAddr(unsigned char *a)
+static inline QzMemNode_T **qzMemHashSlot(QzMemNode_T **table,
+        unsigned long key)
 {
-    return;
+    QzMemNode_T **slot = &table[((key >> 6) ^ (key >> 18)) &
+                                (QZ_MEM_HASH_SIZE - 1)];
+
+    while (NULL != *slot && (*slot)->key != key) {
+        slot = &(*slot)->next;
+    }
+    return slot;
 }
 
-static int qzMemRegAddr(unsigned char *a, size_t sz)
+static QzMemNode_T *qzMemHashAdd(QzMemNode_T **table, unsigned long key,
+                                 unsigned long val)
 {
-    int rc;
-    unsigned long al, b;
+    QzMemNode_T **slot = qzMemHashSlot(table, key);
+
+    if (NULL != *slot) {
+        (*slot)->val += val;
+        return *slot;
+    }
+
+    *slot = calloc(1, sizeof(QzMemNode_T));
+    if (NULL == *slot) {
+        return NULL;
+    }
+    (*slot)->key = key;
+    (*slot)->val = val;
+    return *slot;
+}
+
+/* Take val off the node of key, removing it when nothing is left. Returns
+ * what is left, 0 if key isn't there.
+ */
+static unsigned long qzMemHashSub(QzMemNode_T **table, unsigned long key,
+                                  unsigned long val)
+{
+    QzMemNode_T **slot = qzMemHashSlot(table, key);
+    QzMemNode_T *node = *slot;
+
+    if (NULL == node) {
+        return 0;
+    }
+    node->val -= (val < node->val) ? val : node->val;
+    if (0 == node->val) {
+        *slot = node->next;
+        free(node);
+        return 0;
+    }
+    return node->val;
+}
+
+/* Drop the pages of [a, a + sz) from the page table, but for the end pages
+ * which still hold other allocations.
+ */
+static void qzMemClearRange(unsigned long a, size_t sz)
+{
+    unsigned long first = a & PAGE_MASK;
+    unsigned long last = (a + sz - 1) & PAGE_MASK;
+    unsigned long lo = first, hi = last + PAGE_SIZE;
+
+    if (0 != qzMemHashSub(g_qz_edges, first, 1)) {
+        lo += PAGE_SIZE;
+    }
+    if (last != first && 0 != qzMemHashSub(g_qz_edges, last, 1)) {
+        hi -= PAGE_SIZE;
+    }
+    if (lo < hi) {
+        QZ_MEM_PRINT("Clearing 0x%lx size %lx from page table\n", lo, hi - lo);
+        storeLevel(&g_qz_page_table, 3, lo, hi, 0, STORE_ANY, &g_qz_retired);
+    }
+}
+
+/* Forget the allocation at a, filling in what qzMemRegAddr was given.
+ * Returns -1 if qzMalloc didn't track it, else whether it was pinned.
+ */
+static int qzMemForget(unsigned char *a, size_t *sz, int *numa, int *purpose)
+{
+    unsigned long al = (unsigned long)a;
+    QzMemNode_T **slot, *node;
+    int pinned;
 
     if (0 != pthread_mutex_lock(&g_qz_table_lock)) {
         return -1;
     }
 
-    /*addr already registered*/
-    if ((1 == qzMemFindAddr(a)) &&
-        (1 == qzMemFindAddr(a + sz - 1))) {
+    slot = qzMemHashSlot(g_qz_allocs, al);
+    node = *slot;
+    if (NULL == node) {
         pthread_mutex_unlock(&g_qz_table_lock);
-        return 0;
+        return -1;
+    }
+    *sz = node->val;
+    *numa = node->numa;
+    *purpose = node->purpose;
+    pinned = node->pinned;
+    *slot = node->next;
+    free(node);
+
+    if (pinned) {
+        qzMemClearRange(al, *sz);
+    }
+
+    pthread_mutex_unlock(&g_qz_table_lock);
+    return pinned;
+}
+
+/* Track the allocation at a, adding it to the page table when pinned */
+static int qzMemRegAddr(unsigned char *a, size_t sz, int numa, int pinned,
+                        int purpose)
+{
+    int rc = -1;
+    unsigned long al, b, last;
+    QzMemNode_T *node;
+
+    if (0 != pthread_mutex_lock(&g_qz_table_lock)) {
+        return -1;
     }
 
     al = (unsigned long)a;
     b = (al & PAGE_MASK);
-    sz += (al - b);
+    last = (al + sz - 1) & PAGE_MASK;
     QZ_MEM_PRINT("4 KB page is 0x%lx\n", b);
 
-    QZ_MEM_PRINT("Inserting 0x%lx size %lx to page table\n", b, sz);
-    rc = storeMmapRange(&g_qz_page_table, (void *)b, PINNED, sz);
+    node = qzMemHashAdd(g_qz_allocs, al, sz);
+    if (NULL != node) {
+        node->numa = numa;
+        node->pinned = pinned;
+        node->purpose = purpose;
+        rc = 0;
+    }
+    if (0 == rc && pinned) {
+        rc = (NULL == qzMemHashAdd(g_qz_edges, b, 1)) ? -1 : 0;
+        if (0 == rc && last != b) {
+            rc = (NULL == qzMemHashAdd(g_qz_edges, last, 1)) ? -1 : 0;
+            if (0 != rc) {
+                qzMemHashSub(g_qz_edges, b, 1);
+            }
+        }
+        if (0 != rc) {
+            qzMemHashSub(g_qz_allocs, al, sz);
+        }
+    }
+
+    if (0 == rc && pinned) {
+        QZ_MEM_PRINT("Inserting 0x%lx size %lx to page table\n", b,
+                     sz + (al - b));
+        rc = storeMmapRange(&g_qz_page_table, (void *)b, PINNED, sz + (al - b),
+                            &g_qz_retired);
+        if (0 != rc) {
+            qzMemHashSub(g_qz_allocs, al, sz);
+            qzMemClearRange(al, sz);
+        }
+    }
 
     pthread_mutex_unlock(&g_qz_table_lock);
 
     return rc;
 }
 
+static int qzMemTableInit(void)
+{
+    if (0 == g_table_init) {
+        if (0 != pthread_mutex_lock(&g_qz_table_lock)) {
+            return -1;
+        }
+
+        if (0 == g_table_init) {
+            qzMemSet(&g_qz_page_table, 0, sizeof(QzPageTable_T));
+            g_table_init = 1;
+        }
+
+        if (0 != pthread_mutex_unlock(&g_qz_table_lock)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Register the pages of [a, a + sz) which are neither from qzMalloc nor
+ * registered yet, or unregister the registered ones.
+ */
+static int qzMemMarkUser(unsigned char *a, size_t sz, int reg)
+{
+    unsigned long lo = (unsigned long)a & PAGE_MASK;
+    unsigned long hi = (unsigned long)a + sz;
+    int rc;
+
+    if (0 != pthread_mutex_lock(&g_qz_table_lock)) {
+        return -1;
+    }
+
+    if (reg) {
+        rc = markRange(&g_qz_page_table, lo, hi, (uint64_t)REGISTERED,
+                       &g_qz_retired);
+    } else {
+        rc = storeLevel(&g_qz_page_table, 3, lo, hi, 0, (uint64_t)REGISTERED,
+                        &g_qz_retired);
+    }
+
+    pthread_mutex_unlock(&g_qz_table_lock);
+    return rc;
+}
+
+/* The device reaches pages through the memory driver's translation */
+static int qzMemCanTranslate(unsigned char *a, size_t sz)
+{
+    unsigned long p = (unsigned long)a;
+    unsigned long end = (unsigned long)a + sz;
+
+    while (p < end) {
+        if (0 == qaeVirtToPhysNUMA((void *)p)) {
+            QZ_ERROR("qzRegisterMemory: 0x%lx isn't from the QAT memory "
+                     "driver\n", p);
+            return 0;
+        }
+        p = (p & PAGE_MASK) + PAGE_SIZE;
+    }
+    return 1;
+}
+
+int qzRegisterMemory(void *addr, size_t len)
+{
+    if (NULL == addr || 0 == len ||
+        (unsigned long)addr + len < (unsigned long)addr) {
+        return QZ_PARAMS;
+    }
+
+    if (!qzMemCanTranslate(addr, len) || 0 != qzMemTableInit()) {
+        return QZ_FAIL;
+    }
+
+    QZ_MEM_PRINT("Registering 0x%lx size %zx\n", (unsigned long)addr, len);
+    return (0 == qzMemMarkUser(addr, len, 1)) ? QZ_OK : QZ_FAIL;
+}
+
+int qzUnregisterMemory(void *addr, size_t len)
+{
+    if (NULL == addr || 0 == len ||
+        (unsigned long)addr + len < (unsigned long)addr) {
+        return QZ_PARAMS;
+    }
+
+    if (0 == g_table_init) {
+        return QZ_OK;
+    }
+
+    QZ_MEM_PRINT("Unregistering 0x%lx size %zx\n", (unsigned long)addr, len);
+    return (0 == qzMemMarkUser(addr, len, 0)) ? QZ_OK : QZ_FAIL;
+}
+
+static inline int qzMemNodeSlot(int numa)
+{
+    if (numa < 0) {
+        return 0;
+    }
+    return (numa < QZ_MEM_MAX_NODES) ? numa : QZ_MEM_MAX_NODES - 1;
+}
+
+static inline void qzMemCharge(int numa, int pinned, int purpose, size_t sz)
+{
+    atomic_fetch_add(&g_qz_mem.bytes[qzMemNodeSlot(numa)][!!pinned][purpose],
+                     sz);
+}
+
+static inline void qzMemUncharge(int numa, int pinned, int purpose, size_t sz)
+{
+    atomic_fetch_sub(&g_qz_mem.bytes[qzMemNodeSlot(numa)][!!pinned][purpose],
+                     sz);
+}
+
+/* Bytes numa may still take from the USDM allocator, ULONG_MAX if it has
+ * no budget
+ */
+unsigned long qzMemBudgetAvail(int numa)
+{
+    int slot = qzMemNodeSlot(numa);
+    unsigned long avail = ULONG_MAX, budget, used;
+
+    budget = atomic_load(&g_qz_mem.budget);
+    used = atomic_load(&g_qz_mem.usdm_total);
+    if (0 != budget) {
+        avail = (used < budget) ? budget - used : 0;
+    }
+    budget = atomic_load(&g_qz_mem.node_budget[slot]);
+    used = atomic_load(&g_qz_mem.usdm[slot]);
+    if (0 != budget && avail > ((used < budget) ? budget - used : 0)) {
+        avail = (used < budget) ? budget - used : 0;
+    }
+    return avail;
+}
+
+static void qzSlabTrim(void);
+
+/* USDM memory within the budget. Going over it, the empty slabs and the
+ * cached stream buffers are given back once before giving up.
+ */
+static void *qzMemUsdmAlloc(size_t sz, int numa, size_t align)
+{
+    int slot = qzMemNodeSlot(numa);
+    unsigned long total, on_node, budget, node_budget;
+    int trimmed = 0;
+    void *m;
+
+    for (;;) {
+        total = atomic_fetch_add(&g_qz_mem.usdm_total, sz) + sz;
+        on_node = atomic_fetch_add(&g_qz_mem.usdm[slot], sz) + sz;
+        budget = atomic_load(&g_qz_mem.budget);
+        node_budget = atomic_load(&g_qz_mem.node_budget[slot]);
+        if ((0 == budget || total <= budget) &&
+            (0 == node_budget || on_node <= node_budget)) {
+            break;
+        }
+
+        atomic_fetch_sub(&g_qz_mem.usdm_total, sz);
+        atomic_fetch_sub(&g_qz_mem.usdm[slot], sz);
+        if (trimmed) {
+            QZ_MEM_PRINT("%zu bytes on node %d over budget\n", sz, numa);
+            atomic_fetch_add(&g_qz_mem.budget_denials, 1);
+            return NULL;
+        }
+        qzSlabTrim();
+        streamBufferTrim();
+        trimmed = 1;
+    }
+
+    m = qaeMemAllocNUMA(sz, numa, align);
+    if (NULL == m) {
+        atomic_fetch_sub(&g_qz_mem.usdm_total, sz);
+        atomic_fetch_sub(&g_qz_mem.usdm[slot], sz);
+    }
+    return m;
+}
+
+static void qzMemUsdmFree(void **m, size_t sz, int numa)
+{
+    int slot = qzMemNodeSlot(numa);
+
+    qaeMemFreeNUMA(m);
+    atomic_fetch_sub(&g_qz_mem.usdm_total, sz);
+    atomic_fetch_sub(&g_qz_mem.usdm[slot], sz);
+}
+
+static inline unsigned int qzSlabShift(size_t sz)
+{
+    if (sz <= (1UL << QZ_SLAB_MIN_SHIFT)) {
+        return QZ_SLAB_MIN_SHIFT;
+    }
+    return 64 - __builtin_clzl(sz - 1);
+}
+
+static inline QzSlab_T *qzSlabFind(void *m)
+{
+    uint64_t mt = loadAddr(&g_qz_slab_table,
+                           (void *)((unsigned long)m & PAGE_MASK));
+
+    return (1 == (mt & 1)) ? (QzSlab_T *)(mt & ~1UL) : NULL;
+}
+
+static void qzSlabThreadExit(void *arg);
+
+static void qzSlabInit(void)
+{
+    int i, n;
+
+    g_qz_slab.nodes = numa_max_node() + 1;
+    if (g_qz_slab.nodes <= 0) {
+        g_qz_slab.nodes = 1;
+    }
+    n = QZ_SLAB_KINDS * g_qz_slab.nodes * QZ_SLAB_CLASSES;
+    g_qz_slab.central = calloc(n, sizeof(QzSlabCentral_T));
+    if (NULL == g_qz_slab.central ||
+        0 != pthread_key_create(&g_qz_slab.key, qzSlabThreadExit)) {
+        free(g_qz_slab.central);
+        g_qz_slab.central = NULL;
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        pthread_mutex_init(&g_qz_slab.central[i].lock, NULL);
+    }
+    atomic_store(&g_qz_slab.limit, QZ_SLAB_RETAIN_DEFAULT);
+}
+
+static inline void qzSlabListDel(QzSlab_T **list, QzSlab_T *slab)
+{
+    if (NULL != slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (NULL != slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+}
+
+static inline void qzSlabListAdd(QzSlab_T **list, QzSlab_T *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (NULL != *list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+/* Slab memory from the USDM allocator, registered as pinned, or from huge
+ * pages when kind is QZ_SLAB_KIND_COMMON. It is QZ_SLAB_SIZE aligned so a
+ * slab never spans two huge pages.
+ */
+static unsigned char *qzSlabMap(int kind, int node)
+{
+    unsigned char *m, *base;
+    unsigned long al;
+
+    if (QZ_SLAB_KIND_PINNED == kind) {
+        m = qzMemUsdmAlloc(QZ_SLAB_SIZE, node, QZ_SLAB_SIZE);
+        if (NULL != m &&
+            0 != qzMemRegAddr(m, QZ_SLAB_SIZE, node, 1, QZ_MEM_INST)) {
+            qzMemUsdmFree((void **)&m, QZ_SLAB_SIZE, node);
+        }
+        return m;
+    }
+
+    m = mmap(NULL, QZ_SLAB_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (MAP_FAILED != m) {
+        atomic_store(&g_qz_mem.huge, 1);
+    } else {
+        m = mmap(NULL, 2 * QZ_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == m) {
+            return NULL;
+        }
+        al = ((unsigned long)m + QZ_SLAB_SIZE - 1) & ~(QZ_SLAB_SIZE - 1);
+        base = (unsigned char *)al;
+        if (base != m) {
+            munmap(m, base - m);
+        }
+        munmap(base + QZ_SLAB_SIZE, m + QZ_SLAB_SIZE - base);
+        m = base;
+        (void)madvise(m, QZ_SLAB_SIZE, MADV_HUGEPAGE);
+    }
+    numa_tonode_memory(m, QZ_SLAB_SIZE, node);
+    return m;
+}
+
+static void qzSlabUnmap(int kind, int node, unsigned char *m)
+{
+    size_t sz;
+    int numa, purpose;
+
+    if (QZ_SLAB_KIND_PINNED == kind) {
+        qzMemForget(m, &sz, &numa, &purpose);
+        qzMemUsdmFree((void **)&m, QZ_SLAB_SIZE, node);
+    } else {
+        munmap(m, QZ_SLAB_SIZE);
+    }
+}
+
+static QzSlab_T *qzSlabCreate(unsigned int idx, unsigned int shift)
+{
+    int kind = idx / (g_qz_slab.nodes * QZ_SLAB_CLASSES);
+    int node = (idx / QZ_SLAB_CLASSES) % g_qz_slab.nodes;
+    QzSlab_T *slab;
+    int rc;
+
+    slab = calloc(1, sizeof(QzSlab_T));
+    if (NULL == slab) {
+        return NULL;
+    }
+    slab->base = qzSlabMap(kind, node);
+    if (NULL == slab->base) {
+        free(slab);
+        return NULL;
+    }
+    slab->shift = shift;
+    slab->idx = idx;
+    slab->nblocks = QZ_SLAB_SIZE >> shift;
+
+    if (0 != pthread_mutex_lock(&g_qz_table_lock)) {
+        rc = -1;
+    } else {
+        rc = storeMmapRange(&g_qz_slab_table, slab->base,
+                            (uint64_t)slab | 1, QZ_SLAB_SIZE,
+                            &g_qz_slab_retired);
+        pthread_mutex_unlock(&g_qz_table_lock);
+    }
+    if (0 != rc) {
+        QZ_ERROR("Failed to add slab 0x%lx to slab table\n",
+                 (unsigned long)slab->base);
+        qzSlabUnmap(kind, node, slab->base);
+        free(slab);
+        return NULL;
+    }
+
+    QZ_MEM_PRINT("New slab 0x%lx class %u node %d\n",
+                 (unsigned long)slab->base, 1U << shift, node);
+    atomic_fetch_add(&g_qz_slab.slabs, 1);
+    atomic_fetch_add(&g_qz_slab.slab_bytes, QZ_SLAB_SIZE);
+    atomic_fetch_add(&g_qz_slab.retained, QZ_SLAB_SIZE);
+    atomic_fetch_add(&g_qz_slab.slab_allocs, 1);
+    return slab;
+}
+
+/* The slab's blocks are all back, unlinked from its central list */
+static void qzSlabRelease(QzSlab_T *slab)
+{
+    int kind = slab->idx / (g_qz_slab.nodes * QZ_SLAB_CLASSES);
+    int node = (slab->idx / QZ_SLAB_CLASSES) % g_qz_slab.nodes;
+
+    QZ_MEM_PRINT("Releasing slab 0x%lx\n", (unsigned long)slab->base);
+    if (0 == pthread_mutex_lock(&g_qz_table_lock)) {
+        storeLevel(&g_qz_slab_table, 3, (uintptr_t)slab->base,
+                   (uintptr_t)slab->base + QZ_SLAB_SIZE, 0, STORE_ANY,
+                   &g_qz_slab_retired);
+        pthread_mutex_unlock(&g_qz_table_lock);
+    }
+    qzSlabUnmap(kind, node, slab->base);
+
+    atomic_fetch_sub(&g_qz_slab.slabs, 1);
+    atomic_fetch_sub(&g_qz_slab.slab_bytes, QZ_SLAB_SIZE);
+    atomic_fetch_sub(&g_qz_slab.retained, QZ_SLAB_SIZE);
+    atomic_fetch_add(&g_qz_slab.slab_frees, 1);
+    free(slab);
+}
+
+/* Take up to n blocks of central list idx into blocks, returns how many */
+static unsigned int qzSlabTake(unsigned int idx, unsigned int shift,
+                               void **blocks, unsigned int n)
+{
+    QzSlabCentral_T *central = &g_qz_slab.central[idx];
+    QzSlab_T *slab;
+    unsigned int got = 0;
+
+    if (0 != pthread_mutex_lock(&central->lock)) {
+        return 0;
+    }
+
+    while (got < n) {
+        slab = central->partial;
+        if (NULL == slab) {
+            slab = qzSlabCreate(idx, shift);
+            if (NULL == slab) {
+                break;
+            }
+            qzSlabListAdd(&central->partial, slab);
+        }
+
+        if (NULL != slab->free_list) {
+            blocks[got] = slab->free_list;
+            slab->free_list = *(void **)slab->free_list;
+        } else {
+            blocks[got] = slab->base + ((size_t)slab->carved++ << shift);
+        }
+        got++;
+        if (++slab->used == slab->nblocks) {
+            qzSlabListDel(&central->partial, slab);
+            qzSlabListAdd(&central->full, slab);
+        }
+    }
+
+    pthread_mutex_unlock(&central->lock);
+    atomic_fetch_sub(&g_qz_slab.retained, (unsigned long)got << shift);
+    return got;
+}
+
+/* Give n blocks of central list idx back, releasing the slabs left empty
+ * while more than the retained limit is free.
+ */
+static void qzSlabPut(unsigned int idx, void **blocks, unsigned int n)
+{
+    QzSlabCentral_T *central = &g_qz_slab.central[idx];
+    QzSlab_T *slab;
+    unsigned int i;
+
+    if (0 == n || 0 != pthread_mutex_lock(&central->lock)) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        slab = qzSlabFind(blocks[i]);
+        *(void **)blocks[i] = slab->free_list;
+        slab->free_list = blocks[i];
+        atomic_fetch_add(&g_qz_slab.retained, 1UL << slab->shift);
+
+        if (slab->used-- == slab->nblocks) {
+            qzSlabListDel(&central->full, slab);
+            qzSlabListAdd(&central->partial, slab);
+        }
+        if (0 == slab->used &&
+            atomic_load(&g_qz_slab.retained) > atomic_load(&g_qz_slab.limit)) {
+            qzSlabListDel(&central->partial, slab);
+            qzSlabRelease(slab);
+        }
+    }
+
+    pthread_mutex_unlock(&central->lock);
+}
+
+/* Add the bytes the thread handed out of slabs of group, kind * nodes +
+ * node, for purpose to g_qz_mem
+ */
+static inline void qzSlabFoldAcct(QzSlabThread_T *thd, int group, int purpose)
+{
+    long *acct = &thd->acct[group * QZ_MEM_PURPOSES + purpose];
+
+    if (0 != *acct) {
+        atomic_fetch_add(&g_qz_mem.bytes[qzMemNodeSlot(group % g_qz_slab.nodes)]
+                         [QZ_SLAB_KIND_PINNED == group / g_qz_slab.nodes]
+                         [purpose], (unsigned long)*acct);
+        *acct = 0;
+    }
+}
+
+static void qzSlabFold(QzSlabThread_T *thd)
+{
+    int i, p;
+
+    for (i = 0; i < QZ_SLAB_KINDS * g_qz_slab.nodes; i++) {
+        for (p = 0; p < QZ_MEM_PURPOSES; p++) {
+            qzSlabFoldAcct(thd, i, p);
+        }
+    }
+    atomic_fetch_add(&g_qz_slab.cache_hits, thd->hits);
+    thd->hits = 0;
+}
+
+static void qzSlabFlush(QzSlabThread_T *thd)
+{
+    int i, n = QZ_SLAB_KINDS * g_qz_slab.nodes * QZ_SLAB_CLASSES;
+
+    for (i = 0; i < n; i++) {
+        qzSlabPut(i, thd->cache[i].blocks, thd->cache[i].cnt);
+        thd->cache[i].cnt = 0;
+    }
+    qzSlabFold(thd);
+}
+
+static void qzSlabThreadExit(void *arg)
+{
+    qzSlabFlush((QzSlabThread_T *)arg);
+    free(arg);
+    g_qz_slab_thd = NULL;
+}
+
+static QzSlabThread_T *qzSlabThread(void)
+{
+    int i, n;
+
+    if (likely(NULL != g_qz_slab_thd)) {
+        return g_qz_slab_thd;
+    }
+
+    pthread_once(&g_qz_slab_once, qzSlabInit);
+    if (NULL == g_qz_slab.central) {
+        return NULL;
+    }
+
+    n = QZ_SLAB_KINDS * g_qz_slab.nodes * QZ_SLAB_CLASSES;
+    g_qz_slab_thd = calloc(1, sizeof(QzSlabThread_T) +
+                           n * sizeof(QzSlabCache_T) +
+                           QZ_SLAB_KINDS * g_qz_slab.nodes *
+                           QZ_MEM_PURPOSES * sizeof(long));
+    if (NULL == g_qz_slab_thd) {
+        return NULL;
+    }
+    g_qz_slab_thd->acct = (long *)&g_qz_slab_thd->cache[n];
+    for (i = 0; i < n; i++) {
+        g_qz_slab_thd->cache[i].max = QZ_SLAB_TCACHE_BYTES >>
+                                      (QZ_SLAB_MIN_SHIFT + i % QZ_SLAB_CLASSES);
+        if (g_qz_slab_thd->cache[i].max > QZ_SLAB_TCACHE_MAX) {
+            g_qz_slab_thd->cache[i].max = QZ_SLAB_TCACHE_MAX;
+        } else if (0 == g_qz_slab_thd->cache[i].max) {
+            g_qz_slab_thd->cache[i].max = 1;
+        }
+    }
+    pthread_setspecific(g_qz_slab.key, g_qz_slab_thd);
+    return g_qz_slab_thd;
+}
+
+/* A block of the size class of sz, from the thread cache when it has one.
+ * Returns NULL when sz is over the largest class or no slab could be had.
+ */
+static void *qzSlabAlloc(size_t sz, int node, int pinned, int purpose)
+{
+    unsigned int shift, idx, want;
+    QzSlabThread_T *thd;
+    QzSlabCache_T *cache;
+    int kind, group;
+
+    if (sz > QZ_SLAB_SIZE) {
+        return NULL;
+    }
+    thd = qzSlabThread();
+    if (NULL == thd || node < 0 || node >= g_qz_slab.nodes) {
+        return NULL;
+    }
+
+    shift = qzSlabShift(sz);
+    kind = (!pinned && atomic_load(&g_qz_slab.no_usdm)) ?
+           QZ_SLAB_KIND_COMMON : QZ_SLAB_KIND_PINNED;
+    for (;;) {
+        group = kind * g_qz_slab.nodes + node;
+        idx = group * QZ_SLAB_CLASSES + shift - QZ_SLAB_MIN_SHIFT;
+        cache = &thd->cache[idx];
+        if (likely(cache->cnt > 0)) {
+            thd->hits++;
+            thd->acct[group * QZ_MEM_PURPOSES + purpose] += 1L << shift;
+            return cache->blocks[--cache->cnt];
+        }
+
+        want = (cache->max + 1) / 2;
+        cache->cnt = qzSlabTake(idx, shift, cache->blocks, want);
+        if (cache->cnt > 0) {
+            if (QZ_SLAB_KIND_PINNED == kind) {
+                atomic_store(&g_qz_slab.no_usdm, 0);
+            } else if (!pinned) {
+                atomic_fetch_add(&g_qz_mem.common_fallbacks, 1);
+            }
+            atomic_fetch_add(&g_qz_slab.central_hits, 1);
+            thd->acct[group * QZ_MEM_PURPOSES + purpose] += 1L << shift;
+            qzSlabFoldAcct(thd, group, purpose);
+            return cache->blocks[--cache->cnt];
+        }
+        if (pinned || QZ_SLAB_KIND_COMMON == kind) {
+            return NULL;
+        }
+        atomic_store(&g_qz_slab.no_usdm, 1);
+        kind = QZ_SLAB_KIND_COMMON;
+    }
+}
+
+static void qzSlabFree(QzSlab_T *slab, void *m, int purpose)
+{
+    QzSlabThread_T *thd = qzSlabThread();
+    int group = slab->idx / QZ_SLAB_CLASSES;
+    QzSlabCache_T *cache;
+    unsigned int half;
+
+    if (unlikely(0 != (((unsigned char *)m - slab->base) &
+                       ((1UL << slab->shift) - 1)))) {
+        QZ_ERROR("0x%lx isn't a block of slab 0x%lx\n", (unsigned long)m,
+                 (unsigned long)slab->base);
+        return;
+    }
+    if (unlikely(NULL == thd)) {
+        qzMemUncharge(group % g_qz_slab.nodes,
+                      QZ_SLAB_KIND_PINNED == group / g_qz_slab.nodes,
+                      purpose, 1UL << slab->shift);
+        qzSlabPut(slab->idx, &m, 1);
+        return;
+    }
+
+    thd->acct[group * QZ_MEM_PURPOSES + purpose] -= 1L << slab->shift;
+    cache = &thd->cache[slab->idx];
+    if (unlikely(cache->cnt == cache->max)) {
+        qzSlabFoldAcct(thd, group, purpose);
+        half = cache->max / 2;
+        qzSlabPut(slab->idx, cache->blocks + cache->cnt - half, half);
+        cache->cnt -= half;
+        if (cache->cnt == cache->max) {
+            qzSlabPut(slab->idx, &m, 1);
+            return;
+        }
+    }
+    cache->blocks[cache->cnt++] = m;
+}
+
+/* Give back the slabs left empty, skipping the central lists locked by
+ * others unless wait is set
+ */
+static void qzSlabReleaseEmpty(int wait)
+{
+    QzSlabCentral_T *central;
+    QzSlab_T *slab, *next;
+    int i, n;
+
+    n = QZ_SLAB_KINDS * g_qz_slab.nodes * QZ_SLAB_CLASSES;
+    for (i = 0; i < n; i++) {
+        central = &g_qz_slab.central[i];
+        if (0 != (wait ? pthread_mutex_lock(&central->lock) :
+                  pthread_mutex_trylock(&central->lock))) {
+            continue;
+        }
+        for (slab = central->partial; NULL != slab; slab = next) {
+            next = slab->next;
+            if (0 == slab->used) {
+                qzSlabListDel(&central->partial, slab);
+                qzSlabRelease(slab);
+            }
+        }
+        pthread_mutex_unlock(&central->lock);
+    }
+}
+
+/* Make room under the budget. It may run under a central lock, which
+ * trylock skips.
+ */
+static void qzSlabTrim(void)
+{
+    if (NULL == g_qz_slab.central) {
+        return;
+    }
+    qzSlabReleaseEmpty(0);
+}
+
+/* Give back the calling thread's cache and the slabs left empty */
+static void qzSlabDestroy(void)
+{
+    if (NULL == g_qz_slab.central) {
+        return;
+    }
+    if (NULL != g_qz_slab_thd) {
+        qzSlabFlush(g_qz_slab_thd);
+    }
+    qzSlabReleaseEmpty(1);
+}
+
+int qzSetMemPoolLimit(size_t bytes)
+{
+    pthread_once(&g_qz_slab_once, qzSlabInit);
+    if (NULL == g_qz_slab.central) {
+        return QZ_FAIL;
+    }
+
+    atomic_store(&g_qz_slab.limit, bytes);
+    return QZ_OK;
+}
+
+int qzGetMemPoolStats(QzMemPoolStats_T *stats)
+{
+    if (NULL == stats) {
+        return QZ_PARAMS;
+    }
+
+    if (NULL != g_qz_slab_thd) {
+        qzSlabFold(g_qz_slab_thd);
+    }
+    stats->slabs = atomic_load(&g_qz_slab.slabs);
+    stats->slab_bytes = atomic_load(&g_qz_slab.slab_bytes);
+    stats->retained_bytes = atomic_load(&g_qz_slab.retained);
+    stats->retain_limit = atomic_load(&g_qz_slab.limit);
+    stats->cache_hits = atomic_load(&g_qz_slab.cache_hits);
+    stats->central_hits = atomic_load(&g_qz_slab.central_hits);
+    stats->slab_allocs = atomic_load(&g_qz_slab.slab_allocs);
+    stats->slab_frees = atomic_load(&g_qz_slab.slab_frees);
+    stats->direct_allocs = atomic_load(&g_qz_slab.direct_allocs);
+
+    return QZ_OK;
+}
+
+int qzSetMemBudget(int node, size_t bytes)
+{
+    if (QZ_AUTO_SELECT_NUMA_NODE == node) {
+        atomic_store(&g_qz_mem.budget, bytes);
+        return QZ_OK;
+    }
+    if (node < 0 || node >= QZ_MEM_MAX_NODES) {
+        return QZ_PARAMS;
+    }
+
+    atomic_store(&g_qz_mem.node_budget[node], bytes);
+    return QZ_OK;
+}
+
+int qzGetMemStats(QzMemStats_T *stats)
+{
+    int i, p;
+
+    if (NULL == stats) {
+        return QZ_PARAMS;
+    }
+
+    if (NULL != g_qz_slab_thd) {
+        qzSlabFold(g_qz_slab_thd);
+    }
+    for (i = 0; i < QZ_MEM_MAX_NODES; i++) {
+        for (p = 0; p < QZ_MEM_PURPOSES; p++) {
+            stats->pinned[i][p] = atomic_load(&g_qz_mem.bytes[i][1][p]);
+            stats->common[i][p] = atomic_load(&g_qz_mem.bytes[i][0][p]);
+        }
+        stats->usdm[i] = atomic_load(&g_qz_mem.usdm[i]);
+        stats->node_budget[i] = atomic_load(&g_qz_mem.node_budget[i]);
+    }
+    stats->usdm_total = atomic_load(&g_qz_mem.usdm_total);
+    stats->budget = atomic_load(&g_qz_mem.budget);
+    stats->budget_denials = atomic_load(&g_qz_mem.budget_denials);
+    stats->common_fallbacks = atomic_load(&g_qz_mem.common_fallbacks);
+    stats->ring_denials = atomic_load(&g_process.ring_denials);
+
+    return QZ_OK;
+}
+
+/* KB of USDM and pageable memory held, and whether it is on huge pages */
+void qzMemGetStatus(unsigned long *kb, unsigned char *huge)
+{
+    unsigned long bytes = atomic_load(&g_qz_mem.usdm_total);
+    char buf[32] = {0};
+    int i, p, fd;
+
+    if (NULL != g_qz_slab_thd) {
+        qzSlabFold(g_qz_slab_thd);
+    }
+    for (i = 0; i < QZ_MEM_MAX_NODES; i++) {
+        for (p = 0; p < QZ_MEM_PURPOSES; p++) {
+            bytes += atomic_load(&g_qz_mem.bytes[i][0][p]);
+        }
+    }
+    *kb = bytes >> 10;
+
+    /* USDM memory is on huge pages when its driver reserves some */
+    *huge = atomic_load(&g_qz_mem.huge) ? 1 : 0;
+    if (0 == *huge && 0 != bytes) {
+        fd = open("/sys/module/usdm_drv/parameters/max_huge_pages", O_RDONLY);
+        if (fd >= 0) {
+            if (read(fd, buf, sizeof(buf) - 1) > 0 && atoi(buf) > 0) {
+                *huge = 1;
+            }
+            close(fd);
+        }
+    }
+}
+
 void qzMemDestory(void)
 {
     if (0 == g_table_init) {
         return;
     }
 
+    qzSlabDestroy();
+
     if (0 != pthread_mutex_lock(&g_qz_table_lock)) {
         return;
     }
 
+    reclaimLevels(&g_qz_retired);
     freePageTable(&g_qz_page_table);
     g_table_init = 0;
 
@@ -166,26 +1181,16 @@ void qzMemDestory(void)
     }
 }
 
-void *qzMalloc(size_t sz, int numa, int pinned)
+static void *doQzMalloc(size_t sz, int numa, int pinned, int pool,
+                        int purpose)
 {
     int status;
     int real_numa;
     QzSession_T temp_sess;
     qzMemSet(&temp_sess, 0, sizeof(QzSession_T));
 
-    if (0 == g_table_init) {
-        if (0 != pthread_mutex_lock(&g_qz_table_lock)) {
-            return NULL;
-        }
-
-        if (0 == g_table_init) {
-            qzMemSet(&g_qz_page_table, 0, sizeof(QzPageTable_T));
-            g_table_init = 1;
-        }
-
-        if (0 != pthread_mutex_unlock(&g_qz_table_lock)) {
-            return NULL;
-        }
+    if (0 != qzMemTableInit()) {
+        return NULL;
     }
 
     if (1 == pinned && QZ_NONE == g_process.qz_init_status) {
@@ -207,35 +1212,90 @@ void *qzMalloc(size_t sz, int numa, int pinned)
         real_numa = numa;
     }
 
-    g_a = qaeMemAllocNUMA(sz, real_numa, 64);
+    if (pool) {
+        g_a = qzSlabAlloc(sz, real_numa, pinned, purpose);
+        if (NULL != g_a) {
+            return g_a;
+        }
+        atomic_fetch_add(&g_qz_slab.direct_allocs, 1);
+    }
+
+    g_a = qzMemUsdmAlloc(sz, real_numa, 64);
     if (NULL == g_a) {
         if (0 == pinned) {
             QZ_MEM_PRINT("regular malloc\n");
             g_a = malloc(sz);
+            if (NULL == g_a) {
+                return NULL;
+            }
+            if (0 != qzMemRegAddr(g_a, sz, real_numa, 0, purpose)) {
+                free(g_a);
+                return NULL;
+            }
+            atomic_fetch_add(&g_qz_mem.common_fallbacks, 1);
+            qzMemCharge(real_numa, 0, purpose, sz);
         }
     } else {
-        if (0 != qzMemRegAddr(g_a, sz)) {
-            qaeMemFreeNUMA((void **)&g_a);
+        if (0 != qzMemRegAddr(g_a, sz, real_numa, 1, purpose)) {
+            qzMemUsdmFree((void **)&g_a, sz, real_numa);
             return NULL;
         }
+        qzMemCharge(real_numa, 1, purpose, sz);
     }
 
     return g_a;
 }
 
-void qzFree(void *m)
+void *qzMalloc(size_t sz, int numa, int pinned)
+{
+    return doQzMalloc(sz, numa, pinned, 1, QZ_MEM_USER);
+}
+
+/* qzMalloc accounted to purpose, one of QZ_MEM_* */
+void *qzMallocFor(size_t sz, int numa, int pinned, int purpose)
+{
+    return doQzMalloc(sz, numa, pinned, 1, purpose);
+}
+
+/* qzMalloc without the slab pool, for buffers cached by their owner */
+void *qzMallocDirect(size_t sz, int numa, int pinned, int purpose)
 {
+    return doQzMalloc(sz, numa, pinned, 0, purpose);
+}
+
+/* qzFree of a qzMallocFor allocation of purpose */
+void qzFreeFor(void *m, int purpose)
+{
+    QzSlab_T *slab;
+    size_t sz;
+    int numa, pinned;
+
     if (NULL == m) {
         return;
     }
 
+    slab = qzSlabFind(m);
+    if (NULL != slab) {
+        qzSlabFree(slab, m, purpose);
+        return;
+    }
+
     QZ_MEM_PRINT("\t\tfreeing 0x%lx\n", (unsigned long)m);
-    if (1 == qzMemFindAddr(m)) {
-        qaeMemFreeNUMA((void **)&m);
-        qzMemUnRegAddr(m);
+    /* out of the page table before the memory can be reused */
+    pinned = qzMemForget(m, &sz, &numa, &purpose);
+    if (pinned >= 0) {
+        qzMemUncharge(numa, pinned, purpose, sz);
+    }
+    if (1 == pinned) {
+        qzMemUsdmFree((void **)&m, sz, numa);
     } else {
         free(m);
     }
 
     m = NULL;
 }
+
+void qzFree(void *m)
+{
+    qzFreeFor(m, QZ_MEM_USER);
+}
@@ -38,6 +38,7 @@
 #define _QATZIP_PAGE_TABLE_H
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <qatzip_internal.h>
 
@@ -46,6 +47,21 @@
 #define PAGE_MASK  (~(PAGE_SIZE - 1))
 #define LEVEL_SIZE (PAGE_SIZE / sizeof(uint64_t))
 #define PINNED     (-1)
+/* pinned by the application, see qzRegisterMemory */
+#define REGISTERED (-2)
+/* being registered, only while the table lock is held */
+#define MARKING    (-3)
+/* storeLevel: whatever entries hold */
+#define STORE_ANY  (1)
+
+/* Span of an entry of the levels below the root, level 2 entries are 1 GB
+ * and level 1 entries 2 MB. Entries of these levels and of level 0 hold
+ * either a type for their whole span or a pointer to the next level, told
+ * apart as the types aren't page aligned.
+ */
+#define LEVEL_SHIFT(l)     (PAGE_SHIFT + 9 * (l))
+#define MAX_LEAF_LEVEL     (2)
+#define IS_NEXT_LEVEL(mt)  (0 != (mt) && 0 == ((mt) & ~PAGE_MASK))
 
 typedef struct __attribute__((__packed__))
 {
@@ -69,8 +85,77 @@ typedef struct QzPageTable_T {
     } next[LEVEL_SIZE];
 } QzPageTable_T;
 
+/* A level emptied in a live table is never unmapped, as a lookup which
+ * doesn't take the table lock may still be reading it. It is unlinked and
+ * kept, all zero, for the table to take again when it needs a level, so
+ * that the levels held stay those the table needed at its largest.
+ */
+typedef struct QzPageRetired_S {
+    QzPageTable_T *level;
+    struct QzPageRetired_S *next;
+} QzPageRetired_T;
+
+typedef struct QzPageRetireQ_S {
+    QzPageRetired_T *head;
+} QzPageRetireQ_T;
+
+/* Unmap the retired levels, once the table is no longer looked up */
+static inline void reclaimLevels(QzPageRetireQ_T *q)
+{
+    QzPageRetired_T *r;
 
-static inline void *nextLevel(QzPageTable_T *volatile *ptr)
+    while (NULL != (r = q->head)) {
+        q->head = r->next;
+        munmap(r->level, sizeof(QzPageTable_T));
+        free(r);
+    }
+}
+
+/* A retired level to link again, NULL if there is none */
+static inline QzPageTable_T *reuseLevel(QzPageRetireQ_T *q)
+{
+    QzPageRetired_T *r;
+    QzPageTable_T *level;
+
+    if (NULL == q || NULL == (r = q->head))
+        return NULL;
+
+    q->head = r->next;
+    level = r->level;
+    free(r);
+    return level;
+}
+
+static inline int isEmptyLevel(const QzPageTable_T *level)
+{
+    size_t i;
+
+    for (i = 0; i < LEVEL_SIZE; ++i) {
+        if (0 != level->next[i].mt)
+            return 0;
+    }
+    return 1;
+}
+
+/* Unlink the emptied level held by an entry, for the table to reuse */
+static inline void retireLevel(QzPageTable_T *volatile *ptr,
+                               QzPageRetireQ_T *q)
+{
+    QzPageRetired_T *r = malloc(sizeof(QzPageRetired_T));
+
+    /* without a record the level stays linked, empty but correct */
+    if (NULL == r)
+        return;
+
+    r->level = *ptr;
+    r->next = q->head;
+    *ptr = NULL;
+    q->head = r;
+}
+
+
+static inline void *nextLevel(QzPageTable_T *volatile *ptr,
+                              QzPageRetireQ_T *q)
 {
     QzPageTable_T *old_ptr = *ptr;
     QzPageTable_T *new_ptr;
@@ -78,15 +163,18 @@ static inline void *nextLevel(QzPageTable_T *volatile *ptr)
     if (NULL != old_ptr)
         return old_ptr;
 
-    new_ptr = mmap(NULL,
-                   sizeof(QzPageTable_T),
-                   PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS,
-                   -1,
-                   0);
-    if ((void *) - 1 == new_ptr) {
-        QZ_ERROR("nextLevel: mmap error\n");
-        return NULL;
+    new_ptr = reuseLevel(q);
+    if (NULL == new_ptr) {
+        new_ptr = mmap(NULL,
+                       sizeof(QzPageTable_T),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+        if ((void *) - 1 == new_ptr) {
+            QZ_ERROR("nextLevel: mmap error\n");
+            return NULL;
+        }
     }
 
     if (!__sync_bool_compare_and_swap(ptr, NULL, new_ptr))
@@ -95,6 +183,42 @@ static inline void *nextLevel(QzPageTable_T *volatile *ptr)
     return *ptr;
 }
 
+/* Replace the type held by an entry with a next level holding it in each
+ * of its entries. The level is filled before it is published, as lookups
+ * don't take the table lock.
+ */
+static inline void *splitLevel(QzPageTable_T *volatile *ptr, uint64_t type,
+                               QzPageRetireQ_T *q)
+{
+    QzPageTable_T *new_ptr;
+    size_t i;
+
+    if (0 == type)
+        return nextLevel(ptr, q);
+
+    new_ptr = reuseLevel(q);
+    if (NULL == new_ptr) {
+        new_ptr = mmap(NULL,
+                       sizeof(QzPageTable_T),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+        if ((void *) - 1 == new_ptr) {
+            QZ_ERROR("splitLevel: mmap error\n");
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < LEVEL_SIZE; ++i) {
+        new_ptr->next[i].mt = type;
+    }
+    __sync_synchronize();
+    *ptr = new_ptr;
+
+    return new_ptr;
+}
+
 static inline void freePageLevel(QzPageTable_T *const level, const size_t iter)
 {
     size_t i = 0;
@@ -103,8 +227,8 @@ static inline void freePageLevel(QzPageTable_T *const level, const size_t iter)
         return;
 
     for (i = 0; i < LEVEL_SIZE; ++i) {
-        QzPageTable_T *pt = level->next[i].pt;
-        if (NULL != pt) {
+        if (IS_NEXT_LEVEL(level->next[i].mt)) {
+            QzPageTable_T *pt = level->next[i].pt;
             freePageLevel(pt, iter - 1);
             munmap(pt, sizeof(QzPageTable_T));
         }
@@ -119,70 +243,107 @@ static inline void freePageTable(QzPageTable_T *const table)
     qzMemSet(table, 0, sizeof(QzPageTable_T));
 }
 
-static inline int storeAddr(QzPageTable_T *level,
-                            uintptr_t virt,
-                            uint64_t type)
+/* Set [lo, hi) to type in the subtree of level l, only where entries hold
+ * the type from unless from is STORE_ANY. An entry wholly in the range takes the
+ * type itself down from level 2, so that a range costs one store per 1 GB
+ * or 2 MB it covers plus the 4 KB pages at its unaligned ends. Levels left
+ * empty by clearing are retired to retired, if given, and taken from there
+ * first when a level is needed.
+ */
+static inline int storeLevel(QzPageTable_T *level, int l, uintptr_t lo,
+                             uintptr_t hi, uint64_t type, uint64_t from,
+                             QzPageRetireQ_T *retired)
 {
-    QzPageIndex_T id;
-
-    id.addr = virt;
-
-    level = nextLevel(&level->next[id.pg_entry.idxl3].pt);
-    if (NULL == level) {
-        return -1;
-    }
-
-    level = nextLevel(&level->next[id.pg_entry.idxl2].pt);
-    if (NULL == level) {
-        return -1;
-    }
+    const uintptr_t span = (uintptr_t)1 << LEVEL_SHIFT(l);
+    uintptr_t base, end;
+    QzPageTable_T *next;
+    uint64_t cur;
+    size_t idx;
+
+    for (; lo < hi; lo = end) {
+        idx = (lo >> LEVEL_SHIFT(l)) & (LEVEL_SIZE - 1);
+        base = lo & ~(span - 1);
+        end = (hi - base < span) ? hi : base + span;
+        cur = level->next[idx].mt;
+
+        if (!IS_NEXT_LEVEL(cur)) {
+            if (cur == type || ((uint64_t)STORE_ANY != from && cur != from))
+                continue;
+            if (0 == l || (l <= MAX_LEAF_LEVEL && lo == base &&
+                           end == base + span)) {
+                level->next[idx].mt = type;
+                continue;
+            }
+            next = splitLevel(&level->next[idx].pt, cur, retired);
+        } else {
+            next = level->next[idx].pt;
+        }
 
-    level = nextLevel(&level->next[id.pg_entry.idxl1].pt);
-    if (NULL == level) {
-        return -1;
+        if (NULL == next ||
+            0 != storeLevel(next, l - 1, lo, end, type, from, retired)) {
+            return -1;
+        }
+        if (0 == type && NULL != retired && isEmptyLevel(next)) {
+            retireLevel(&level->next[idx].pt, retired);
+        }
     }
 
-    level->next[id.pg_entry.idxl0].mt = type;
     return 0;
 }
 
+static inline int storeAddr(QzPageTable_T *level,
+                            uintptr_t virt,
+                            uint64_t type)
+{
+    return storeLevel(level, 3, virt & PAGE_MASK,
+                      (virt & PAGE_MASK) + PAGE_SIZE, type, STORE_ANY, NULL);
+}
+
 static inline int storeMmapRange(QzPageTable_T *p_level,
                                  void *p_virt,
                                  uint64_t type,
-                                 size_t p_size)
+                                 size_t p_size,
+                                 QzPageRetireQ_T *retired)
 {
-    size_t offset;
-    size_t page_size = PAGE_SIZE;
     const uintptr_t virt = (uintptr_t)p_virt;
 
-    for (offset = 0; offset < p_size; offset += page_size) {
-        if (0 != storeAddr(p_level, virt + offset, type)) {
-            return -1;
-        }
-    }
+    return storeLevel(p_level, 3, virt, virt + p_size, type, STORE_ANY,
+                      retired);
+}
 
-    return 0;
+/* Set the empty entries of [lo, hi) to type. If the table can't be
+ * extended, only the entries this call set are cleared again.
+ */
+static inline int markRange(QzPageTable_T *table, uintptr_t lo, uintptr_t hi,
+                            uint64_t type, QzPageRetireQ_T *retired)
+{
+    if (0 != storeLevel(table, 3, lo, hi, (uint64_t)MARKING, 0, retired)) {
+        storeLevel(table, 3, lo, hi, 0, (uint64_t)MARKING, retired);
+        return -1;
+    }
+    return storeLevel(table, 3, lo, hi, type, (uint64_t)MARKING, retired);
 }
 
 static inline uint64_t loadAddr(QzPageTable_T *level, void *virt)
 {
     QzPageIndex_T id;
+    uint64_t mt;
 
     id.addr = (uintptr_t)virt;
 
-    level = level->next[id.pg_entry.idxl3].pt;
-    if (NULL == level)
-        return 0;
+    mt = level->next[id.pg_entry.idxl3].mt;
+    if (!IS_NEXT_LEVEL(mt))
+        return mt;
 
-    level = level->next[id.pg_entry.idxl2].pt;
-    if (NULL == level)
-        return 0;
+    mt = ((QzPageTable_T *)mt)->next[id.pg_entry.idxl2].mt;
+    if (!IS_NEXT_LEVEL(mt))
+        return mt;
 
-    level = level->next[id.pg_entry.idxl1].pt;
-    if (NULL == level)
-        return 0;
+    mt = ((QzPageTable_T *)mt)->next[id.pg_entry.idxl1].mt;
+    if (!IS_NEXT_LEVEL(mt))
+        return mt;
 
-    return level->next[id.pg_entry.idxl0].mt;
+    return ((QzPageTable_T *)mt)->next[id.pg_entry.idxl0].mt;
 }
 
 #endif
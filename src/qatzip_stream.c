@@ -48,233 +48,330 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <qatzip.h>
 #include <qz_utils.h>
 #include <qatzip_internal.h>
+#define XXH_NAMESPACE QATZIP_
+#include "xxhash.h"
+
+/* Stream buffers are cached by size class of STREAM_BUFF_GRAIN, in a
+ * magazine of STREAM_BUFF_LIST_SZ per thread and class in use and behind
+ * that in a lock-free depot per class. Each buffer has its header in front
+ * of it, so it goes back to its class without a lookup. A trim frees the
+ * depots at once and the magazines as their threads come back.
+ */
+#define STREAM_BUFF_LIST_SZ   8
+#define STREAM_BUFF_MAGS      4
+#define STREAM_BUFF_DEPOT_MAX 32
+#define STREAM_BUFF_GRAIN     (4 * 1024)
+#define STREAM_BUFF_CLASSES   \
+    ((QZ_STRM_BUFF_MAX_SZ + STREAM_BUFF_GRAIN - 1) / STREAM_BUFF_GRAIN + 1)
+
+typedef struct StreamBuffHdr_S {
+    unsigned int cls;
+    int pinned;
+} __attribute__((aligned(64))) StreamBuffHdr_T;
 
-#define STREAM_BUFF_LIST_SZ 8
+/* Buffers change hands by exchanging a slot, never by following a link,
+ * so a buffer taken from the depot can be freed at once.
+ */
+typedef struct StreamBuffDepot_S {
+    StreamBuffHdr_T *slots[STREAM_BUFF_DEPOT_MAX];
+} StreamBuffDepot_T;
 
-typedef struct StreamBuffNode_S {
-    void *buffer;
-    size_t size;
+typedef struct StreamBuffMag_S {
+    unsigned int cls;
     int pinned;
-    struct StreamBuffNode_S *next;
-    struct StreamBuffNode_S *prev;
-} StreamBuffNode_T;
-
-typedef struct StreamBuffNodeList_S {
-    StreamBuffNode_T *head;
-    StreamBuffNode_T *tail;
-    unsigned int size;
-    pthread_mutex_t mutex;
-} StreamBuffNodeList_T;
-
-StreamBuffNodeList_T g_strm_buff_list_free = {
-    .head = NULL,
-    .tail = NULL,
-    .size = 0,
-    .mutex = PTHREAD_MUTEX_INITIALIZER
-};
-
-StreamBuffNodeList_T g_strm_buff_list_used = {
-    .head = NULL,
-    .tail = NULL,
-    .size = 0,
-    .mutex = PTHREAD_MUTEX_INITIALIZER
-};
-
-static inline int addNodeToList(StreamBuffNode_T *node,
-                                StreamBuffNodeList_T *buff_list)
-{
-    buff_list->size += 1;
-    node->next = NULL;
-    if (NULL == buff_list->tail) {
-        buff_list->head = node;
-        node->prev = NULL;
-    } else {
-        node->prev = buff_list->tail;
-        buff_list->tail->next = node;
-    }
-    buff_list->tail = node;
+    unsigned int cnt;
+    unsigned long last_use;
+    StreamBuffHdr_T *bufs[STREAM_BUFF_LIST_SZ];
+} StreamBuffMag_T;
+
+typedef struct StreamBuffThread_S {
+    unsigned long clock;
+    /* g_strm_buff_gen when the magazines were last emptied */
+    unsigned long gen;
+    StreamBuffMag_T mags[STREAM_BUFF_MAGS];
+} StreamBuffThread_T;
+
+/* Depots are set up on first use of their class */
+static StreamBuffDepot_T *g_strm_buff_depot[2][STREAM_BUFF_CLASSES];
+static pthread_key_t g_strm_buff_key;
+static pthread_once_t g_strm_buff_once = PTHREAD_ONCE_INIT;
+static int g_strm_buff_key_ok = 0;
+static __thread StreamBuffThread_T *g_strm_buff_thd;
+/* Bumped by streamBufferTrim, each thread then frees what its magazines
+ * hold on its next stream buffer alloc or free
+ */
+static unsigned long g_strm_buff_gen = 0;
+
+static inline void *streamBufferData(StreamBuffHdr_T *hdr)
+{
+    return (unsigned char *)hdr + sizeof(StreamBuffHdr_T);
+}
 
-    return SUCCESS;
+static inline StreamBuffHdr_T *streamBufferHdr(void *addr)
+{
+    return (StreamBuffHdr_T *)((unsigned char *)addr - sizeof(StreamBuffHdr_T));
 }
 
-static inline int removeNodeFromList(StreamBuffNode_T *node,
-                                     StreamBuffNodeList_T *buff_list)
+static StreamBuffDepot_T *depotGet(int pinned, unsigned int cls)
 {
-    buff_list->size -= 1;
-    if (NULL != node->prev) {
-        node->prev->next = node->next;
-        if (NULL != node->next) {
-            node->next->prev = node->prev;
-        } else {
-            buff_list->tail = node->prev;
-        }
-    } else {
-        if (NULL != node->next) {
-            node->next->prev = NULL;
-            buff_list->head = node->next;
-        } else {
-            buff_list->head = NULL;
-            buff_list->tail = NULL;
-        }
+    StreamBuffDepot_T *depot, *expected = NULL;
+
+    depot = __atomic_load_n(&g_strm_buff_depot[pinned][cls], __ATOMIC_ACQUIRE);
+    if (likely(NULL != depot)) {
+        return depot;
     }
 
-    return SUCCESS;
+    depot = calloc(1, sizeof(StreamBuffDepot_T));
+    if (NULL == depot) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(&g_strm_buff_depot[pinned][cls],
+                                     &expected, depot, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        free(depot);
+        depot = expected;
+    }
+    return depot;
 }
 
-void streamBufferCleanup(void)
+/* Returns 0 when the depot is full and hdr wasn't taken */
+static int depotPush(StreamBuffDepot_T *depot, StreamBuffHdr_T *hdr)
 {
-    StreamBuffNode_T *node;
-    StreamBuffNode_T *next;
+    StreamBuffHdr_T *expected;
+    int i;
 
-    if (unlikely(0 != pthread_mutex_lock(&g_strm_buff_list_used.mutex))) {
-        QZ_ERROR("Failed to get Mutex Lock.\n");
-        return;
+    for (i = 0; i < STREAM_BUFF_DEPOT_MAX; i++) {
+        expected = NULL;
+        if (NULL == __atomic_load_n(&depot->slots[i], __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&depot->slots[i], &expected, hdr, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    node = g_strm_buff_list_used.head;
-    while (node != NULL) {
-        next = node->next;
-        removeNodeFromList(node, &g_strm_buff_list_used);
-        qzFree(node->buffer);
-        free(node);
-        node = next;
+static StreamBuffHdr_T *depotPop(StreamBuffDepot_T *depot)
+{
+    StreamBuffHdr_T *hdr;
+    int i;
+
+    for (i = 0; i < STREAM_BUFF_DEPOT_MAX; i++) {
+        if (NULL != __atomic_load_n(&depot->slots[i], __ATOMIC_RELAXED)) {
+            hdr = __atomic_exchange_n(&depot->slots[i], NULL, __ATOMIC_ACQUIRE);
+            if (NULL != hdr) {
+                return hdr;
+            }
+        }
     }
+    return NULL;
+}
 
-    if (unlikely(0 != pthread_mutex_unlock(&g_strm_buff_list_used.mutex))) {
-        QZ_ERROR("Failed to release Mutex Lock.\n");
-        return;
+static void streamBufferRelease(StreamBuffHdr_T *hdr)
+{
+    StreamBuffDepot_T *depot = depotGet(hdr->pinned, hdr->cls);
+
+    if (NULL == depot || !depotPush(depot, hdr)) {
+        qzFreeFor(hdr, QZ_MEM_STREAM);
     }
+}
 
-    if (unlikely(0 != pthread_mutex_lock(&g_strm_buff_list_free.mutex))) {
-        QZ_ERROR("Failed to get Mutex Lock.\n");
-        return;
+static void magFlush(StreamBuffMag_T *mag)
+{
+    while (mag->cnt > 0) {
+        streamBufferRelease(mag->bufs[--mag->cnt]);
     }
+}
 
-    node = g_strm_buff_list_free.head;
-    while (node != NULL) {
-        next = node->next;
-        removeNodeFromList(node, &g_strm_buff_list_free);
-        qzFree(node->buffer);
-        free(node);
-        node = next;
+static void magDrop(StreamBuffMag_T *mag)
+{
+    while (mag->cnt > 0) {
+        qzFreeFor(mag->bufs[--mag->cnt], QZ_MEM_STREAM);
     }
+}
 
-    if (unlikely(0 != pthread_mutex_unlock(&g_strm_buff_list_free.mutex))) {
-        QZ_ERROR("Failed to release Mutex Lock.\n");
-        return;
+static void streamBufferThreadExit(void *arg)
+{
+    StreamBuffThread_T *thd = arg;
+    int i;
+
+    for (i = 0; i < STREAM_BUFF_MAGS; i++) {
+        magFlush(&thd->mags[i]);
     }
+    free(thd);
+    g_strm_buff_thd = NULL;
 }
 
-static void *getNodeBuffFromFreeList(size_t sz, int pinned)
+static void streamBufferInit(void)
 {
-    pthread_mutex_lock(&g_strm_buff_list_free.mutex);
-    pthread_mutex_lock(&g_strm_buff_list_used.mutex);
+    g_strm_buff_key_ok =
+        (0 == pthread_key_create(&g_strm_buff_key, streamBufferThreadExit));
+}
 
-    void *retval  = NULL;
-    StreamBuffNode_T *node;
+static StreamBuffThread_T *streamBufferThread(void)
+{
+    StreamBuffThread_T *thd = g_strm_buff_thd;
+    unsigned long gen;
+    int i;
 
-    for (node = g_strm_buff_list_free.head; node != NULL; node = node->next) {
-        if (pinned == node->pinned && sz <= node->size) {
-            if (!removeNodeFromList(node, &g_strm_buff_list_free)) {
-                retval = NULL;
-                goto done;
+    if (likely(NULL != thd)) {
+        gen = __atomic_load_n(&g_strm_buff_gen, __ATOMIC_RELAXED);
+        if (unlikely(thd->gen != gen)) {
+            for (i = 0; i < STREAM_BUFF_MAGS; i++) {
+                magDrop(&thd->mags[i]);
             }
-            if (!addNodeToList(node, &g_strm_buff_list_used)) {
-                retval = NULL;
-                goto done;
-            }
-
-            retval = node->buffer;
-            goto done;
+            thd->gen = gen;
         }
+        return thd;
     }
 
-done:
-    pthread_mutex_unlock(&g_strm_buff_list_used.mutex);
-    pthread_mutex_unlock(&g_strm_buff_list_free.mutex);
-    return retval;
+    pthread_once(&g_strm_buff_once, streamBufferInit);
+    if (!g_strm_buff_key_ok) {
+        return NULL;
+    }
+    g_strm_buff_thd = calloc(1, sizeof(StreamBuffThread_T));
+    if (NULL != g_strm_buff_thd) {
+        g_strm_buff_thd->gen = __atomic_load_n(&g_strm_buff_gen,
+                                               __ATOMIC_RELAXED);
+        pthread_setspecific(g_strm_buff_key, g_strm_buff_thd);
+    }
+    return g_strm_buff_thd;
 }
 
-static void allocSomeNodesForFreeList(size_t sz, int numa, int pinned)
+/* The thread's magazine of cls, taking over the least recently used one
+ * when none is, or NULL if create is 0.
+ */
+static StreamBuffMag_T *magFind(StreamBuffThread_T *thd, unsigned int cls,
+                                int pinned, int create)
 {
-    StreamBuffNode_T *node;
+    StreamBuffMag_T *mag, *lru = &thd->mags[0];
     int i;
-    for (i = 0; i < STREAM_BUFF_LIST_SZ; ++i) {
-        node = malloc(sizeof(StreamBuffNode_T));
-        if (NULL == node) {
-            break;
-        }
 
-        node->buffer = qzMalloc(sz, numa, pinned);
-        if (NULL == node->buffer) {
-            free(node);
-            break;
+    for (i = 0; i < STREAM_BUFF_MAGS; i++) {
+        mag = &thd->mags[i];
+        if (mag->cls == cls && mag->pinned == pinned) {
+            mag->last_use = ++thd->clock;
+            return mag;
         }
-        node->pinned = pinned;
-        node->size = sz;
-
-        if (unlikely(0 != pthread_mutex_lock(&g_strm_buff_list_free.mutex))) {
-            QZ_ERROR("Failed to get Mutex Lock.\n");
-            free(node);
-            return;
+        if (mag->last_use < lru->last_use) {
+            lru = mag;
         }
+    }
+    if (!create) {
+        return NULL;
+    }
 
-        if (!addNodeToList(node, &g_strm_buff_list_free)) {
-            free(node);
-            if (unlikely(0 != pthread_mutex_unlock(&g_strm_buff_list_free.mutex))) {
-                QZ_ERROR("Failed to release Mutex Lock.\n");
-                return;
+    magFlush(lru);
+    lru->cls = cls;
+    lru->pinned = pinned;
+    lru->last_use = ++thd->clock;
+    return lru;
+}
+
+/* Free the buffers of the depots and of this thread's magazines. Other
+ * threads free theirs when they next use a stream buffer.
+ */
+void streamBufferTrim(void)
+{
+    StreamBuffDepot_T *depot;
+    StreamBuffHdr_T *hdr;
+    int i, j;
+
+    __atomic_add_fetch(&g_strm_buff_gen, 1, __ATOMIC_RELAXED);
+    if (NULL != g_strm_buff_thd) {
+        (void)streamBufferThread();
+    }
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < STREAM_BUFF_CLASSES; j++) {
+            depot = g_strm_buff_depot[i][j];
+            if (NULL == depot) {
+                continue;
+            }
+            while (NULL != (hdr = depotPop(depot))) {
+                qzFreeFor(hdr, QZ_MEM_STREAM);
             }
         }
+    }
+}
 
-        if (unlikely(0 != pthread_mutex_unlock(&g_strm_buff_list_free.mutex))) {
-            QZ_ERROR("Failed to release Mutex Lock.\n");
-            free(node);
-            return;
+void streamBufferCleanup(void)
+{
+    int i;
+
+    if (NULL != g_strm_buff_thd) {
+        for (i = 0; i < STREAM_BUFF_MAGS; i++) {
+            magFlush(&g_strm_buff_thd->mags[i]);
         }
     }
+    streamBufferTrim();
 }
 
 static void *streamBufferAlloc(size_t sz, int numa, int pinned)
 {
-    StreamBuffNode_T *node = getNodeBuffFromFreeList(sz, pinned);
-    if (NULL == node) { //try to add some nodes to free list
-        allocSomeNodesForFreeList(sz, numa, pinned);
-        node = getNodeBuffFromFreeList(sz, pinned);
+    unsigned int cls = (sz + STREAM_BUFF_GRAIN - 1) / STREAM_BUFF_GRAIN;
+    StreamBuffThread_T *thd;
+    StreamBuffMag_T *mag = NULL;
+    StreamBuffDepot_T *depot;
+    StreamBuffHdr_T *hdr = NULL;
+
+    pinned = !!pinned;
+    if (unlikely(0 == cls || cls >= STREAM_BUFF_CLASSES)) {
+        return NULL;
     }
-    return node;
+
+    thd = streamBufferThread();
+    if (likely(NULL != thd)) {
+        mag = magFind(thd, cls, pinned, 1);
+        if (mag->cnt > 0) {
+            return streamBufferData(mag->bufs[--mag->cnt]);
+        }
+    }
+
+    depot = depotGet(pinned, cls);
+    if (NULL != depot) {
+        hdr = depotPop(depot);
+    }
+    if (NULL == hdr) {
+        /* the buffer is cached here, not in the qzMalloc pool */
+        hdr = qzMallocDirect(sizeof(StreamBuffHdr_T) +
+                             (size_t)cls * STREAM_BUFF_GRAIN, numa, pinned,
+                             QZ_MEM_STREAM);
+        if (NULL == hdr) {
+            return NULL;
+        }
+        hdr->cls = cls;
+        hdr->pinned = pinned;
+    }
+    return streamBufferData(hdr);
 }
 
 static void streamBufferFree(void *addr)
 {
-    StreamBuffNode_T *node;
+    StreamBuffHdr_T *hdr;
+    StreamBuffThread_T *thd;
+    StreamBuffMag_T *mag;
 
-    pthread_mutex_lock(&g_strm_buff_list_free.mutex);
-    pthread_mutex_lock(&g_strm_buff_list_used.mutex);
-    for (node = g_strm_buff_list_used.head; node != NULL; node = node->next) {
-        if (addr == node->buffer) {
-            if (removeNodeFromList(node, &g_strm_buff_list_used) == FAILURE) {
-                QZ_ERROR("Fail to remove Node for streamBufferFree");
-                goto done;
-            }
-            if (STREAM_BUFF_LIST_SZ <= g_strm_buff_list_free.size) {
-                qzFree(node->buffer);
-                free(node);
-            } else {
-                addNodeToList(node, &g_strm_buff_list_free);
-            }
-            addr = NULL;
-            goto done;
-        }
+    if (NULL == addr) {
+        return;
     }
+    hdr = streamBufferHdr(addr);
 
-done:
-    pthread_mutex_unlock(&g_strm_buff_list_used.mutex);
-    pthread_mutex_unlock(&g_strm_buff_list_free.mutex);
+    thd = streamBufferThread();
+    if (likely(NULL != thd)) {
+        mag = magFind(thd, hdr->cls, hdr->pinned, 0);
+        if (NULL != mag && mag->cnt < STREAM_BUFF_LIST_SZ) {
+            mag->bufs[mag->cnt++] = hdr;
+            return;
+        }
+    }
+    streamBufferRelease(hdr);
 }
 
 int initStream(QzSession_T *sess, QzStream_T *strm)
@@ -313,6 +410,9 @@ int initStream(QzSession_T *sess, QzStream_T *strm)
     stream_buf->out_offset = 0;
     stream_buf->in_offset = 0;
     stream_buf->flush_more = 0;
+    stream_buf->pipe = NULL;
+    stream_buf->pipe_failed = 0;
+    stream_buf->xxh32 = NULL;
     stream_buf->buf_len = qz_sess->sess_params.strm_buff_sz;
     stream_buf->in_buf =
         streamBufferAlloc(stream_buf->buf_len, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
@@ -334,6 +434,15 @@ int initStream(QzSession_T *sess, QzStream_T *strm)
         NULL == stream_buf->out_buf) {
         goto clear;
     }
+
+    if (LZ4_FH == qz_sess->sess_params.data_fmt) {
+        stream_buf->xxh32 = XXH32_createState();
+        if (NULL == stream_buf->xxh32) {
+            QZ_ERROR("Fail to allocate XXH32 state of QzStreamBuf");
+            goto clear;
+        }
+        XXH32_reset(stream_buf->xxh32, 0);
+    }
     QZ_INFO("Allocate stream buf %u\n", stream_buf->buf_len);
 
     strm->pending_in = 0;
@@ -345,13 +454,13 @@ clear:
     if (NULL == stream_buf->in_buf) {
         QZ_ERROR("Fail to allocate memory for in_buf of QzStreamBuf");
     } else {
-        qzFree(stream_buf->in_buf);
+        streamBufferFree(stream_buf->in_buf);
     }
 
     if (NULL == stream_buf->out_buf) {
         QZ_ERROR("Fail to allocate memory for out_buf of QzStreamBuf");
     } else {
-        qzFree(stream_buf->out_buf);
+        streamBufferFree(stream_buf->out_buf);
     }
     free(stream_buf);
     stream_buf = NULL;
@@ -399,11 +508,398 @@ static unsigned int copyStreamOutput(QzStream_T *strm, unsigned char *out)
     return cpy_cnt;
 }
 
+/* Content checksums the stream keeps itself: XXH32 of LZ4 frames, which
+ * only carry their own, and Adler-32 of zlib streams
+ */
+static void streamChecksumUpdate(QzStreamBuf_T *stream_buf,
+                                 DataFormatInternal_T data_fmt,
+                                 const unsigned char *data, unsigned int len,
+                                 unsigned int *sum)
+{
+    if (0 == len) {
+        return;
+    }
+    if (LZ4_FH == data_fmt && NULL != stream_buf->xxh32) {
+        XXH32_update(stream_buf->xxh32, data, len);
+        *sum = XXH32_digest(stream_buf->xxh32);
+    } else if (DEFLATE_ZLIB == data_fmt) {
+        *sum = adler32((0 == *sum) ? adler32(0L, Z_NULL, 0) : *sum, data, len);
+    }
+}
+
+/* A flush ends the gzip member or LZ4 frame, unless single_member keeps
+ * it open: software would otherwise leave it without its trailer. Raw
+ * deflate goes on with non-final blocks, zlib is always one stream.
+ */
+static unsigned int streamFlushEnds(QzSession_T *sess)
+{
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+
+    return DEFLATE_RAW != data_fmt && DEFLATE_ZLIB != data_fmt &&
+           !qz_sess->sess_params.single_member;
+}
+
+/* RFC 1950 has no concatenation, so the zlib output of a stream is a
+ * single zlib stream: its calls run as with single_member set
+ */
+static int streamCompressCrc(QzSession_T *sess, const unsigned char *src,
+                             unsigned int *src_len, unsigned char *dest,
+                             unsigned int *dest_len, unsigned int last,
+                             unsigned long *crc)
+{
+    QzSess_T *qz_sess = (QzSess_T *)sess->internal;
+    int rc;
+
+    qz_sess->strm_member = (DEFLATE_ZLIB == qz_sess->sess_params.data_fmt);
+    rc = qzCompressCrc(sess, src, src_len, dest, dest_len, last, crc);
+    qz_sess->strm_member = 0;
+    return rc;
+}
+
+/* Input to compress straight from strm->in into strm->out, 0 when it has
+ * to go through the stream buffers: whole buffers unless last or a flush,
+ * and never more than surely fits in the output
+ */
+static unsigned int streamDirectLen(QzSession_T *sess, QzStream_T *strm,
+                                    unsigned int last)
+{
+    QzStreamBuf_T *stream_buf = strm->opaque;
+    unsigned int buf_len = stream_buf->buf_len;
+    unsigned int len, bound;
+
+    if (0 != strm->pending_in || 0 != strm->pending_out ||
+        1 == stream_buf->flush_more || strm->in_sz < buf_len) {
+        return 0;
+    }
+
+    len = last ? strm->in_sz : strm->in_sz - strm->in_sz % buf_len;
+    if (len > strm->out_sz) {
+        len = strm->out_sz - strm->out_sz % buf_len;
+    }
+    while (len >= buf_len) {
+        bound = qzMaxCompressedLength(len, sess);
+        if (0 != bound && bound <= strm->out_sz) {
+            return len;
+        }
+        len -= (len % buf_len) ? (len % buf_len) : buf_len;
+    }
+
+    return 0;
+}
+
+/* strm_pipeline: the caller fills slot fill % depth while the stream's
+ * worker compresses the slots in [done, fill) in order. The output of the
+ * slots in [drain, done) is handed out in order, a slot being free again
+ * once drained. fill and drain are the caller's, done is the worker's.
+ */
+typedef struct QzStreamSlot_S {
+    unsigned char *in_buf;
+    unsigned char *out_buf;
+    unsigned int in_len;
+    unsigned int out_len;
+    unsigned int out_offset;
+    unsigned int last;
+    /* in pending_out rather than pending_in */
+    unsigned int counted;
+    unsigned long crc;
+} QzStreamSlot_T;
+
+typedef struct QzStreamPipe_S {
+    /* the caller's session, the worker compresses with its clone wsess */
+    QzSession_T *sess;
+    QzSession_T wsess;
+    unsigned int depth;
+    /* input of a slot, whose output surely fits in out_cap */
+    unsigned int in_cap;
+    unsigned int out_cap;
+    QzStreamSlot_T slot[QZ_STRM_PIPELINE_MAX];
+    unsigned long fill;
+    unsigned long done;
+    unsigned long drain;
+    unsigned int last_filled;
+    unsigned long crc;
+    /* LZ4_FH: the stream's XXH32, only the worker updates it */
+    struct XXH32_state_s *xxh32;
+    /* DEFLATE_ZLIB: crc is the stream's Adler-32 */
+    unsigned int adler;
+    int rc;
+    int exit;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+} QzStreamPipe_T;
+
+static void *streamPipeWorker(void *arg)
+{
+    QzStreamPipe_T *pipe = (QzStreamPipe_T *)arg;
+    QzStreamSlot_T *slot;
+    unsigned int in_len, out_len;
+    unsigned long call_crc;
+    int rc = QZ_OK;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->exit) {
+        if (pipe->done == pipe->fill) {
+            pthread_cond_wait(&pipe->work_cond, &pipe->lock);
+            continue;
+        }
+        slot = &pipe->slot[pipe->done % pipe->depth];
+        pthread_mutex_unlock(&pipe->lock);
+
+        in_len = slot->in_len;
+        out_len = pipe->out_cap;
+        call_crc = pipe->crc;
+        if (QZ_OK == rc) {
+            rc = streamCompressCrc(&pipe->wsess, slot->in_buf, &in_len,
+                                   slot->out_buf, &out_len, slot->last,
+                                   &call_crc);
+            if (QZ_OK != rc || in_len != slot->in_len) {
+                QZ_ERROR("Pipelined stream compression failed: %d\n", rc);
+                rc = QZ_FAIL;
+            } else if (NULL != pipe->xxh32) {
+                if (in_len > 0) {
+                    XXH32_update(pipe->xxh32, slot->in_buf, in_len);
+                    pipe->crc = XXH32_digest(pipe->xxh32);
+                }
+            } else if (pipe->adler) {
+                if (in_len > 0) {
+                    pipe->crc = adler32((0 == pipe->crc) ?
+                                        adler32(0L, Z_NULL, 0) : pipe->crc,
+                                        slot->in_buf, in_len);
+                }
+            } else {
+                pipe->crc = call_crc;
+            }
+        }
+        slot->out_len = (QZ_OK == rc) ? out_len : 0;
+        slot->crc = pipe->crc;
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->rc = rc;
+        pipe->done++;
+        pthread_cond_signal(&pipe->done_cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+static void *streamPipeBufAlloc(size_t sz)
+{
+    void *buf = streamBufferAlloc(sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+
+    if (NULL == buf) {
+        buf = streamBufferAlloc(sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    }
+    return buf;
+}
+
+static void streamPipeFree(QzStreamPipe_T *pipe)
+{
+    unsigned int k;
+
+    for (k = 0; k < pipe->depth; k++) {
+        streamBufferFree(pipe->slot[k].in_buf);
+        streamBufferFree(pipe->slot[k].out_buf);
+    }
+    (void)qzTeardownSession(&pipe->wsess);
+    pthread_cond_destroy(&pipe->done_cond);
+    pthread_cond_destroy(&pipe->work_cond);
+    pthread_mutex_destroy(&pipe->lock);
+    free(pipe);
+}
+
+static void streamPipeDestroy(QzStreamPipe_T *pipe)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->exit = 1;
+    pthread_cond_signal(&pipe->work_cond);
+    pthread_mutex_unlock(&pipe->lock);
+    pthread_join(pipe->worker, NULL);
+    streamPipeFree(pipe);
+}
+
+static QzStreamPipe_T *streamPipeCreate(QzSession_T *sess, QzStream_T *strm,
+                                        unsigned int depth)
+{
+    QzStreamBuf_T *stream_buf = strm->opaque;
+    QzStreamPipe_T *pipe;
+    unsigned int k;
+
+    pipe = calloc(1, sizeof(QzStreamPipe_T));
+    if (NULL == pipe) {
+        return NULL;
+    }
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->work_cond, NULL);
+    pthread_cond_init(&pipe->done_cond, NULL);
+    pipe->sess = sess;
+    pipe->crc = strm->crc_32;
+    pipe->xxh32 = stream_buf->xxh32;
+    pipe->adler = (DEFLATE_ZLIB ==
+                   ((QzSess_T *)sess->internal)->sess_params.data_fmt);
+    pipe->rc = QZ_OK;
+    if (QZ_SETUP_SESSION_FAIL(qzCloneSession(&pipe->wsess, sess))) {
+        streamPipeFree(pipe);
+        return NULL;
+    }
+
+    /* Slots take no more input than what compresses into a stream buffer */
+    pipe->in_cap = stream_buf->buf_len;
+    while (pipe->in_cap > STREAM_BUFF_GRAIN &&
+           qzMaxCompressedLength(pipe->in_cap, sess) > QZ_STRM_BUFF_MAX_SZ) {
+        pipe->in_cap -= STREAM_BUFF_GRAIN;
+    }
+    pipe->out_cap = qzMaxCompressedLength(pipe->in_cap, sess);
+    if (0 == pipe->out_cap || pipe->out_cap > QZ_STRM_BUFF_MAX_SZ) {
+        streamPipeFree(pipe);
+        return NULL;
+    }
+
+    for (pipe->depth = 0; pipe->depth < depth; pipe->depth++) {
+        k = pipe->depth;
+        pipe->slot[k].in_buf = streamPipeBufAlloc(pipe->in_cap);
+        pipe->slot[k].out_buf = streamPipeBufAlloc(pipe->out_cap);
+        if (NULL == pipe->slot[k].in_buf || NULL == pipe->slot[k].out_buf) {
+            streamBufferFree(pipe->slot[k].in_buf);
+            streamBufferFree(pipe->slot[k].out_buf);
+            break;
+        }
+    }
+
+    /* With less than two buffers there is nothing to overlap */
+    if (pipe->depth < 2 ||
+        0 != pthread_create(&pipe->worker, NULL, streamPipeWorker, pipe)) {
+        streamPipeFree(pipe);
+        return NULL;
+    }
+
+    QZ_INFO("Stream pipeline of %u buffers of %u\n", pipe->depth,
+            pipe->in_cap);
+    return pipe;
+}
+
+/* qzCompressStream with a pipeline: takes all input it has room for and
+ * returns without waiting for the hardware, unless the slots are all busy
+ * or last asks for the end of the stream. A flush sends a part filled slot
+ * and waits for the output of all slots.
+ */
+static int streamPipeCompress(QzStream_T *strm, QzStreamPipe_T *pipe,
+                              unsigned int last, unsigned int flush)
+{
+    QzStreamSlot_T *slot;
+    unsigned int in_left = strm->in_sz, out_left = strm->out_sz;
+    unsigned int consumed = 0, produced = 0, cnt;
+    unsigned long done;
+    int progress, rc = QZ_OK;
+
+    /* new data after the end of the previous stream */
+    if (pipe->last_filled && pipe->drain == pipe->fill && in_left > 0) {
+        pipe->last_filled = 0;
+    }
+
+    for (;;) {
+        progress = 0;
+        pthread_mutex_lock(&pipe->lock);
+        done = pipe->done;
+        rc = pipe->rc;
+        pthread_mutex_unlock(&pipe->lock);
+        if (QZ_OK != rc) {
+            rc = QZ_FAIL;
+            break;
+        }
+
+        while (pipe->drain < done) {
+            slot = &pipe->slot[pipe->drain % pipe->depth];
+            if (!slot->counted) {
+                strm->pending_in -= slot->in_len;
+                strm->pending_out += slot->out_len;
+                strm->crc_32 = slot->crc;
+                pipe->sess->total_in += slot->in_len;
+                pipe->sess->total_out += slot->out_len;
+                slot->counted = 1;
+            }
+            cnt = slot->out_len - slot->out_offset;
+            cnt = (cnt > out_left) ? out_left : cnt;
+            QZ_MEMCPY(strm->out + produced, slot->out_buf + slot->out_offset,
+                      out_left, cnt);
+            slot->out_offset += cnt;
+            strm->pending_out -= cnt;
+            produced += cnt;
+            out_left -= cnt;
+            progress |= (0 != cnt);
+            if (slot->out_offset < slot->out_len) {
+                break;
+            }
+            slot->in_len = 0;
+            slot->out_len = 0;
+            slot->out_offset = 0;
+            slot->counted = 0;
+            pipe->drain++;
+            progress = 1;
+        }
+
+        if (pipe->fill - pipe->drain < pipe->depth && !pipe->last_filled &&
+            (in_left > 0 || last || flush)) {
+            slot = &pipe->slot[pipe->fill % pipe->depth];
+            cnt = pipe->in_cap - slot->in_len;
+            cnt = (cnt > in_left) ? in_left : cnt;
+            if (cnt > 0) {
+                QZ_MEMCPY(slot->in_buf + slot->in_len, strm->in + consumed,
+                          pipe->in_cap - slot->in_len, cnt);
+            }
+            slot->in_len += cnt;
+            strm->pending_in += cnt;
+            consumed += cnt;
+            in_left -= cnt;
+            progress |= (0 != cnt);
+
+            if (slot->in_len == pipe->in_cap || (last && 0 == in_left) ||
+                (flush && 0 == in_left && slot->in_len > 0)) {
+                slot->last = (last && 0 == in_left) ? 1 : 0;
+                pipe->last_filled = slot->last;
+                if (flush && 0 == in_left && !slot->last) {
+                    slot->last = streamFlushEnds(pipe->sess);
+                }
+                pthread_mutex_lock(&pipe->lock);
+                pipe->fill++;
+                pthread_cond_signal(&pipe->work_cond);
+                pthread_mutex_unlock(&pipe->lock);
+                progress = 1;
+            }
+        }
+
+        if (progress) {
+            continue;
+        }
+        /* Wait for the worker only when input waits for a slot or the end
+         * of the stream or a flush is asked for, and there is room for its
+         * output
+         */
+        if (0 == out_left || pipe->drain == pipe->fill ||
+            (0 == in_left && !last && !flush)) {
+            break;
+        }
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->done == done && QZ_OK == pipe->rc) {
+            pthread_cond_wait(&pipe->done_cond, &pipe->lock);
+        }
+        pthread_mutex_unlock(&pipe->lock);
+    }
+
+    strm->in_sz = consumed;
+    strm->out_sz = produced;
+    return rc;
+}
+
 
 int qzCompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
 {
     int rc = QZ_FAIL;
     unsigned long *strm_crc = NULL;
+    unsigned long call_crc = 0;
     unsigned int input_len = 0;
     unsigned int output_len = 0;
     unsigned int copied_output = 0;
@@ -414,13 +910,15 @@ int qzCompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
     unsigned int consumed = 0;
     unsigned int produced = 0;
     unsigned int strm_last = 0;
+    unsigned int flush = 0;
+    unsigned int flush_end = 0;
     QzStreamBuf_T *stream_buf = NULL;
     QzSess_T *qz_sess = NULL;
     DataFormatInternal_T data_fmt = DEFLATE_GZIP_EXT;
 
     if (NULL == sess     || \
         NULL == strm     || \
-        (last != 0 && last != 1)) {
+        last > QZ_FULL_FLUSH) {
         rc = QZ_PARAMS;
         if (NULL != strm) {
             strm->in_sz = 0;
@@ -429,6 +927,10 @@ int qzCompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
         goto end;
     }
 
+    /* A flush compresses what is held as blocks that don't end the stream */
+    flush = (QZ_SYNC_FLUSH == last || QZ_FULL_FLUSH == last) ? 1 : 0;
+    last = (QZ_FINISH == last) ? 1 : 0;
+
     if (NULL == strm->out) {
         rc = QZ_PARAMS;
         strm->in_sz = 0;
@@ -476,14 +978,42 @@ int qzCompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
     qz_sess = (QzSess_T *)(sess->internal);
     data_fmt = qz_sess->sess_params.data_fmt;
     if (data_fmt != DEFLATE_RAW &&
-        data_fmt != DEFLATE_GZIP_EXT) {
+        data_fmt != DEFLATE_GZIP_EXT &&
+        data_fmt != DEFLATE_ZLIB &&
+        data_fmt != LZ4_FH) {
         QZ_ERROR("Invalid data format: %d\n", data_fmt);
         strm->in_sz = 0;
         strm->out_sz = 0;
         return QZ_PARAMS;
     }
+    /* the stream keeps these checksums over all of its data */
+    if (LZ4_FH == data_fmt || DEFLATE_ZLIB == data_fmt) {
+        strm_crc = &call_crc;
+    }
+    flush_end = flush ? streamFlushEnds(sess) : 0;
 
     stream_buf = (QzStreamBuf_T *) strm->opaque;
+    if (qz_sess->sess_params.strm_pipeline > 1 && NULL == stream_buf->pipe &&
+        !stream_buf->pipe_failed &&
+        0 == strm->pending_in && 0 == strm->pending_out) {
+        stream_buf->pipe = streamPipeCreate(sess, strm,
+                                            qz_sess->sess_params.strm_pipeline);
+        if (NULL == stream_buf->pipe) {
+            QZ_INFO("Stream pipeline unavailable, compressing serially\n");
+            stream_buf->pipe_failed = 1;
+        }
+    }
+    if (NULL != stream_buf->pipe) {
+        /* The worker's session is a clone of the one the pipe was made for */
+        if (unlikely(sess != stream_buf->pipe->sess)) {
+            QZ_ERROR("Pipelined stream used with another session\n");
+            strm->in_sz = 0;
+            strm->out_sz = 0;
+            return QZ_PARAMS;
+        }
+        return streamPipeCompress(strm, stream_buf->pipe, last, flush);
+    }
+
     while (strm->pending_out > 0) {
         copied_output = copyStreamOutput(strm, strm->out + produced);
         produced += copied_output;
@@ -502,18 +1032,56 @@ int qzCompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
         }
     }
 
+    /* Large chunks skip the stream buffers, only the tail is buffered */
+    input_len = streamDirectLen(sess, strm, last || flush);
+    if (input_len > 0) {
+        output_len = strm->out_sz;
+        strm_last = (input_len == strm->in_sz && (last || flush_end)) ? 1 : 0;
+        rc = streamCompressCrc(sess, strm->in, &input_len, strm->out,
+                               &output_len, strm_last, strm_crc);
+        if (QZ_BUF_ERROR == rc && 0 != input_len) {
+            rc = QZ_OK;
+        }
+        if (QZ_OK != rc) {
+            rc = QZ_FAIL;
+            goto done;
+        }
+        QZ_DEBUG("Direct qzCompressCrc input_len %u output_len %u\n",
+                 input_len, output_len);
+        streamChecksumUpdate(stream_buf, data_fmt, strm->in, input_len,
+                             &strm->crc_32);
+
+        copied_input = input_len;
+        consumed = input_len;
+        produced = output_len;
+        strm->in_sz -= input_len;
+        strm->out_sz -= output_len;
+        if (0 == strm->in_sz) {
+            goto done;
+        }
+    }
+
     while (0 == strm->pending_out) {
 
         if (copy_more == 1 && stream_buf->flush_more != 1) {
             copied_input_last = copied_input;
+            /* more input goes behind what is left of a partly consumed
+             * buffer
+             */
+            if (strm->pending_in > 0 && stream_buf->in_offset > 0) {
+                memmove(stream_buf->in_buf,
+                        stream_buf->in_buf + stream_buf->in_offset,
+                        strm->pending_in);
+                stream_buf->in_offset = 0;
+            }
             // Note, strm->in == NULL and strm->in_sz == 0, will not cause
             // copyStreamInput failed, but it's Dangerous behavior.
             if (NULL != strm->in) {
                 copied_input += copyStreamInput(strm, strm->in + consumed);
             }
 
-            if (strm->pending_in < stream_buf->buf_len &&
-                last != 1) {
+            if (strm->pending_in < stream_buf->buf_len && last != 1 &&
+                (!flush || 0 == strm->pending_in)) {
                 rc = QZ_OK;
                 goto done;
             } else {
@@ -528,15 +1096,16 @@ int qzCompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
             stream_buf->flush_more = 0;
         }
 
-        strm_last = (0 == strm->in_sz && last) ? 1 : 0;
+        strm_last = (0 == strm->in_sz && (last || flush_end)) ? 1 : 0;
         QZ_DEBUG("Before Call qzCompressCrc input_len %u output_len %u "
                  "stream->pending_in %u stream->pending_out %u "
                  "stream->in_sz %d stream->out_sz %d\n",
                  input_len, output_len, strm->pending_in, strm->pending_out,
                  strm->in_sz, strm->out_sz);
 
-        rc = qzCompressCrc(sess, stream_buf->in_buf + inbuf_offset, &input_len,
-                           stream_buf->out_buf, &output_len, strm_last, strm_crc);
+        rc = streamCompressCrc(sess, stream_buf->in_buf + inbuf_offset,
+                               &input_len, stream_buf->out_buf, &output_len,
+                               strm_last, strm_crc);
 
         strm->pending_in -= input_len;
         strm->pending_out = output_len;
@@ -570,9 +1139,14 @@ int qzCompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
             goto done;
         }
 
+        streamChecksumUpdate(stream_buf, data_fmt,
+                             stream_buf->in_buf + inbuf_offset - input_len,
+                             input_len, &strm->crc_32);
+
         if (0 == strm->pending_in) {
             copy_more = 1;
             inbuf_offset = 0;
+            stream_buf->in_offset = 0;
         }
 
 
@@ -609,6 +1183,7 @@ int qzDecompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
     unsigned int copy_more = 1;
     unsigned int inbuf_offset = 0;
     QzStreamBuf_T *stream_buf = NULL;
+    DataFormatInternal_T data_fmt = DEFLATE_GZIP_EXT;
 
     if (NULL == sess     || \
         NULL == strm     || \
@@ -637,6 +1212,7 @@ int qzDecompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
     }
 
     stream_buf = (QzStreamBuf_T *) strm->opaque;
+    data_fmt = ((QzSess_T *)sess->internal)->sess_params.data_fmt;
     QZ_INFO("Decompress Stream Start...\n");
 
     while (strm->pending_out > 0) {
@@ -660,6 +1236,14 @@ int qzDecompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
 
         if (1 == copy_more && stream_buf->flush_more != 1) {
             copied_input_last = copied_input;
+            /* more input goes behind what is left of a cut frame */
+            if (strm->pending_in > 0 && stream_buf->in_offset > 0) {
+                memmove(stream_buf->in_buf,
+                        stream_buf->in_buf + stream_buf->in_offset,
+                        strm->pending_in);
+                stream_buf->in_offset = 0;
+                inbuf_offset = 0;
+            }
             copied_input += copyStreamInput(strm, strm->in + consumed);
 
             if (strm->pending_in < stream_buf->buf_len &&
@@ -692,10 +1276,22 @@ int qzDecompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
                           stream_buf->out_buf, &output_len);
 
         QZ_DEBUG("Return code = %d\n", rc);
+        /* A frame cut at the end of the buffer waits for the rest of it,
+         * unless there is no more input or no room for it
+         */
+        if (QZ_DATA_ERROR == rc && (0 != input_len ||
+                                    (strm->pending_in < stream_buf->buf_len &&
+                                     !(last && 0 == strm->in_sz)))) {
+            QZ_INFO("Incomplete frame, wait for more input...\n");
+            rc = QZ_OK;
+            copy_more = 1;
+        }
         if (QZ_OK != rc && QZ_BUF_ERROR != rc) {
             copied_input = copied_input_last;
             goto done;
         }
+        streamChecksumUpdate(stream_buf, data_fmt, stream_buf->out_buf,
+                             output_len, &strm->crc_32);
 
         inbuf_offset += input_len;
         stream_buf->in_offset = inbuf_offset;
@@ -728,6 +1324,7 @@ int qzDecompressStream(QzSession_T *sess, QzStream_T *strm, unsigned int last)
             copy_more = 1;
             inbuf_offset = 0;
         }
+        stream_buf->in_offset = inbuf_offset;
         if (0 == strm->pending_in && 0 == strm->in_sz) {
             rc = QZ_OK;
             goto done;
@@ -765,6 +1362,12 @@ int qzEndStream(QzSession_T *sess, QzStream_T *strm)
     }
 
     stream_buf = (QzStreamBuf_T *)strm->opaque;
+    if (NULL != stream_buf->pipe) {
+        streamPipeDestroy(stream_buf->pipe);
+    }
+    if (NULL != stream_buf->xxh32) {
+        XXH32_freeState(stream_buf->xxh32);
+    }
     streamBufferFree(stream_buf->out_buf);
     streamBufferFree(stream_buf->in_buf);
     free(stream_buf);
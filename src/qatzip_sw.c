@@ -219,6 +219,13 @@ int qzDeflateSWCompress(QzSession_T *sess, const unsigned char *src,
                 *qz_sess->crc32 = crc32(*qz_sess->crc32,
                                         src + total_in - current_loop_in,
                                         current_loop_in);
+            } else if (DEFLATE_ZLIB == data_fmt) {
+                /* zlib streams carry Adler-32, not CRC-32 */
+                *qz_sess->crc32 = adler32((0 == *qz_sess->crc32) ?
+                                          adler32(0L, Z_NULL, 0) :
+                                          *qz_sess->crc32,
+                                          src + total_in - current_loop_in,
+                                          current_loop_in);
             } else {
                 if (0 == *qz_sess->crc32) {
                     *qz_sess->crc32 = stream->adler;
@@ -713,6 +720,19 @@ int compInSWFallback(int i, int j, QzSession_T *sess,
         return QZ_FAIL;
     }
 
+    /* a software member can't continue the single member */
+    if (qz_sess->member_on) {
+        QZ_ERROR("The instance %d fallback to sw, single member open, compressIn error!\n",
+                 i);
+        return QZ_FAIL;
+    }
+
+    if (NULL != qz_sess->src_iov) {
+        QZ_INFO("The instance %d fallback to sw, segmented src, back to API level fallback!\n",
+                i);
+        return QZ_FAIL;
+    }
+
     if (qz_sess->stop_submitting) {
         QZ_INFO("compInSWFallback stop submit\n");
         return QZ_FAIL;
@@ -757,7 +777,13 @@ int compOutSWFallback(int i, int j, QzSession_T *sess,
     unsigned int dest_receive_sz = outputHeaderSz(qz_sess->sess_params.data_fmt) +
                                    g_process.qz_inst[i].dest_buffers[j]->pBuffers->dataLenInBytes;
     unsigned char *src_ptr = g_process.qz_inst[i].src_buffers[j]->pBuffers->pData;
-    unsigned char *dest_ptr = g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData;
+    unsigned char *dest_ptr;
+
+    /* Software writes its own header, so its output goes through the
+     * instance buffer rather than the caller's dest after a header gap.
+     */
+    RestoreDestCpastreamBuffer(i, j);
+    dest_ptr = g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData;
 
     if (!qz_sess->sess_params.sw_backup) {
         QZ_ERROR("The instance %d heartbeat down, Don't enable sw fallback, compressOut error!\n",
@@ -765,6 +791,27 @@ int compOutSWFallback(int i, int j, QzSession_T *sess,
         return QZ_FAIL;
     }
 
+    if (qz_sess->member_on) {
+        QZ_ERROR("The instance %d fallback to sw, single member open, compressOut error!\n",
+                 i);
+        return QZ_FAIL;
+    }
+
+    /* software needs an SGL request gathered into the pinned buffer */
+    if (g_process.qz_inst[i].src_buffers[j]->numBuffers > 1) {
+        CpaBufferList *list = g_process.qz_inst[i].src_buffers[j];
+        Cpa32U k;
+
+        src_ptr = g_process.qz_inst[i].stream[j].orig_src;
+        src_send_sz = 0;
+        for (k = 0; k < list->numBuffers; k++) {
+            QZ_MEMCPY(src_ptr + src_send_sz, list->pBuffers[k].pData,
+                      qz_sess->sess_params.hw_buff_sz - src_send_sz,
+                      list->pBuffers[k].dataLenInBytes);
+            src_send_sz += list->pBuffers[k].dataLenInBytes;
+        }
+    }
+
     QZ_DEBUG("The request get dummy emty respond, offload to software!\n");
     QZ_DEBUG("SW CompOut src_ptr %p, dst_ptr %p, Sending %u bytes, seq = %ld\n",
              src_ptr, dest_ptr, src_send_sz, g_process.qz_inst[i].stream[j].seq);
@@ -35,6 +35,9 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include <qz_utils.h>
 
 #ifdef HAVE_QAT_HEADERS
@@ -392,6 +395,32 @@ int qzSetupSessionInternal(QzSession_T *sess)
     return rc;
 }
 
+/* Set up sess with the parameters of src, for another thread to use */
+int qzCloneSession(QzSession_T *sess, QzSession_T *src)
+{
+    int rc;
+    QzSess_T *qz_sess;
+
+    assert(sess);
+    assert(src);
+    assert(src->internal);
+
+    qz_sess = calloc(1, sizeof(QzSess_T));
+    if (unlikely(NULL == qz_sess)) {
+        sess->hw_session_stat = QZ_NOSW_LOW_MEM;
+        return QZ_NOSW_LOW_MEM;
+    }
+    qz_sess->sess_params = ((QzSess_T *)src->internal)->sess_params;
+    sess->internal = qz_sess;
+
+    rc = qzSetupSessionInternal(sess);
+    if (rc < 0) {
+        free(sess->internal);
+        sess->internal = NULL;
+    }
+    return rc;
+}
+
 int qzCheckParams(QzSessionParams_T *params)
 {
     assert(params);
@@ -498,11 +527,36 @@ static int qzCheckParamsCommon(QzSessionParamsCommon_T *params)
         return QZ_PARAMS;
     }
 
+    if (params->polling_mode > QZ_CENTRAL_POLLING) {
+        QZ_ERROR("Invalid polling_mode value\n");
+        return QZ_PARAMS;
+    }
+
     if (params->hw_buff_sz & (params->hw_buff_sz - 1)) {
         QZ_ERROR("Invalid hw_buff_sz value, must be a power of 2k\n");
         return QZ_PARAMS;
     }
 
+    if (params->share_inst > 1) {
+        QZ_ERROR("Invalid share_inst value\n");
+        return QZ_PARAMS;
+    }
+
+    if (params->coalesce_usec > QZ_COALESCE_USEC_MAX) {
+        QZ_ERROR("Invalid coalesce_usec value\n");
+        return QZ_PARAMS;
+    }
+
+    if (params->strm_pipeline > QZ_STRM_PIPELINE_MAX) {
+        QZ_ERROR("Invalid strm_pipeline value\n");
+        return QZ_PARAMS;
+    }
+
+    if (params->single_member > 1) {
+        QZ_ERROR("Invalid single_member value\n");
+        return QZ_PARAMS;
+    }
+
     return QZ_OK;
 }
 
@@ -652,6 +706,10 @@ static void qzSetParamsCommon(QzSessionParamsCommon_T *params,
     internal_params->wait_cnt_thrshold = params->wait_cnt_thrshold;
     internal_params->polling_mode = params->polling_mode;
     internal_params->is_sensitive_mode = params->is_sensitive_mode;
+    internal_params->share_inst = params->share_inst;
+    internal_params->coalesce_usec = params->coalesce_usec;
+    internal_params->strm_pipeline = params->strm_pipeline;
+    internal_params->single_member = params->single_member;
 }
 
 /**
@@ -807,6 +865,10 @@ static void qzGetParamsCommon(QzSessionParamsInternal_T *internal_params,
     params->wait_cnt_thrshold = internal_params->wait_cnt_thrshold;
     params->polling_mode = internal_params->polling_mode;
     params->is_sensitive_mode = internal_params->is_sensitive_mode;
+    params->share_inst = internal_params->share_inst;
+    params->coalesce_usec = internal_params->coalesce_usec;
+    params->strm_pipeline = internal_params->strm_pipeline;
+    params->single_member = internal_params->single_member;
 }
 
 /**
@@ -1045,16 +1107,114 @@ void RestoreSrcCpastreamBuffer(int i, int j)
     if (g_process.qz_inst[i].stream[j].src_need_reset) {
         g_process.qz_inst[i].src_buffers[j]->pBuffers->pData =
             g_process.qz_inst[i].stream[j].orig_src;
+        g_process.qz_inst[i].src_buffers[j]->numBuffers = 1;
         g_process.qz_inst[i].stream[j].src_need_reset = 0;
     }
 }
 
 void ResetCpastreamSink(int i, int j)
 {
+    QzCpaStream_T *stream = &g_process.qz_inst[i].stream[j];
+    int in_use = (stream->src1 != stream->src2 ||
+                  stream->src1 != stream->sink1 ||
+                  stream->src1 != stream->sink2);
+
     g_process.qz_inst[i].stream[j].src1 = 0;
     g_process.qz_inst[i].stream[j].src2 = 0;
     g_process.qz_inst[i].stream[j].sink1 = 0;
     g_process.qz_inst[i].stream[j].sink2 = 0;
+    if (in_use) {
+        putUnusedBuffer(i, j);
+    }
+}
+
+unsigned long qzIovLen(const QzIovec_T *iov, unsigned int cnt)
+{
+    unsigned long len = 0;
+    unsigned int k;
+
+    for (k = 0; k < cnt; k++) {
+        len += iov[k].len;
+    }
+    return len;
+}
+
+/* Gather len bytes starting at offset off of the segments into dest */
+void qzIovCopy(unsigned char *dest, const QzIovec_T *iov, unsigned int cnt,
+               unsigned long off, unsigned int len)
+{
+    unsigned int k, n;
+
+    for (k = 0; k < cnt && off >= iov[k].len; k++) {
+        off -= iov[k].len;
+    }
+
+    for (; k < cnt && len > 0; k++) {
+        n = iov[k].len - off;
+        n = n < len ? n : len;
+        QZ_MEMCPY(dest, iov[k].buf + off, len, n);
+        dest += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+/* Feed the src_send_sz bytes at offset off of the session's segments to
+ * src buffer j. The segments are handed to the device as an SGL when it can
+ * read them all, otherwise they are gathered into the pinned buffer.
+ */
+static void compIovSetup(int i, int j, QzSess_T *qz_sess, unsigned long off,
+                         unsigned int src_send_sz, CpaBoolean need_cont_mem)
+{
+    CpaBufferList *list = g_process.qz_inst[i].src_buffers[j];
+    const QzIovec_T *iov = qz_sess->src_iov;
+    unsigned int cnt = qz_sess->src_iov_cnt;
+    unsigned int k, first, n, len, left;
+    unsigned long first_off;
+
+    for (k = 0; k < cnt && off >= iov[k].len; k++) {
+        off -= iov[k].len;
+    }
+    first = k;
+    first_off = off;
+
+    /* check every segment the request covers can be read in place */
+    for (n = 0, left = src_send_sz; k < cnt && left > 0; k++, off = 0) {
+        len = iov[k].len - off;
+        if (0 == len) {
+            continue;
+        }
+        if (n == QZ_SGL_MAX_FLATS ||
+            (need_cont_mem && COMMON_MEM == qzMemFindAddr(iov[k].buf + off))) {
+            break;
+        }
+        left -= len < left ? len : left;
+        n++;
+    }
+
+    if (0 != left) {
+        qzIovCopy(list->pBuffers->pData, iov + first, cnt - first, first_off,
+                  src_send_sz);
+        g_process.qz_inst[i].stream[j].src_need_reset = 0;
+        atomic_fetch_add(&g_process.bytes_copied, src_send_sz);
+        return;
+    }
+
+    for (n = 0, k = first, off = first_off, left = src_send_sz; left > 0;
+         k++, off = 0) {
+        len = iov[k].len - off;
+        if (0 == len) {
+            continue;
+        }
+        len = len < left ? len : left;
+        list->pBuffers[n].pData = iov[k].buf + off;
+        list->pBuffers[n].dataLenInBytes = len;
+        left -= len;
+        n++;
+    }
+    list->numBuffers = n;
+    g_process.qz_inst[i].stream[j].src_need_reset = 1;
+    atomic_fetch_add(&g_process.bytes_zero_copy, src_send_sz);
 }
 
 /*  This setup function will always match with buffer clean up function
@@ -1079,8 +1239,10 @@ void compBufferSetup(int i, int j, QzSess_T *qz_sess,
     opData->inputSkipData.skipMode = CPA_DC_SKIP_DISABLED;
     opData->outputSkipData.skipMode = CPA_DC_SKIP_DISABLED;
     opData->compressAndVerify = CPA_TRUE;
-    if (IS_DEFLATE_RAW(data_fmt) && (1 != qz_sess->last ||
-                                     src_remaining > hw_buff_sz)) {
+    if ((IS_DEFLATE_RAW(data_fmt) && (1 != qz_sess->last ||
+                                      src_remaining > hw_buff_sz)) ||
+        (qz_sess->member_on && IS_DEFLATE(data_fmt))) {
+        /* the final block of a single member is added by software */
         opData->flushFlag = CPA_DC_FLUSH_FULL;
     } else {
         opData->flushFlag = CPA_DC_FLUSH_FINAL;
@@ -1097,21 +1259,29 @@ void compBufferSetup(int i, int j, QzSess_T *qz_sess,
     g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes = src_send_sz;
     g_process.qz_inst[i].dest_buffers[j]->pBuffers->dataLenInBytes =
         dest_receive_sz;
+    if (QZ_ADAPTIVE_POLLING == qz_sess->sess_params.polling_mode) {
+        qzPollModelSubmit(i, j, qz_sess, QZ_DIR_COMPRESS);
+    }
 
     if (!need_cont_mem) {
         QZ_DEBUG("Compress SVM Enabled in doCompressIn\n");
     }
 
     /*Feed src/dest buffer*/
-    if ((COMMON_MEM == qzMemFindAddr(src_ptr)) && need_cont_mem) {
+    if (NULL != qz_sess->src_iov) {
+        compIovSetup(i, j, qz_sess, *qz_sess->src_sz - src_remaining,
+                     src_send_sz, need_cont_mem);
+    } else if ((COMMON_MEM == qzMemFindAddr(src_ptr)) && need_cont_mem) {
         QZ_MEMCPY(g_process.qz_inst[i].src_buffers[j]->pBuffers->pData,
                   src_ptr,
                   src_send_sz,
                   src_remaining);
         g_process.qz_inst[i].stream[j].src_need_reset = 0;
+        atomic_fetch_add(&g_process.bytes_copied, src_send_sz);
     } else {
         g_process.qz_inst[i].src_buffers[j]->pBuffers->pData = src_ptr;
         g_process.qz_inst[i].stream[j].src_need_reset = 1;
+        atomic_fetch_add(&g_process.bytes_zero_copy, src_send_sz);
     }
 
     /*using zerocopy for the first request while dest buffer is pinned*/
@@ -1123,6 +1293,45 @@ void compBufferSetup(int i, int j, QzSess_T *qz_sess,
     }
 }
 
+/* Give the request its own slot of the caller's dest, sized for its worst
+ * case output, so that the device writes there in place. The slots follow
+ * each other, a request starts no later than its slot once the outputs
+ * before it are compacted, so compOutValidDestBufferCleanUp moves it down
+ * without touching a later slot still in flight.
+ */
+void compDestSlotSetup(int i, int j, QzSess_T *qz_sess)
+{
+    QzCpaStream_T *stream = &g_process.qz_inst[i].stream[j];
+    CpaFlatBuffer *dest = g_process.qz_inst[i].dest_buffers[j]->pBuffers;
+    DataFormatInternal_T data_fmt = qz_sess->sess_params.data_fmt;
+    CpaBoolean need_cont_mem =
+        g_process.qz_inst[i].instance_info.requiresPhysicallyContiguousMemory;
+    unsigned long slot_off;
+    unsigned char *slot;
+
+    /* nothing in flight, so the output so far is final: restart the slots
+     * right behind it, which also covers software output of doCompressIn
+     */
+    if (qz_sess->seq == qz_sess->seq_in) {
+        qz_sess->slot_off = qz_sess->next_dest - qz_sess->dest_base;
+    }
+    slot_off = qz_sess->slot_off;
+    qz_sess->slot_off += outputHeaderSz(data_fmt) + dest->dataLenInBytes +
+                         outputFooterSz(data_fmt);
+    /* the first request is already at the start of dest */
+    if (stream->dest_need_reset || qz_sess->slot_off > *qz_sess->dest_sz) {
+        return;
+    }
+
+    slot = qz_sess->dest_base + slot_off;
+    if (need_cont_mem && COMMON_MEM == qzMemFindAddr(slot)) {
+        return;
+    }
+
+    dest->pData = slot + outputHeaderSz(data_fmt);
+    stream->dest_need_reset = 1;
+}
+
 /*  when offload request failed after setup the buffer.
 *   use this function to cleanup setup buffer.
 */
@@ -1132,6 +1341,7 @@ void compInBufferCleanUp(int i, int j)
     RestoreSrcCpastreamBuffer(i, j);
     g_process.qz_inst[i].stream[j].src1 -= 1;
     g_process.qz_inst[i].stream[j].src2 -= 1;
+    putUnusedBuffer(i, j);
 }
 
 /*  when offload request successfully, Using below functions to process
@@ -1159,6 +1369,15 @@ void compOutValidDestBufferCleanUp(int i, int j, QzSess_T *qz_sess,
     }
 
     if (g_process.qz_inst[i].stream[j].dest_need_reset) {
+        unsigned char *out = g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData;
+
+        /* output in a later slot moves down behind the previous one */
+        if (out != qz_sess->next_dest) {
+            memmove(qz_sess->next_dest, out, dest_receive_sz);
+            atomic_fetch_add(&g_process.bytes_copied, dest_receive_sz);
+        } else {
+            atomic_fetch_add(&g_process.bytes_zero_copy, dest_receive_sz);
+        }
         g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData =
             g_process.qz_inst[i].stream[j].orig_dest;
         g_process.qz_inst[i].stream[j].dest_need_reset = 0;
@@ -1167,6 +1386,7 @@ void compOutValidDestBufferCleanUp(int i, int j, QzSess_T *qz_sess,
                   g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData,
                   *qz_sess->dest_sz - qz_sess->qz_out_len,
                   dest_receive_sz);
+        atomic_fetch_add(&g_process.bytes_copied, dest_receive_sz);
     }
 }
 
@@ -1178,9 +1398,14 @@ void compOutProcessedRespond(int i, int j, QzSess_T *qz_sess)
     compOutSrcBufferCleanUp(i, j);
     /* Update the seq_in and process, clean buffer */
     assert(g_process.qz_inst[i].stream[j].seq == qz_sess->seq_in);
+    if (QZ_ADAPTIVE_POLLING == qz_sess->sess_params.polling_mode) {
+        qzPollModelComplete(i, j, qz_sess, QZ_DIR_COMPRESS);
+    }
+    qz_sess->cq[QZ_CQ_IDX(qz_sess->seq_in)] = 0;
     g_process.qz_inst[i].stream[j].sink2++;
     qz_sess->processed++;
     qz_sess->seq_in++;
+    putUnusedBuffer(i, j);
 }
 
 void compOutSkipErrorRespond(int i, int j, QzSess_T *qz_sess)
@@ -1380,6 +1605,9 @@ void decompBufferSetup(int i, int j, QzSess_T *qz_sess,
     g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes = src_send_sz;
     g_process.qz_inst[i].dest_buffers[j]->pBuffers->dataLenInBytes =
         dest_receive_sz;
+    if (QZ_ADAPTIVE_POLLING == qz_sess->sess_params.polling_mode) {
+        qzPollModelSubmit(i, j, qz_sess, QZ_DIR_DECOMPRESS);
+    }
 
     QZ_DEBUG("doDecompressIn: Sending %u bytes starting at 0x%lx\n",
              src_send_sz, (unsigned long)src_ptr);
@@ -1409,9 +1637,11 @@ void decompBufferSetup(int i, int j, QzSess_T *qz_sess,
                   src_avail_len,
                   src_send_sz);
         g_process.qz_inst[i].stream[j].src_need_reset = 0;
+        atomic_fetch_add(&g_process.bytes_copied, src_send_sz);
     } else {
         g_process.qz_inst[i].src_buffers[j]->pBuffers->pData = src_ptr;
         g_process.qz_inst[i].stream[j].src_need_reset = 1;
+        atomic_fetch_add(&g_process.bytes_zero_copy, src_send_sz);
     }
 
     if ((COMMON_MEM == dest_mem_type) && need_cont_mem) {
@@ -1434,6 +1664,7 @@ void decompInBufferCleanUp(int i, int j)
     RestoreDestCpastreamBuffer(i, j);
     RestoreSrcCpastreamBuffer(i, j);
     swapDataBuffer(i, j);
+    putUnusedBuffer(i, j);
 }
 
 void decompOutSrcBufferCleanUp(int i, int j)
@@ -1456,10 +1687,12 @@ void decompOutValidDestBufferCleanUp(int i, int j, QzSess_T *qz_sess,
                   g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData,
                   dest_avail_len,
                   resl->produced);
+        atomic_fetch_add(&g_process.bytes_copied, resl->produced);
     } else {
         g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData =
             g_process.qz_inst[i].stream[j].orig_dest;
         g_process.qz_inst[i].stream[j].dest_need_reset = 0;
+        atomic_fetch_add(&g_process.bytes_zero_copy, resl->produced);
     }
 }
 
@@ -1469,9 +1702,14 @@ void decompOutProcessedRespond(int i, int j, QzSess_T *qz_sess)
     decompOutSrcBufferCleanUp(i, j);
     swapDataBuffer(i, j); /*swap pdata back after decompress*/
     assert(g_process.qz_inst[i].stream[j].seq == qz_sess->seq_in);
+    if (QZ_ADAPTIVE_POLLING == qz_sess->sess_params.polling_mode) {
+        qzPollModelComplete(i, j, qz_sess, QZ_DIR_DECOMPRESS);
+    }
+    qz_sess->cq[QZ_CQ_IDX(qz_sess->seq_in)] = 0;
     g_process.qz_inst[i].stream[j].sink2++;
     qz_sess->seq_in++;
     qz_sess->processed++;
+    putUnusedBuffer(i, j);
 }
 
 void decompOutSkipErrorRespond(int i, int j, QzSess_T *qz_sess)
@@ -1645,11 +1883,13 @@ void AsyncCompOutValidDestBufferCleanUp(int i, int j,
         g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData =
             g_process.qz_inst[i].stream[j].orig_dest;
         g_process.qz_inst[i].stream[j].dest_need_reset = 0;
+        atomic_fetch_add(&g_process.bytes_zero_copy, dest_receive_sz);
     } else {
         QZ_MEMCPY(req->dest,
                   g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData,
                   req->qzResults->dest_len - req->req_out_len,
                   dest_receive_sz);
+        atomic_fetch_add(&g_process.bytes_copied, dest_receive_sz);
     }
 }
 
@@ -1663,10 +1903,12 @@ void AsyncDecompOutValidDestBufferCleanUp(int i, int j, QzSess_T *qz_sess,
                   g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData,
                   req->qzResults->dest_len,
                   resl->produced);
+        atomic_fetch_add(&g_process.bytes_copied, resl->produced);
     } else {
         g_process.qz_inst[i].dest_buffers[j]->pBuffers->pData =
             g_process.qz_inst[i].stream[j].orig_dest;
         g_process.qz_inst[i].stream[j].dest_need_reset = 0;
+        atomic_fetch_add(&g_process.bytes_zero_copy, resl->produced);
     }
 }
 
@@ -1821,3 +2063,144 @@ void *QzRingConsumeDequeue(QzRing_T *ring, int is_single_consumer)
 
     return obj;
 }
+
+/* Wait for events of a file descriptor signalled by an instance, or by a
+ * stand-in such as an eventfd. Returns the epoll fd, -1 on failure.
+ */
+int qzEventOpen(int fd)
+{
+    struct epoll_event ev = {0};
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (unlikely(epoll_fd < 0)) {
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (unlikely(0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev))) {
+        close(epoll_fd);
+        return -1;
+    }
+    return epoll_fd;
+}
+
+/* 1 if the fd is readable, 0 on timeout or signal, -1 on error. The fd
+ * stays readable until its owner consumes the event, for an instance
+ * that is the next poll.
+ */
+int qzEventWait(int epoll_fd, int timeout_ms)
+{
+    struct epoll_event ev;
+    int rc = epoll_wait(epoll_fd, &ev, 1, timeout_ms);
+
+    if (unlikely(rc < 0)) {
+        return (EINTR == errno) ? 0 : -1;
+    }
+    return rc;
+}
+
+void qzEventClose(int epoll_fd)
+{
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+}
+
+/* Adaptive polling learns the service time per KB of input of each
+ * instance and direction, and sleeps until the oldest request of a
+ * session is predicted to be done. A request found done by the first
+ * poll after a sleep may have been done long before, so that only gives
+ * an upper bound of the service time. One found done after a poll that
+ * found nothing is bracketed by the two polls.
+ */
+#define POLL_MODEL_SHIFT        3
+#define POLL_MIN_SLEEP_NSEC     10000UL
+#define POLL_MAX_SLEEP_NSEC     64000000UL
+
+void qzPollModelSubmit(int i, int j, QzSess_T *qz_sess, QzDirection_T dir)
+{
+    QzCpaStream_T *stream = &g_process.qz_inst[i].stream[j];
+    unsigned long ns_per_kb =
+        __atomic_load_n(&g_process.qz_inst[i].poll_est[dir].ns_per_kb,
+                        __ATOMIC_RELAXED);
+    unsigned long due = 0;
+
+    stream->submit_ns = qzNowNs();
+    stream->submit_bytes =
+        g_process.qz_inst[i].src_buffers[j]->pBuffers->dataLenInBytes;
+    if (ns_per_kb) {
+        due = stream->submit_ns + (ns_per_kb * stream->submit_bytes >> 10);
+    }
+    /* read by the thread polling for the session */
+    __atomic_store_n(&qz_sess->due_ns[QZ_CQ_IDX(qz_sess->seq)], due,
+                     __ATOMIC_RELAXED);
+}
+
+void qzPollModelComplete(int i, int j, QzSess_T *qz_sess, QzDirection_T dir)
+{
+    QzCpaStream_T *stream = &g_process.qz_inst[i].stream[j];
+    QzPollEstimate_T *est = &g_process.qz_inst[i].poll_est[dir];
+    unsigned long now = qzNowNs();
+    unsigned long done_ns = now;
+    long old, sample;
+    int bracketed = qz_sess->poll_empty_ns > stream->submit_ns;
+
+    qz_sess->due_ns[QZ_CQ_IDX(qz_sess->seq_in)] = 0;
+    qz_sess->poll_predicted = 0;
+    if (unlikely(CPA_STATUS_SUCCESS != stream->job_status ||
+                 CPA_DC_OK != stream->res.status ||
+                 0 == stream->submit_bytes)) {
+        return;
+    }
+
+    /* the rest of this drain may have been held up behind this one */
+    if (bracketed) {
+        done_ns = qz_sess->poll_empty_ns + ((now - qz_sess->poll_empty_ns) >> 1);
+        qz_sess->poll_empty_ns = 0;
+    }
+    sample = (long)(((done_ns - stream->submit_ns) << 10) / stream->submit_bytes);
+    old = (long)__atomic_load_n(&est->ns_per_kb, __ATOMIC_RELAXED);
+    if (0 == old) {
+        old = sample;
+    } else if (bracketed || sample < old) {
+        old += (sample - old) >> POLL_MODEL_SHIFT;
+    }
+    /* sharers of the instance may race here, any of their updates will do */
+    __atomic_store_n(&est->ns_per_kb, (unsigned long)old, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&est->samples, 1, __ATOMIC_RELAXED);
+}
+
+/* Sleep until the oldest request of the session is predicted to be done.
+ * Returns -1 without sleeping if that is unknown or already past.
+ */
+int qzPollModelSleep(int i, QzSess_T *qz_sess)
+{
+    unsigned long now = qzNowNs();
+    unsigned long due;
+
+    qz_sess->poll_empty_ns = now;
+    if (qz_sess->poll_predicted) {
+        qz_sess->poll_predicted = 0;
+        __atomic_fetch_add(&g_process.qz_inst[i].early_polls, 1,
+                           __ATOMIC_RELAXED);
+    }
+
+    if (qz_sess->processed >= qz_sess->submitted) {
+        return -1;
+    }
+    due = __atomic_load_n(&qz_sess->due_ns[QZ_CQ_IDX(qz_sess->seq_in)],
+                          __ATOMIC_RELAXED);
+    if (0 == due || due < now + POLL_MIN_SLEEP_NSEC) {
+        return -1;
+    }
+
+    if (due - now > POLL_MAX_SLEEP_NSEC) {
+        due = now + POLL_MAX_SLEEP_NSEC;
+    }
+    qz_sess->poll_predicted = 1;
+    __atomic_fetch_add(&g_process.qz_inst[i].predicted_sleeps, 1,
+                       __ATOMIC_RELAXED);
+    usleep((due - now) / 1000);
+    return 0;
+}
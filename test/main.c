@@ -65,7 +65,12 @@
 #include <qatzip.h>
 #include <qatzip_internal.h>
 #include <qz_utils.h>
+#include <qatzip_page_table.h>
+#define XXH_NAMESPACE QATZIP_
+#include "xxhash.h"
 #include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #define QZ_FMT_NAME         "QZ"
 #define GZIP_FMT_NAME       "GZIP"
@@ -175,6 +180,10 @@ typedef struct {
     int thread_sleep;
     int block_size;
     unsigned int is_sensitive_mode;
+    unsigned int share_inst;
+    unsigned int coalesce_usec;
+    unsigned int strm_pipeline;
+    unsigned int single_member;
 } TestArg_T;
 
 const unsigned int USDM_ALLOC_MAX_SZ = (2 * MB - 5 * KB);
@@ -496,6 +505,10 @@ int qzSetupDeflateExt(QzSession_T *sess, TestArg_T *arg)
     params.deflate_params.common_params.req_cnt_thrshold = arg->req_cnt_thrshold;
     params.deflate_params.common_params.max_forks = arg->max_forks;
     params.deflate_params.common_params.sw_backup = arg->sw_backup;
+    params.deflate_params.common_params.share_inst = arg->share_inst;
+    params.deflate_params.common_params.coalesce_usec = arg->coalesce_usec;
+    params.deflate_params.common_params.strm_pipeline = arg->strm_pipeline;
+    params.deflate_params.common_params.single_member = arg->single_member;
 
     status = qzSetupSessionDeflateExt(sess, &params);
     if (status < 0) {
@@ -545,6 +558,10 @@ int qzSetupDeflate(QzSession_T *sess, TestArg_T *arg)
     params.common_params.max_forks = arg->max_forks;
     params.common_params.sw_backup = arg->sw_backup;
     params.common_params.is_sensitive_mode = arg->is_sensitive_mode;
+    params.common_params.share_inst = arg->share_inst;
+    params.common_params.coalesce_usec = arg->coalesce_usec;
+    params.common_params.strm_pipeline = arg->strm_pipeline;
+    params.common_params.single_member = arg->single_member;
 
     status = qzSetupSessionDeflate(sess, &params);
     if (status < 0) {
@@ -575,6 +592,10 @@ int qzSetupLZ4(QzSession_T *sess, TestArg_T *arg)
     params.common_params.max_forks = arg->max_forks;
     params.common_params.sw_backup = arg->sw_backup;
     params.common_params.is_sensitive_mode = arg->is_sensitive_mode;
+    params.common_params.share_inst = arg->share_inst;
+    params.common_params.coalesce_usec = arg->coalesce_usec;
+    params.common_params.strm_pipeline = arg->strm_pipeline;
+    params.common_params.single_member = arg->single_member;
 
     status = qzSetupSessionLZ4(sess, &params);
     if (status) {
@@ -604,6 +625,10 @@ int qzSetupLZ4S(QzSession_T *sess, TestArg_T *arg)
     params.common_params.max_forks = arg->max_forks;
     params.common_params.sw_backup = arg->sw_backup;
     params.common_params.is_sensitive_mode = arg->is_sensitive_mode;
+    params.common_params.share_inst = arg->share_inst;
+    params.common_params.coalesce_usec = arg->coalesce_usec;
+    params.common_params.strm_pipeline = arg->strm_pipeline;
+    params.common_params.single_member = arg->single_member;
 
     status = qzSetupSessionLZ4S(sess, &params);
     if (status) {
@@ -2070,6 +2095,7 @@ void *qzCompressAndDecompress(void *arg)
     const int gen_data = ((TestArg_T *)arg)->gen_data;
     int thread_sleep = ((TestArg_T *)arg)->thread_sleep;
     QzSession_T sess = {0};
+    QzPollModel_T poll_model;
 
     if (!org_src_sz) {
         pthread_exit((void *)"input size is 0\n");
@@ -2372,6 +2398,15 @@ void *qzCompressAndDecompress(void *arg)
                  comp_out_sz, decomp_out_sz);
     }
     QZ_PRINT("\n");
+    if (QZ_ADAPTIVE_POLLING == ((TestArg_T *)arg)->polling_mode &&
+        QZ_OK == qzGetPollModel(&sess, &poll_model)) {
+        QZ_PRINT("[INFO] tid=%ld, comp %lu ns/KB (%lu samples), "
+                 "decomp %lu ns/KB (%lu samples), predicted sleeps %lu, "
+                 "early polls %lu\n", tid,
+                 poll_model.comp_ns_per_kb, poll_model.comp_samples,
+                 poll_model.decomp_ns_per_kb, poll_model.decomp_samples,
+                 poll_model.predicted_sleeps, poll_model.early_polls);
+    }
     if (test_thread_safe_flag == 1) {
         if (thread_sleep == 0) {
             srand(time(NULL));
@@ -4751,35 +4786,58 @@ done:
     pthread_exit((void *)NULL);
 }
 
-void *qzLSMcompressPerf(void *arg)
+static int cmpLatency(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void printLatency(long tid, const char *name,
+                         unsigned long long *lat, int count)
+{
+    unsigned long long sum = 0;
+
+    if (count <= 0) {
+        return;
+    }
+    qsort(lat, count, sizeof(unsigned long long), cmpLatency);
+    for (int k = 0; k < count; k++) {
+        sum += lat[k];
+    }
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] thread %ld %-16s avg %llu us, p50 %llu us, p99 %llu us\n",
+             tid, name, sum / count, lat[count / 2], lat[(count * 99) / 100]);
+    pthread_mutex_unlock(&g_lock_print);
+}
+
+static void *emptyThread(void *arg)
+{
+    return arg;
+}
+
+/* Per call latency of the single thread path against the threaded path,
+ * which hands its submit side to the session's worker thread. The cost
+ * of a thread per call is measured alongside for reference.
+ */
+void *qzSubmitLatencyPerf(void *arg)
 {
     int rc = -1, k;
-    unsigned char *src, *comp_out, *decomp_out;
-    int *compressed_blocks_sz = NULL;
-    size_t src_sz, comp_out_sz, decomp_out_sz;
-    size_t block_size, in_sz, out_sz, consumed, produced;
-    size_t num_blocks;
+    unsigned char *src = NULL, *comp_out = NULL;
+    unsigned int in_sz, out_sz;
+    unsigned long long *lat = NULL;
     struct timeval ts, te;
-    unsigned long long ts_m = 0, te_m = 0, el_m = 0;
-    long double sec, rate;
-    const size_t org_src_sz = ((TestArg_T *)arg)->src_sz;
-    const size_t org_comp_out_sz = ((TestArg_T *)arg)->comp_out_sz;
+    pthread_t th;
+    const size_t src_sz = ((TestArg_T *)arg)->src_sz;
+    const size_t comp_out_sz = ((TestArg_T *)arg)->comp_out_sz;
     const long tid = ((TestArg_T *)arg)->thd_id;
-    const int verify_data = ((TestArg_T *)arg)->verify_data;
     const int count = ((TestArg_T *)arg)->count;
     const int gen_data = ((TestArg_T *)arg)->gen_data;
-    const int SW_only_flag = ((TestArg_T *)arg)->init_engine_disabled;
-    ((TestArg_T *)arg)->init_engine_disabled = 0;
-    const int HW_only_flag = !((TestArg_T *)arg)->sw_backup;
-    ((TestArg_T *)arg)->sw_backup = 1;
-    const unsigned long LSM_max_avg = ULONG_MAX;
+    const int org_thrshold = ((TestArg_T *)arg)->req_cnt_thrshold;
     QzSession_T sess = {0};
     QzSess_T *qz_sess = NULL;
 
-    src_sz = org_src_sz;
-    comp_out_sz = org_comp_out_sz;
-    decomp_out_sz = org_src_sz;
-
     rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
     if (rc != QZ_OK && rc != QZ_DUPLICATE) {
 #ifndef ENABLE_THREAD_BARRIER
@@ -4788,68 +4846,28 @@ void *qzLSMcompressPerf(void *arg)
 #endif
         pthread_exit((void *)"qzInit failed");
     }
-
     qz_sess = (QzSess_T *)(sess.internal);
-    if (qz_sess == NULL) {
-        pthread_exit((void *)"qzInit failed");
-    }
-
-    /* According to contorl flow, adjust LSM matrix table*/
-    if (HW_only_flag) {
-        if (qz_sess->sess_params.is_sensitive_mode) {
-            for (int i = 0; i < LSM_MET_DEPTH; i++) {
-                qz_sess->SWT.latency_array[i] = LSM_max_avg;
-            }
-        }
-        qz_sess->SWT.arr_avg = LSM_max_avg;
-    }
-
-    if (SW_only_flag) {
-        if (qz_sess->sess_params.is_sensitive_mode) {
-            for (int i = 0; i < LSM_MET_DEPTH; i++) {
-                qz_sess->RRT.latency_array[i] = LSM_max_avg;
-                qz_sess->PPT.latency_array[i] = LSM_max_avg;
-            }
-        }
-        qz_sess->PPT.arr_avg = LSM_max_avg;
-        qz_sess->RRT.arr_avg = LSM_max_avg;
-    }
 
-    /* perpare the test data */
-    if (gen_data && !g_perf_svm) {
+    if (gen_data) {
         src = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
         comp_out = qzMalloc(comp_out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
-        decomp_out = qzMalloc(decomp_out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
     } else {
-        src = g_perf_svm ? malloc(src_sz) : ((TestArg_T *)arg)->src;
-        comp_out = g_perf_svm ? malloc(comp_out_sz) : ((TestArg_T *)arg)->comp_out;
-        decomp_out = g_perf_svm ? malloc(decomp_out_sz) : ((TestArg_T *)
-                     arg)->decomp_out;
+        src = ((TestArg_T *)arg)->src;
+        comp_out = ((TestArg_T *)arg)->comp_out;
     }
-    if (!src || !comp_out || !decomp_out) {
+    lat = malloc(sizeof(unsigned long long) * count);
+    if (!src || !comp_out || !lat) {
         QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
         goto done;
     }
-    if (g_perf_svm && g_input_file_name) {
-        memcpy(src, ((TestArg_T *)arg)->src, src_sz);
-    }
     if (gen_data) {
         genRandomData(src, src_sz);
     }
 
-    /* split the src to multiple block */
-    block_size = ((TestArg_T *)arg)->block_size == -1 ?
-                 src_sz : ((TestArg_T *)arg)->block_size;
-
-    num_blocks = src_sz / block_size + (src_sz % block_size ? 1 : 0);
-    compressed_blocks_sz = malloc(sizeof(int) * num_blocks);
-    memset(compressed_blocks_sz, 0, sizeof(int) * num_blocks);
-    // QZ_PRINT("src len: %lu, block: %lu, num block: %lu\n", src_sz, block_size, num_blocks);
-    /* sync the different thread */
 #ifdef ENABLE_THREAD_BARRIER
     pthread_barrier_wait(&g_bar);
 #else
-    /* mutex lock for thread count */
     pthread_mutex_lock(&g_cond_mutex);
     g_ready_thread_count++;
     pthread_cond_signal(&g_ready_cond);
@@ -4859,166 +4877,2467 @@ void *qzLSMcompressPerf(void *arg)
     pthread_mutex_unlock(&g_cond_mutex);
 #endif
 
-    /* loop test */
-    for (k = 0; k < count; k++) {
-        (void)gettimeofday(&ts, NULL);
-        {
-            comp_out_sz = org_comp_out_sz;
-            QZ_DEBUG("thread %ld before Compressed %lu bytes into %lu\n", tid, src_sz,
-                     comp_out_sz);
-            consumed = 0;
-            produced = 0;
-
-            for (int i = 0; i < num_blocks; i ++) {
-                in_sz =  block_size < (org_src_sz - consumed) ? block_size :
-                         (org_src_sz - consumed);
-                out_sz = comp_out_sz - produced;
-
-                rc = qzCompress(&sess, src + consumed, (uint32_t *)(&in_sz),
-                                comp_out + produced,
-                                (uint32_t *)(&out_sz), 1);
-                if (rc != QZ_OK) {
-                    QZ_ERROR("ERROR: Compression FAILED with return value: %d\n", rc);
-                    dumpInputData(in_sz, src + consumed);
-                    goto done;
-                }
-
-                consumed = consumed + in_sz;
-                produced = produced + out_sz;
-                compressed_blocks_sz[i] = out_sz;
-
-                /* Because sw would insert 0 to RRT Matrix table every time.
-                 * Have to update the Matrix to Max
-                 */
-                if (SW_only_flag) {
-                    for (int i = 0; i < LSM_MET_DEPTH; i++) {
-                        if (qz_sess->sess_params.is_sensitive_mode) {
-                            qz_sess->RRT.latency_array[i] = LSM_max_avg;
-                            qz_sess->PPT.latency_array[i] = LSM_max_avg;
-                        }
-                    }
-                    qz_sess->PPT.arr_avg = LSM_max_avg;
-                    qz_sess->RRT.arr_avg = LSM_max_avg;
-                }
-            }
-
-            src_sz = consumed;
-            comp_out_sz = produced;
-            if (src_sz != org_src_sz) {
-                QZ_ERROR("ERROR: After Compression src_sz: %lu != org_src_sz: %lu \n!", src_sz,
-                         org_src_sz);
-                dumpInputData(src_sz, src);
+    /* pass 0: single thread path, pass 1: worker thread path */
+    for (int pass = 0; pass < 2; pass++) {
+        qz_sess->sess_params.req_cnt_thrshold = pass ? 1 : org_thrshold;
+        for (k = 0; k < count; k++) {
+            in_sz = src_sz;
+            out_sz = comp_out_sz;
+            (void)gettimeofday(&ts, NULL);
+            rc = qzCompress(&sess, src, &in_sz, comp_out, &out_sz, 1);
+            (void)gettimeofday(&te, NULL);
+            if (rc != QZ_OK) {
+                QZ_ERROR("ERROR: Compression FAILED with return value: %d\n", rc);
                 goto done;
             }
-            QZ_DEBUG("thread %ld after Compressed %lu bytes into %lu\n", tid, src_sz,
-                     comp_out_sz);
+            lat[k] = (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
         }
-        (void)gettimeofday(&te, NULL);
-        ts_m = (ts.tv_sec * 1000000) + ts.tv_usec;
-        te_m = (te.tv_sec * 1000000) + te.tv_usec;
-        el_m += te_m - ts_m;
+        printLatency(tid, pass ? "worker thread" : "single thread", lat, count);
     }
 
-    /*  Verify the last compress is enough
-        decompress data for verify
-    */
-    if (verify_data) {
-        consumed = 0;
-        produced = 0;
-        for (int i = 0; i < num_blocks; i ++) {
-            in_sz = compressed_blocks_sz[i];
-            out_sz = decomp_out_sz - produced;
-            rc = qzDecompress(&sess, comp_out + consumed, (uint32_t *)(&in_sz),
-                              decomp_out + produced, (uint32_t *)(&out_sz));
-            if (rc != QZ_OK) {
-                QZ_ERROR("ERROR: Decompression FAILED with return value: %d\n", rc);
-                goto done;
-            }
-            consumed += in_sz;
-            produced += out_sz;
+    for (k = 0; k < count; k++) {
+        (void)gettimeofday(&ts, NULL);
+        if (0 != pthread_create(&th, NULL, emptyThread, NULL)) {
+            QZ_ERROR("ERROR: pthread_create failed\n");
+            rc = QZ_FAIL;
+            goto done;
         }
+        pthread_join(th, NULL);
+        (void)gettimeofday(&te, NULL);
+        lat[k] = (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+    }
+    printLatency(tid, "thread create", lat, count);
+    rc = QZ_OK;
 
-        QZ_DEBUG("verify compressed data..\n");
-        decomp_out_sz = produced;
-        if (decomp_out_sz != org_src_sz ||
-            memcmp(src, decomp_out, org_src_sz)) {
-            QZ_ERROR("compressed data is uncorrect\n");
-            goto done;
+done:
+    if (gen_data) {
+        qzFree(src);
+        qzFree(comp_out);
+    }
+    free(lat);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"submit latency test failed");
+}
+
+typedef struct EventStandIn_S {
+    int event_fd;
+    int count;
+    struct timeval *signaled;
+} EventStandIn_T;
+
+/* Software stand-in for an instance in epoll mode, signals its eventfd
+ * as if a response had arrived.
+ */
+static void *eventStandIn(void *arg)
+{
+    EventStandIn_T *inst = (EventStandIn_T *)arg;
+    uint64_t one = 1;
+
+    for (int k = 0; k < inst->count; k++) {
+        usleep(100 + rand() % 400);
+        (void)gettimeofday(&inst->signaled[k], NULL);
+        if (sizeof(one) != write(inst->event_fd, &one, sizeof(one))) {
+            QZ_ERROR("ERROR: eventfd write failed\n");
+            break;
         }
     }
+    return NULL;
+}
 
-    sec = (long double)(el_m);
-    sec = sec / 1000000.0;
-    rate = org_src_sz;
-    rate /= 1024;
-    rate *= 8;// Kbits
+/* Wake up latency of QZ_EVENT_POLLING waits, against a stand-in instance */
+void *qzEventPollingTest(void *arg)
+{
+    int rc = QZ_FAIL, k, n = 0;
+    int epoll_fd = -1;
+    uint64_t val;
+    unsigned long long *lat = NULL;
+    struct timeval woke;
+    pthread_t th;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    EventStandIn_T inst = {0};
+
+    inst.count = count;
+    inst.event_fd = eventfd(0, EFD_NONBLOCK);
+    inst.signaled = malloc(sizeof(struct timeval) * count);
+    lat = malloc(sizeof(unsigned long long) * count);
+    if (inst.event_fd < 0 || !inst.signaled || !lat) {
+        QZ_ERROR("ERROR: eventfd or malloc failed\n");
+        goto done;
+    }
+    epoll_fd = qzEventOpen(inst.event_fd);
+    assert(epoll_fd >= 0);
 
-    rate *= count;
-    rate /= 1024 * 1024; // gigbits
-    rate /= sec;// Gbps
+    /* nothing signaled, the wait times out */
+    rc = qzEventWait(epoll_fd, 1);
+    assert(0 == rc);
 
-    pthread_mutex_lock(&g_lock_print);
-#ifdef QATZIP_DEBUG
-    QZ_PRINT("[INFO]:RRT Total call: %ld, Total avg: %ld\n",
-             qz_sess->RRT.invoke_counter,
-             qz_sess->RRT.sess_lat_avg);
-    QZ_PRINT("[INFO]:SWT Total call: %ld, Total avg: %ld\n",
-             qz_sess->SWT.invoke_counter,
-             qz_sess->SWT.sess_lat_avg);
-    QZ_PRINT("[INFO]:PPT Total call: %ld, Total avg: %ld\n",
-             qz_sess->PPT.invoke_counter,
-             qz_sess->PPT.sess_lat_avg);
-#endif
-    QZ_PRINT("[INFO] The AVG latency is RRT: %ld, SWT: %ld, PPT: %ld\n",
-             qz_sess->RRT.arr_avg, qz_sess->SWT.arr_avg, qz_sess->PPT.arr_avg);
-    QZ_PRINT("[INFO] invoke counter is RRT: %ld, SWT: %ld, PPT: %ld\n",
-             qz_sess->RRT.invoke_counter, qz_sess->SWT.invoke_counter,
-             qz_sess->PPT.invoke_counter);
-    QZ_PRINT("[INFO] tid=%ld, count=%d, msec=%llu, bytes=%lu, %Lf Gbps",
-             tid, count, el_m, org_src_sz, rate);
-    QZ_PRINT(", input_len=%lu, comp_len=%lu, ratio=%f%%\n",
-             org_src_sz, comp_out_sz,
-             ((double)comp_out_sz / (double)org_src_sz) * 100);
-    pthread_mutex_unlock(&g_lock_print);
+    if (0 != pthread_create(&th, NULL, eventStandIn, (void *)&inst)) {
+        QZ_ERROR("ERROR: pthread_create failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    for (k = 0; k < count; k += val) {
+        do {
+            rc = qzEventWait(epoll_fd, 1000);
+            assert(rc >= 0);
+        } while (0 == rc);
+        (void)gettimeofday(&woke, NULL);
+        /* the poll consumes the event, later signals may be folded in */
+        rc = read(inst.event_fd, &val, sizeof(val));
+        assert(sizeof(val) == rc);
+        lat[n++] = (woke.tv_sec - inst.signaled[k].tv_sec) * 1000000ULL +
+                   woke.tv_usec - inst.signaled[k].tv_usec;
+    }
+    pthread_join(th, NULL);
+    printLatency(tid, "event wake up", lat, n);
+    rc = QZ_OK;
 
 done:
-    if (gen_data && !g_perf_svm) {
-        qzFree(src);
-        qzFree(comp_out);
-        qzFree(decomp_out);
-    } else if (g_perf_svm) {
-        free(src);
-        free(comp_out);
-        free(decomp_out);
-    }
-    if (compressed_blocks_sz != NULL) {
-        free(compressed_blocks_sz);
+    qzEventClose(epoll_fd);
+    if (inst.event_fd >= 0) {
+        close(inst.event_fd);
     }
-    (void)qzTeardownSession(&sess);
-    pthread_exit((void *)NULL);
+    free(inst.signaled);
+    free(lat);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"event polling test failed");
 }
 
-void *qzLSMdecompressPerf(void *arg)
+#define BATCH_MSG_SZ_DEFAULT (16 * 1024)
+
+/* Batched compression/decompression of block_size messages against one
+ * call per message. Output and per message results have to be the same.
+ */
+void *qzBatchTest(void *arg)
 {
     int rc = -1, k;
-    unsigned char *src, *comp_out, *decomp_out;
-    int *compressed_blocks_sz = NULL;
-    size_t src_sz, comp_out_sz, decomp_out_sz;
-    size_t block_size, in_sz, out_sz, consumed, produced;
-    size_t num_blocks;
+    unsigned int m, n, msg_sz, out_sz, in_len, out_len;
+    unsigned char *src = NULL, *single = NULL, *batch = NULL, *decomp = NULL;
+    unsigned int *single_len = NULL;
+    QzBatchReq_T *reqs = NULL;
     struct timeval ts, te;
-    unsigned long long ts_m = 0, te_m = 0, el_m = 0;
-    long double sec, rate;
-    const size_t org_src_sz = ((TestArg_T *)arg)->src_sz;
-    const size_t org_comp_out_sz = ((TestArg_T *)arg)->comp_out_sz;
+    unsigned long long us[4] = {0};
+    const size_t src_sz = ((TestArg_T *)arg)->src_sz;
     const long tid = ((TestArg_T *)arg)->thd_id;
-    const int verify_data = ((TestArg_T *)arg)->verify_data;
     const int count = ((TestArg_T *)arg)->count;
     const int gen_data = ((TestArg_T *)arg)->gen_data;
-    const int SW_only_flag = ((TestArg_T *)arg)->init_engine_disabled;
-    ((TestArg_T *)arg)->init_engine_disabled = 0;
-    const int HW_only_flag = !((TestArg_T *)arg)->sw_backup;
-    ((TestArg_T *)arg)->sw_backup = 1;
+    const int block_size = ((TestArg_T *)arg)->block_size;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    msg_sz = (-1 == block_size) ? BATCH_MSG_SZ_DEFAULT : block_size;
+    n = src_sz / msg_sz;
+    if (0 == n) {
+        n = 1;
+        msg_sz = src_sz;
+    }
+    out_sz = qzMaxCompressedLength(msg_sz, &sess);
+
+    if (gen_data) {
+        src = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    } else {
+        src = ((TestArg_T *)arg)->src;
+    }
+    single = qzMalloc((size_t)n * out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    batch = qzMalloc((size_t)n * out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    decomp = qzMalloc((size_t)n * msg_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    single_len = malloc(sizeof(unsigned int) * n);
+    reqs = malloc(sizeof(QzBatchReq_T) * n);
+    if (!src || !single || !batch || !decomp || !single_len || !reqs) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    if (gen_data) {
+        genRandomData(src, src_sz);
+    }
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    for (k = 0; k < count; k++) {
+        (void)gettimeofday(&ts, NULL);
+        for (m = 0; m < n; m++) {
+            in_len = msg_sz;
+            single_len[m] = out_sz;
+            rc = qzCompress(&sess, src + (size_t)m * msg_sz, &in_len,
+                            single + (size_t)m * out_sz, &single_len[m], 1);
+            if (QZ_OK != rc || msg_sz != in_len) {
+                QZ_ERROR("ERROR: qzCompress of message %u rc %d\n", m, rc);
+                rc = QZ_FAIL;
+                goto done;
+            }
+        }
+        (void)gettimeofday(&te, NULL);
+        us[0] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+
+        for (m = 0; m < n; m++) {
+            memset(&reqs[m], 0, sizeof(QzBatchReq_T));
+            reqs[m].src = src + (size_t)m * msg_sz;
+            reqs[m].src_len = msg_sz;
+            reqs[m].dest = batch + (size_t)m * out_sz;
+            reqs[m].dest_len = out_sz;
+        }
+        (void)gettimeofday(&ts, NULL);
+        rc = qzCompressBatch(&sess, reqs, n);
+        (void)gettimeofday(&te, NULL);
+        us[1] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+        for (m = 0; m < n && QZ_OK == rc; m++) {
+            if (QZ_OK != reqs[m].status || msg_sz != reqs[m].src_len ||
+                single_len[m] != reqs[m].dest_len ||
+                memcmp(single + (size_t)m * out_sz,
+                       batch + (size_t)m * out_sz, single_len[m])) {
+                QZ_ERROR("ERROR: qzCompressBatch message %u differs\n", m);
+                rc = QZ_FAIL;
+            }
+        }
+        if (QZ_OK != rc) {
+            QZ_ERROR("ERROR: qzCompressBatch FAILED with return value: %d\n",
+                     rc);
+            goto done;
+        }
+
+        (void)gettimeofday(&ts, NULL);
+        for (m = 0; m < n; m++) {
+            in_len = single_len[m];
+            out_len = msg_sz;
+            rc = qzDecompress(&sess, single + (size_t)m * out_sz, &in_len,
+                              decomp + (size_t)m * msg_sz, &out_len);
+            if (QZ_OK != rc || msg_sz != out_len) {
+                QZ_ERROR("ERROR: qzDecompress of message %u rc %d\n", m, rc);
+                rc = QZ_FAIL;
+                goto done;
+            }
+        }
+        (void)gettimeofday(&te, NULL);
+        us[2] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+
+        memset(decomp, 0, (size_t)n * msg_sz);
+        for (m = 0; m < n; m++) {
+            reqs[m].src = batch + (size_t)m * out_sz;
+            reqs[m].src_len = single_len[m];
+            reqs[m].dest = decomp + (size_t)m * msg_sz;
+            reqs[m].dest_len = msg_sz;
+        }
+        (void)gettimeofday(&ts, NULL);
+        rc = qzDecompressBatch(&sess, reqs, n);
+        (void)gettimeofday(&te, NULL);
+        us[3] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+        for (m = 0; m < n && QZ_OK == rc; m++) {
+            if (QZ_OK != reqs[m].status || single_len[m] != reqs[m].src_len ||
+                msg_sz != reqs[m].dest_len) {
+                QZ_ERROR("ERROR: qzDecompressBatch message %u differs\n", m);
+                rc = QZ_FAIL;
+            }
+        }
+        if (QZ_OK == rc && memcmp(src, decomp, (size_t)n * msg_sz)) {
+            QZ_ERROR("ERROR: qzDecompressBatch output differs\n");
+            rc = QZ_FAIL;
+        }
+        if (QZ_OK != rc) {
+            QZ_ERROR("ERROR: qzDecompressBatch FAILED with return value: %d\n",
+                     rc);
+            goto done;
+        }
+    }
+    rc = QZ_OK;
+
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] thread %ld %u messages of %u bytes, per message:\n",
+             tid, n, msg_sz);
+    QZ_PRINT("[INFO]     compress   single %llu ns, batch %llu ns\n",
+             us[0] * 1000 / ((unsigned long long)count * n),
+             us[1] * 1000 / ((unsigned long long)count * n));
+    QZ_PRINT("[INFO]     decompress single %llu ns, batch %llu ns\n",
+             us[2] * 1000 / ((unsigned long long)count * n),
+             us[3] * 1000 / ((unsigned long long)count * n));
+    pthread_mutex_unlock(&g_lock_print);
+
+done:
+    if (gen_data) {
+        qzFree(src);
+    }
+    qzFree(single);
+    qzFree(batch);
+    qzFree(decomp);
+    free(single_len);
+    free(reqs);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"batch test failed");
+}
+
+#define COALESCE_MSG_SZ_DEFAULT 512
+
+/* Latency of compression requests below input_sz_thrshold, which are
+ * coalesced onto HW with those of the other threads when -c is set.
+ */
+void *qzCoalesceTest(void *arg)
+{
+    int rc = -1, k;
+    unsigned char *src = NULL, *comp_out = NULL, *decomp_out = NULL;
+    unsigned int msg_sz, out_sz, in_len, out_len, off;
+    unsigned long long *lat = NULL;
+    struct timeval ts, te;
+    const size_t src_sz = ((TestArg_T *)arg)->src_sz;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    const int gen_data = ((TestArg_T *)arg)->gen_data;
+    const int block_size = ((TestArg_T *)arg)->block_size;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    msg_sz = (-1 == block_size) ? COALESCE_MSG_SZ_DEFAULT : block_size;
+    if (msg_sz > src_sz) {
+        msg_sz = src_sz;
+    }
+    out_sz = qzMaxCompressedLength(msg_sz, &sess);
+
+    if (gen_data) {
+        src = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    } else {
+        src = ((TestArg_T *)arg)->src;
+    }
+    comp_out = qzMalloc(out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    decomp_out = qzMalloc(msg_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    lat = malloc(sizeof(unsigned long long) * count);
+    if (!src || !comp_out || !decomp_out || !lat) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    if (gen_data) {
+        genRandomData(src, src_sz);
+    }
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    for (k = 0; k < count; k++) {
+        off = (k * msg_sz) % (src_sz - msg_sz + 1);
+        in_len = msg_sz;
+        out_len = out_sz;
+        (void)gettimeofday(&ts, NULL);
+        rc = qzCompress(&sess, src + off, &in_len, comp_out, &out_len, 1);
+        (void)gettimeofday(&te, NULL);
+        if (rc != QZ_OK || in_len != msg_sz) {
+            QZ_ERROR("ERROR: Compression FAILED with return value: %d\n", rc);
+            rc = QZ_FAIL;
+            goto done;
+        }
+        lat[k] = (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+
+        in_len = out_len;
+        out_len = msg_sz;
+        rc = qzDecompress(&sess, comp_out, &in_len, decomp_out, &out_len);
+        if (rc != QZ_OK || out_len != msg_sz ||
+            memcmp(src + off, decomp_out, msg_sz)) {
+            QZ_ERROR("ERROR: Decompression FAILED with return value: %d\n", rc);
+            rc = QZ_FAIL;
+            goto done;
+        }
+    }
+    printLatency(tid, "small compress", lat, count);
+    rc = QZ_OK;
+
+done:
+    if (gen_data) {
+        qzFree(src);
+    }
+    qzFree(comp_out);
+    qzFree(decomp_out);
+    free(lat);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"coalesce test failed");
+}
+
+#define IOV_SEG_SZ_DEFAULT (4 * 1024)
+
+/* qzCompressV/qzDecompressV over block_size segments spread through pinned
+ * and through ordinary memory, against qzCompressCrc over one buffer.
+ * Output and crc have to be the same.
+ */
+void *qzIovTest(void *arg)
+{
+    int rc = -1, k, pinned;
+    unsigned int m, n, seg_sz, out_sz, in_len, out_len, flat_len;
+    unsigned long crc, crc_v;
+    unsigned char *src = NULL, *flat_out = NULL, *v_out = NULL;
+    unsigned char *decomp = NULL, *spread[2] = {NULL, NULL};
+    size_t spread_sz;
+    QzIovec_T *iov = NULL;
+    struct timeval ts, te;
+    unsigned long long us[3][2] = {{0}};
+    const size_t src_sz = ((TestArg_T *)arg)->src_sz;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    const int gen_data = ((TestArg_T *)arg)->gen_data;
+    const int block_size = ((TestArg_T *)arg)->block_size;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    seg_sz = (-1 == block_size) ? IOV_SEG_SZ_DEFAULT : block_size;
+    if (seg_sz > src_sz) {
+        seg_sz = src_sz;
+    }
+    n = (src_sz + seg_sz - 1) / seg_sz;
+    out_sz = qzMaxCompressedLength(src_sz, &sess);
+
+    if (gen_data) {
+        src = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    } else {
+        src = ((TestArg_T *)arg)->src;
+    }
+    flat_out = qzMalloc(out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    v_out = qzMalloc(out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    decomp = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    /* every other seg_sz slot holds a segment, so none are adjacent */
+    spread_sz = (size_t)n * seg_sz * 2;
+    spread_sz = spread_sz > out_sz ? spread_sz : out_sz;
+    spread[0] = qzMalloc(spread_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    spread[1] = malloc(spread_sz);
+    /* the compressed data may take more segments than the source */
+    iov = malloc(sizeof(QzIovec_T) * (n + out_sz / seg_sz + 1));
+    if (!src || !flat_out || !v_out || !decomp || !spread[0] || !spread[1] ||
+        !iov) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    if (gen_data) {
+        genRandomData(src, src_sz);
+    }
+    for (m = 0; m < n; m++) {
+        in_len = (m == n - 1) ? src_sz - (size_t)m * seg_sz : seg_sz;
+        memcpy(spread[0] + (size_t)m * seg_sz * 2, src + (size_t)m * seg_sz,
+               in_len);
+        memcpy(spread[1] + (size_t)m * seg_sz * 2, src + (size_t)m * seg_sz,
+               in_len);
+    }
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    for (k = 0; k < count; k++) {
+        in_len = src_sz;
+        flat_len = out_sz;
+        crc = 0;
+        (void)gettimeofday(&ts, NULL);
+        rc = qzCompressCrc(&sess, src, &in_len, flat_out, &flat_len, 1, &crc);
+        (void)gettimeofday(&te, NULL);
+        us[0][0] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+        if (rc != QZ_OK || in_len != src_sz) {
+            QZ_ERROR("ERROR: Compression FAILED with return value: %d\n", rc);
+            rc = QZ_FAIL;
+            goto done;
+        }
+
+        for (pinned = 0; pinned < 2; pinned++) {
+            for (m = 0; m < n; m++) {
+                iov[m].buf = spread[pinned] + (size_t)m * seg_sz * 2;
+                iov[m].len = (m == n - 1) ? src_sz - (size_t)m * seg_sz : seg_sz;
+            }
+            out_len = out_sz;
+            crc_v = 0;
+            (void)gettimeofday(&ts, NULL);
+            rc = qzCompressV(&sess, iov, n, &in_len, v_out, &out_len, 1, &crc_v);
+            (void)gettimeofday(&te, NULL);
+            us[1][pinned] += (te.tv_sec - ts.tv_sec) * 1000000ULL +
+                             te.tv_usec - ts.tv_usec;
+            if (rc != QZ_OK || in_len != src_sz || out_len != flat_len ||
+                crc_v != crc || memcmp(flat_out, v_out, flat_len)) {
+                QZ_ERROR("ERROR: CompressV output differs, rc %d\n", rc);
+                rc = QZ_FAIL;
+                goto done;
+            }
+
+            /* hand the compressed data back in seg_sz pieces */
+            memcpy(spread[pinned], v_out, out_len);
+            for (m = 0; m * seg_sz < out_len; m++) {
+                iov[m].buf = spread[pinned] + (size_t)m * seg_sz;
+                iov[m].len = (out_len - m * seg_sz < seg_sz) ?
+                             out_len - m * seg_sz : seg_sz;
+            }
+            out_len = src_sz;
+            crc_v = 0;
+            (void)gettimeofday(&ts, NULL);
+            rc = qzDecompressV(&sess, iov, m, &in_len, decomp, &out_len, &crc_v);
+            (void)gettimeofday(&te, NULL);
+            us[2][pinned] += (te.tv_sec - ts.tv_sec) * 1000000ULL +
+                             te.tv_usec - ts.tv_usec;
+            /* software decompression leaves the checksum at 0 */
+            if (rc != QZ_OK || in_len != flat_len || out_len != src_sz ||
+                (0 != crc_v && crc_v != crc) || memcmp(src, decomp, src_sz)) {
+                QZ_ERROR("ERROR: DecompressV output differs, rc %d\n", rc);
+                rc = QZ_FAIL;
+                goto done;
+            }
+
+            /* put the segments back for the next round */
+            for (m = 0; m < n; m++) {
+                in_len = (m == n - 1) ? src_sz - (size_t)m * seg_sz : seg_sz;
+                memcpy(spread[pinned] + (size_t)m * seg_sz * 2,
+                       src + (size_t)m * seg_sz, in_len);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] thread %ld %zu bytes in %u segments, per call:\n",
+             tid, src_sz, n);
+    QZ_PRINT("[INFO]     compress   flat %llu us, pinned segments %llu us, "
+             "common segments %llu us\n", us[0][0] / count,
+             us[1][0] / count, us[1][1] / count);
+    QZ_PRINT("[INFO]     decompress pinned segments %llu us, "
+             "common segments %llu us\n", us[2][0] / count, us[2][1] / count);
+    pthread_mutex_unlock(&g_lock_print);
+    rc = QZ_OK;
+
+done:
+    if (gen_data) {
+        qzFree(src);
+    }
+    qzFree(flat_out);
+    qzFree(v_out);
+    qzFree(decomp);
+    qzFree(spread[0]);
+    free(spread[1]);
+    free(iov);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"iov test failed");
+}
+
+/* Compression from and to pinned buffers which QATzip doesn't know about,
+ * before and after qzRegisterMemory. Once registered the buffers have to be
+ * used in place and give the same output.
+ */
+void *qzRegisterMemTest(void *arg)
+{
+    int rc = -1, k, reg;
+    unsigned int in_len, out_len, ref_len = 0;
+    unsigned char *src = NULL, *out = NULL, *ref = NULL;
+    struct timeval ts, te;
+    unsigned long long us[2] = {0};
+    const size_t src_sz = ((TestArg_T *)arg)->src_sz;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    size_t out_sz;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    out_sz = qzMaxCompressedLength(src_sz, &sess);
+    /* straight from the memory driver, so not in QATzip's page table */
+    src = qaeMemAllocNUMA(src_sz, 0, 64);
+    out = qaeMemAllocNUMA(out_sz, 0, 64);
+    ref = malloc(out_sz);
+    if (!ref) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    if (src && ((TestArg_T *)arg)->gen_data) {
+        genRandomData(src, src_sz);
+    } else if (src) {
+        memcpy(src, ((TestArg_T *)arg)->src, src_sz);
+    }
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    if (!src || !out) {
+        /* no memory driver, as on a host without QAT */
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld no USDM memory, skipped\n", tid);
+        pthread_mutex_unlock(&g_lock_print);
+        rc = QZ_OK;
+        goto done;
+    }
+
+    for (reg = 0; reg < 2; reg++) {
+        if (reg && (QZ_OK != qzRegisterMemory(src, src_sz) ||
+                    QZ_OK != qzRegisterMemory(out, out_sz))) {
+            QZ_ERROR("ERROR: qzRegisterMemory FAILED\n");
+            rc = QZ_FAIL;
+            goto done;
+        }
+        if (qzMemFindAddr(src) != reg || qzMemFindAddr(out + out_sz - 1) != reg) {
+            QZ_ERROR("ERROR: qzMemFindAddr doesn't match registration\n");
+            rc = QZ_FAIL;
+            goto done;
+        }
+
+        for (k = 0; k < count; k++) {
+            in_len = src_sz;
+            out_len = out_sz;
+            (void)gettimeofday(&ts, NULL);
+            rc = qzCompress(&sess, src, &in_len, out, &out_len, 1);
+            (void)gettimeofday(&te, NULL);
+            us[reg] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+            if (rc != QZ_OK || in_len != src_sz) {
+                QZ_ERROR("ERROR: Compression FAILED with return value: %d\n", rc);
+                rc = QZ_FAIL;
+                goto done;
+            }
+            if (0 == reg && 0 == k) {
+                memcpy(ref, out, out_len);
+                ref_len = out_len;
+            } else if (out_len != ref_len || memcmp(ref, out, out_len)) {
+                QZ_ERROR("ERROR: output differs once registered\n");
+                rc = QZ_FAIL;
+                goto done;
+            }
+        }
+    }
+
+    if (QZ_OK != qzUnregisterMemory(src, src_sz) ||
+        QZ_OK != qzUnregisterMemory(out, out_sz) ||
+        0 != qzMemFindAddr(src) || 0 != qzMemFindAddr(out)) {
+        QZ_ERROR("ERROR: qzUnregisterMemory FAILED\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] thread %ld compress %zu bytes, unregistered %llu us, "
+             "registered %llu us\n", tid, src_sz, us[0] / count,
+             us[1] / count);
+    pthread_mutex_unlock(&g_lock_print);
+    rc = QZ_OK;
+
+done:
+    if (src) {
+        qzUnregisterMemory(src, src_sz);
+        qaeMemFreeNUMA((void **)&src);
+    }
+    if (out) {
+        qzUnregisterMemory(out, out_sz);
+        qaeMemFreeNUMA((void **)&out);
+    }
+    free(ref);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"register memory test failed");
+}
+
+/* Multi request compression into a pinned dest, where every request is
+ * written in place, against a dest which goes through instance buffers.
+ * Output has to be the same and decompress back to the source.
+ */
+void *qzDestInPlaceTest(void *arg)
+{
+    int rc = -1, k, pinned;
+    unsigned int in_len, out_len[2], dec_len;
+    unsigned char *src = NULL, *out[2] = {NULL, NULL}, *decomp = NULL;
+    struct timeval ts, te;
+    unsigned long long us[2] = {0};
+    const size_t src_sz = ((TestArg_T *)arg)->src_sz;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    const int gen_data = ((TestArg_T *)arg)->gen_data;
+    size_t out_sz;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    out_sz = qzMaxCompressedLength(src_sz, &sess);
+    if (gen_data) {
+        src = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    } else {
+        src = ((TestArg_T *)arg)->src;
+    }
+    out[0] = malloc(out_sz);
+    out[1] = qzMalloc(out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    decomp = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    if (!src || !out[0] || !out[1] || !decomp) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    if (gen_data) {
+        genRandomData(src, src_sz);
+    }
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    for (k = 0; k < count; k++) {
+        for (pinned = 0; pinned < 2; pinned++) {
+            in_len = src_sz;
+            out_len[pinned] = out_sz;
+            (void)gettimeofday(&ts, NULL);
+            rc = qzCompress(&sess, src, &in_len, out[pinned], &out_len[pinned], 1);
+            (void)gettimeofday(&te, NULL);
+            us[pinned] += (te.tv_sec - ts.tv_sec) * 1000000ULL +
+                          te.tv_usec - ts.tv_usec;
+            if (rc != QZ_OK || in_len != src_sz) {
+                QZ_ERROR("ERROR: Compression FAILED with return value: %d\n", rc);
+                rc = QZ_FAIL;
+                goto done;
+            }
+        }
+        if (out_len[0] != out_len[1] || memcmp(out[0], out[1], out_len[0])) {
+            QZ_ERROR("ERROR: in place output differs\n");
+            rc = QZ_FAIL;
+            goto done;
+        }
+
+        in_len = out_len[1];
+        dec_len = src_sz;
+        rc = qzDecompress(&sess, out[1], &in_len, decomp, &dec_len);
+        if (rc != QZ_OK || dec_len != src_sz || memcmp(src, decomp, src_sz)) {
+            QZ_ERROR("ERROR: Decompression FAILED with return value: %d\n", rc);
+            rc = QZ_FAIL;
+            goto done;
+        }
+    }
+
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] thread %ld compress %zu bytes, common dest %llu us, "
+             "pinned dest %llu us\n", tid, src_sz, us[0] / count,
+             us[1] / count);
+    pthread_mutex_unlock(&g_lock_print);
+    rc = QZ_OK;
+
+done:
+    if (gen_data) {
+        qzFree(src);
+    }
+    free(out[0]);
+    qzFree(out[1]);
+    qzFree(decomp);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"dest in place test failed");
+}
+
+#define PT_BENCH_RANGE    (2UL << 30)
+#define PT_BENCH_LOOKUPS  (1 << 20)
+
+/* Cost of registering, looking up and unregistering a 2 GB range in a
+ * page table, 1 GB aligned, 2 MB aligned and 4 KB off alignment. The range
+ * is reserved address space only, which qzRegisterMemory would refuse, so
+ * the table is driven the way qzRegisterMemory drives QATzip's own.
+ */
+void *qzPageTableBench(void *arg)
+{
+    int k, c, rc = QZ_OK;
+    unsigned int seed = 1;
+    unsigned char *area, *start;
+    uintptr_t lo, hi;
+    QzPageTable_T *table = NULL;
+    QzPageRetireQ_T retired = {NULL};
+    size_t area_sz = PT_BENCH_RANGE + (2UL << 30);
+    struct timeval ts, te;
+    unsigned long long us[3];
+    unsigned long found;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    const size_t offsets[3] = {0, 2UL << 20, 4UL << 10};
+    const char *names[3] = {"1GB aligned", "2MB aligned", "4KB aligned"};
+
+    area = mmap(NULL, area_sz, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#ifndef ENABLE_THREAD_BARRIER
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#else
+    pthread_barrier_wait(&g_bar);
+#endif
+    table = calloc(1, sizeof(QzPageTable_T));
+    if (MAP_FAILED == area || NULL == table) {
+        pthread_exit((void *)"mmap failed");
+    }
+    start = (unsigned char *)(((unsigned long)area + (1UL << 30) - 1) &
+                              ~((1UL << 30) - 1));
+
+    for (c = 0; c < 3; c++) {
+        memset(us, 0, sizeof(us));
+        found = 0;
+        lo = (uintptr_t)(start + offsets[c]);
+        hi = lo + PT_BENCH_RANGE;
+        for (k = 0; k < count && QZ_OK == rc; k++) {
+            (void)gettimeofday(&ts, NULL);
+            rc = markRange(table, lo, hi, (uint64_t)REGISTERED, &retired);
+            (void)gettimeofday(&te, NULL);
+            us[0] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+
+            (void)gettimeofday(&ts, NULL);
+            for (int n = 0; n < PT_BENCH_LOOKUPS; n++) {
+                found += ((uint64_t)REGISTERED ==
+                          loadAddr(table, (void *)(lo +
+                                   ((unsigned long)rand_r(&seed) %
+                                    (PT_BENCH_RANGE >> 12) << 12))));
+            }
+            (void)gettimeofday(&te, NULL);
+            us[1] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+
+            (void)gettimeofday(&ts, NULL);
+            rc |= storeLevel(table, 3, lo, hi, 0, (uint64_t)REGISTERED,
+                             &retired);
+            (void)gettimeofday(&te, NULL);
+            us[2] += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+        }
+        if (QZ_OK != rc || found != (unsigned long)count * PT_BENCH_LOOKUPS ||
+            0 != loadAddr(table, (void *)lo)) {
+            QZ_ERROR("ERROR: page table bench %s failed, rc %d\n", names[c], rc);
+            rc = QZ_FAIL;
+            break;
+        }
+
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld 2GB %s: register %llu us, lookup %llu ns, "
+                 "unregister %llu us\n", tid, names[c], us[0] / count,
+                 us[1] * 1000 / ((unsigned long long)count * PT_BENCH_LOOKUPS),
+                 us[2] / count);
+        pthread_mutex_unlock(&g_lock_print);
+    }
+
+    reclaimLevels(&retired);
+    freePageTable(table);
+    free(table);
+    munmap(area, area_sz);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"page table bench failed");
+}
+
+/* Pinned buffers from qzMalloc have to leave the page table on qzFree,
+ * while a neighbour sharing an edge page stays registered. Sizes are over
+ * 2 MB, smaller ones stay pinned in the memory pool once freed.
+ */
+void *qzMemReuseTest(void *arg)
+{
+    int k, rc = QZ_OK;
+    unsigned int seed = 1;
+    size_t sz;
+    unsigned char *a, *b;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+
+#ifndef ENABLE_THREAD_BARRIER
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#else
+    pthread_barrier_wait(&g_bar);
+#endif
+
+    for (k = 0; k < count && QZ_OK == rc; k++) {
+        sz = (2UL << 20) + 1 + (size_t)rand_r(&seed) % (4UL << 20);
+        a = qzMalloc(sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+        b = qzMalloc(sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+        if (!a || !b) {
+            QZ_ERROR("ERROR: pinned malloc of %zu bytes failed\n", sz);
+            qzFree(a);
+            qzFree(b);
+            rc = QZ_FAIL;
+            break;
+        }
+        if (!qzMemFindAddr(a) || !qzMemFindAddr(a + sz - 1) ||
+            !qzMemFindAddr(b) || !qzMemFindAddr(b + sz - 1)) {
+            rc = QZ_FAIL;
+        }
+
+        qzFree(a);
+        if (!qzMemFindAddr(b) || !qzMemFindAddr(b + sz - 1)) {
+            rc = QZ_FAIL;
+        }
+        qzFree(b);
+        if (qzMemFindAddr(b) || qzMemFindAddr(b + sz - 1)) {
+            rc = QZ_FAIL;
+        }
+    }
+
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] thread %ld pinned alloc/free %d rounds: %s\n", tid, k,
+             (QZ_OK == rc) ? "PASSED" : "FAILED");
+    pthread_mutex_unlock(&g_lock_print);
+
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"memory reuse test failed");
+}
+
+#define POOL_BENCH_LIVE    (16)
+#define POOL_BENCH_ROUNDS  (4096)
+
+/* qzMalloc/qzFree through the slab pool against the USDM allocator, with
+ * POOL_BENCH_LIVE allocations live at a time. COMMON_MEM so that the pool
+ * runs on huge pages when the USDM allocator is absent.
+ */
+void *qzMemPoolBench(void *arg)
+{
+    int c, k, r, i;
+    unsigned char *m[POOL_BENCH_LIVE];
+    struct timeval ts, te;
+    unsigned long long us[2];
+    unsigned long long pairs;
+    QzMemPoolStats_T stats;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    const size_t sizes[4] = {256, 4UL << 10, 64UL << 10, 512UL << 10};
+
+#ifndef ENABLE_THREAD_BARRIER
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#else
+    pthread_barrier_wait(&g_bar);
+#endif
+
+    pairs = (unsigned long long)count * POOL_BENCH_ROUNDS * POOL_BENCH_LIVE;
+    for (c = 0; c < 4; c++) {
+        memset(us, 0, sizeof(us));
+
+        (void)gettimeofday(&ts, NULL);
+        for (k = 0; k < count * POOL_BENCH_ROUNDS; k++) {
+            for (i = 0; i < POOL_BENCH_LIVE; i++) {
+                m[i] = qzMalloc(sizes[c], QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+                if (NULL == m[i]) {
+                    pthread_exit((void *)"qzMalloc failed");
+                }
+                m[i][0] = m[i][sizes[c] - 1] = (unsigned char)i;
+            }
+            for (i = 0; i < POOL_BENCH_LIVE; i++) {
+                assert(m[i][0] == (unsigned char)i &&
+                       m[i][sizes[c] - 1] == (unsigned char)i);
+                qzFree(m[i]);
+            }
+        }
+        (void)gettimeofday(&te, NULL);
+        us[0] = (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+
+        (void)gettimeofday(&ts, NULL);
+        for (k = 0, r = 1; k < count * POOL_BENCH_ROUNDS && r; k++) {
+            for (i = 0; i < POOL_BENCH_LIVE; i++) {
+                m[i] = qaeMemAllocNUMA(sizes[c], 0, 64);
+                r = r && (NULL != m[i]);
+            }
+            for (i = 0; i < POOL_BENCH_LIVE; i++) {
+                if (NULL != m[i]) {
+                    qaeMemFreeNUMA((void **)&m[i]);
+                }
+            }
+        }
+        (void)gettimeofday(&te, NULL);
+        us[1] = (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+
+        pthread_mutex_lock(&g_lock_print);
+        if (r) {
+            QZ_PRINT("[INFO] thread %ld %zu B: pool %llu ns, USDM %llu ns "
+                     "per alloc/free\n", tid, sizes[c], us[0] * 1000 / pairs,
+                     us[1] * 1000 / pairs);
+        } else {
+            QZ_PRINT("[INFO] thread %ld %zu B: pool %llu ns per alloc/free, "
+                     "no USDM\n", tid, sizes[c], us[0] * 1000 / pairs);
+        }
+        pthread_mutex_unlock(&g_lock_print);
+    }
+
+    if (QZ_OK == qzGetMemPoolStats(&stats)) {
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld pool: %lu slabs %lu B, retained %lu B, "
+                 "cache hits %lu, refills %lu, slabs allocated %lu freed %lu\n",
+                 tid, stats.slabs, stats.slab_bytes, stats.retained_bytes,
+                 stats.cache_hits, stats.central_hits, stats.slab_allocs,
+                 stats.slab_frees);
+        pthread_mutex_unlock(&g_lock_print);
+    }
+
+    pthread_exit(NULL);
+}
+
+#define STREAM_CHURN_STREAMS  (1024)
+#define STREAM_CHURN_MSG_SZ    (4 * 1024)
+
+/* Many short lived streams per thread, each compressing one small message,
+ * to time the stream buffer cache under qzCompressStream/qzEndStream.
+ */
+void *qzStreamChurnTest(void *arg)
+{
+    int rc = -1, k, n;
+    unsigned char *src = NULL, *dest = NULL;
+    unsigned int dest_sz;
+    struct timeval ts, te;
+    unsigned long long us = 0;
+    QzStream_T strm;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    dest_sz = qzMaxCompressedLength(STREAM_CHURN_MSG_SZ, &sess);
+    src = qzMalloc(STREAM_CHURN_MSG_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    dest = qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (!src || !dest) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, STREAM_CHURN_MSG_SZ);
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    for (k = 0; k < count && QZ_OK == rc; k++) {
+        (void)gettimeofday(&ts, NULL);
+        for (n = 0; n < STREAM_CHURN_STREAMS; n++) {
+            memset(&strm, 0, sizeof(QzStream_T));
+            strm.in = src;
+            strm.in_sz = STREAM_CHURN_MSG_SZ;
+            strm.out = dest;
+            strm.out_sz = dest_sz;
+            rc = qzCompressStream(&sess, &strm, 1);
+            qzEndStream(&sess, &strm);
+            if (QZ_OK != rc) {
+                QZ_ERROR("qzCompressStream FAILED, return: %d\n", rc);
+                break;
+            }
+        }
+        (void)gettimeofday(&te, NULL);
+        us += (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+    }
+
+    if (QZ_OK == rc) {
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld %d streams of %d B: %llu ns per stream\n",
+                 tid, count * STREAM_CHURN_STREAMS, STREAM_CHURN_MSG_SZ,
+                 us * 1000 / ((unsigned long long)count * STREAM_CHURN_STREAMS));
+        pthread_mutex_unlock(&g_lock_print);
+    }
+
+done:
+    qzFree(src);
+    qzFree(dest);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"stream churn test failed");
+}
+
+#define STREAM_DIRECT_SZ    (32 * 1024 * 1024)
+#define STREAM_DIRECT_CHUNK (8 * 1024 * 1024)
+
+/* Stream compress src in chunks of chunk bytes, *out_len is the output
+ * and *crc, if given, the stream's checksum
+ */
+static int streamCompressChunks(QzSession_T *sess, unsigned char *src,
+                                unsigned int src_sz, unsigned char *dest,
+                                unsigned int dest_sz, unsigned int chunk,
+                                unsigned int *out_len, unsigned int *crc)
+{
+    unsigned int in_off = 0, out_off = 0, last = 0;
+    QzStream_T strm;
+    int rc = QZ_OK;
+
+    memset(&strm, 0, sizeof(QzStream_T));
+    while (!last || strm.pending_in > 0 || strm.pending_out > 0) {
+        strm.in = src + in_off;
+        strm.in_sz = (src_sz - in_off > chunk) ? chunk : src_sz - in_off;
+        strm.out = dest + out_off;
+        strm.out_sz = dest_sz - out_off;
+        last = (in_off + strm.in_sz == src_sz) ? 1 : 0;
+        rc = qzCompressStream(sess, &strm, last);
+        if (QZ_OK != rc) {
+            QZ_ERROR("qzCompressStream FAILED, return: %d\n", rc);
+            break;
+        }
+        in_off += strm.in_sz;
+        out_off += strm.out_sz;
+        if (in_off < src_sz) {
+            last = 0;
+        }
+    }
+    qzEndStream(sess, &strm);
+
+    *out_len = out_off;
+    if (NULL != crc) {
+        *crc = strm.crc_32;
+    }
+    return rc;
+}
+
+/* Stream decompress src in chunks of chunk bytes, *out_len is the output
+ * and *crc, if given, the stream's checksum
+ */
+static int streamDecompressChunks(QzSession_T *sess, unsigned char *src,
+                                  unsigned int src_sz, unsigned char *dest,
+                                  unsigned int dest_sz, unsigned int chunk,
+                                  unsigned int *out_len, unsigned int *crc)
+{
+    unsigned int in_off = 0, out_off = 0, last = 0;
+    QzStream_T strm;
+    int rc = QZ_OK;
+
+    memset(&strm, 0, sizeof(QzStream_T));
+    while (!last || strm.pending_in > 0 || strm.pending_out > 0) {
+        strm.in = src + in_off;
+        strm.in_sz = (src_sz - in_off > chunk) ? chunk : src_sz - in_off;
+        strm.out = dest + out_off;
+        strm.out_sz = dest_sz - out_off;
+        last = (in_off + strm.in_sz == src_sz) ? 1 : 0;
+        rc = qzDecompressStream(sess, &strm, last);
+        if (QZ_OK != rc) {
+            QZ_ERROR("qzDecompressStream FAILED, return: %d\n", rc);
+            break;
+        }
+        in_off += strm.in_sz;
+        out_off += strm.out_sz;
+        if (in_off < src_sz) {
+            last = 0;
+        }
+        if (last && 0 == strm.in_sz && 0 == strm.out_sz) {
+            QZ_ERROR("qzDecompressStream made no progress\n");
+            rc = QZ_FAIL;
+            break;
+        }
+    }
+    qzEndStream(sess, &strm);
+
+    *out_len = out_off;
+    if (NULL != crc) {
+        *crc = strm.crc_32;
+    }
+    return rc;
+}
+
+/* Stream compression bandwidth of chunks going through the stream buffers
+ * against chunks large enough to be compressed in place, whose output must
+ * decompress back to the input
+ */
+void *qzStreamDirectBench(void *arg)
+{
+    int rc = -1, k, n;
+    unsigned char *src = NULL, *dest = NULL, *back = NULL;
+    unsigned int dest_sz, out_len = 0, back_sz, in_sz;
+    const unsigned int chunk[2] = {QZ_STRM_BUFF_SZ_DEFAULT / 4,
+                                   STREAM_DIRECT_CHUNK
+                                  };
+    struct timeval ts, te;
+    unsigned long long us[2] = {0, 0};
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    dest_sz = qzMaxCompressedLength(STREAM_DIRECT_SZ, &sess);
+    src = qzMalloc(STREAM_DIRECT_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    dest = qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    back = qzMalloc(STREAM_DIRECT_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (!src || !dest || !back) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, STREAM_DIRECT_SZ);
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    for (k = 0; k < count && QZ_OK == rc; k++) {
+        for (n = 0; n < 2 && QZ_OK == rc; n++) {
+            (void)gettimeofday(&ts, NULL);
+            rc = streamCompressChunks(&sess, src, STREAM_DIRECT_SZ, dest,
+                                      dest_sz, chunk[n], &out_len, NULL);
+            (void)gettimeofday(&te, NULL);
+            us[n] += (te.tv_sec - ts.tv_sec) * 1000000ULL +
+                     te.tv_usec - ts.tv_usec;
+        }
+    }
+    if (QZ_OK != rc) {
+        goto done;
+    }
+
+    in_sz = out_len;
+    back_sz = STREAM_DIRECT_SZ;
+    rc = qzDecompress(&sess, dest, &in_sz, back, &back_sz);
+    if (QZ_OK != rc || STREAM_DIRECT_SZ != back_sz ||
+        memcmp(src, back, STREAM_DIRECT_SZ)) {
+        QZ_ERROR("ERROR: direct stream output doesn't decompress to its "
+                 "input, rc %d, %u bytes\n", rc, back_sz);
+        rc = QZ_FAIL;
+        goto done;
+    }
+
+    pthread_mutex_lock(&g_lock_print);
+    for (n = 0; n < 2; n++) {
+        QZ_PRINT("[INFO] thread %ld stream chunks of %u B: %.2f MB/s\n",
+                 tid, chunk[n], (double)STREAM_DIRECT_SZ * count /
+                 (us[n] ? us[n] : 1));
+    }
+    pthread_mutex_unlock(&g_lock_print);
+
+done:
+    qzFree(src);
+    qzFree(dest);
+    qzFree(back);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"stream direct bench failed");
+}
+
+#define STREAM_PIPE_DEPTH   4
+
+/* Stream compression bandwidth in stream buffer sized chunks, one buffer at
+ * a time and with strm_pipeline buffers rotating (-R, STREAM_PIPE_DEPTH if
+ * not given), against the one-shot API. The pipelined output must
+ * decompress back to the input.
+ */
+void *qzStreamPipeBench(void *arg)
+{
+    int rc = -1, k, n;
+    unsigned char *src = NULL, *dest = NULL, *back = NULL;
+    unsigned int dest_sz, out_len = 0, back_sz, in_sz;
+    struct timeval ts, te;
+    unsigned long long us[3] = {0, 0, 0};
+    const char *name[3] = {"serial stream", "pipelined stream", "one-shot"};
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int count = ((TestArg_T *)arg)->count;
+    TestArg_T serial_arg = *(TestArg_T *)arg;
+    TestArg_T pipe_arg = *(TestArg_T *)arg;
+    QzSession_T sess = {0}, pipe_sess = {0};
+
+    serial_arg.strm_pipeline = 0;
+    if (pipe_arg.strm_pipeline < 2) {
+        pipe_arg.strm_pipeline = STREAM_PIPE_DEPTH;
+    }
+    rc = qzInitSetupsession(&sess, &serial_arg);
+    if (rc == QZ_OK || rc == QZ_DUPLICATE) {
+        rc = qzInitSetupsession(&pipe_sess, &pipe_arg);
+    }
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    dest_sz = qzMaxCompressedLength(STREAM_DIRECT_SZ, &sess);
+    src = qzMalloc(STREAM_DIRECT_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    dest = qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    back = qzMalloc(STREAM_DIRECT_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (!src || !dest || !back) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, STREAM_DIRECT_SZ);
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    for (k = 0; k < count && QZ_OK == rc; k++) {
+        for (n = 2; n >= 0 && QZ_OK == rc; n--) {
+            (void)gettimeofday(&ts, NULL);
+            if (2 == n) {
+                in_sz = STREAM_DIRECT_SZ;
+                out_len = dest_sz;
+                rc = qzCompress(&sess, src, &in_sz, dest, &out_len, 1);
+            } else {
+                rc = streamCompressChunks(n ? &pipe_sess : &sess, src,
+                                          STREAM_DIRECT_SZ, dest, dest_sz,
+                                          QZ_STRM_BUFF_SZ_DEFAULT, &out_len,
+                                          NULL);
+            }
+            (void)gettimeofday(&te, NULL);
+            us[n] += (te.tv_sec - ts.tv_sec) * 1000000ULL +
+                     te.tv_usec - ts.tv_usec;
+        }
+    }
+    if (QZ_OK != rc) {
+        goto done;
+    }
+
+    /* the last round ran the pipelined stream */
+    in_sz = out_len;
+    back_sz = STREAM_DIRECT_SZ;
+    rc = qzDecompress(&sess, dest, &in_sz, back, &back_sz);
+    if (QZ_OK != rc || STREAM_DIRECT_SZ != back_sz ||
+        memcmp(src, back, STREAM_DIRECT_SZ)) {
+        QZ_ERROR("ERROR: pipelined stream output doesn't decompress to its "
+                 "input, rc %d, %u bytes\n", rc, back_sz);
+        rc = QZ_FAIL;
+        goto done;
+    }
+
+    pthread_mutex_lock(&g_lock_print);
+    for (n = 0; n < 3; n++) {
+        QZ_PRINT("[INFO] thread %ld %s: %.2f MB/s\n", tid, name[n],
+                 (double)STREAM_DIRECT_SZ * count / (us[n] ? us[n] : 1));
+    }
+    pthread_mutex_unlock(&g_lock_print);
+
+done:
+    qzFree(src);
+    qzFree(dest);
+    qzFree(back);
+    (void)qzTeardownSession(&pipe_sess);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"stream pipeline bench failed");
+}
+
+#define STREAM_FMT_SZ         (4 * 1024 * 1024 + 123)
+#define STREAM_FMT_COMP_CHUNK (100000)
+#define STREAM_FMT_DECOMP_CHUNK (7777)
+
+/* Standard gzip or zlib with inflate until Z_STREAM_END, which has to take
+ * all of the input to be a single member or stream
+ */
+static int inflateSingleCheck(unsigned char *comp, unsigned int comp_len,
+                              unsigned char *orig, unsigned int orig_len,
+                              unsigned char *back, int window_bits)
+{
+    z_stream strm = {0};
+    int ret;
+
+    if (Z_OK != inflateInit2(&strm, window_bits)) {
+        return QZ_FAIL;
+    }
+    strm.next_in = comp;
+    strm.avail_in = comp_len;
+    strm.next_out = back;
+    strm.avail_out = orig_len;
+    ret = inflate(&strm, Z_FINISH);
+    (void)inflateEnd(&strm);
+    if (Z_STREAM_END != ret || 0 != strm.avail_in ||
+        orig_len != strm.total_out || memcmp(orig, back, orig_len)) {
+        QZ_ERROR("ERROR: inflate ret %d, %u bytes left, %lu bytes out\n",
+                 ret, strm.avail_in, strm.total_out);
+        return QZ_FAIL;
+    }
+    return QZ_OK;
+}
+
+/* A thread whose session setup failed still lets the others start */
+static void threadSetupFailed(void)
+{
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+}
+
+/* zlib streams and LZ4 frames through the stream APIs: chunks that don't
+ * line up with the stream buffers, and compressed chunks that cut frames,
+ * must round trip with the Adler-32 or XXH32 of the whole data
+ */
+void *qzStreamFormatTest(void *arg)
+{
+    int rc = -1, n;
+    unsigned char *src = NULL, *dest = NULL, *back = NULL;
+    unsigned int dest_sz, out_len = 0, back_len = 0;
+    unsigned int want, in_len, comp_crc = 0, decomp_crc = 0;
+    unsigned long one_crc;
+    const int format[2] = {TEST_ZLIB, TEST_LZ4};
+    const char *name[2] = {"zlib", "LZ4 frame"};
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    TestArg_T fmt_arg[2];
+    QzSession_T sess[2] = {{0}, {0}};
+
+    for (n = 0; n < 2; n++) {
+        fmt_arg[n] = *(TestArg_T *)arg;
+        fmt_arg[n].test_format = format[n];
+        fmt_arg[n].comp_algorithm = (TEST_LZ4 == format[n]) ? QZ_LZ4 :
+                                    QZ_DEFLATE;
+        rc = qzInitSetupsession(&sess[n], &fmt_arg[n]);
+        if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+            (void)qzTeardownSession(&sess[0]);
+            threadSetupFailed();
+            pthread_exit((void *)"qzInit failed");
+        }
+    }
+
+    dest_sz = qzMaxCompressedLength(STREAM_FMT_SZ, &sess[1]);
+    if (dest_sz < qzMaxCompressedLength(STREAM_FMT_SZ, &sess[0])) {
+        dest_sz = qzMaxCompressedLength(STREAM_FMT_SZ, &sess[0]);
+    }
+    src = qzMalloc(STREAM_FMT_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    dest = qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    back = qzMalloc(STREAM_FMT_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (!src || !dest || !back) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, STREAM_FMT_SZ);
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    rc = QZ_OK;
+    for (n = 0; n < 2 && QZ_OK == rc; n++) {
+        want = (TEST_LZ4 == format[n]) ? XXH32(src, STREAM_FMT_SZ, 0) :
+               adler32(adler32(0L, Z_NULL, 0), src, STREAM_FMT_SZ);
+
+        rc = streamCompressChunks(&sess[n], src, STREAM_FMT_SZ, dest, dest_sz,
+                                  STREAM_FMT_COMP_CHUNK, &out_len, &comp_crc);
+        /* zlib comes out as one standard zlib stream */
+        if (QZ_OK == rc && TEST_ZLIB == format[n]) {
+            rc = inflateSingleCheck(dest, out_len, src, STREAM_FMT_SZ, back,
+                                    MAX_WBITS);
+        }
+        if (QZ_OK == rc) {
+            rc = streamDecompressChunks(&sess[n], dest, out_len, back,
+                                        STREAM_FMT_SZ, STREAM_FMT_DECOMP_CHUNK,
+                                        &back_len, &decomp_crc);
+        }
+        if (QZ_OK != rc || STREAM_FMT_SZ != back_len ||
+            memcmp(src, back, STREAM_FMT_SZ) ||
+            want != comp_crc || want != decomp_crc) {
+            QZ_ERROR("ERROR: %s stream round trip failed, rc %d, %u bytes, "
+                     "checksum 0x%x compress 0x%x decompress 0x%x\n",
+                     name[n], rc, back_len, want, comp_crc, decomp_crc);
+            rc = QZ_FAIL;
+            break;
+        }
+
+        /* qzCompressCrc of a zlib stream gives the same Adler-32 */
+        if (TEST_ZLIB == format[n]) {
+            in_len = STREAM_FMT_SZ;
+            out_len = dest_sz;
+            one_crc = 0;
+            rc = qzCompressCrc(&sess[n], src, &in_len, dest, &out_len, 1,
+                               &one_crc);
+            if (QZ_OK != rc || STREAM_FMT_SZ != in_len || want != one_crc) {
+                QZ_ERROR("ERROR: zlib qzCompressCrc rc %d, %u bytes, "
+                         "checksum 0x%x, want 0x%x\n", rc, in_len,
+                         (unsigned int)one_crc, want);
+                rc = QZ_FAIL;
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld %s stream: %u -> %u bytes, checksum 0x%x\n",
+                 tid, name[n], STREAM_FMT_SZ, out_len, want);
+        pthread_mutex_unlock(&g_lock_print);
+    }
+
+done:
+    qzFree(src);
+    qzFree(dest);
+    qzFree(back);
+    (void)qzTeardownSession(&sess[1]);
+    (void)qzTeardownSession(&sess[0]);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"stream format test failed");
+}
+
+#define SINGLE_MEMBER_SZ    (4 * 1024 * 1024 + 123)
+#define SINGLE_MEMBER_CHUNK (1000000)
+
+/* An LZ4 frame ends in a zero end mark and the XXH32 of all the content */
+static int lz4SingleFrameCheck(QzSession_T *sess, unsigned char *comp,
+                               unsigned int comp_len, unsigned char *orig,
+                               unsigned int orig_len, unsigned char *back)
+{
+    unsigned int in_len = comp_len, back_len = orig_len;
+    unsigned int end_mark, cksum;
+    int rc;
+
+    memcpy(&end_mark, comp + comp_len - 8, sizeof(end_mark));
+    memcpy(&cksum, comp + comp_len - 4, sizeof(cksum));
+    if (0 != end_mark || XXH32(orig, orig_len, 0) != cksum) {
+        QZ_ERROR("ERROR: LZ4 frame end 0x%x, checksum 0x%x\n", end_mark,
+                 cksum);
+        return QZ_FAIL;
+    }
+    rc = qzDecompress(sess, comp, &in_len, back, &back_len);
+    if (QZ_OK != rc || comp_len != in_len || orig_len != back_len ||
+        memcmp(orig, back, orig_len)) {
+        QZ_ERROR("ERROR: LZ4 frame decompress rc %d, %u -> %u bytes\n", rc,
+                 in_len, back_len);
+        return QZ_FAIL;
+    }
+    return QZ_OK;
+}
+
+/* single_member: calls with last 0 then 1 build one gzip member or one LZ4
+ * frame, which standard decoders read in one go
+ */
+void *qzSingleMemberTest(void *arg)
+{
+    int rc = -1, n;
+    unsigned char *src = NULL, *dest = NULL, *back = NULL;
+    unsigned int dest_sz, in_len, out_len, off, produced;
+    const int format[2] = {TEST_GZIP, TEST_LZ4};
+    const char *name[2] = {"gzip member", "LZ4 frame"};
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    TestArg_T fmt_arg[2];
+    QzSession_T sess[2] = {{0}, {0}};
+
+    for (n = 0; n < 2; n++) {
+        fmt_arg[n] = *(TestArg_T *)arg;
+        fmt_arg[n].test_format = format[n];
+        fmt_arg[n].comp_algorithm = (TEST_LZ4 == format[n]) ? QZ_LZ4 :
+                                    QZ_DEFLATE;
+        fmt_arg[n].single_member = 1;
+        rc = qzInitSetupsession(&sess[n], &fmt_arg[n]);
+        if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+            (void)qzTeardownSession(&sess[0]);
+            threadSetupFailed();
+            pthread_exit((void *)"qzInit failed");
+        }
+    }
+
+    dest_sz = qzMaxCompressedLength(SINGLE_MEMBER_SZ, &sess[1]);
+    if (dest_sz < qzMaxCompressedLength(SINGLE_MEMBER_SZ, &sess[0])) {
+        dest_sz = qzMaxCompressedLength(SINGLE_MEMBER_SZ, &sess[0]);
+    }
+    src = qzMalloc(SINGLE_MEMBER_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    dest = qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    back = qzMalloc(SINGLE_MEMBER_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (!src || !dest || !back) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, SINGLE_MEMBER_SZ);
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    rc = QZ_OK;
+    for (n = 0; n < 2 && QZ_OK == rc; n++) {
+        off = 0;
+        produced = 0;
+        while (QZ_OK == rc && off < SINGLE_MEMBER_SZ) {
+            in_len = SINGLE_MEMBER_SZ - off;
+            if (in_len > SINGLE_MEMBER_CHUNK) {
+                in_len = SINGLE_MEMBER_CHUNK;
+            }
+            out_len = dest_sz - produced;
+            rc = qzCompress(&sess[n], src + off, &in_len, dest + produced,
+                            &out_len, off + in_len == SINGLE_MEMBER_SZ);
+            off += in_len;
+            produced += out_len;
+        }
+        if (QZ_OK != rc) {
+            QZ_ERROR("ERROR: %s compress rc %d at %u\n", name[n], rc, off);
+            break;
+        }
+
+        rc = (TEST_GZIP == format[n]) ?
+             inflateSingleCheck(dest, produced, src, SINGLE_MEMBER_SZ, back,
+                                MAX_WBITS + 16) :
+             lz4SingleFrameCheck(&sess[n], dest, produced, src,
+                                 SINGLE_MEMBER_SZ, back);
+        if (QZ_OK != rc) {
+            QZ_ERROR("ERROR: %s output of %u bytes isn't a single member\n",
+                     name[n], produced);
+            break;
+        }
+
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld single %s: %u -> %u bytes\n", tid,
+                 name[n], SINGLE_MEMBER_SZ, produced);
+        pthread_mutex_unlock(&g_lock_print);
+    }
+
+done:
+    qzFree(src);
+    qzFree(dest);
+    qzFree(back);
+    (void)qzTeardownSession(&sess[1]);
+    (void)qzTeardownSession(&sess[0]);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"single member test failed");
+}
+
+#define STREAM_FLUSH_MSGS   (64)
+#define STREAM_FLUSH_MSG_SZ (20000)
+
+/* QZ_SYNC_FLUSH after each message of a raw deflate stream: everything
+ * sent so far has to come out, and inflate it back to the message, while
+ * the stream goes on
+ */
+void *qzStreamFlushTest(void *arg)
+{
+    int rc = -1, k, ret;
+    unsigned char *src = NULL, *dest = NULL, *back = NULL;
+    unsigned int dest_sz, msg_sz, in_off = 0, out_off, got;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    TestArg_T raw_arg = *(TestArg_T *)arg;
+    QzSession_T sess = {0};
+    QzStream_T strm;
+    z_stream inf = {0};
+
+    raw_arg.test_format = TEST_DEFLATE;
+    raw_arg.comp_algorithm = QZ_DEFLATE;
+    rc = qzInitSetupsession(&sess, &raw_arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+        threadSetupFailed();
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    dest_sz = qzMaxCompressedLength(STREAM_FLUSH_MSG_SZ, &sess);
+    src = qzMalloc(STREAM_FLUSH_MSGS * STREAM_FLUSH_MSG_SZ,
+                   QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    dest = qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    back = qzMalloc(STREAM_FLUSH_MSG_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (!src || !dest || !back || Z_OK != inflateInit2(&inf, -MAX_WBITS)) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, STREAM_FLUSH_MSGS * STREAM_FLUSH_MSG_SZ);
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    rc = QZ_OK;
+    memset(&strm, 0, sizeof(QzStream_T));
+    for (k = 0; k < STREAM_FLUSH_MSGS && QZ_OK == rc; k++) {
+        /* from a single byte up to the whole message */
+        msg_sz = 1 + (unsigned int)(k * 7919) % STREAM_FLUSH_MSG_SZ;
+        strm.in = src + in_off;
+        strm.in_sz = msg_sz;
+        out_off = 0;
+        do {
+            strm.out = dest + out_off;
+            strm.out_sz = dest_sz - out_off;
+            rc = qzCompressStream(&sess, &strm, QZ_SYNC_FLUSH);
+            out_off += strm.out_sz;
+            strm.in += strm.in_sz;
+            msg_sz -= strm.in_sz;
+            strm.in_sz = msg_sz;
+        } while (QZ_OK == rc &&
+                 (msg_sz > 0 || strm.pending_in > 0 || strm.pending_out > 0));
+        if (QZ_OK != rc) {
+            QZ_ERROR("ERROR: qzCompressStream flush of message %d: %d\n", k,
+                     rc);
+            break;
+        }
+
+        msg_sz = 1 + (unsigned int)(k * 7919) % STREAM_FLUSH_MSG_SZ;
+        inf.next_in = dest;
+        inf.avail_in = out_off;
+        inf.next_out = back;
+        inf.avail_out = STREAM_FLUSH_MSG_SZ;
+        ret = inflate(&inf, Z_SYNC_FLUSH);
+        got = STREAM_FLUSH_MSG_SZ - inf.avail_out;
+        if ((Z_OK != ret && Z_BUF_ERROR != ret) || 0 != inf.avail_in ||
+            msg_sz != got || memcmp(src + in_off, back, got)) {
+            QZ_ERROR("ERROR: message %d of %u bytes flushed %u bytes which "
+                     "inflate to %u, ret %d\n", k, msg_sz, out_off, got, ret);
+            rc = QZ_FAIL;
+        }
+        in_off += msg_sz;
+    }
+    (void)qzEndStream(&sess, &strm);
+
+    if (QZ_OK == rc) {
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld flushed %d messages, %u bytes\n", tid,
+                 STREAM_FLUSH_MSGS, in_off);
+        pthread_mutex_unlock(&g_lock_print);
+    }
+
+done:
+    (void)inflateEnd(&inf);
+    qzFree(src);
+    qzFree(dest);
+    qzFree(back);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"stream flush test failed");
+}
+
+#define MEM_BUDGET_SZ      (3UL << 20)
+#define MEM_BUDGET_ALLOCS  (16)
+
+static unsigned long memStatsSum(unsigned long acct[][QZ_MEM_PURPOSES],
+                                 int purpose)
+{
+    unsigned long sum = 0;
+    int n;
+
+    for (n = 0; n < QZ_MEM_MAX_NODES; n++) {
+        sum += acct[n][purpose];
+    }
+    return sum;
+}
+
+/* The memory a session and qzMalloc hold shows in qzGetMemStats and
+ * qzGetStatus. Thread 0 then sets a process budget just over what is held:
+ * PINNED_MEM requests have to be refused before long, while COMMON_MEM ones
+ * still get pageable memory.
+ */
+void *qzMemBudgetTest(void *arg)
+{
+    int rc = -1, k, got = 0;
+    unsigned char *src = NULL, *dest = NULL, *common = NULL, *pin;
+    unsigned char *held[MEM_BUDGET_ALLOCS] = {NULL};
+    unsigned int src_sz = QZ_HW_BUFF_SZ, dest_sz;
+    QzMemStats_T before, after;
+    QzStatus_T status;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    dest_sz = qzMaxCompressedLength(src_sz, &sess);
+    src = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    dest = qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (!src || !dest) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, src_sz);
+    rc = qzCompress(&sess, src, &src_sz, dest, &dest_sz, 1);
+    if (QZ_OK != rc) {
+        QZ_ERROR("qzCompress FAILED, return: %d\n", rc);
+        goto done;
+    }
+
+    (void)qzGetMemStats(&before);
+    (void)qzGetStatus(&sess, &status);
+    if (!status.qat_service_init) {
+        /* software only, no instance or USDM memory to account */
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld no QAT service, %lu KB held, pinned "
+                 "memory checks skipped\n", tid, status.memory_alloced);
+        pthread_mutex_unlock(&g_lock_print);
+        rc = QZ_OK;
+        goto done;
+    }
+    if (0 == status.memory_alloced ||
+        (status.qat_instance_attach &&
+         0 == memStatsSum(before.pinned, QZ_MEM_INST))) {
+        QZ_ERROR("ERROR: init %u attach %u but %lu KB held, %lu for instances\n",
+                 status.qat_service_init, status.qat_instance_attach,
+                 status.memory_alloced, memStatsSum(before.pinned, QZ_MEM_INST));
+        rc = QZ_FAIL;
+        goto done;
+    }
+
+    pin = qzMalloc(MEM_BUDGET_SZ, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    (void)qzGetMemStats(&after);
+    if (NULL != pin &&
+        memStatsSum(after.pinned, QZ_MEM_USER) < MEM_BUDGET_SZ) {
+        QZ_ERROR("ERROR: %lu B pinned held with a %lu B allocation live\n",
+                 memStatsSum(after.pinned, QZ_MEM_USER), MEM_BUDGET_SZ);
+        rc = QZ_FAIL;
+    } else if (NULL == pin && 0 == after.budget) {
+        QZ_ERROR("ERROR: pinned malloc failed without a budget\n");
+        rc = QZ_FAIL;
+    }
+    qzFree(pin);
+
+    if (0 == tid && QZ_OK == rc) {
+        (void)qzSetMemBudget(QZ_AUTO_SELECT_NUMA_NODE,
+                             after.usdm_total + 2 * MEM_BUDGET_SZ);
+        for (k = 0; k < MEM_BUDGET_ALLOCS; k++) {
+            held[k] = qzMalloc(MEM_BUDGET_SZ, QZ_AUTO_SELECT_NUMA_NODE,
+                               PINNED_MEM);
+            if (NULL == held[k]) {
+                break;
+            }
+            got++;
+        }
+        common = qzMalloc(MEM_BUDGET_SZ, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+        (void)qzGetMemStats(&after);
+        if (MEM_BUDGET_ALLOCS == got || NULL == common ||
+            after.budget_denials <= before.budget_denials) {
+            QZ_ERROR("ERROR: %d pinned allocations under budget, common %p, "
+                     "%lu denials\n", got, (void *)common,
+                     after.budget_denials);
+            rc = QZ_FAIL;
+        }
+        for (k = 0; k < got; k++) {
+            qzFree(held[k]);
+        }
+        qzFree(common);
+        (void)qzSetMemBudget(QZ_AUTO_SELECT_NUMA_NODE, 0);
+    }
+
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] thread %ld %lu KB held, huge pages %u, %d pinned "
+             "allocations under budget: %s\n", tid, status.memory_alloced,
+             status.using_huge_pages, got,
+             (QZ_OK == rc) ? "PASSED" : "FAILED");
+    pthread_mutex_unlock(&g_lock_print);
+
+done:
+    qzFree(src);
+    qzFree(dest);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"memory budget test failed");
+}
+
+#define RING_TEST_SZ  (4 * 1024 * 1024)
+
+/* An instance's stream buffer ring starts at QZ_INST_MIN_BUFF buffers and
+ * grows while requests queue up. The extra buffers go once they are idle
+ * for QZ_RING_IDLE_NS.
+ */
+void *qzRingGrowTest(void *arg)
+{
+    int rc = -1;
+    unsigned char *src = NULL, *dest = NULL;
+    unsigned int src_sz = RING_TEST_SZ, dest_sz, small_sz = 4096, out_sz;
+    QzProcessStats_T grown, trimmed;
+    QzStatus_T status;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    dest_sz = qzMaxCompressedLength(src_sz, &sess);
+    src = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    dest = qzMalloc(dest_sz, QZ_AUTO_SELECT_NUMA_NODE, COMMON_MEM);
+    if (!src || !dest) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, src_sz);
+
+    out_sz = dest_sz;
+    rc = qzCompress(&sess, src, &src_sz, dest, &out_sz, 1);
+    if (QZ_OK != rc) {
+        QZ_ERROR("qzCompress FAILED, return: %d\n", rc);
+        goto done;
+    }
+    (void)qzGetProcessStats(&grown);
+    (void)qzGetStatus(&sess, &status);
+    if (!status.qat_instance_attach) {
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] thread %ld not on hardware, rings not tested\n", tid);
+        pthread_mutex_unlock(&g_lock_print);
+        goto done;
+    }
+
+    usleep(2 * QZ_RING_IDLE_NS / 1000 + 100000);
+    out_sz = dest_sz;
+    rc = qzCompress(&sess, src, &small_sz, dest, &out_sz, 1);
+    if (QZ_OK != rc) {
+        QZ_ERROR("qzCompress FAILED, return: %d\n", rc);
+        goto done;
+    }
+    (void)qzGetProcessStats(&trimmed);
+
+    if (0 == grown.ring_grows || 0 == trimmed.ring_trims) {
+        QZ_ERROR("ERROR: rings grown %lu times, trimmed %lu times\n",
+                 grown.ring_grows, trimmed.ring_trims);
+        rc = QZ_FAIL;
+    }
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] thread %ld rings grown by %lu buffers, trimmed by %lu: "
+             "%s\n", tid, grown.ring_grows, trimmed.ring_trims,
+             (QZ_OK == rc) ? "PASSED" : "FAILED");
+    pthread_mutex_unlock(&g_lock_print);
+
+done:
+    qzFree(src);
+    qzFree(dest);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"ring grow test failed");
+}
+
+#define PREWARM_BENCH_SZ    (64 * 1024)
+#define PREWARM_BENCH_REQS  (8)
+
+/* Latency of the first PREWARM_BENCH_REQS requests of sess, in us */
+static int prewarmBenchRequests(QzSession_T *sess, unsigned char *src,
+                                unsigned char *dest, unsigned int dest_sz,
+                                unsigned long long *us)
+{
+    struct timeval ts, te;
+    unsigned int in_sz, out_sz;
+    int k, rc = QZ_OK;
+
+    for (k = 0; k < PREWARM_BENCH_REQS; k++) {
+        in_sz = PREWARM_BENCH_SZ;
+        out_sz = dest_sz;
+        (void)gettimeofday(&ts, NULL);
+        rc = qzCompress(sess, src, &in_sz, dest, &out_sz, 1);
+        (void)gettimeofday(&te, NULL);
+        if (QZ_OK != rc) {
+            QZ_ERROR("qzCompress FAILED, return: %d\n", rc);
+            break;
+        }
+        us[k] = (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+    }
+
+    return rc;
+}
+
+/* Startup latency with and without qzPrewarm. The cold round needs a fresh
+ * qzInit, which is process wide, so only thread 0 runs the benchmark.
+ */
+void *qzPrewarmBench(void *arg)
+{
+    int rc = -1, k;
+    unsigned char *src = NULL, *dest = NULL;
+    unsigned int dest_sz;
+    unsigned long long cold[PREWARM_BENCH_REQS], warm[PREWARM_BENCH_REQS];
+    unsigned long long cold_max = 0, warm_max = 0, setup_us;
+    struct timeval ts, te;
+    QzPrewarmReport_T report;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    QzSession_T sess = {0};
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    if (0 != tid) {
+        (void)qzTeardownSession(&sess);
+        pthread_exit(NULL);
+    }
+
+    dest_sz = qzMaxCompressedLength(PREWARM_BENCH_SZ, &sess);
+    src = malloc(PREWARM_BENCH_SZ);
+    dest = malloc(dest_sz);
+    if (!src || !dest) {
+        QZ_ERROR("Malloc failed\n");
+        rc = QZ_FAIL;
+        goto done;
+    }
+    genRandomData(src, PREWARM_BENCH_SZ);
+
+    rc = prewarmBenchRequests(&sess, src, dest, dest_sz, cold);
+    if (QZ_OK != rc) {
+        goto done;
+    }
+
+    /* Start over with cold instances, then prewarm them */
+    (void)qzTeardownSession(&sess);
+    (void)qzClose(&sess);
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+        QZ_ERROR("qzInit FAILED, return: %d\n", rc);
+        goto done;
+    }
+
+    (void)gettimeofday(&ts, NULL);
+    rc = qzPrewarm(&sess, QZ_PREWARM_ALL, &report);
+    (void)gettimeofday(&te, NULL);
+    setup_us = (te.tv_sec - ts.tv_sec) * 1000000ULL + te.tv_usec - ts.tv_usec;
+    if (QZ_NO_HW == rc) {
+        pthread_mutex_lock(&g_lock_print);
+        QZ_PRINT("[INFO] prewarm: no QAT device, skipped\n");
+        pthread_mutex_unlock(&g_lock_print);
+        rc = QZ_OK;
+        goto done;
+    }
+    if (QZ_OK != rc) {
+        QZ_ERROR("qzPrewarm FAILED, return: %d\n", rc);
+        goto done;
+    }
+
+    rc = prewarmBenchRequests(&sess, src, dest, dest_sz, warm);
+    if (QZ_OK != rc) {
+        goto done;
+    }
+
+    for (k = 0; k < PREWARM_BENCH_REQS; k++) {
+        cold_max = cold[k] > cold_max ? cold[k] : cold_max;
+        warm_max = warm[k] > warm_max ? warm[k] : warm_max;
+    }
+
+    pthread_mutex_lock(&g_lock_print);
+    QZ_PRINT("[INFO] prewarm: %u instances, %u ready, %u busy, %u skipped, "
+             "%u failed, nodes 0x%x, %llu us (slowest instance %lu us)\n",
+             report.instances, report.ready, report.busy, report.skipped,
+             report.failed, report.ready_nodes, setup_us, report.slowest_us);
+    QZ_PRINT("[INFO] first request: cold %llu us, warm %llu us\n",
+             cold[0], warm[0]);
+    QZ_PRINT("[INFO] worst of %d requests: cold %llu us, warm %llu us\n",
+             PREWARM_BENCH_REQS, cold_max, warm_max);
+    pthread_mutex_unlock(&g_lock_print);
+
+done:
+    free(src);
+    free(dest);
+    (void)qzTeardownSession(&sess);
+    pthread_exit((QZ_OK == rc) ? NULL : (void *)"prewarm bench failed");
+}
+
+void *qzLSMcompressPerf(void *arg)
+{
+    int rc = -1, k;
+    unsigned char *src, *comp_out, *decomp_out;
+    int *compressed_blocks_sz = NULL;
+    size_t src_sz, comp_out_sz, decomp_out_sz;
+    size_t block_size, in_sz, out_sz, consumed, produced;
+    size_t num_blocks;
+    struct timeval ts, te;
+    unsigned long long ts_m = 0, te_m = 0, el_m = 0;
+    long double sec, rate;
+    const size_t org_src_sz = ((TestArg_T *)arg)->src_sz;
+    const size_t org_comp_out_sz = ((TestArg_T *)arg)->comp_out_sz;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int verify_data = ((TestArg_T *)arg)->verify_data;
+    const int count = ((TestArg_T *)arg)->count;
+    const int gen_data = ((TestArg_T *)arg)->gen_data;
+    const int SW_only_flag = ((TestArg_T *)arg)->init_engine_disabled;
+    ((TestArg_T *)arg)->init_engine_disabled = 0;
+    const int HW_only_flag = !((TestArg_T *)arg)->sw_backup;
+    ((TestArg_T *)arg)->sw_backup = 1;
+    const unsigned long LSM_max_avg = ULONG_MAX;
+    QzSession_T sess = {0};
+    QzSess_T *qz_sess = NULL;
+
+    src_sz = org_src_sz;
+    comp_out_sz = org_comp_out_sz;
+    decomp_out_sz = org_src_sz;
+
+    rc = qzInitSetupsession(&sess, (TestArg_T *)arg);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE) {
+#ifndef ENABLE_THREAD_BARRIER
+        g_ready_thread_count++;
+        pthread_cond_signal(&g_ready_cond);
+#endif
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    qz_sess = (QzSess_T *)(sess.internal);
+    if (qz_sess == NULL) {
+        pthread_exit((void *)"qzInit failed");
+    }
+
+    /* According to contorl flow, adjust LSM matrix table*/
+    if (HW_only_flag) {
+        if (qz_sess->sess_params.is_sensitive_mode) {
+            for (int i = 0; i < LSM_MET_DEPTH; i++) {
+                qz_sess->SWT.latency_array[i] = LSM_max_avg;
+            }
+        }
+        qz_sess->SWT.arr_avg = LSM_max_avg;
+    }
+
+    if (SW_only_flag) {
+        if (qz_sess->sess_params.is_sensitive_mode) {
+            for (int i = 0; i < LSM_MET_DEPTH; i++) {
+                qz_sess->RRT.latency_array[i] = LSM_max_avg;
+                qz_sess->PPT.latency_array[i] = LSM_max_avg;
+            }
+        }
+        qz_sess->PPT.arr_avg = LSM_max_avg;
+        qz_sess->RRT.arr_avg = LSM_max_avg;
+    }
+
+    /* perpare the test data */
+    if (gen_data && !g_perf_svm) {
+        src = qzMalloc(src_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+        comp_out = qzMalloc(comp_out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+        decomp_out = qzMalloc(decomp_out_sz, QZ_AUTO_SELECT_NUMA_NODE, PINNED_MEM);
+    } else {
+        src = g_perf_svm ? malloc(src_sz) : ((TestArg_T *)arg)->src;
+        comp_out = g_perf_svm ? malloc(comp_out_sz) : ((TestArg_T *)arg)->comp_out;
+        decomp_out = g_perf_svm ? malloc(decomp_out_sz) : ((TestArg_T *)
+                     arg)->decomp_out;
+    }
+    if (!src || !comp_out || !decomp_out) {
+        QZ_ERROR("Malloc failed\n");
+        goto done;
+    }
+    if (g_perf_svm && g_input_file_name) {
+        memcpy(src, ((TestArg_T *)arg)->src, src_sz);
+    }
+    if (gen_data) {
+        genRandomData(src, src_sz);
+    }
+
+    /* split the src to multiple block */
+    block_size = ((TestArg_T *)arg)->block_size == -1 ?
+                 src_sz : ((TestArg_T *)arg)->block_size;
+
+    num_blocks = src_sz / block_size + (src_sz % block_size ? 1 : 0);
+    compressed_blocks_sz = malloc(sizeof(int) * num_blocks);
+    memset(compressed_blocks_sz, 0, sizeof(int) * num_blocks);
+    // QZ_PRINT("src len: %lu, block: %lu, num block: %lu\n", src_sz, block_size, num_blocks);
+    /* sync the different thread */
+#ifdef ENABLE_THREAD_BARRIER
+    pthread_barrier_wait(&g_bar);
+#else
+    /* mutex lock for thread count */
+    pthread_mutex_lock(&g_cond_mutex);
+    g_ready_thread_count++;
+    pthread_cond_signal(&g_ready_cond);
+    while (!g_ready_to_start) {
+        pthread_cond_wait(&g_start_cond, &g_cond_mutex);
+    }
+    pthread_mutex_unlock(&g_cond_mutex);
+#endif
+
+    /* loop test */
+    for (k = 0; k < count; k++) {
+        (void)gettimeofday(&ts, NULL);
+        {
+            comp_out_sz = org_comp_out_sz;
+            QZ_DEBUG("thread %ld before Compressed %lu bytes into %lu\n", tid, src_sz,
+                     comp_out_sz);
+            consumed = 0;
+            produced = 0;
+
+            for (int i = 0; i < num_blocks; i ++) {
+                in_sz =  block_size < (org_src_sz - consumed) ? block_size :
+                         (org_src_sz - consumed);
+                out_sz = comp_out_sz - produced;
+
+                rc = qzCompress(&sess, src + consumed, (uint32_t *)(&in_sz),
+                                comp_out + produced,
+                                (uint32_t *)(&out_sz), 1);
+                if (rc != QZ_OK) {
+                    QZ_ERROR("ERROR: Compression FAILED with return value: %d\n", rc);
+                    dumpInputData(in_sz, src + consumed);
+                    goto done;
+                }
+
+                consumed = consumed + in_sz;
+                produced = produced + out_sz;
+                compressed_blocks_sz[i] = out_sz;
+
+                /* Because sw would insert 0 to RRT Matrix table every time.
+                 * Have to update the Matrix to Max
+                 */
+                if (SW_only_flag) {
+                    for (int i = 0; i < LSM_MET_DEPTH; i++) {
+                        if (qz_sess->sess_params.is_sensitive_mode) {
+                            qz_sess->RRT.latency_array[i] = LSM_max_avg;
+                            qz_sess->PPT.latency_array[i] = LSM_max_avg;
+                        }
+                    }
+                    qz_sess->PPT.arr_avg = LSM_max_avg;
+                    qz_sess->RRT.arr_avg = LSM_max_avg;
+                }
+            }
+
+            src_sz = consumed;
+            comp_out_sz = produced;
+            if (src_sz != org_src_sz) {
+                QZ_ERROR("ERROR: After Compression src_sz: %lu != org_src_sz: %lu \n!", src_sz,
+                         org_src_sz);
+                dumpInputData(src_sz, src);
+                goto done;
+            }
+            QZ_DEBUG("thread %ld after Compressed %lu bytes into %lu\n", tid, src_sz,
+                     comp_out_sz);
+        }
+        (void)gettimeofday(&te, NULL);
+        ts_m = (ts.tv_sec * 1000000) + ts.tv_usec;
+        te_m = (te.tv_sec * 1000000) + te.tv_usec;
+        el_m += te_m - ts_m;
+    }
+
+    /*  Verify the last compress is enough
+        decompress data for verify
+    */
+    if (verify_data) {
+        consumed = 0;
+        produced = 0;
+        for (int i = 0; i < num_blocks; i ++) {
+            in_sz = compressed_blocks_sz[i];
+            out_sz = decomp_out_sz - produced;
+            rc = qzDecompress(&sess, comp_out + consumed, (uint32_t *)(&in_sz),
+                              decomp_out + produced, (uint32_t *)(&out_sz));
+            if (rc != QZ_OK) {
+                QZ_ERROR("ERROR: Decompression FAILED with return value: %d\n", rc);
+                goto done;
+            }
+            consumed += in_sz;
+            produced += out_sz;
+        }
+
+        QZ_DEBUG("verify compressed data..\n");
+        decomp_out_sz = produced;
+        if (decomp_out_sz != org_src_sz ||
+            memcmp(src, decomp_out, org_src_sz)) {
+            QZ_ERROR("compressed data is uncorrect\n");
+            goto done;
+        }
+    }
+
+    sec = (long double)(el_m);
+    sec = sec / 1000000.0;
+    rate = org_src_sz;
+    rate /= 1024;
+    rate *= 8;// Kbits
+
+    rate *= count;
+    rate /= 1024 * 1024; // gigbits
+    rate /= sec;// Gbps
+
+    pthread_mutex_lock(&g_lock_print);
+#ifdef QATZIP_DEBUG
+    QZ_PRINT("[INFO]:RRT Total call: %ld, Total avg: %ld\n",
+             qz_sess->RRT.invoke_counter,
+             qz_sess->RRT.sess_lat_avg);
+    QZ_PRINT("[INFO]:SWT Total call: %ld, Total avg: %ld\n",
+             qz_sess->SWT.invoke_counter,
+             qz_sess->SWT.sess_lat_avg);
+    QZ_PRINT("[INFO]:PPT Total call: %ld, Total avg: %ld\n",
+             qz_sess->PPT.invoke_counter,
+             qz_sess->PPT.sess_lat_avg);
+#endif
+    QZ_PRINT("[INFO] The AVG latency is RRT: %ld, SWT: %ld, PPT: %ld\n",
+             qz_sess->RRT.arr_avg, qz_sess->SWT.arr_avg, qz_sess->PPT.arr_avg);
+    QZ_PRINT("[INFO] invoke counter is RRT: %ld, SWT: %ld, PPT: %ld\n",
+             qz_sess->RRT.invoke_counter, qz_sess->SWT.invoke_counter,
+             qz_sess->PPT.invoke_counter);
+    QZ_PRINT("[INFO] tid=%ld, count=%d, msec=%llu, bytes=%lu, %Lf Gbps",
+             tid, count, el_m, org_src_sz, rate);
+    QZ_PRINT(", input_len=%lu, comp_len=%lu, ratio=%f%%\n",
+             org_src_sz, comp_out_sz,
+             ((double)comp_out_sz / (double)org_src_sz) * 100);
+    pthread_mutex_unlock(&g_lock_print);
+
+done:
+    if (gen_data && !g_perf_svm) {
+        qzFree(src);
+        qzFree(comp_out);
+        qzFree(decomp_out);
+    } else if (g_perf_svm) {
+        free(src);
+        free(comp_out);
+        free(decomp_out);
+    }
+    if (compressed_blocks_sz != NULL) {
+        free(compressed_blocks_sz);
+    }
+    (void)qzTeardownSession(&sess);
+    pthread_exit((void *)NULL);
+}
+
+void *qzLSMdecompressPerf(void *arg)
+{
+    int rc = -1, k;
+    unsigned char *src, *comp_out, *decomp_out;
+    int *compressed_blocks_sz = NULL;
+    size_t src_sz, comp_out_sz, decomp_out_sz;
+    size_t block_size, in_sz, out_sz, consumed, produced;
+    size_t num_blocks;
+    struct timeval ts, te;
+    unsigned long long ts_m = 0, te_m = 0, el_m = 0;
+    long double sec, rate;
+    const size_t org_src_sz = ((TestArg_T *)arg)->src_sz;
+    const size_t org_comp_out_sz = ((TestArg_T *)arg)->comp_out_sz;
+    const long tid = ((TestArg_T *)arg)->thd_id;
+    const int verify_data = ((TestArg_T *)arg)->verify_data;
+    const int count = ((TestArg_T *)arg)->count;
+    const int gen_data = ((TestArg_T *)arg)->gen_data;
+    const int SW_only_flag = ((TestArg_T *)arg)->init_engine_disabled;
+    ((TestArg_T *)arg)->init_engine_disabled = 0;
+    const int HW_only_flag = !((TestArg_T *)arg)->sw_backup;
+    ((TestArg_T *)arg)->sw_backup = 1;
     const unsigned long LSM_max_avg = ULONG_MAX;
     QzSession_T sess = {0};
     QzSess_T *qz_sess;
@@ -6359,6 +8678,9 @@ done:
     "    -P polling            set polling mode, default is periodical polling\n" \
     "                          when set busy polling mode, it would automaticlly \n"    \
     "                          enable the LSM(latency sensitive mode) \n"    \
+    "                          event polling sleeps on the instance event fd\n" \
+    "                          adaptive polling sleeps until predicted completion\n" \
+    "                          central polling leaves it to a thread per instance\n" \
     "    -M svm                set perf mode with file input, default is non\n" \
     "                          svm mode. When set to svm, all memory will\n"    \
     "                          be allocated with malloc instead of qzMalloc\n"  \
@@ -6370,6 +8692,11 @@ done:
     "                          allocation limit is 2M\n"                        \
     "    -g loglevel           set qatzip loglevel(none|error|warn|info|debug)\n"  \
     "    -a sensitive_mode     Enable Latency sensitive mode\n" \
+    "    -I                    share instances between test threads\n"        \
+    "    -c coalesce_usec      coalesce small requests of the test threads\n"  \
+    "                          onto HW within this time window, default 0\n"   \
+    "    -R strm_pipeline      stream buffers rotating in qzCompressStream,\n" \
+    "                          default 0\n"                                      \
     "    -q async_queue_sz     default is 100, it's for async queue size\n"     \
     "    -h                    Print this help message\n"
 
@@ -6421,7 +8748,7 @@ int main(int argc, char *argv[])
     s1.sa_flags = 0;
     sigaction(SIGINT, &s1, NULL);
 
-    const char *optstring = "m:t:A:C:D:F:L:T:i:l:e:s:r:B:O:S:P:M:b:p:g:d:q:vha";
+    const char *optstring = "m:t:A:C:D:F:L:T:i:l:e:s:r:B:O:S:P:M:b:p:g:d:q:c:R:vhaI";
     int opt = 0, loop_cnt = 2, verify = 0;
     int disable_init_engine = 0, disable_init_session = 0;
     char *stop = NULL;
@@ -6562,6 +8889,25 @@ int main(int argc, char *argv[])
         case 'a':
             args.is_sensitive_mode = true;
             break;
+        case 'I':
+            args.share_inst = 1;
+            break;
+        case 'c':
+            args.coalesce_usec = GET_LOWER_32BITS(strtoul(optarg, &stop, 0));
+            if (*stop != '\0' || errno ||
+                args.coalesce_usec > QZ_COALESCE_USEC_MAX) {
+                QZ_ERROR("Error coalesce_usec arg: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'R':
+            args.strm_pipeline = GET_LOWER_32BITS(strtoul(optarg, &stop, 0));
+            if (*stop != '\0' || errno ||
+                args.strm_pipeline > QZ_STRM_PIPELINE_MAX) {
+                QZ_ERROR("Error strm_pipeline arg: %s\n", optarg);
+                return -1;
+            }
+            break;
         case 'i':
             g_input_file_name = optarg;
             break;
@@ -6603,6 +8949,12 @@ int main(int argc, char *argv[])
         case 'P':
             if (strcmp(optarg, "busy") == 0) {
                 args.polling_mode = QZ_BUSY_POLLING;
+            } else if (strcmp(optarg, "event") == 0) {
+                args.polling_mode = QZ_EVENT_POLLING;
+            } else if (strcmp(optarg, "adaptive") == 0) {
+                args.polling_mode = QZ_ADAPTIVE_POLLING;
+            } else if (strcmp(optarg, "central") == 0) {
+                args.polling_mode = QZ_CENTRAL_POLLING;
             } else {
                 QZ_ERROR("Error set polling mode: %s\n", optarg);
                 return -1;
@@ -6764,6 +9116,63 @@ int main(int argc, char *argv[])
     case 31:
         qzThdOps = qzTestStopDecompressionOnStreamEndMultiStream;
         break;
+    case 32:
+        qzThdOps = qzSubmitLatencyPerf;
+        break;
+    case 33:
+        qzThdOps = qzEventPollingTest;
+        break;
+    case 34:
+        qzThdOps = qzBatchTest;
+        break;
+    case 35:
+        qzThdOps = qzCoalesceTest;
+        break;
+    case 36:
+        qzThdOps = qzIovTest;
+        break;
+    case 37:
+        qzThdOps = qzRegisterMemTest;
+        break;
+    case 38:
+        qzThdOps = qzDestInPlaceTest;
+        break;
+    case 39:
+        qzThdOps = qzPageTableBench;
+        break;
+    case 40:
+        qzThdOps = qzMemReuseTest;
+        break;
+    case 41:
+        qzThdOps = qzMemPoolBench;
+        break;
+    case 42:
+        qzThdOps = qzStreamChurnTest;
+        break;
+    case 43:
+        qzThdOps = qzMemBudgetTest;
+        break;
+    case 44:
+        qzThdOps = qzRingGrowTest;
+        break;
+    case 45:
+        qzThdOps = qzPrewarmBench;
+        break;
+    case 46:
+        qzThdOps = qzStreamDirectBench;
+        break;
+    case 47:
+        qzThdOps = qzStreamPipeBench;
+        break;
+    case 48:
+        qzThdOps = qzStreamFormatTest;
+        break;
+    case 49:
+        qzThdOps = qzSingleMemberTest;
+        break;
+    case 50:
+        qzThdOps = qzStreamFlushTest;
+        break;
     default:
         goto done;
     }
@@ -6866,7 +9275,11 @@ int main(int argc, char *argv[])
 #ifndef ENABLE_THREAD_BARRIER
     /*for qzCompressAndDecompress test*/
     if (test == 4 || test == 18 || test == 23 || test == 24 || test == 25 ||
-        test == 26 || test == 28 || test == 29) {
+        test == 26 || test == 28 || test == 29 || test == 32 || test == 34 ||
+        test == 35 || test == 36 || test == 37 || test == 38 || test == 39 ||
+        test == 40 || test == 41 || test == 42 || test == 43 || test == 45 ||
+        test == 44 || test == 46 || test == 47 || test == 48 || test == 49 ||
+        test == 50) {
         ret = pthread_mutex_lock(&g_cond_mutex);
         if (ret != 0) {
             QZ_ERROR("Failure to get Mutex Lock, status = %d\n", ret);
@@ -6912,6 +9325,22 @@ int main(int argc, char *argv[])
     pthread_barrier_destroy(&g_bar);
 #endif
 
+    if (test == 35) {
+        QzProcessStats_T stats;
+        if (QZ_OK == qzGetProcessStats(&stats)) {
+            QZ_PRINT("Small requests: coalesced %lu, software %lu\n",
+                     stats.small_coalesced, stats.small_sw);
+        }
+    }
+
+    if (test == 37 || test == 38) {
+        QzProcessStats_T stats;
+        if (QZ_OK == qzGetProcessStats(&stats)) {
+            QZ_PRINT("HW request bytes: copied %lu, zero copy %lu\n",
+                     stats.bytes_copied, stats.bytes_zero_copy);
+        }
+    }
+
     if (test == 18) {
         rc_check = qz_do_g_process_Check();
         if (QZ_OK == rc_check) {